@@ -27,20 +27,31 @@
 #ifndef JPACK_H_
 #define JPACK_H_
 
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
 
+// Scatter-gather entries for writev, declared in <sys/uio.h>
+struct iovec;
+
+// Returned instead of a length when a format is invalid
+#define JPACK_INVALID ((uint32_t)-1)
 
 // Packs the data given into the buffer according to the format
 // Returns the number of bytes written to buf. If buf was to short it returns
 // the number of bytes that was written to the buffer.
-// It will return -1 if you gave an invalid format
+// It will return JPACK_INVALID if you gave an invalid format
 
 // Option, description
 // <       little-endian (default)
 // >       big-endian
 // !       network (big)
+//
+// Options apply to the field that follows them.
 
 // Format char, type,     length
 // x,           padbyte,  1
@@ -54,18 +65,589 @@ extern "C" {
 // L,           uint64_t, 8
 // f,           float,    4
 // d,           double,   8
+// e,           float,    2
+// qB qH qI,    double,   1 2 4
 // s,           string,   -
+// S,           view,     -
+// pB pH pI,    blob,     1 2 4 + length
+// zB zH zI,    string,   1 2 4 + length
+// v,           int32_t,  1-5
+// V,           uint32_t, 1-5
+// w,           int64_t,  1-10
+// W,           uint64_t, 1-10
+// u1 - u32,    uint32_t, bits
+// rI rL,       uint32_t or uint64_t array, frame of reference coded, -
+// tI tL,       uint32_t or uint64_t array, delta coded, -
+// TI TL,       uint32_t or uint64_t array, delta of delta coded, -
+// B() H() I(), group,    1 2 4 + records
+
+// A format char can be preceded by a count, e.g. "256I" or "!16d". A field
+// with a count takes a pointer to an array of count elements instead of a
+// value, and junpack takes a pointer to the array to fill. Arrays are byte
+// swapped in bulk. A count before x gives that many pad bytes. Strings can
+// not have a count.
+
+// A view is packed like a string, from a pointer to a jpack_view whose bytes
+// must not contain a NUL. junpack fills the jpack_view with a pointer into buf
+// and the length without the terminator, so no copy is made. A string that is
+// cut off by the end of buf gives an empty view with a NULL pointer.
+typedef struct jpack_view {
+    const uint8_t * ptr;
+    uint32_t len;
+} jpack_view;
+
+// p and z fields start with the length of their payload as a B, H or I in
+// the byte order given for the field, e.g. "!pH", and have no terminator, so
+// they can be skipped without scanning and may hold any bytes. A blob is
+// packed from and unpacked into a jpack_view like S. A z string is packed
+// from a const char * and unpacked into a char buffer, which gets a
+// terminator. A payload longer than the prefix can hold is cut short. A blob
+// that is cut off by the end of buf gives an empty view and a z string an
+// empty string.
+
+// v, V, w and W are LEB128 varints, 7 bits per byte with the lowest bits
+// first, so small values take fewer bytes. v and w are zigzag encoded so that
+// small negative values are short too. Byte order options do not apply to
+// varints and they can not have a count.
+
+// e is an IEEE 754 half float, packed from a float rounded to nearest even
+// and unpacked into a float, which suits values that need about 3 decimal
+// digits. q is a fixed point value in a B, H or I code spread evenly over a
+// range given in brackets, e.g. "!qH[-180,180]", packed from a double rounded
+// to the nearest code and unpacked into a double. The bounds are decimal
+// numbers with an optional exponent and a . as the decimal point in every
+// locale. Values outside the range are clamped to it and NaN packs as the
+// low end. Arrays of e and q fields take arrays of floats and doubles and are
+// converted in bulk, with F16C and AVX2 when the cpu has them. Batches and
+// columns store e fields as floats and q fields as doubles.
+
+// r, t and T are coded arrays of I or L values. They must have a count, e.g.
+// "1000tL", and take a pointer to the array like other arrays, but take far
+// fewer bytes when the values are close together. r stores the values, t the
+// differences between neighbours and T the differences between those, which
+// suits sequence numbers (t) and timestamps taken at a steady rate (T). The
+// first one or two values are stored whole and the rest go in blocks of 128,
+// each holding the bit width, the smallest value and the values less it
+// packed with SIMD-BP128. Coded arrays are always little-endian and can not
+// be used with a stream.
+
+// A B, H or I followed by a format in parentheses is a group, e.g.
+// "!H(IffB)": the number of records as a count in the byte order given for
+// the group, then that many records of the format in parentheses packed back
+// to back. Groups can be nested. A group is packed from a pointer to a
+// jpack_group whose items point to an array of records laid out like for
+// jpack_batch, where a nested group is stored as a jpack_group. More records
+// than the count can hold are cut short. junpack takes a pointer to a
+// jpack_group with items, capacity, stride and field_offsets set up, unpacks
+// up to capacity records and stores the number unpacked in count. The other
+// records are skipped, and a group that is cut off by the end of buf keeps
+// the records before the cut. Strings in records are unpacked like for
+// junpack_batch. The records of a group are compiled once and then packed in
+// a loop, but jpack and junpack compile them on every call, so use a plan
+// for groups on a hot path. Groups can not be used with a stream.
+typedef struct jpack_group {
+    void * items;                   // First record
+    uint32_t count;                 // Number of records
+    uint32_t capacity;              // Records items has room for when unpacking
+    size_t stride;                  // Bytes from the start of one record to the next
+    const size_t * field_offsets;   // Offset of each field of the group in a record
+} jpack_group;
+
+// uN is a bit field of N bits, e.g. "u3u1u4B". Bit fields that follow each
+// other share bytes and are filled from the lowest bit of each byte up. Any
+// other field or pad byte starts on the next whole byte and the unused bits
+// before it are written as zeros. Bit fields take a uint32_t, of which only
+// the low N bits are packed. Byte order options do not apply and bit fields
+// can not have a count.
 
 uint32_t jpack(uint8_t * buf, size_t size, const char * format, ...);
 
+// Same as jpack but takes the values as a va_list, like vprintf. The va_list
+// is copied so it can still be used by the caller afterwards.
+uint32_t jvpack(uint8_t * buf, size_t size, const char * format, va_list arg_list);
+
 // Unpacks the buffer according to the format to the addresses provided.
-// It will return -1 if you gave an invalid format otherwise returns the read size
+// It will return JPACK_INVALID if you gave an invalid format otherwise returns
+// the read size
 uint32_t junpack(const uint8_t * buf, size_t size, const char * format, ...);
+uint32_t jvunpack(const uint8_t * buf, size_t size, const char * format, va_list arg_list);
 
-// Returns the size needed to hold the format or -1 if the format is invalid and
-// -2 if the result is unknown i.e. the format contains a string
+// Same as jpack and junpack but reads and writes the values through
+// pointers, with ptrs[i] pointing to the variable for field i. The variables
+// are laid out like the fields of a record for jpack_batch, so a float is a
+// float and not promoted to a double. Pad bytes do not take a pointer.
+uint32_t jpack_fields(uint8_t * buf, size_t size, const char * format,
+                      const void * const * ptrs);
+uint32_t junpack_fields(const uint8_t * buf, size_t size, const char * format,
+                        void * const * ptrs);
+
+// Same as junpack but checks that the whole message is in buf first. If a
+// field would run past the end of buf it returns JPACK_INVALID without
+// touching any of the variables.
+uint32_t junpack_safe(const uint8_t * buf, size_t size, const char * format, ...);
+
+// Returns the size needed to hold the format, JPACK_INVALID if the format is
+// invalid and 0 if the result is unknown i.e. the format contains a string
 uint32_t jpack_format_length(const char * format);
 
+// Stores the smallest and largest size a message of the format can take in
+// min and max if they are not NULL. max is UINT64_MAX if the format has an s
+// or S field. Returns 0 on success and -1 if the format is invalid.
+int jpack_format_bounds(const char * format, uint64_t * min, uint64_t * max);
+
+// Returns the offset of field index, 0 being the first one, in every message
+// of the format, so that it can be read without unpacking the fields before
+// it. Pad bytes are not fields and a bit field gives the byte it starts in.
+// Returns JPACK_INVALID if the format is invalid, if there is no such field
+// or if a variable length field comes before it.
+uint32_t jpack_field_offset(const char * format, uint32_t index);
+
+// Bytes taken by the checksum after a framed message
+#define JPACK_CRC_SIZE 4
+
+// Returns the CRC32C of length bytes of data, continuing from crc which is 0
+// for the first bytes. The crc32 instruction of SSE4.2 is used when the cpu
+// has it and a table otherwise.
+uint32_t jpack_crc32c(uint32_t crc, const uint8_t * data, size_t length);
+
+// Same as jpack but follows the message with its CRC32C as a little-endian
+// uint32_t, taken field by field as the message is written. Returns the
+// length of the message and checksum, which is more than size if they did
+// not fit, or JPACK_INVALID if the format is invalid. The checksum is only
+// written if the whole message fit.
+uint32_t jpack_framed(uint8_t * buf, size_t size, const char * format, ...);
+
+// Same as junpack but checks the CRC32C after the message first, taken while
+// the message is measured. If the message is cut off or does not match its
+// checksum it returns JPACK_INVALID without touching any of the variables.
+// Returns the length of the message and checksum.
+uint32_t junpack_framed(const uint8_t * buf, size_t size, const char * format, ...);
+
+// Same as jpack but packs the message as pieces for writev or sendmsg, so
+// that large payloads are not copied. Fields are packed into scratch, except
+// the payloads of s, S, z and p fields of at least threshold bytes, which get
+// an entry of their own in iov pointing at the caller's memory. The pieces of
+// scratch between them get entries too and the entries are in message order.
+// iov has room for *count entries and the number the message needs is
+// stored in *count. The payloads must stay valid until the pieces are
+// written. Returns the length of the message, the sum of the entries, or
+// JPACK_INVALID if the format is invalid or scratch or iov was too short.
+uint32_t jpack_iov(uint8_t * scratch, size_t size, struct iovec * iov, uint32_t * count,
+                   size_t threshold, const char * format, ...);
+
+// Same as junpack but only unpacks field i if bit i of mask is set and only
+// takes addresses for those fields. Skipped fields are not copied, variable
+// length ones are only measured to find the fields after them, and nothing
+// after the last field in mask is read. Only the first 64 fields can be
+// selected.
+// Returns the offset just past the last field in mask, or JPACK_INVALID if
+// the format is invalid or a skipped field runs past the end of buf.
+uint32_t junpack_mask(const uint8_t * buf, size_t size, const char * format,
+                      uint64_t mask, ...);
+
+// A format that has been validated and compiled once so that it can be packed
+// and unpacked without parsing the format string again. Byte order, offsets
+// and the total size are resolved when the plan is compiled.
+typedef struct jpack_plan jpack_plan;
+
+// Compiles the format into a plan. Returns NULL if the format is invalid or
+// if memory could not be allocated. Free the plan with jpack_plan_free.
+jpack_plan * jpack_compile(const char * format);
+
+void jpack_plan_free(jpack_plan * plan);
+
+// Returns the size needed to hold the plan or 0 if the plan contains a string
+uint32_t jpack_plan_length(const jpack_plan * plan);
+
+// Same as jpack and junpack but driven by a compiled plan
+uint32_t jpack_plan_pack(const jpack_plan * plan, uint8_t * buf, size_t size, ...);
+uint32_t jpack_plan_unpack(const jpack_plan * plan, const uint8_t * buf, size_t size, ...);
+uint32_t jpack_plan_unpack_safe(const jpack_plan * plan, const uint8_t * buf,
+                                size_t size, ...);
+uint32_t jpack_plan_pack_fields(const jpack_plan * plan, uint8_t * buf, size_t size,
+                                const void * const * ptrs);
+uint32_t jpack_plan_unpack_fields(const jpack_plan * plan, const uint8_t * buf,
+                                  size_t size, void * const * ptrs);
+
+// Same as jpack_iov but driven by a compiled plan
+uint32_t jpack_plan_pack_iov(const jpack_plan * plan, uint8_t * scratch, size_t size,
+                             struct iovec * iov, uint32_t * count, size_t threshold, ...);
+
+// Same as jpack_field_offset and junpack_mask but driven by a compiled plan.
+// The offset is looked up in constant time.
+uint32_t jpack_plan_field_offset(const jpack_plan * plan, uint32_t index);
+uint32_t jpack_plan_unpack_mask(const jpack_plan * plan, const uint8_t * buf,
+                                size_t size, uint64_t mask, ...);
+
+// Packs count records from an array of structs. Record r starts at
+// base + r * stride and field i of the format is read from
+// field_offsets[i] bytes into the record, usually given with offsetof. Pad
+// bytes do not have an offset. Arrays are stored inline in the struct,
+// s and z strings as a const char *, views and blobs as a jpack_view and bit
+// fields as a uint32_t.
+// Records are written back to back, with a plain memcpy when the struct has
+// the same layout and byte order as the packed records.
+// Returns the number of records that fit in buf and stores the number of
+// bytes they take in length if it is not NULL. It will return JPACK_INVALID if
+// you gave an invalid format.
+uint32_t jpack_batch(uint8_t * buf, size_t size, const char * format,
+                     const void * base, uint32_t count, size_t stride,
+                     const size_t * field_offsets, uint32_t * length);
+
+// Unpacks up to count records into an array of structs laid out like for
+// jpack_batch. Strings are copied to the buffer the char * in the struct
+// points to. Records that are cut off by the end of buf are not unpacked.
+// Returns the number of records unpacked and stores the number of bytes read
+// in length if it is not NULL.
+uint32_t junpack_batch(const uint8_t * buf, size_t size, const char * format,
+                       void * base, uint32_t count, size_t stride,
+                       const size_t * field_offsets, uint32_t * length);
+
+// Same as jpack_batch and junpack_batch but driven by a compiled plan
+uint32_t jpack_plan_pack_batch(const jpack_plan * plan, uint8_t * buf, size_t size,
+                               const void * base, uint32_t count, size_t stride,
+                               const size_t * field_offsets, uint32_t * length);
+uint32_t jpack_plan_unpack_batch(const jpack_plan * plan, const uint8_t * buf,
+                                 size_t size, void * base, uint32_t count,
+                                 size_t stride, const size_t * field_offsets,
+                                 uint32_t * length);
+
+// Returns the number of bytes one record laid out like for jpack_batch takes
+// when packed, JPACK_INVALID if the format is invalid or the record does not
+// fit in 32 bits. Unlike jpack_format_length this includes the strings.
+uint32_t jpack_record_length(const char * format, const void * record,
+                             const size_t * field_offsets);
+uint32_t jpack_plan_record_length(const jpack_plan * plan, const void * record,
+                                  const size_t * field_offsets);
+
+// Packs only the fields of the record at current that differ from the record
+// at previous, both laid out like for jpack_batch, to replicate a state that
+// changes a little at a time. The delta starts with a change mask of one bit
+// per field, lowest bit first and padded to whole bytes, followed by the
+// fields whose bit is set packed back to back. Pad bytes are left out and a
+// bit field takes whole bytes of its own. Fields are compared by their bytes
+// and strings and views by their contents, and a record of up to 1 KiB is
+// compared with SIMD in one pass before the fields are checked. If previous
+// is NULL every field is packed. Groups can not be used in a delta.
+// Returns the length of the delta, which is the size of the mask if nothing
+// changed, or JPACK_INVALID if the format is invalid.
+uint32_t jpack_delta(uint8_t * buf, size_t size, const char * format,
+                     const void * current, const void * previous,
+                     const size_t * field_offsets);
+
+// Applies a delta packed by jpack_delta to the record at state, so that it
+// matches the record the delta was packed from if state matched previous.
+// Only the fields in the change mask are written. Strings are copied like
+// for junpack_batch.
+// Returns the number of bytes the delta takes, or JPACK_INVALID if the format
+// is invalid or does not match the mask or the delta is cut off, in which
+// case state is left untouched.
+uint32_t junpack_delta(const uint8_t * buf, size_t size, const char * format,
+                       void * state, const size_t * field_offsets);
+
+// Same as jpack_delta and junpack_delta but driven by a compiled plan
+uint32_t jpack_plan_pack_delta(const jpack_plan * plan, uint8_t * buf, size_t size,
+                               const void * current, const void * previous,
+                               const size_t * field_offsets);
+uint32_t jpack_plan_unpack_delta(const jpack_plan * plan, const uint8_t * buf, size_t size,
+                                 void * state, const size_t * field_offsets);
+
+// A pool of worker threads for the parallel functions. threads counts the
+// thread that calls them, so a pool of 1 thread starts no workers, and 0 uses
+// one thread per online cpu. Returns NULL if the threads could not be started.
+// A pool can be used by one call at a time.
+typedef struct jpack_pool jpack_pool;
+
+jpack_pool * jpack_pool_create(uint32_t threads);
+void jpack_pool_free(jpack_pool * pool);
+uint32_t jpack_pool_threads(const jpack_pool * pool);
+
+// Same as jpack_batch and jpack_plan_pack_batch, with the same result, but
+// the records are split into chunks that are packed by the threads of pool.
+// When the format has a string the size of every chunk is computed first so
+// that each chunk can be packed straight to its place in buf. Small batches
+// and a NULL pool are packed on the calling thread.
+uint32_t jpack_batch_parallel(jpack_pool * pool, uint8_t * buf, size_t size,
+                              const char * format, const void * base, uint32_t count,
+                              size_t stride, const size_t * field_offsets,
+                              uint32_t * length);
+uint32_t jpack_plan_pack_batch_parallel(jpack_pool * pool, const jpack_plan * plan,
+                                        uint8_t * buf, size_t size, const void * base,
+                                        uint32_t count, size_t stride,
+                                        const size_t * field_offsets, uint32_t * length);
+
+// Packs count records laid out like for jpack_batch as columns, one column
+// per field with the values of all records back to back. The columns start
+// with a header of little-endian uint32_t values: the number of records, the
+// number of columns and then the offset of each column from the start of buf
+// followed by the total length. Columns are aligned to 8 bytes. The values
+// of a bit field column are packed back to back without any padding.
+// Returns the number of bytes needed. Nothing is written if buf is too short,
+// so it can be called with a NULL buf to size it. It will return
+// JPACK_INVALID if you gave an invalid format.
+uint32_t jpack_columns(uint8_t * buf, size_t size, const char * format,
+                       const void * base, uint32_t count, size_t stride,
+                       const size_t * field_offsets);
+
+// Unpacks up to count records from columns packed with jpack_columns into an
+// array of structs laid out like for jpack_batch.
+// Returns the number of records unpacked or JPACK_INVALID if the format is
+// invalid or does not match the columns.
+uint32_t junpack_columns(const uint8_t * buf, size_t size, const char * format,
+                         void * base, uint32_t count, size_t stride,
+                         const size_t * field_offsets);
+
+// Same as junpack_columns but unpacks field i of every record into the array
+// columns[i]. Strings are copied to the buffers a char * array points to.
+uint32_t junpack_columns_soa(const uint8_t * buf, size_t size, const char * format,
+                             void * const * columns, uint32_t count);
+
+// Returns a pointer to the packed values of one column without touching the
+// others, or NULL if the column does not exist. The number of records is
+// stored in count and the length of the column, including up to 7 bytes of
+// alignment padding, in length if they are not NULL.
+const uint8_t * jpack_column(const uint8_t * buf, size_t size, uint32_t column,
+                             uint32_t * count, uint32_t * length);
+
+// Called by a stream writer with the staged bytes. Returns 0 on success.
+typedef int (*jpack_write_fn)(void * ctx, const uint8_t * data, size_t length);
+
+// Called by a stream reader to fill up to length bytes of data. Returns the
+// number of bytes read or 0 at the end of the stream.
+typedef size_t (*jpack_read_fn)(void * ctx, uint8_t * data, size_t length);
+
+// Packs or unpacks messages of any size through a fixed staging buffer. The
+// fields are internal, set them up with jpack_stream_writer or
+// jpack_stream_reader.
+typedef struct jpack_stream {
+    uint8_t * buf;
+    size_t size;
+    size_t used;
+    size_t pos;
+    uint64_t total;
+    jpack_write_fn write;
+    jpack_read_fn read;
+    void * ctx;
+    int error;
+    int framed;
+    size_t mark;
+    uint32_t crc;
+} jpack_stream;
+
+// Sets up a stream that stages packed bytes in buf and hands them to write
+// whenever it fills up. buf must be at least 8 bytes.
+void jpack_stream_writer(jpack_stream * stream, uint8_t * buf, size_t size,
+                         jpack_write_fn write, void * ctx);
+
+// Sets up a stream that refills buf from read as messages are unpacked. It
+// may read past the end of a message, the rest is kept for the next one.
+// buf must be at least 8 bytes. Views and blobs can not be unpacked from a
+// stream.
+void jpack_stream_reader(jpack_stream * stream, uint8_t * buf, size_t size,
+                         jpack_read_fn read, void * ctx);
+
+// Hands the staged bytes to write. Returns 0 on success.
+int jpack_stream_flush(jpack_stream * stream);
+
+// Same as jpack and junpack but for a stream. Pad bytes are written as zeros
+// and skipped when reading.
+// Returns the length of the message or JPACK_INVALID if the format is
+// invalid, write failed or the stream ended before the message did. A stream
+// stays failed after an error. A format that turns out to be invalid part way
+// through leaves the fields before it written, use a plan to avoid that.
+uint32_t jpack_stream_pack(jpack_stream * stream, const char * format, ...);
+uint32_t jpack_stream_unpack(jpack_stream * stream, const char * format, ...);
+
+// Same as jpack_stream_pack and jpack_stream_unpack but driven by a compiled
+// plan
+uint32_t jpack_stream_plan_pack(jpack_stream * stream, const jpack_plan * plan, ...);
+uint32_t jpack_stream_plan_unpack(jpack_stream * stream, const jpack_plan * plan, ...);
+
+// Same as jpack_stream_pack but follows the message with its CRC32C, like
+// jpack_framed. The checksum is taken as the bytes leave the staging buffer,
+// so messages larger than the buffer can be framed. Returns the length of
+// the message and checksum or JPACK_INVALID.
+uint32_t jpack_stream_pack_framed(jpack_stream * stream, const char * format, ...);
+
+// A growable output buffer that packs messages back to back into a chain of
+// blocks, so the size of a message does not have to be known up front. Each
+// message is kept whole in one block and a block that is too small is
+// replaced by one twice its size. The blocks are kept when the buffer is
+// reset, so packing the same kind of messages again does not allocate.
+typedef struct jpack_buf jpack_buf;
+
+// Creates a buffer whose first block is size bytes, or 4096 if size is 0.
+// Returns NULL if memory could not be allocated.
+jpack_buf * jpack_buf_create(size_t size);
+
+void jpack_buf_free(jpack_buf * buf);
+
+// Drops the packed messages but keeps the blocks for the next ones
+void jpack_buf_reset(jpack_buf * buf);
+
+// Same as jpack but appends the message to the buffer, growing it as needed.
+// Returns the length of the message or JPACK_INVALID if the format is invalid
+// or memory could not be allocated.
+uint32_t jpack_buf_pack(jpack_buf * buf, const char * format, ...);
+uint32_t jpack_buf_vpack(jpack_buf * buf, const char * format, va_list arg_list);
+
+// Returns the number of bytes packed since the last reset
+uint64_t jpack_buf_length(const jpack_buf * buf);
+
+// Returns the packed messages as one contiguous span and stores its length in
+// length. If they are spread over several blocks these are joined into one
+// big enough for all of them, so the next round after a reset is contiguous
+// from the start. Returns NULL if memory could not be allocated.
+const uint8_t * jpack_buf_data(jpack_buf * buf, size_t * length);
+
+// Stores up to count of the blocks holding messages in iov, in order, to hand
+// them to writev without joining them. Returns the number of blocks holding
+// messages, which may be more than count.
+uint32_t jpack_buf_blocks(const jpack_buf * buf, struct iovec * iov, uint32_t count);
+
+// Record files hold packed records back to back, each one framed by its
+// length as a little-endian uint32_t. They are written by appending and read
+// through a read-only memory mapping, so records are unpacked in place
+// without copying them or making a syscall per record.
+typedef struct jpack_file_writer jpack_file_writer;
+typedef struct jpack_file_reader jpack_file_reader;
+
+// Opens path for appending records, creating it if needed. Records are staged
+// in memory and written in large blocks. Returns NULL on failure.
+jpack_file_writer * jpack_file_writer_open(const char * path);
+
+// Flushes and closes the writer. Returns 0 on success or -1 if a write failed.
+int jpack_file_writer_close(jpack_file_writer * writer);
+
+// Writes the staged records to the file. Returns 0 on success or -1.
+int jpack_file_flush(jpack_file_writer * writer);
+
+// Appends an already packed record. Returns 0 on success or -1.
+int jpack_file_append(jpack_file_writer * writer, const uint8_t * record,
+                      uint32_t length);
+
+// Packs a record straight into the staging buffer and appends it. Returns
+// the length of the record or JPACK_INVALID if the format is invalid or the
+// record could not be written.
+uint32_t jpack_file_pack(jpack_file_writer * writer, const char * format, ...);
+
+// Maps the records in path for reading. Records appended after this are not
+// seen. The mapping is advised for sequential reading. Returns NULL on
+// failure.
+jpack_file_reader * jpack_file_reader_open(const char * path);
+
+void jpack_file_reader_close(jpack_file_reader * reader);
+
+// Returns the record at *offset, 0 being the first one, and moves *offset to
+// the next record. The length of the record is stored in length. Returns NULL
+// at the end of the file or at a record cut off by it.
+const uint8_t * jpack_file_next(const jpack_file_reader * reader, uint64_t * offset,
+                                uint32_t * length);
+
+// Unpacks the record at *offset like junpack and moves *offset to the next
+// record. Strings, views and blobs can be unpacked, views point into the
+// mapping. Returns the length of the record or JPACK_INVALID at the end of the
+// file or if the format is invalid.
+uint32_t jpack_file_unpack(const jpack_file_reader * reader, uint64_t * offset,
+                           const char * format, ...);
+
+// Scans the file once to find every record so that they can be looked up by
+// number. Returns the number of records or UINT64_MAX on failure.
+uint64_t jpack_file_index(jpack_file_reader * reader);
+
+// Returns record number index, after jpack_file_index, and stores its length
+// in length. Returns NULL if there is no such record.
+const uint8_t * jpack_file_record(const jpack_file_reader * reader, uint64_t index,
+                                  uint32_t * length);
+
+// Access patterns for jpack_file_advise
+#define JPACK_FILE_NORMAL     0
+#define JPACK_FILE_SEQUENTIAL 1
+#define JPACK_FILE_RANDOM     2
+#define JPACK_FILE_WILLNEED   3
+#define JPACK_FILE_DONTNEED   4
+
+// Tells the kernel how length bytes from offset will be read, so that it can
+// read ahead or drop pages. A length of 0 means to the end of the file.
+// Returns 0 on success or -1.
+int jpack_file_advise(const jpack_file_reader * reader, uint64_t offset,
+                      uint64_t length, int advice);
+
+// A registry decodes streams of mixed messages, each a type byte followed by
+// the fields of the format registered for it. Formats are compiled when they
+// are registered, and jpack_dispatch unpacks runs of messages of the same
+// type into an array of records that is handed to the handler in one call.
+// A registry can be used by one call at a time.
+typedef struct jpack_registry jpack_registry;
+
+// Called with count records unpacked from messages of type id, laid out as
+// registered. The records and any views in them are only valid during the
+// call.
+typedef void (*jpack_handler)(void * ctx, uint8_t id, const void * records,
+                              uint32_t count);
+
+// Creates a registry that hands up to batch records to a handler at a time,
+// or 64 if batch is 0. Returns NULL if memory could not be allocated.
+jpack_registry * jpack_registry_create(uint32_t batch);
+
+void jpack_registry_free(jpack_registry * registry);
+
+// Registers messages of type id, replacing any earlier ones. Their fields are
+// unpacked into records laid out like for junpack_batch, stride bytes apart
+// and with field i at field_offsets[i], which must stay valid while the id is
+// registered. The records are kept by the registry, so the format can not
+// have s or z strings or groups that need buffers of their own, but views and
+// blobs can point into the messages. Returns 0 on success or -1 if the format
+// is invalid or not allowed, handler is NULL or memory could not be allocated.
+int jpack_registry_add(jpack_registry * registry, uint8_t id, const char * format,
+                       size_t stride, const size_t * field_offsets,
+                       jpack_handler handler, void * ctx);
+
+void jpack_registry_remove(jpack_registry * registry, uint8_t id);
+
+// Unpacks the messages in buf in order and hands them to their handlers, one
+// call per run of messages of the same type or per batch records. Stops at a
+// message that is cut off by the end of buf, so that it can be completed with
+// more data. Returns the number of messages handled and stores the bytes they
+// take in length if it is not NULL. Returns JPACK_INVALID if a type is not
+// registered, after handling the messages before it, whose length is still
+// stored in length.
+uint32_t jpack_dispatch(jpack_registry * registry, const uint8_t * buf, size_t size,
+                        uint32_t * length);
+
+// Statistics per format, collected only when the library is built with
+// JPACK_STATS defined (make STATS=1) so that they cost nothing otherwise.
+// Every thread counts in its own table, the tables are only summed when a
+// snapshot is taken. Formats are told apart by their first
+// JPACK_STATS_FORMAT_MAX - 1 chars, formats past the first
+// JPACK_STATS_MAX_FORMATS of a thread are counted as "(other)".
+#define JPACK_STATS_FORMAT_MAX 64
+#define JPACK_STATS_MAX_FORMATS 64
+
+typedef struct jpack_format_stats {
+    char format[JPACK_STATS_FORMAT_MAX];
+    uint64_t calls;     // Calls to pack or unpack the format
+    uint64_t bytes;     // Bytes packed or unpacked, up to the end of buf
+    uint64_t truncated; // Calls where the message did not fit in buf
+    uint64_t invalid;   // Calls that returned JPACK_INVALID
+    uint64_t cycles;    // Time stamp counter cycles spent, only counted when
+                        // built with JPACK_STATS_CYCLES (make STATS=cycles)
+} jpack_format_stats;
+
+typedef struct jpack_stats {
+    uint32_t count;
+    jpack_format_stats formats[JPACK_STATS_MAX_FORMATS];
+} jpack_stats;
+
+// Stores the counts of all threads since the last reset in stats. Counted are
+// jpack, junpack, their va_list, fields and safe variants and the plan
+// versions of them. Returns 0 on success or -1 with stats cleared if the
+// library was built without JPACK_STATS.
+int jpack_stats_snapshot(jpack_stats * stats);
+
+// Starts the counts of all threads over from zero
+void jpack_stats_reset(void);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -0,0 +1,466 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef JPACK_HPP_
+#define JPACK_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "jpack.h"
+
+// C++17 front end for jpack. The format is parsed at compile time, the
+// arguments are checked against it and the fields are packed with plain
+// stores at fixed offsets, giving the same bytes as jpack and junpack.
+//
+// The namespace is jpk since jpack is taken by the C function.
+//
+//     constexpr auto header = JPACK_FORMAT("!IHd");
+//     jpk::pack(header, buf, sizeof(buf), id, kind, value);
+//     jpk::unpack(header, buf, sizeof(buf), &id, &kind, &value);
+//
+// With C++20 the format can be given as a template argument instead:
+//
+//     jpk::pack<"!IHd">(buf, sizeof(buf), id, kind, value);
+//
+// Supported format chars are b B h H i I l L f d with counts, x, s and the
+// byte order options. Each argument must have the exact type of its field,
+// e.g. uint16_t for H, and a pointer or an array of count elements for a
+// field with a count. Strings take a const char * when packing and a char *
+// when unpacking. When buf is too short, or a string is not terminated
+// inside buf, the call is handed to jpack or junpack so that truncation
+// works the same way.
+
+// Makes a format object from a string literal
+#define JPACK_FORMAT(format) \
+    ([] { \
+        struct jpack_format { \
+            static constexpr const char * value() { return format; } \
+        }; \
+        return jpack_format{}; \
+    }())
+
+namespace jpk {
+
+namespace detail {
+
+struct field {
+    char type;
+    std::uint32_t width;    // Bytes per element, 0 for strings
+    std::uint32_t count;    // Number of elements, 1 unless the field is an array
+    bool array;             // Non zero if the field had a count
+    bool big;               // Non zero if the field is big-endian
+    std::uint32_t offset;   // Offset from the end of the previous string
+};
+
+struct summary {
+    bool valid;
+    std::size_t fields;
+    bool strings;
+    std::uint32_t fixed;    // Bytes taken by everything but the strings
+    std::uint32_t tail;     // Bytes after the last string
+};
+
+constexpr std::uint32_t width_of(char c) {
+    switch (c) {
+    case 'b': case 'B':
+        return 1;
+    case 'h': case 'H':
+        return 2;
+    case 'i': case 'I': case 'f':
+        return 4;
+    case 'l': case 'L': case 'd':
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// Parses format the same way as jpack, storing up to capacity fields in out
+constexpr summary parse(const char * format, field * out, std::size_t capacity) {
+    summary result = { true, 0, false, 0, 0 };
+    std::uint32_t segment = 0;
+    std::uint32_t count = 0;
+    bool has_count = false;
+    bool big = false;
+
+    for (;; ++format) {
+        char c = *format;
+        std::uint32_t width = width_of(c);
+
+        if (c == '\0') {
+            result.valid = !has_count;
+            result.fixed += segment;
+            result.tail = segment;
+            return result;
+        } else if (c >= '0' && c <= '9') {
+            count = count * 10 + static_cast<std::uint32_t>(c - '0');
+            has_count = true;
+            continue;
+        } else if (c == '<') {
+            big = false;
+            continue;
+        } else if (c == '>' || c == '!') {
+            big = true;
+            continue;
+        } else if (c == 'x') {
+            segment += has_count ? count : 1;
+        } else if (c == 's' && !has_count) {
+            if (result.fields < capacity) {
+                out[result.fields] = field{ c, 0, 1, false, false, segment };
+            }
+            result.fields++;
+            result.strings = true;
+            result.fixed += segment;
+            segment = 0;
+        } else if (width) {
+            if (result.fields < capacity) {
+                out[result.fields] = field{ c, width, has_count ? count : 1,
+                                            has_count, big, segment };
+            }
+            result.fields++;
+            segment += width * (has_count ? count : 1);
+        } else {
+            result.valid = false;
+            return result;
+        }
+
+        big = false;
+        has_count = false;
+        count = 0;
+    }
+}
+
+template <typename Format>
+struct format_info {
+    static constexpr const char * string = Format::value();
+    static constexpr summary info = parse(string, nullptr, 0);
+    static_assert(info.valid, "invalid or unsupported jpack format");
+
+    static constexpr std::array<field, info.fields> make_fields() {
+        std::array<field, info.fields> fields = {};
+        parse(string, fields.data(), fields.size());
+        return fields;
+    }
+
+    static constexpr std::array<field, info.fields> fields = make_fields();
+};
+
+template <char C> struct element;
+template <> struct element<'b'> { using type = std::int8_t; };
+template <> struct element<'B'> { using type = std::uint8_t; };
+template <> struct element<'h'> { using type = std::int16_t; };
+template <> struct element<'H'> { using type = std::uint16_t; };
+template <> struct element<'i'> { using type = std::int32_t; };
+template <> struct element<'I'> { using type = std::uint32_t; };
+template <> struct element<'l'> { using type = std::int64_t; };
+template <> struct element<'L'> { using type = std::uint64_t; };
+template <> struct element<'f'> { using type = float; };
+template <> struct element<'d'> { using type = double; };
+
+template <std::size_t Size> struct bits;
+template <> struct bits<1> { using type = std::uint8_t; };
+template <> struct bits<2> { using type = std::uint16_t; };
+template <> struct bits<4> { using type = std::uint32_t; };
+template <> struct bits<8> { using type = std::uint64_t; };
+
+template <typename T>
+using bits_t = typename bits<sizeof(T)>::type;
+
+template <typename T>
+inline bits_t<T> to_bits(T val) {
+    bits_t<T> out;
+    std::memcpy(&out, &val, sizeof(out));
+    return out;
+}
+
+template <typename T>
+inline T from_bits(bits_t<T> val) {
+    T out;
+    std::memcpy(&out, &val, sizeof(out));
+    return out;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool host_big = true;
+#else
+constexpr bool host_big = false;
+#endif
+
+template <typename U>
+inline U swap(U val) {
+#if defined(__GNUC__)
+    if constexpr (sizeof(U) == 2) {
+        return __builtin_bswap16(val);
+    } else if constexpr (sizeof(U) == 4) {
+        return __builtin_bswap32(val);
+    } else if constexpr (sizeof(U) == 8) {
+        return __builtin_bswap64(val);
+    }
+#endif
+    U out = 0;
+    for (std::size_t i = 0; i < sizeof(U); ++i) {
+        out = static_cast<U>(out << 8 | ((val >> (8 * i)) & 0xFF));
+    }
+    return out;
+}
+
+template <bool Big, typename U>
+inline void store(std::uint8_t * buf, U val) {
+    if constexpr (Big != host_big && sizeof(U) > 1) {
+        val = swap(val);
+    }
+    std::memcpy(buf, &val, sizeof(val));
+}
+
+template <bool Big, typename U>
+inline U load(const std::uint8_t * buf) {
+    U val;
+    std::memcpy(&val, buf, sizeof(val));
+    if constexpr (Big != host_big && sizeof(U) > 1) {
+        val = swap(val);
+    }
+    return val;
+}
+
+template <typename A>
+using bare_t = std::remove_cv_t<std::remove_reference_t<A>>;
+
+template <typename A, typename T>
+constexpr bool is_pointer_to = std::is_pointer_v<A> &&
+    std::is_same_v<std::remove_cv_t<std::remove_pointer_t<A>>, T>;
+
+template <typename A, typename T>
+constexpr bool is_array_of = std::is_array_v<A> &&
+    std::is_same_v<std::remove_cv_t<std::remove_extent_t<A>>, T>;
+
+template <typename Info, std::size_t I, typename Arg>
+constexpr bool check_pack() {
+    constexpr field f = Info::fields[I];
+    using A = bare_t<Arg>;
+
+    if constexpr (f.type == 's') {
+        static_assert(is_pointer_to<A, char> || is_array_of<A, char>,
+                      "s takes a const char *");
+    } else if constexpr (f.array) {
+        using T = typename element<f.type>::type;
+        static_assert(is_pointer_to<A, T> ||
+                      (is_array_of<A, T> && std::extent_v<A> == f.count),
+                      "a field with a count takes a pointer to or an array of "
+                      "count elements of its type");
+    } else {
+        using T = typename element<f.type>::type;
+        static_assert(std::is_same_v<A, T>,
+                      "argument type does not match its format char");
+    }
+    return true;
+}
+
+template <typename Info, std::size_t I, typename Arg>
+constexpr bool check_unpack() {
+    constexpr field f = Info::fields[I];
+    using A = bare_t<Arg>;
+
+    if constexpr (f.type == 's') {
+        static_assert(std::is_same_v<A, char *>, "s takes a char *");
+    } else {
+        using T = typename element<f.type>::type;
+        static_assert(std::is_same_v<A, T *>,
+                      "argument is not a pointer to the type of its format char");
+    }
+    return true;
+}
+
+template <typename Info, std::size_t I, typename Arg>
+inline std::size_t string_length(const Arg & arg) {
+    if constexpr (Info::fields[I].type == 's') {
+        return std::strlen(arg) + 1;
+    } else {
+        (void)arg;
+        return 0;
+    }
+}
+
+template <typename Info, std::size_t I, typename Arg>
+inline void put(std::uint8_t * buf, std::size_t & base, const Arg & arg) {
+    constexpr field f = Info::fields[I];
+    std::uint8_t * at = buf + base + f.offset;
+
+    if constexpr (f.type == 's') {
+        const char * val = arg;
+        std::size_t length = std::strlen(val) + 1;
+        std::memcpy(at, val, length);
+        base += f.offset + length;
+    } else {
+        using T = typename element<f.type>::type;
+        if constexpr (f.array) {
+            const T * values = arg;
+            for (std::uint32_t i = 0; i < f.count; ++i) {
+                store<f.big>(at + i * sizeof(T), to_bits(values[i]));
+            }
+        } else {
+            store<f.big>(at, to_bits<T>(arg));
+        }
+    }
+}
+
+template <typename Info, std::size_t I, typename Arg>
+inline bool fits(const std::uint8_t * buf, std::size_t size, std::size_t & base, Arg) {
+    constexpr field f = Info::fields[I];
+
+    if constexpr (f.type == 's') {
+        std::size_t at = base + f.offset;
+        const void * end;
+        if (at >= size || (end = std::memchr(buf + at, 0, size - at)) == nullptr) {
+            return false;
+        }
+        base = static_cast<std::size_t>(static_cast<const std::uint8_t *>(end) - buf) + 1;
+    }
+    return true;
+}
+
+template <typename Info, std::size_t I, typename Arg>
+inline void get(const std::uint8_t * buf, std::size_t & base, Arg arg) {
+    constexpr field f = Info::fields[I];
+    const std::uint8_t * at = buf + base + f.offset;
+
+    if constexpr (f.type == 's') {
+        std::size_t length = std::strlen(reinterpret_cast<const char *>(at)) + 1;
+        std::memcpy(arg, at, length);
+        base += f.offset + length;
+    } else {
+        using T = typename element<f.type>::type;
+        for (std::uint32_t i = 0; i < f.count; ++i) {
+            arg[i] = from_bits<T>(load<f.big, bits_t<T>>(at + i * sizeof(T)));
+        }
+    }
+}
+
+template <typename Format, std::size_t... I, typename... Args>
+inline std::uint32_t pack(std::index_sequence<I...>, std::uint8_t * buf,
+                          std::size_t size, const Args &... args) {
+    using info = format_info<Format>;
+    static_assert(sizeof...(Args) == info::fields.size(),
+                  "number of arguments does not match the format");
+    static_assert((check_pack<info, I, Args>() && ...), "");
+
+    std::size_t base = 0;
+
+    if (info::info.fixed + (std::size_t{0} + ... + string_length<info, I>(args)) > size) {
+        return ::jpack(buf, size, info::string, args...);
+    }
+
+    (put<info, I>(buf, base, args), ...);
+
+    return static_cast<std::uint32_t>(base + info::info.tail);
+}
+
+template <typename Format, std::size_t... I, typename... Args>
+inline std::uint32_t unpack(std::index_sequence<I...>, const std::uint8_t * buf,
+                            std::size_t size, Args... args) {
+    using info = format_info<Format>;
+    static_assert(sizeof...(Args) == info::fields.size(),
+                  "number of arguments does not match the format");
+    static_assert((check_unpack<info, I, Args>() && ...), "");
+
+    std::size_t base = 0;
+
+    // Check that all strings are terminated before touching any argument
+    if (!(fits<info, I>(buf, size, base, args) && ...) || base + info::info.tail > size) {
+        return ::junpack(buf, size, info::string, args...);
+    }
+
+    base = 0;
+    (get<info, I>(buf, base, args), ...);
+
+    return static_cast<std::uint32_t>(base + info::info.tail);
+}
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+template <std::size_t N>
+struct fixed_string {
+    char data[N];
+
+    constexpr fixed_string(const char (&string)[N]) : data() {
+        for (std::size_t i = 0; i < N; ++i) {
+            data[i] = string[i];
+        }
+    }
+};
+
+template <fixed_string S>
+struct literal_format {
+    static constexpr const char * value() { return S.data; }
+};
+#endif
+
+} // namespace detail
+
+// Same as jpack but with the format parsed at compile time
+template <typename Format, typename... Args>
+inline std::uint32_t pack(Format, std::uint8_t * buf, std::size_t size,
+                          const Args &... args) {
+    return detail::pack<Format>(std::index_sequence_for<Args...>{}, buf, size, args...);
+}
+
+// Same as junpack but with the format parsed at compile time
+template <typename Format, typename... Args>
+inline std::uint32_t unpack(Format, const std::uint8_t * buf, std::size_t size,
+                            Args... args) {
+    return detail::unpack<Format>(std::index_sequence_for<Args...>{}, buf, size, args...);
+}
+
+// Returns the size needed to hold the format or 0 if it contains a string
+template <typename Format>
+constexpr std::uint32_t length(Format) {
+    using info = detail::format_info<Format>;
+    return info::info.strings ? 0 : info::info.fixed;
+}
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+template <detail::fixed_string S, typename... Args>
+inline std::uint32_t pack(std::uint8_t * buf, std::size_t size, const Args &... args) {
+    return pack(detail::literal_format<S>{}, buf, size, args...);
+}
+
+template <detail::fixed_string S, typename... Args>
+inline std::uint32_t unpack(const std::uint8_t * buf, std::size_t size, Args... args) {
+    return unpack(detail::literal_format<S>{}, buf, size, args...);
+}
+
+template <detail::fixed_string S>
+constexpr std::uint32_t length() {
+    return length(detail::literal_format<S>{});
+}
+#endif
+
+} // namespace jpk
+
+#endif // JPACK_HPP_
@@ -28,15 +28,22 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <float.h>
+#include <sys/uio.h>
 
 #ifdef TEST
+#include <locale.h>
+#include <stddef.h>
 #include <stdio.h>
 #endif // TEST
 
 #include "jpack.h"
+#include "jpack_pool.h"
+#include "jpack_simd.h"
+#include "jpack_stats.h"
 
-static int system_big_endian = -1;
-
+// Checked on every call rather than cached in a global so that it is safe to
+// use from any thread, the compiler folds it to a constant
 static int is_system_big_endian(void) {
     union {
         uint32_t i;
@@ -74,428 +81,4594 @@ static void swap_bytes_64(uint64_t * in) {
           ((num << 56) & 0xff00000000000000);
 }
 
-static size_t min(size_t a, size_t b) {
-    return a < b ? a : b;
-}
+// One field of a format. Pad bytes do not get an op, they are folded into the
+// offset of the next field.
+typedef struct jpack_op {
+    char type;          // Format char
+    uint8_t width;      // Bytes per element, 0 for variable length fields
+    uint8_t swap;       // Non zero if the field needs its bytes swapped
+    uint8_t array;      // Non zero if the field had a count and takes a pointer
+    uint8_t prefix;     // Bytes in the length prefix of p and z fields
+    uint8_t bits;       // Bits in a u field
+    uint8_t shift;      // Bit in the byte at offset where a u field starts
+    uint8_t element;    // Bytes per value of a coded array, 0 for other fields
+    uint32_t count;     // Number of elements, 1 unless the field is an array
+    uint32_t offset;    // Offset from the end of the previous variable field
+    double low;         // Value of code 0 of a q field
+    double step;        // Value between codes of a q field
+    const char * body;  // Format of the records of a group, just after its (
+    struct jpack_plan * group;  // Compiled records of a group, NULL until compiled
+} jpack_op;
 
-uint32_t jpack(uint8_t * buf, size_t size, const char * format, ...) {
-    if (system_big_endian == -1) {
-        system_big_endian = is_system_big_endian();
-    }
+struct jpack_plan {
+    jpack_op * ops;
+    uint32_t op_count;
+    uint32_t size;      // Bytes taken by fixed size fields and padding
+    uint32_t tail;      // Bytes after the last variable field
+    uint32_t fixed;     // Number of leading fields that have a fixed offset
+    int variable;       // Non zero if the format contains a string
+#ifdef JPACK_STATS
+    char * format;      // Copy of the format to count the plan under
+#endif // JPACK_STATS
+};
 
-    uint32_t offset = 0;
-    int next_is_big_endian = 0;
-    va_list arg_list;
+// Bytes on the wire for each field format char, WIDTH_VARIABLE for variable
+// length fields and 0 for chars that are not fields
+#define WIDTH_VARIABLE 0xff
 
-    va_start(arg_list, format);
+static const uint8_t field_widths[128] = {
+    ['b'] = 1, ['B'] = 1,
+    ['h'] = 2, ['H'] = 2,
+    ['e'] = 2,
+    ['i'] = 4, ['I'] = 4, ['f'] = 4,
+    ['l'] = 8, ['L'] = 8, ['d'] = 8,
+    ['s'] = WIDTH_VARIABLE, ['S'] = WIDTH_VARIABLE,
+    ['v'] = WIDTH_VARIABLE, ['V'] = WIDTH_VARIABLE,
+    ['w'] = WIDTH_VARIABLE, ['W'] = WIDTH_VARIABLE,
+};
 
-    while (*format) {
-        switch (*format) {
-        case 'x': {
-            offset++;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'b': {
-            int8_t val = (int8_t)va_arg(arg_list, int);
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset++;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'B': {
-            uint8_t val = (uint8_t)va_arg(arg_list, int);
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset++;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'h': {
-            int16_t val = (int16_t)va_arg(arg_list, int);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_16((uint16_t *)(&val));
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 2;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'H': {
-            uint16_t val = (uint16_t)va_arg(arg_list, int);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_16(&val);
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 2;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'i': {
-            int32_t val = va_arg(arg_list, int32_t);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_32((uint32_t *)(&val));
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 4;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'I': {
-            uint32_t val = va_arg(arg_list, uint32_t);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_32(&val);
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 4;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'f': {
-            float val = (float)(va_arg(arg_list, double));
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_32((uint32_t *)(&val));
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 4;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'l': {
-            int64_t val = va_arg(arg_list, int64_t);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_64((uint64_t *)(&val));
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 8;
-            next_is_big_endian = 0;
-            break;
+static uint32_t compile_format(const char ** format, char end, jpack_plan * plan,
+                               jpack_op * ops, uint32_t capacity);
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Parses a decimal number such as -1.5 or 2e3 at text into val. Unlike strtod
+// it reads a . as the decimal point in every locale, so that the , between
+// the bounds of a q field is never part of a number.
+// Returns the end of the number or NULL if text does not start with one.
+static const char * parse_decimal(const char * text, double * val) {
+    uint64_t mantissa = 0;
+    int64_t exponent = 0;
+    int negative = *text == '-';
+    int digits = 0;
+    double scale = 1.0;
+    int64_t i;
+
+    if (*text == '-' || *text == '+') {
+        text++;
+    }
+
+    // Digits past what the mantissa holds only scale it
+    for (; is_digit(*text); ++text, ++digits) {
+        if (mantissa < 100000000000000000ull) {
+            mantissa = mantissa * 10 + (uint64_t)(*text - '0');
+        } else {
+            exponent++;
         }
-        case 'L': {
-            uint64_t val = va_arg(arg_list, uint64_t);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_64(&val);
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
+    }
+    if (*text == '.') {
+        for (++text; is_digit(*text); ++text, ++digits) {
+            if (mantissa < 100000000000000000ull) {
+                mantissa = mantissa * 10 + (uint64_t)(*text - '0');
+                exponent--;
             }
-            offset += 8;
-            next_is_big_endian = 0;
-            break;
         }
-        case 'd': {
-            double val = va_arg(arg_list, double);
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_64((uint64_t *)(&val));
-            }
-            if (size - offset > 0) {
-                memcpy(buf + offset, &val, min(sizeof(val), size - offset));
-            }
-            offset += 8;
-            next_is_big_endian = 0;
-            break;
+    }
+    if (digits == 0) {
+        return NULL;
+    }
+
+    if (*text == 'e' || *text == 'E') {
+        int negative_power = text[1] == '-';
+        int64_t power = 0;
+
+        text += text[1] == '-' || text[1] == '+' ? 2 : 1;
+        if (!is_digit(*text)) {
+            return NULL;
         }
-        case 's': {
-            const char * val = va_arg(arg_list, const char *);
-            uint32_t length = (uint32_t)(strlen(val) + 1);
-            if (size - offset > 0) {
-                memcpy(buf + offset, val, min(length, size - offset));
+        for (; is_digit(*text); ++text) {
+            if (power < 100000) {
+                power = power * 10 + (*text - '0');
             }
-            offset += length;
-            next_is_big_endian = 0;
-            break;
-        }
-        case '<': {
-            next_is_big_endian = 0;
-            break;
-        }
-        case '>': {
-            next_is_big_endian = 1;
-            break;
-        }
-        case '!': {
-            next_is_big_endian = 1;
-            break;
-        }
-        default: {
-            break;
-        }
         }
-        format++;
+        exponent += negative_power ? -power : power;
     }
 
-    va_end(arg_list);
+    // Powers of ten up to 1e22 are exact, so common bounds round once
+    for (i = 0; i < (exponent < 0 ? -exponent : exponent) && scale <= DBL_MAX; ++i) {
+        scale *= 10.0;
+    }
+    *val = exponent < 0 ? (double)mantissa / scale : (double)mantissa * scale;
+    if (negative) {
+        *val = -*val;
+    }
 
-    return offset;
+    return text;
 }
 
-uint32_t junpack(const uint8_t * buf, size_t size, const char * format, ...) {
-    if (system_big_endian == -1) {
-        system_big_endian = is_system_big_endian();
-    }
-
-    uint32_t offset = 0;
+// Parses the next field of format into op. Pad bytes and byte order options
+// are consumed on the way. segment holds the offset from the end of the last
+// variable length field and is advanced past the field. bit holds the number
+// of bits used in the last byte by bit fields, any other field starts on the
+// next byte.
+// Returns 1 if a field was parsed, 0 at the end of the format or at the ) that
+// ends the records of a group and -1 if the format is invalid.
+static int parse_field(const char ** format, jpack_op * op, uint32_t * segment,
+                       uint8_t * bit) {
     int next_is_big_endian = 0;
-    va_list arg_list;
+    int has_count = 0;
+    uint32_t count = 0;
 
-    va_start(arg_list, format);
+    for (;; (*format)++) {
+        unsigned char c = (unsigned char)**format;
+        uint8_t width = c < 128 ? field_widths[c] : 0;
 
-    while (*format) {
-        switch (*format) {
-        case 'x': {
-            offset++;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 'b': {
-            int8_t * val = va_arg(arg_list, int8_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
+        if (width == WIDTH_VARIABLE) {
+            if (has_count) {
+                return -1;
             }
-            offset++;
-            next_is_big_endian = 0;
-            break;
+            op->type = (char)c;
+            op->width = 0;
+            op->swap = 0;
+            op->array = 0;
+            op->prefix = 0;
+            op->element = 0;
+            op->count = 1;
+            op->offset = *segment;
+            *segment = 0;
+            *bit = 0;
+            (*format)++;
+            return 1;
         }
-        case 'B': {
-            uint8_t * val = va_arg(arg_list, uint8_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
+
+        if (width && (*format)[1] == '(') {
+            const char * body = *format + 2;
+            jpack_plan records;
+            if (has_count || (c != 'B' && c != 'H' && c != 'I') ||
+                    compile_format(&body, ')', &records, NULL, 0) == JPACK_INVALID ||
+                    records.op_count == 0) {
+                return -1;
             }
-            offset++;
-            next_is_big_endian = 0;
-            break;
+            op->type = '(';
+            op->width = 0;
+            op->prefix = width;
+            op->swap = width > 1 && next_is_big_endian != is_system_big_endian();
+            op->array = 0;
+            op->element = 0;
+            op->count = 1;
+            op->offset = *segment;
+            op->body = *format + 2;
+            op->group = NULL;
+            *segment = 0;
+            *bit = 0;
+            *format = body + 1;
+            return 1;
         }
-        case 'h': {
-            int16_t * val = va_arg(arg_list, int16_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
+
+        if (width) {
+            if (!has_count) {
+                count = 1;
+            } else if (count > UINT32_MAX / width) {
+                return -1;
             }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_16((uint16_t *)(val));
+            if (*segment > UINT32_MAX - width * count) {
+                return -1;
             }
-            offset += 2;
-            next_is_big_endian = 0;
-            break;
+            op->type = (char)c;
+            op->width = width;
+            op->swap = width > 1 && next_is_big_endian != is_system_big_endian();
+            op->array = (uint8_t)has_count;
+            op->prefix = 0;
+            op->element = 0;
+            op->count = count;
+            op->offset = *segment;
+            *segment += width * count;
+            *bit = 0;
+            (*format)++;
+            return 1;
         }
-        case 'H': {
-            uint16_t * val = va_arg(arg_list, uint16_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
-            }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_16(val);
+
+        switch (c) {
+        case '\0':
+        case ')':
+            return has_count ? -1 : 0;
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            if (count > (UINT32_MAX - 9) / 10) {
+                return -1;
             }
-            offset += 2;
-            next_is_big_endian = 0;
+            count = count * 10 + (uint32_t)(c - '0');
+            has_count = 1;
             break;
-        }
-        case 'i': {
-            int32_t * val = va_arg(arg_list, int32_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
-            }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_32((uint32_t *)(val));
-            }
-            offset += 4;
+        case '<':
             next_is_big_endian = 0;
             break;
-        }
-        case 'I': {
-            uint32_t * val = va_arg(arg_list, uint32_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
-            }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_32(val);
-            }
-            offset += 4;
-            next_is_big_endian = 0;
+        case '>':
+        case '!':
+            next_is_big_endian = 1;
             break;
-        }
-        case 'f': {
-            float * val = va_arg(arg_list, float *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
+        case 'p':
+        case 'z': {
+            unsigned char length = (unsigned char)(*format)[1];
+            if (has_count || (length != 'B' && length != 'H' && length != 'I')) {
+                return -1;
             }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_32((uint32_t *)(val));
-            }
-            offset += 4;
-            next_is_big_endian = 0;
-            break;
+            op->type = (char)c;
+            op->width = 0;
+            op->prefix = field_widths[length];
+            op->swap = op->prefix > 1 && next_is_big_endian != is_system_big_endian();
+            op->array = 0;
+            op->element = 0;
+            op->count = 1;
+            op->offset = *segment;
+            *segment = 0;
+            *bit = 0;
+            *format += 2;
+            return 1;
         }
-        case 'l': {
-            int64_t * val = va_arg(arg_list, int64_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
-            }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_64((uint64_t *)(val));
+        case 'r':
+        case 't':
+        case 'T': {
+            unsigned char type = (unsigned char)(*format)[1];
+            uint8_t element = type == 'I' || type == 'L' ? field_widths[type] : 0;
+            if (!has_count || element == 0 || count > UINT32_MAX / (2u * element)) {
+                return -1;
             }
-            offset += 8;
-            next_is_big_endian = 0;
-            break;
+            op->type = (char)c;
+            op->width = 0;
+            op->swap = 0;
+            op->array = 0;
+            op->prefix = 0;
+            op->element = element;
+            op->count = count;
+            op->offset = *segment;
+            *segment = 0;
+            *bit = 0;
+            *format += 2;
+            return 1;
         }
-        case 'L': {
-            uint64_t * val = va_arg(arg_list, uint64_t *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
+        case 'q': {
+            unsigned char type = (unsigned char)(*format)[1];
+            uint8_t width = type == 'B' || type == 'H' || type == 'I' ? field_widths[type] : 0;
+            const char * end = *format + 2;
+            double low, high;
+            if (width == 0 || *end != '[' ||
+                    (end = parse_decimal(end + 1, &low)) == NULL || *end != ',' ||
+                    (end = parse_decimal(end + 1, &high)) == NULL || *end != ']' ||
+                    !(low < high) || !(high - low <= DBL_MAX)) {
+                return -1;
             }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_64(val);
+            if (!has_count) {
+                count = 1;
+            } else if (count > UINT32_MAX / width) {
+                return -1;
             }
-            offset += 8;
-            next_is_big_endian = 0;
-            break;
+            if (*segment > UINT32_MAX - width * count) {
+                return -1;
+            }
+            op->type = (char)c;
+            op->width = width;
+            op->swap = width > 1 && next_is_big_endian != is_system_big_endian();
+            op->array = (uint8_t)has_count;
+            op->prefix = 0;
+            op->element = 0;
+            op->count = count;
+            op->offset = *segment;
+            op->low = low;
+            op->step = (high - low) / (width == 4 ? (double)UINT32_MAX
+                                                  : (double)((1u << width * 8) - 1));
+            *segment += width * count;
+            *bit = 0;
+            *format = end + 1;
+            return 1;
         }
-        case 'd': {
-            double * val = va_arg(arg_list, double *);
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(*val), size - offset));
+        case 'u': {
+            uint32_t bits = 0;
+            uint32_t end;
+            while ((*format)[1] >= '0' && (*format)[1] <= '9' && bits <= 32) {
+                bits = bits * 10 + (uint32_t)((*format)[1] - '0');
+                (*format)++;
             }
-            if (next_is_big_endian != system_big_endian) {
-                swap_bytes_64((uint64_t *)(val));
+            if (has_count || bits < 1 || bits > 32) {
+                return -1;
             }
-            offset += 8;
-            next_is_big_endian = 0;
-            break;
-        }
-        case 's': {
-            char * val = va_arg(arg_list, char *);
-            uint32_t length = (uint32_t)(strlen((const char *)(buf + offset)));
-            if (size - offset > 0) {
-                memcpy(val, buf + offset, min(sizeof(length), size - offset));
+            op->type = (char)c;
+            op->width = sizeof(uint32_t);
+            op->swap = 0;
+            op->array = 0;
+            op->prefix = 0;
+            op->element = 0;
+            op->bits = (uint8_t)bits;
+            op->shift = *bit;
+            op->count = 1;
+            op->offset = *bit ? *segment - 1 : *segment;
+            end = op->shift + bits;
+            if (op->offset > UINT32_MAX - (end + 7) / 8) {
+                return -1;
             }
-            val[length] = 0;
-            offset += length;
-            next_is_big_endian = 0;
-            break;
+            *segment = op->offset + (end + 7) / 8;
+            *bit = (uint8_t)(end % 8);
+            (*format)++;
+            return 1;
         }
-        case '<': {
+        case 'x':
+            if (*segment > UINT32_MAX - (has_count ? count : 1)) {
+                return -1;
+            }
+            *segment += has_count ? count : 1;
+            *bit = 0;
             next_is_big_endian = 0;
+            has_count = 0;
+            count = 0;
             break;
+        default:
+            return -1;
         }
-        case '>': {
-            next_is_big_endian = 1;
-            break;
-        }
-        case '!': {
-            next_is_big_endian = 1;
-            break;
+    }
+}
+
+// Same as parse_field for a whole format, where a ) outside a group is invalid
+static int parse_op(const char ** format, jpack_op * op, uint32_t * segment,
+                    uint8_t * bit) {
+    int status = parse_field(format, op, segment, bit);
+    return status == 0 && **format != '\0' ? -1 : status;
+}
+
+// Compiles format up to end, '\0' for a whole format and ')' for the records
+// of a group, into plan, writing at most capacity ops to ops. format is left
+// at end. The records of groups are not compiled.
+// Returns the number of ops the format needs or JPACK_INVALID.
+static uint32_t compile_format(const char ** format, char end, jpack_plan * plan,
+                               jpack_op * ops, uint32_t capacity) {
+    uint32_t count = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t size = 0;
+    uint32_t fixed = 0;
+    int variable = 0;
+    int status;
+    jpack_op op;
+
+    if (*format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_field(format, &op, &segment, &bit)) > 0) {
+        if (count < capacity) {
+            ops[count] = op;
         }
-        default: {
-            break;
+        if (!variable) {
+            fixed = count + 1;
         }
+        if (op.width == 0) {
+            if (size > UINT32_MAX - op.offset) {
+                return JPACK_INVALID;
+            }
+            size += op.offset;
+            variable = 1;
         }
-        format++;
+        count++;
     }
 
-    va_end(arg_list);
+    if (status < 0 || **format != end || size > UINT32_MAX - segment) {
+        return JPACK_INVALID;
+    }
 
-    return offset;
+    plan->ops = ops;
+    plan->op_count = count;
+    plan->size = size + segment;
+    plan->tail = segment;
+    plan->fixed = fixed;
+    plan->variable = variable;
+
+    return count;
 }
 
-uint32_t jpack_format_length(const char * format) {
-    if (format == NULL) {
+// Returns non zero if length bytes at offset fit in a buffer of size bytes
+static int fits(size_t size, uint32_t offset, size_t length) {
+    return length <= size && offset <= size - length;
+}
+
+// Writes length bytes at offset, truncating at the end of the buffer
+static void store(uint8_t * buf, size_t size, uint32_t offset,
+                  const void * data, size_t length) {
+    if (fits(size, offset, length)) {
+        memcpy(buf + offset, data, length);
+    } else if (offset < size) {
+        memcpy(buf + offset, data, size - offset);
+    }
+}
+
+// Reads length bytes at offset, truncating at the end of the buffer
+static void load(const uint8_t * buf, size_t size, uint32_t offset,
+                 void * data, size_t length) {
+    if (fits(size, offset, length)) {
+        memcpy(data, buf + offset, length);
+    } else if (offset < size) {
+        memcpy(data, buf + offset, size - offset);
+    }
+}
+
+static void put_16(uint8_t * buf, size_t size, uint32_t offset,
+                   uint16_t val, int swap) {
+    if (swap) {
+        swap_bytes_16(&val);
+    }
+    store(buf, size, offset, &val, sizeof(val));
+}
+
+static void put_32(uint8_t * buf, size_t size, uint32_t offset,
+                   uint32_t val, int swap) {
+    if (swap) {
+        swap_bytes_32(&val);
+    }
+    store(buf, size, offset, &val, sizeof(val));
+}
+
+static void put_64(uint8_t * buf, size_t size, uint32_t offset,
+                   uint64_t val, int swap) {
+    if (swap) {
+        swap_bytes_64(&val);
+    }
+    store(buf, size, offset, &val, sizeof(val));
+}
+
+// Reads the part of a scalar that is left in the buffer over dst and swaps it
+// as a whole. dst is left untouched if the field starts past the end.
+static void get_partial(const uint8_t * buf, size_t size, uint32_t offset,
+                        void * dst, size_t width, int swap) {
+    union {
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+    } val;
+
+    if (offset >= size) {
+        return;
+    }
+
+    memcpy(&val, dst, width);
+    memcpy(&val, buf + offset, size - offset);
+    if (swap && width == 2) {
+        swap_bytes_16(&val.u16);
+    } else if (swap && width == 4) {
+        swap_bytes_32(&val.u32);
+    } else if (swap && width == 8) {
+        swap_bytes_64(&val.u64);
+    }
+    memcpy(dst, &val, width);
+}
+
+// Reads a scalar into dst, swapping it if needed
+static inline void get_16(const uint8_t * buf, size_t size, uint32_t offset,
+                   void * dst, int swap) {
+    uint16_t val;
+    if (!fits(size, offset, sizeof(val))) {
+        get_partial(buf, size, offset, dst, sizeof(val), swap);
+        return;
+    }
+    memcpy(&val, buf + offset, sizeof(val));
+    if (swap) {
+        swap_bytes_16(&val);
+    }
+    memcpy(dst, &val, sizeof(val));
+}
+
+static inline void get_32(const uint8_t * buf, size_t size, uint32_t offset,
+                   void * dst, int swap) {
+    uint32_t val;
+    if (!fits(size, offset, sizeof(val))) {
+        get_partial(buf, size, offset, dst, sizeof(val), swap);
+        return;
+    }
+    memcpy(&val, buf + offset, sizeof(val));
+    if (swap) {
+        swap_bytes_32(&val);
+    }
+    memcpy(dst, &val, sizeof(val));
+}
+
+static inline void get_64(const uint8_t * buf, size_t size, uint32_t offset,
+                   void * dst, int swap) {
+    uint64_t val;
+    if (!fits(size, offset, sizeof(val))) {
+        get_partial(buf, size, offset, dst, sizeof(val), swap);
+        return;
+    }
+    memcpy(&val, buf + offset, sizeof(val));
+    if (swap) {
+        swap_bytes_64(&val);
+    }
+    memcpy(dst, &val, sizeof(val));
+}
+
+// Returns the most bytes a varint field op can take, 0 if op is not a varint
+static uint32_t varint_max(const jpack_op * op) {
+    switch (op->type) {
+    case 'v':
+    case 'V':
+        return 5;
+    case 'w':
+    case 'W':
+        return 10;
+    default:
         return 0;
     }
+}
+
+static inline uint32_t lowest_bit(uint64_t val) {
+#if defined(__GNUC__)
+    return (uint32_t)__builtin_ctzll(val);
+#else
+    uint32_t bit = 0;
+    while (!(val & 1)) {
+        val >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static uint64_t zigzag_32(int32_t val) {
+    return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+
+static uint64_t zigzag_64(int64_t val) {
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
 
+// Writes val as a LEB128 varint to out. Returns the number of bytes written.
+static uint32_t encode_varint(uint8_t * out, uint64_t val) {
     uint32_t length = 0;
 
-    while (*format) {
-        switch (*format) {
-        case 'x':
-        case 'b':
-        case 'B':
-            length += 1;
-            break;
-        case 'h':
-        case 'H':
-            length += 2;
-            break;
-        case 'i':
-        case 'I':
-        case 'f':
-            length += 4;
-            break;
-        case 'l':
-        case 'L':
-        case 'd':
-            length += 8;
-            break;
-        case '<':
-        case '>':
-        case '!':
-            break;
-        case 's':
-            return 0;
-        default:
-            break;
-        }
-        format++;
+    while (val >= 0x80) {
+        out[length++] = (uint8_t)(val | 0x80);
+        val >>= 7;
     }
+    out[length++] = (uint8_t)val;
 
     return length;
 }
 
-#ifdef TEST
-int main(int argc, char *argv[]) {
-    (void)argc; (void)argv;
+// Writes val as a varint at offset, truncating at the end of the buffer.
+// Returns the number of bytes the varint takes.
+static uint32_t put_varint(uint8_t * buf, size_t size, uint32_t offset, uint64_t val) {
+    uint8_t tmp[10];
+    uint32_t length;
 
-    { // TEST 1
-        uint32_t length = jpack_format_length("IiB");
-        if (length != 9) {
-            fprintf(stderr, "IiB format length should be 9 not: %i\n", length);
-            return EXIT_FAILURE;
-        }
-    } fprintf(stderr, "TEST1 Succeeded\n");
+    if (fits(size, offset, sizeof(tmp))) {
+        return encode_varint(buf + offset, val);
+    }
 
-    { // TEST 2
-        uint8_t * buffer;
+    length = encode_varint(tmp, val);
+    store(buf, size, offset, tmp, length);
 
-        int8_t a = -1, a2;
-        uint8_t b = 2, b2;
-        int16_t c = -3, c2;
-        uint16_t d = 4, d2;
-        int32_t e = -5, e2;
-        uint32_t f = 6, f2;
-        int64_t g = -7, g2;
-        uint64_t h = 8, h2;
-        float i = 1.0f, i2;
-        double j = 2.0, j2;
-        char k[5] = "Test";
-        char k2[5];
+    return length;
+}
 
-        size_t length = (size_t)jpack_format_length("bBxhHxiIxlLxfd") + 5;
-        buffer = malloc(length);
+// Reads the varint at offset into val. Varints of up to 8 bytes that are not
+// near the end of the buffer are decoded from a single word: the first byte
+// without the continuation bit gives the length and the 7 bit groups are
+// then squeezed together in three steps.
+// Returns the number of bytes the varint takes, or 0 if it is cut off by the
+// end of the buffer or longer than max bytes.
+static inline uint32_t get_varint(const uint8_t * buf, size_t size, uint32_t offset,
+                                  uint32_t max, uint64_t * val) {
+    uint64_t result = 0;
+    uint32_t i;
 
-        jpack(buffer, length, "bBxhHxiIxlLxfds", a, b, c, d, e, f, g, h, i, j, k);
+    if (fits(size, offset, 8)) {
+        uint64_t word;
+        uint64_t stops;
 
-        junpack(buffer, length, "bBxhHxiIxlLxfds", &a2, &b2, &c2, &d2, &e2, &f2, &g2, &h2, &i2, &j2, k2);
+        memcpy(&word, buf + offset, sizeof(word));
+        if (is_system_big_endian()) {
+            swap_bytes_64(&word);
+        }
 
-        free(buffer);
+        stops = ~word & 0x8080808080808080ull;
+        if (stops) {
+            uint32_t length = lowest_bit(stops) / 8 + 1;
+            if (length > max) {
+                return 0;
+            }
+            if (length < 8) {
+                word &= ((uint64_t)1 << (length * 8)) - 1;
+            }
+            word = (word & 0x007f007f007f007full) | ((word & 0x7f007f007f007f00ull) >> 1);
+            word = (word & 0x00003fff00003fffull) | ((word & 0x3fff00003fff0000ull) >> 2);
+            word = (word & 0x000000000fffffffull) | ((word & 0x0fffffff00000000ull) >> 4);
+            *val = word;
+            return length;
+        }
+    }
 
-        if (a != a2 ||
-                b != b2 ||
-                c != c2 ||
-                d != d2 ||
-                e != e2 ||
+    for (i = 0; i < max && offset + i < size; ++i) {
+        uint8_t byte = buf[offset + i];
+        result |= (uint64_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *val = result;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+// Packs the varint field op from the variable stored at src.
+// Returns the number of bytes the field takes.
+static uint32_t pack_varint(const jpack_op * op, uint8_t * buf, size_t size,
+                            uint32_t offset, const void * src) {
+    switch (op->type) {
+    case 'v': {
+        int32_t val;
+        memcpy(&val, src, sizeof(val));
+        return put_varint(buf, size, offset, zigzag_32(val));
+    }
+    case 'V': {
+        uint32_t val;
+        memcpy(&val, src, sizeof(val));
+        return put_varint(buf, size, offset, val);
+    }
+    case 'w': {
+        int64_t val;
+        memcpy(&val, src, sizeof(val));
+        return put_varint(buf, size, offset, zigzag_64(val));
+    }
+    default: {
+        uint64_t val;
+        memcpy(&val, src, sizeof(val));
+        return put_varint(buf, size, offset, val);
+    }
+    }
+}
+
+// Unpacks the varint field op at offset into dst. dst is left untouched if
+// the varint is cut off by the end of the buffer.
+// Returns the number of bytes the field takes.
+static inline uint32_t unpack_varint(const jpack_op * op, const uint8_t * buf,
+                                     size_t size, uint32_t offset, void * dst) {
+    uint64_t val;
+    uint32_t length = get_varint(buf, size, offset, varint_max(op), &val);
+
+    if (length == 0) {
+        return offset < size ? (uint32_t)(size - offset) + 1 : 1;
+    }
+
+    switch (op->type) {
+    case 'v': {
+        int32_t out = (int32_t)((uint32_t)(val >> 1) ^ (0u - (uint32_t)(val & 1)));
+        memcpy(dst, &out, sizeof(out));
+        break;
+    }
+    case 'V': {
+        uint32_t out = (uint32_t)val;
+        memcpy(dst, &out, sizeof(out));
+        break;
+    }
+    case 'w': {
+        int64_t out = (int64_t)((val >> 1) ^ (0u - (val & 1)));
+        memcpy(dst, &out, sizeof(out));
+        break;
+    }
+    default:
+        memcpy(dst, &val, sizeof(val));
+        break;
+    }
+
+    return length;
+}
+
+static uint64_t bit_mask(uint32_t bits) {
+    return ((uint64_t)1 << bits) - 1;
+}
+
+// Writes the low length bytes of word in little-endian order, truncating at
+// the end of the buffer. The common lengths become plain stores.
+static inline void put_word(uint8_t * buf, size_t size, uint32_t offset,
+                            uint64_t word, uint32_t length) {
+    if (is_system_big_endian()) {
+        swap_bytes_64(&word);
+    }
+
+    if (!fits(size, offset, length)) {
+        store(buf, size, offset, &word, length);
+        return;
+    }
+
+    switch (length) {
+    case 1:
+        memcpy(buf + offset, &word, 1);
+        break;
+    case 2:
+        memcpy(buf + offset, &word, 2);
+        break;
+    case 3:
+        memcpy(buf + offset, &word, 3);
+        break;
+    case 4:
+        memcpy(buf + offset, &word, 4);
+        break;
+    case 5:
+        memcpy(buf + offset, &word, 5);
+        break;
+    case 6:
+        memcpy(buf + offset, &word, 6);
+        break;
+    case 7:
+        memcpy(buf + offset, &word, 7);
+        break;
+    default:
+        memcpy(buf + offset, &word, 8);
+        break;
+    }
+}
+
+// Values in each block of a coded array
+#define CODED_BLOCK 128
+
+// Returns the number of values at the start of the coded array op that are
+// stored whole instead of as residuals
+static uint32_t coded_seeds(const jpack_op * op) {
+    uint32_t seeds = op->type == 'r' ? 0 : op->type == 't' ? 1 : 2;
+    return seeds < op->count ? seeds : op->count;
+}
+
+// Returns the number of bits needed to hold val
+static inline uint32_t bit_width(uint64_t val) {
+#if defined(__GNUC__)
+    return val ? 64 - (uint32_t)__builtin_clzll(val) : 0;
+#else
+    uint32_t bits = 0;
+    while (val) {
+        val >>= 1;
+        bits++;
+    }
+    return bits;
+#endif
+}
+
+static inline uint64_t get_element(const uint8_t * src, uint32_t element, uint32_t i) {
+    if (element == 4) {
+        uint32_t val;
+        memcpy(&val, src + 4 * (size_t)i, sizeof(val));
+        return val;
+    } else {
+        uint64_t val;
+        memcpy(&val, src + 8 * (size_t)i, sizeof(val));
+        return val;
+    }
+}
+
+static inline void set_element(uint8_t * dst, uint32_t element, uint32_t i, uint64_t val) {
+    if (element == 4) {
+        uint32_t narrow = (uint32_t)val;
+        memcpy(dst + 4 * (size_t)i, &narrow, sizeof(narrow));
+    } else {
+        memcpy(dst + 8 * (size_t)i, &val, sizeof(val));
+    }
+}
+
+// Reads the little-endian word of length bytes at offset, which the caller
+// has checked is in the buffer
+static inline uint64_t get_word(const uint8_t * buf, uint32_t offset, uint32_t length) {
+    uint64_t word = 0;
+
+    memcpy(&word, buf + offset, length);
+    if (is_system_big_endian()) {
+        swap_bytes_64(&word);
+    }
+
+    return word;
+}
+
+// Zigzag encodes a residual of element bytes so that small negative ones
+// take few bits
+static inline uint64_t zigzag_element(uint64_t val, uint32_t element) {
+    return element == 4 ? zigzag_32((int32_t)(uint32_t)val) : zigzag_64((int64_t)val);
+}
+
+static inline uint64_t unzigzag(uint64_t val) {
+    return (val >> 1) ^ (0u - (val & 1));
+}
+
+// Writes n residuals of bits bits each at offset, truncating at the end of
+// the buffer. A whole block uses the SIMD layout and a shorter last block is
+// packed bit after bit. Returns the number of bytes written.
+static uint32_t put_block(uint8_t * buf, size_t size, uint32_t offset,
+                          const uint64_t * residuals, uint32_t n, uint32_t bits,
+                          uint32_t element) {
+    uint8_t tmp[CODED_BLOCK * 8];
+    uint32_t length = (n * bits + 7) / 8;
+    uint8_t * out = fits(size, offset, length) ? buf + offset : tmp;
+    uint32_t j;
+
+    if (n == CODED_BLOCK && element == 4) {
+        uint32_t narrow[CODED_BLOCK];
+        for (j = 0; j < CODED_BLOCK; ++j) {
+            narrow[j] = (uint32_t)residuals[j];
+        }
+        jpack_bitpack_32(out, narrow, bits);
+    } else if (n == CODED_BLOCK) {
+        jpack_bitpack_64(out, residuals, bits);
+    } else {
+        memset(out, 0, length);
+        for (j = 0; j < n; ++j) {
+            uint32_t bit = j * bits;
+            uint32_t done = 0;
+            while (done < bits) {
+                uint32_t shift = (bit + done) % 8;
+                uint32_t take = 8 - shift < bits - done ? 8 - shift : bits - done;
+                out[(bit + done) / 8] |=
+                    (uint8_t)(((residuals[j] >> done) & bit_mask(take)) << shift);
+                done += take;
+            }
+        }
+    }
+
+    if (out == tmp) {
+        store(buf, size, offset, tmp, length);
+    }
+
+    return length;
+}
+
+// Reads n residuals of bits bits each at offset, which the caller has checked
+// is in the buffer
+static void get_block(const uint8_t * buf, uint32_t offset, uint64_t * residuals,
+                      uint32_t n, uint32_t bits, uint32_t element) {
+    const uint8_t * in = buf + offset;
+    uint32_t j;
+
+    if (n == CODED_BLOCK && element == 4) {
+        uint32_t narrow[CODED_BLOCK];
+        jpack_bitunpack_32(narrow, in, bits);
+        for (j = 0; j < CODED_BLOCK; ++j) {
+            residuals[j] = narrow[j];
+        }
+    } else if (n == CODED_BLOCK) {
+        jpack_bitunpack_64(residuals, in, bits);
+    } else {
+        for (j = 0; j < n; ++j) {
+            uint32_t bit = j * bits;
+            uint32_t done = 0;
+            uint64_t val = 0;
+            while (done < bits) {
+                uint32_t shift = (bit + done) % 8;
+                uint32_t take = 8 - shift < bits - done ? 8 - shift : bits - done;
+                val |= (uint64_t)((in[(bit + done) / 8] >> shift) & bit_mask(take)) << done;
+                done += take;
+            }
+            residuals[j] = val;
+        }
+    }
+}
+
+// Packs the coded array op from the count values at src. Values before the
+// residuals are stored whole, then every block of up to 128 residuals is
+// stored as the bit width, the smallest residual and the residuals less it.
+// Returns the number of bytes the field takes.
+static uint32_t put_coded(const jpack_op * op, uint8_t * buf, size_t size,
+                          uint32_t offset, const void * src) {
+    const uint8_t * in = src;
+    uint32_t element = op->element;
+    uint64_t mask = element == 4 ? UINT32_MAX : UINT64_MAX;
+    uint32_t seeds = coded_seeds(op);
+    uint64_t prev = 0;
+    uint64_t delta = 0;
+    uint32_t at = offset;
+    uint32_t i, j;
+
+    for (i = 0; i < seeds; ++i) {
+        uint64_t val = get_element(in, element, i);
+        put_word(buf, size, at, val, element);
+        delta = (val - prev) & mask;
+        prev = val;
+        at += element;
+    }
+
+    for (i = seeds; i < op->count; i += CODED_BLOCK) {
+        uint64_t residuals[CODED_BLOCK];
+        uint32_t n = op->count - i < CODED_BLOCK ? op->count - i : CODED_BLOCK;
+        uint64_t low = mask;
+        uint64_t high = 0;
+        uint32_t bits;
+
+        for (j = 0; j < n; ++j) {
+            uint64_t val = get_element(in, element, i + j);
+            uint64_t residual = val;
+            if (op->type != 'r') {
+                uint64_t diff = (val - prev) & mask;
+                residual = zigzag_element(op->type == 't' ? diff : (diff - delta) & mask,
+                                          element);
+                delta = diff;
+                prev = val;
+            }
+            residuals[j] = residual;
+            low = residual < low ? residual : low;
+            high = residual > high ? residual : high;
+        }
+
+        bits = bit_width(high - low);
+        for (j = 0; j < n; ++j) {
+            residuals[j] -= low;
+        }
+
+        put_word(buf, size, at, bits, 1);
+        put_word(buf, size, at + 1, low, element);
+        at += 1 + element;
+        at += put_block(buf, size, at, residuals, n, bits, element);
+    }
+
+    return at - offset;
+}
+
+// Returns the number of bytes the coded array op at offset takes, or
+// JPACK_INVALID if it runs past the end of the buffer
+static uint32_t coded_length(const jpack_op * op, const uint8_t * buf, size_t size,
+                             uint32_t offset) {
+    uint32_t element = op->element;
+    uint32_t at = offset + coded_seeds(op) * element;
+    uint32_t i;
+
+    if (!fits(size, offset, coded_seeds(op) * element)) {
+        return JPACK_INVALID;
+    }
+
+    for (i = coded_seeds(op); i < op->count; i += CODED_BLOCK) {
+        uint32_t n = op->count - i < CODED_BLOCK ? op->count - i : CODED_BLOCK;
+        uint32_t bits;
+
+        if (!fits(size, at, 1 + element) || (bits = buf[at]) > 8 * element ||
+                !fits(size, at + 1 + element, (n * bits + 7) / 8)) {
+            return JPACK_INVALID;
+        }
+        at += 1 + element + (n * bits + 7) / 8;
+    }
+
+    return at - offset;
+}
+
+// Unpacks the coded array op at offset into the count values at dst. Values
+// that are cut off by the end of the buffer are set to 0.
+// Returns the number of bytes the field takes.
+static uint32_t get_coded(const jpack_op * op, const uint8_t * buf, size_t size,
+                          uint32_t offset, void * dst) {
+    uint8_t * out = dst;
+    uint32_t element = op->element;
+    uint64_t mask = element == 4 ? UINT32_MAX : UINT64_MAX;
+    uint32_t seeds = coded_seeds(op);
+    uint64_t prev = 0;
+    uint64_t delta = 0;
+    uint32_t at = offset;
+    uint32_t i, j;
+
+    for (i = 0; i < seeds; ++i) {
+        uint64_t val;
+        if (!fits(size, at, element)) {
+            goto cut_off;
+        }
+        val = get_word(buf, at, element);
+        set_element(out, element, i, val);
+        delta = (val - prev) & mask;
+        prev = val;
+        at += element;
+    }
+
+    for (; i < op->count; i += CODED_BLOCK) {
+        uint64_t residuals[CODED_BLOCK];
+        uint32_t n = op->count - i < CODED_BLOCK ? op->count - i : CODED_BLOCK;
+        uint32_t bits;
+        uint64_t low;
+
+        if (!fits(size, at, 1 + element) || (bits = buf[at]) > 8 * element ||
+                !fits(size, at + 1 + element, (n * bits + 7) / 8)) {
+            goto cut_off;
+        }
+        low = get_word(buf, at + 1, element);
+        at += 1 + element;
+        get_block(buf, at, residuals, n, bits, element);
+        at += (n * bits + 7) / 8;
+
+        if (op->type == 'r') {
+            for (j = 0; j < n; ++j) {
+                set_element(out, element, i + j, (residuals[j] + low) & mask);
+            }
+        } else {
+            for (j = 0; j < n; ++j) {
+                uint64_t diff = unzigzag((residuals[j] + low) & mask) & mask;
+                if (op->type == 'T') {
+                    diff = (diff + delta) & mask;
+                }
+                prev = (prev + diff) & mask;
+                delta = diff;
+                set_element(out, element, i + j, prev);
+            }
+        }
+    }
+
+    return at - offset;
+
+cut_off:
+    memset(out + (size_t)i * element, 0, (size_t)(op->count - i) * element);
+    return offset < size ? (uint32_t)(size - offset) + 1 : 1;
+}
+
+// Writes the low bits of val as the bit field op at offset. Bits of earlier
+// fields in the first byte are kept and the bits above the field in its last
+// byte are cleared, so trailing pad bits end up zero.
+static inline void put_bits(const jpack_op * op, uint8_t * buf, size_t size,
+                            uint32_t offset, uint32_t val) {
+    uint64_t word = (val & bit_mask(op->bits)) << op->shift;
+
+    if (op->shift && offset < size) {
+        word |= buf[offset] & bit_mask(op->shift);
+    }
+
+    put_word(buf, size, offset, word, (op->shift + op->bits + 7u) / 8);
+}
+
+// Reads the bit field op at offset into dst, which is left untouched if the
+// field is cut off by the end of the buffer
+static inline void get_bits(const jpack_op * op, const uint8_t * buf, size_t size,
+                            uint32_t offset, void * dst) {
+    uint32_t length = (op->shift + op->bits + 7u) / 8;
+    uint64_t word = 0;
+    uint32_t val;
+
+    if (fits(size, offset, sizeof(word))) {
+        memcpy(&word, buf + offset, sizeof(word));
+    } else if (fits(size, offset, length)) {
+        memcpy(&word, buf + offset, length);
+    } else {
+        return;
+    }
+    if (is_system_big_endian()) {
+        swap_bytes_64(&word);
+    }
+
+    val = (uint32_t)((word >> op->shift) & bit_mask(op->bits));
+    memcpy(dst, &val, sizeof(val));
+}
+
+// Copies count elements of width bytes, swapping each of them if needed
+static void copy_elements(void * dst, const void * src, size_t count,
+                          uint8_t width, int swap) {
+    if (!swap || width == 1) {
+        memcpy(dst, src, count * width);
+    } else if (width == 2) {
+        jpack_swap_16(dst, src, count);
+    } else if (width == 4) {
+        jpack_swap_32(dst, src, count);
+    } else {
+        jpack_swap_64(dst, src, count);
+    }
+}
+
+// Returns non zero if the field op is stored as a float or a double that is
+// narrowed on the wire, e fields to half floats and q fields to fixed point
+static int is_converted(const jpack_op * op) {
+    return op->type == 'e' || op->type == 'q';
+}
+
+// Bytes per element of the variable the field op is stored in
+static size_t element_storage(const jpack_op * op) {
+    if (is_converted(op)) {
+        return op->type == 'e' ? sizeof(float) : sizeof(double);
+    }
+    return op->width;
+}
+
+// Packs count elements of the field op from the variables at src to the wire
+// bytes at dst
+static void put_elements(const jpack_op * op, uint8_t * dst, const void * src,
+                         size_t count) {
+    if (!is_converted(op)) {
+        copy_elements(dst, src, count, op->width, op->swap);
+        return;
+    }
+
+    if (op->type == 'e') {
+        jpack_float_to_half(dst, src, count);
+    } else {
+        jpack_quantize(dst, src, count, op->width, op->low, 1.0 / op->step);
+    }
+    if (op->swap) {
+        copy_elements(dst, dst, count, op->width, op->swap);
+    }
+}
+
+// Unpacks count elements of the field op from the wire bytes at src to the
+// variables at dst. Converted elements are swapped a chunk at a time on the
+// stack since src may not be written.
+static void get_elements(const jpack_op * op, void * dst, const uint8_t * src,
+                         size_t count) {
+    uint8_t chunk[512];
+    uint8_t * out = dst;
+    size_t storage = element_storage(op);
+
+    if (!is_converted(op)) {
+        copy_elements(dst, src, count, op->width, op->swap);
+        return;
+    }
+
+    while (count) {
+        size_t n = count < sizeof(chunk) / op->width ? count : sizeof(chunk) / op->width;
+        const uint8_t * codes = src;
+        if (op->swap) {
+            copy_elements(chunk, src, n, op->width, op->swap);
+            codes = chunk;
+        }
+        if (op->type == 'e') {
+            jpack_half_to_float(out, codes, n);
+        } else {
+            jpack_dequantize(out, codes, n, op->width, op->low, op->step);
+        }
+        src += n * op->width;
+        out += n * storage;
+        count -= n;
+    }
+}
+
+// Packs the array at src. Elements that only partly fit are truncated like
+// any other field.
+static void pack_array(const jpack_op * op, uint8_t * buf, size_t size,
+                       uint32_t offset, const void * src) {
+    size_t length = (size_t)op->width * op->count;
+    size_t whole;
+
+    if (offset >= size) {
+        return;
+    }
+
+    whole = fits(size, offset, length) ? op->count : (size - offset) / op->width;
+    put_elements(op, buf + offset, src, whole);
+
+    if (whole < op->count) {
+        uint8_t element[8];
+        put_elements(op, element, (const uint8_t *)src + whole * element_storage(op), 1);
+        store(buf, size, (uint32_t)(offset + whole * op->width), element, op->width);
+    }
+}
+
+// Unpacks an array into dst. Elements past the end of the buffer are left
+// untouched, as are converted elements that only partly fit.
+static void unpack_array(const jpack_op * op, const uint8_t * buf, size_t size,
+                         uint32_t offset, void * dst) {
+    size_t length = (size_t)op->width * op->count;
+    size_t whole;
+
+    if (offset >= size) {
+        return;
+    }
+
+    whole = fits(size, offset, length) ? op->count : (size - offset) / op->width;
+    get_elements(op, dst, buf + offset, whole);
+
+    if (whole < op->count && !is_converted(op)) {
+        get_partial(buf, size, (uint32_t)(offset + whole * op->width),
+                    (uint8_t *)dst + whole * op->width, op->width, op->swap);
+    }
+}
+
+// Copies the string at offset to dst, stopping at the end of the buffer.
+// Returns the number of bytes the string takes including the terminator.
+static uint32_t unpack_string(const uint8_t * buf, size_t size, uint32_t offset,
+                              char * dst) {
+    const uint8_t * end;
+    uint32_t length = 0;
+
+    if (offset < size) {
+        end = memchr(buf + offset, 0, size - offset);
+        length = end ? (uint32_t)(end - (buf + offset))
+                     : (uint32_t)(size - offset);
+        memcpy(dst, buf + offset, length);
+    }
+    dst[length] = 0;
+
+    return length + 1;
+}
+
+// Points dst at the string at offset without copying it. dst is set to an
+// empty view if the string is cut off by the end of the buffer.
+// Returns the number of bytes the string takes including the terminator.
+static uint32_t unpack_view(const uint8_t * buf, size_t size, uint32_t offset,
+                            jpack_view * dst) {
+    const uint8_t * end = NULL;
+
+    if (offset < size) {
+        end = memchr(buf + offset, 0, size - offset);
+    }
+    if (end == NULL) {
+        dst->ptr = NULL;
+        dst->len = 0;
+        return offset < size ? (uint32_t)(size - offset) + 1 : 1;
+    }
+
+    dst->ptr = buf + offset;
+    dst->len = (uint32_t)(end - dst->ptr);
+
+    return dst->len + 1;
+}
+
+// Stores length bytes of string followed by a terminator.
+// Returns the number of bytes the string takes including the terminator.
+static uint32_t store_string(uint8_t * buf, size_t size, uint32_t offset,
+                             const void * string, uint32_t length) {
+    static const uint8_t terminator = 0;
+    store(buf, size, offset, string, length);
+    store(buf, size, offset + length, &terminator, 1);
+    return length + 1;
+}
+
+// Returns the largest length the prefix of op can hold
+static uint32_t prefix_max(const jpack_op * op) {
+    return op->prefix == 1 ? UINT8_MAX : op->prefix == 2 ? UINT16_MAX : UINT32_MAX;
+}
+
+static void put_prefix(const jpack_op * op, uint8_t * buf, size_t size,
+                       uint32_t offset, uint32_t length) {
+    switch (op->prefix) {
+    case 1: {
+        uint8_t val = (uint8_t)length;
+        store(buf, size, offset, &val, sizeof(val));
+        break;
+    }
+    case 2:
+        put_16(buf, size, offset, (uint16_t)length, op->swap);
+        break;
+    default:
+        put_32(buf, size, offset, length, op->swap);
+        break;
+    }
+}
+
+// Reads the length prefix of op at offset. Returns 0 if it is cut off by the
+// end of the buffer.
+static int get_prefix(const jpack_op * op, const uint8_t * buf, size_t size,
+                      uint32_t offset, uint32_t * length) {
+    if (!fits(size, offset, op->prefix)) {
+        return 0;
+    }
+
+    switch (op->prefix) {
+    case 1:
+        *length = buf[offset];
+        break;
+    case 2: {
+        uint16_t val;
+        get_16(buf, size, offset, &val, op->swap);
+        *length = val;
+        break;
+    }
+    default:
+        get_32(buf, size, offset, length, op->swap);
+        break;
+    }
+
+    return 1;
+}
+
+// Returns the number of bytes a variable length field with length bytes of
+// payload takes. Prefixed payloads are cut to what the prefix can hold.
+static uint64_t variable_size(const jpack_op * op, uint32_t length) {
+    if (op->prefix == 0) {
+        return (uint64_t)length + 1;
+    }
+    return (uint64_t)op->prefix + (length < prefix_max(op) ? length : prefix_max(op));
+}
+
+// Stores length bytes of data as the variable length field op, either
+// terminated or after a length prefix.
+// Returns the number of bytes the field takes.
+static uint32_t store_variable(const jpack_op * op, uint8_t * buf, size_t size,
+                               uint32_t offset, const void * data, uint32_t length) {
+    if (op->prefix == 0) {
+        return store_string(buf, size, offset, data, length);
+    }
+
+    if (length > prefix_max(op)) {
+        length = prefix_max(op);
+    }
+    put_prefix(op, buf, size, offset, length);
+    store(buf, size, offset + op->prefix, data, length);
+
+    return op->prefix + length;
+}
+
+// Points dst at the payload of the prefixed field op at offset without
+// copying it. dst is set to an empty view if the payload is cut off by the
+// end of the buffer.
+// Returns the number of bytes the field takes.
+static uint32_t unpack_prefixed(const jpack_op * op, const uint8_t * buf,
+                                size_t size, uint32_t offset, jpack_view * dst) {
+    uint32_t length;
+
+    dst->ptr = NULL;
+    dst->len = 0;
+
+    if (!get_prefix(op, buf, size, offset, &length)) {
+        return op->prefix;
+    }
+    if (fits(size, offset + op->prefix, length)) {
+        dst->ptr = buf + offset + op->prefix;
+        dst->len = length;
+    }
+
+    return op->prefix + length;
+}
+
+// Unpacks the variable length field op at offset. dst points to a char
+// buffer for s and z and to a jpack_view for S and p. A z string that is cut
+// off by the end of the buffer is unpacked as an empty string.
+// Returns the number of bytes the field takes.
+static uint32_t unpack_variable(const jpack_op * op, const uint8_t * buf,
+                                size_t size, uint32_t offset, void * dst) {
+    switch (op->type) {
+    case 's':
+        return unpack_string(buf, size, offset, dst);
+    case 'S':
+        return unpack_view(buf, size, offset, dst);
+    case 'p':
+        return unpack_prefixed(op, buf, size, offset, dst);
+    default: {
+        jpack_view view;
+        uint32_t length = unpack_prefixed(op, buf, size, offset, &view);
+        if (view.len) {
+            memcpy(dst, view.ptr, view.len);
+        }
+        ((char *)dst)[view.len] = 0;
+        return length;
+    }
+    }
+}
+
+// The records of a group are packed field by field like a batch, so a group
+// nested in them comes back to these
+static uint32_t pack_group(const jpack_op * op, uint8_t * buf, size_t size,
+                           uint32_t offset, const jpack_group * group);
+static uint32_t unpack_group(const jpack_op * op, const uint8_t * buf, size_t size,
+                             uint32_t offset, jpack_group * group);
+static uint32_t group_length(const jpack_op * op, const uint8_t * buf, size_t size,
+                             uint32_t offset);
+static uint64_t group_size(const jpack_op * op, const jpack_group * group);
+
+// Returns the number of bytes the variable length field op at offset takes,
+// or JPACK_INVALID if it runs past the end of the buffer
+static uint32_t variable_length(const jpack_op * op, const uint8_t * buf,
+                                size_t size, uint32_t offset) {
+    const uint8_t * end;
+    uint32_t length;
+
+    if (varint_max(op)) {
+        uint64_t val;
+        length = get_varint(buf, size, offset, varint_max(op), &val);
+        return length ? length : JPACK_INVALID;
+    }
+
+    if (op->element) {
+        return coded_length(op, buf, size, offset);
+    }
+
+    if (op->type == '(') {
+        return group_length(op, buf, size, offset);
+    }
+
+    if (op->prefix == 0) {
+        if (offset >= size || (end = memchr(buf + offset, 0, size - offset)) == NULL) {
+            return JPACK_INVALID;
+        }
+        return (uint32_t)(end - (buf + offset)) + 1;
+    }
+
+    if (!get_prefix(op, buf, size, offset, &length) ||
+            !fits(size, offset + op->prefix, length)) {
+        return JPACK_INVALID;
+    }
+
+    return op->prefix + length;
+}
+
+// Returns the payload of the variable length field op stored at src, a
+// char pointer for s and z and a view for S and p, and its length without
+// the terminator
+static const void * field_string(const jpack_op * op, const void * src,
+                                 uint32_t * length) {
+    if (op->type == 'S' || op->type == 'p') {
+        jpack_view val;
+        memcpy(&val, src, sizeof(val));
+        *length = val.len;
+        return val.ptr;
+    } else {
+        const char * val;
+        memcpy(&val, src, sizeof(val));
+        *length = (uint32_t)strlen(val);
+        return val;
+    }
+}
+
+// Packs the next argument as the field op at offset.
+// Returns the number of bytes the field takes.
+static inline uint32_t pack_op(const jpack_op * op, uint8_t * buf, size_t size,
+                        uint32_t offset, va_list * arg_list) {
+    if (op->array) {
+        pack_array(op, buf, size, offset, va_arg(*arg_list, const void *));
+        return op->width * op->count;
+    }
+
+    switch (op->type) {
+    case 'b':
+    case 'B': {
+        uint8_t val = (uint8_t)va_arg(*arg_list, int);
+        store(buf, size, offset, &val, sizeof(val));
+        break;
+    }
+    case 'h':
+    case 'H':
+        put_16(buf, size, offset, (uint16_t)va_arg(*arg_list, int), op->swap);
+        break;
+    case 'i':
+        put_32(buf, size, offset, (uint32_t)va_arg(*arg_list, int32_t), op->swap);
+        break;
+    case 'I':
+        put_32(buf, size, offset, va_arg(*arg_list, uint32_t), op->swap);
+        break;
+    case 'f': {
+        float fval = (float)(va_arg(*arg_list, double));
+        uint32_t val;
+        memcpy(&val, &fval, sizeof(val));
+        put_32(buf, size, offset, val, op->swap);
+        break;
+    }
+    case 'l':
+        put_64(buf, size, offset, (uint64_t)va_arg(*arg_list, int64_t), op->swap);
+        break;
+    case 'L':
+        put_64(buf, size, offset, va_arg(*arg_list, uint64_t), op->swap);
+        break;
+    case 'd': {
+        double dval = va_arg(*arg_list, double);
+        uint64_t val;
+        memcpy(&val, &dval, sizeof(val));
+        put_64(buf, size, offset, val, op->swap);
+        break;
+    }
+    case 'e': {
+        float val = (float)va_arg(*arg_list, double);
+        pack_array(op, buf, size, offset, &val);
+        break;
+    }
+    case 'q': {
+        double val = va_arg(*arg_list, double);
+        pack_array(op, buf, size, offset, &val);
+        break;
+    }
+    case 's': {
+        const char * val = va_arg(*arg_list, const char *);
+        uint32_t length = (uint32_t)(strlen(val) + 1);
+        store(buf, size, offset, val, length);
+        return length;
+    }
+    case 'S':
+    case 'p': {
+        const jpack_view * val = va_arg(*arg_list, const jpack_view *);
+        return store_variable(op, buf, size, offset, val->ptr, val->len);
+    }
+    case 'z': {
+        const char * val = va_arg(*arg_list, const char *);
+        return store_variable(op, buf, size, offset, val, (uint32_t)strlen(val));
+    }
+    case 'v':
+        return put_varint(buf, size, offset, zigzag_32(va_arg(*arg_list, int32_t)));
+    case 'V':
+        return put_varint(buf, size, offset, va_arg(*arg_list, uint32_t));
+    case 'w':
+        return put_varint(buf, size, offset, zigzag_64(va_arg(*arg_list, int64_t)));
+    case 'W':
+        return put_varint(buf, size, offset, va_arg(*arg_list, uint64_t));
+    case 'r':
+    case 't':
+    case 'T':
+        return put_coded(op, buf, size, offset, va_arg(*arg_list, const void *));
+    case '(':
+        return pack_group(op, buf, size, offset, va_arg(*arg_list, const jpack_group *));
+    case 'u':
+        put_bits(op, buf, size, offset, va_arg(*arg_list, uint32_t));
+        break;
+    default:
+        break;
+    }
+
+    return op->width;
+}
+
+// Unpacks the field op at offset into the next argument.
+// Returns the number of bytes the field takes.
+static inline uint32_t unpack_op(const jpack_op * op, const uint8_t * buf, size_t size,
+                          uint32_t offset, va_list * arg_list) {
+    if (op->array) {
+        unpack_array(op, buf, size, offset, va_arg(*arg_list, void *));
+        return op->width * op->count;
+    }
+
+    switch (op->type) {
+    case 'b':
+        load(buf, size, offset, va_arg(*arg_list, int8_t *), 1);
+        break;
+    case 'B':
+        load(buf, size, offset, va_arg(*arg_list, uint8_t *), 1);
+        break;
+    case 'h':
+        get_16(buf, size, offset, va_arg(*arg_list, int16_t *), op->swap);
+        break;
+    case 'H':
+        get_16(buf, size, offset, va_arg(*arg_list, uint16_t *), op->swap);
+        break;
+    case 'i':
+        get_32(buf, size, offset, va_arg(*arg_list, int32_t *), op->swap);
+        break;
+    case 'I':
+        get_32(buf, size, offset, va_arg(*arg_list, uint32_t *), op->swap);
+        break;
+    case 'f':
+        get_32(buf, size, offset, va_arg(*arg_list, float *), op->swap);
+        break;
+    case 'l':
+        get_64(buf, size, offset, va_arg(*arg_list, int64_t *), op->swap);
+        break;
+    case 'L':
+        get_64(buf, size, offset, va_arg(*arg_list, uint64_t *), op->swap);
+        break;
+    case 'd':
+        get_64(buf, size, offset, va_arg(*arg_list, double *), op->swap);
+        break;
+    case 'e':
+    case 'q':
+        unpack_array(op, buf, size, offset, va_arg(*arg_list, void *));
+        break;
+    case 's':
+        return unpack_string(buf, size, offset, va_arg(*arg_list, char *));
+    case 'S':
+    case 'p':
+    case 'z':
+        return unpack_variable(op, buf, size, offset, va_arg(*arg_list, void *));
+    case 'v':
+    case 'V':
+    case 'w':
+    case 'W':
+        return unpack_varint(op, buf, size, offset, va_arg(*arg_list, void *));
+    case 'r':
+    case 't':
+    case 'T':
+        return get_coded(op, buf, size, offset, va_arg(*arg_list, void *));
+    case '(':
+        return unpack_group(op, buf, size, offset, va_arg(*arg_list, jpack_group *));
+    case 'u':
+        get_bits(op, buf, size, offset, va_arg(*arg_list, uint32_t *));
+        break;
+    default:
+        break;
+    }
+
+    return op->width;
+}
+
+// Packs the field op from the variable stored at src. Arrays are stored
+// inline, strings as a pointer to the string and views as a jpack_view.
+// Returns the number of bytes the field takes.
+static uint32_t pack_field(const jpack_op * op, uint8_t * buf, size_t size,
+                           uint32_t offset, const void * src) {
+    if (op->array || is_converted(op)) {
+        pack_array(op, buf, size, offset, src);
+        return op->width * op->count;
+    }
+
+    if (op->type == 'u') {
+        uint32_t val;
+        memcpy(&val, src, sizeof(val));
+        put_bits(op, buf, size, offset, val);
+        return op->width;
+    }
+
+    switch (op->width) {
+    case 0: {
+        uint32_t length;
+        const void * val;
+        if (varint_max(op)) {
+            return pack_varint(op, buf, size, offset, src);
+        }
+        if (op->element) {
+            return put_coded(op, buf, size, offset, src);
+        }
+        if (op->type == '(') {
+            jpack_group group;
+            memcpy(&group, src, sizeof(group));
+            return pack_group(op, buf, size, offset, &group);
+        }
+        val = field_string(op, src, &length);
+        return store_variable(op, buf, size, offset, val, length);
+    }
+    case 1:
+        store(buf, size, offset, src, 1);
+        break;
+    case 2: {
+        uint16_t val;
+        memcpy(&val, src, sizeof(val));
+        put_16(buf, size, offset, val, op->swap);
+        break;
+    }
+    case 4: {
+        uint32_t val;
+        memcpy(&val, src, sizeof(val));
+        put_32(buf, size, offset, val, op->swap);
+        break;
+    }
+    case 8: {
+        uint64_t val;
+        memcpy(&val, src, sizeof(val));
+        put_64(buf, size, offset, val, op->swap);
+        break;
+    }
+    default:
+        break;
+    }
+
+    return op->width;
+}
+
+// Unpacks the field op into the variable stored at dst. Strings are copied to
+// the buffer the char pointer stored at dst points to, views are stored at
+// dst.
+// Returns the number of bytes the field takes.
+static uint32_t unpack_field(const jpack_op * op, const uint8_t * buf, size_t size,
+                             uint32_t offset, void * dst) {
+    if (op->array || is_converted(op)) {
+        unpack_array(op, buf, size, offset, dst);
+        return op->width * op->count;
+    }
+
+    if (op->type == 'u') {
+        get_bits(op, buf, size, offset, dst);
+        return op->width;
+    }
+
+    switch (op->width) {
+    case 0: {
+        char * val;
+        if (varint_max(op)) {
+            return unpack_varint(op, buf, size, offset, dst);
+        }
+        if (op->element) {
+            return get_coded(op, buf, size, offset, dst);
+        }
+        if (op->type == '(') {
+            jpack_group group;
+            uint32_t length;
+            memcpy(&group, dst, sizeof(group));
+            length = unpack_group(op, buf, size, offset, &group);
+            memcpy(dst, &group, sizeof(group));
+            return length;
+        }
+        if (op->type == 'S' || op->type == 'p') {
+            jpack_view view;
+            uint32_t length = unpack_variable(op, buf, size, offset, &view);
+            memcpy(dst, &view, sizeof(view));
+            return length;
+        }
+        memcpy(&val, dst, sizeof(val));
+        return unpack_variable(op, buf, size, offset, val);
+    }
+    case 1:
+        load(buf, size, offset, dst, 1);
+        break;
+    case 2:
+        get_16(buf, size, offset, dst, op->swap);
+        break;
+    case 4:
+        get_32(buf, size, offset, dst, op->swap);
+        break;
+    case 8:
+        get_64(buf, size, offset, dst, op->swap);
+        break;
+    default:
+        break;
+    }
+
+    return op->width;
+}
+
+// Returns the number of bytes the variable length field op stored at src takes
+static uint64_t field_size(const jpack_op * op, const void * src) {
+    uint32_t length;
+
+    if (varint_max(op)) {
+        uint8_t tmp[10];
+        return pack_varint(op, tmp, sizeof(tmp), 0, src);
+    }
+
+    if (op->element) {
+        return put_coded(op, NULL, 0, 0, src);
+    }
+
+    if (op->type == '(') {
+        jpack_group group;
+        memcpy(&group, src, sizeof(group));
+        return group_size(op, &group);
+    }
+
+    field_string(op, src, &length);
+    return variable_size(op, length);
+}
+
+// Packs the run of bit fields that starts with ops[*index] at offset. The
+// bits are gathered in a 64-bit word that is written out a whole number of
+// bytes at a time, instead of every field updating the bytes it shares.
+// Leaves index at the last field of the run.
+static void pack_bit_run(const jpack_plan * plan, uint32_t * index,
+                         uint8_t * buf, size_t size, uint32_t offset,
+                         va_list * arg_list) {
+    uint64_t word = 0;
+    uint32_t filled = 0;
+    uint32_t i = *index;
+
+    for (;;) {
+        const jpack_op * op = &plan->ops[i];
+        uint64_t val = va_arg(*arg_list, uint32_t) & bit_mask(op->bits);
+        const jpack_op * next = op + 1;
+
+        if (filled + op->bits > 64) {
+            uint32_t length = filled / 8;
+            put_word(buf, size, offset, word, length);
+            offset += length;
+            word = length < 8 ? word >> (length * 8) : 0;
+            filled -= length * 8;
+        }
+        word |= val << filled;
+        filled += op->bits;
+
+        if (i + 1 == plan->op_count || next->type != 'u' ||
+                next->offset * 8 + next->shift != op->offset * 8 + op->shift + op->bits) {
+            break;
+        }
+        i++;
+    }
+
+    put_word(buf, size, offset, word, (filled + 7) / 8);
+    *index = i;
+}
+
+static uint32_t plan_pack(const jpack_plan * plan, uint8_t * buf, size_t size,
+                          va_list * arg_list) {
+    uint32_t base = 0;
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t offset = base + op->offset;
+        uint32_t length;
+
+        if (op->type == 'u') {
+            pack_bit_run(plan, &i, buf, size, offset, arg_list);
+            continue;
+        }
+
+        length = pack_op(op, buf, size, offset, arg_list);
+        if (op->width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return base + plan->tail;
+}
+
+static uint32_t plan_unpack(const jpack_plan * plan, const uint8_t * buf,
+                            size_t size, va_list * arg_list) {
+    uint32_t base = 0;
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t offset = base + op->offset;
+        uint32_t length = unpack_op(op, buf, size, offset, arg_list);
+        if (op->width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return base + plan->tail;
+}
+
+// Returns the number of bytes the message at offset takes, or JPACK_INVALID
+// if it runs past the end of the buffer
+static uint32_t plan_measure(const jpack_plan * plan, const uint8_t * buf,
+                             size_t size, uint32_t offset) {
+    uint32_t base = offset;
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t at = base + op->offset;
+        uint32_t length;
+
+        if (op->width) {
+            continue;
+        }
+        if ((length = variable_length(op, buf, size, at)) == JPACK_INVALID) {
+            return JPACK_INVALID;
+        }
+        base = at + length;
+    }
+
+    if (!fits(size, base, plan->tail)) {
+        return JPACK_INVALID;
+    }
+
+    return base + plan->tail - offset;
+}
+
+// Unpacks op at offset if it is selected and otherwise only measures it if it
+// is variable length. Returns the number of bytes a variable length field
+// takes or JPACK_INVALID if a skipped one runs past the end of the buffer.
+static uint32_t unpack_selected(const jpack_op * op, const uint8_t * buf, size_t size,
+                                uint32_t offset, int selected, va_list * arg_list) {
+    if (selected) {
+        return unpack_op(op, buf, size, offset, arg_list);
+    }
+    return op->width ? 0 : variable_length(op, buf, size, offset);
+}
+
+// Returns the number of bytes the fixed size field op takes
+static uint32_t fixed_length(const jpack_op * op) {
+    if (op->type == 'u') {
+        return (uint32_t)(op->shift + op->bits + 7) / 8;
+    }
+    return op->width * op->count;
+}
+
+// Returns non zero if field i is in mask
+static int in_mask(uint64_t mask, uint32_t i) {
+    return i < 64 && (mask >> i) & 1;
+}
+
+// Returns non zero if mask has no fields from i on
+static int mask_done(uint64_t mask, uint32_t i) {
+    return i >= 64 || (mask >> i) == 0;
+}
+
+// Returns non zero if records with fields at field_offsets have the same
+// bytes as the packed records, so that they can be copied as they are
+static int layout_matches(const jpack_plan * plan, size_t stride,
+                          const size_t * field_offsets) {
+    uint32_t i;
+
+    if (plan->variable || stride < plan->size) {
+        return 0;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        if (plan->ops[i].swap || plan->ops[i].type == 'u' || is_converted(&plan->ops[i]) ||
+                field_offsets[i] != plan->ops[i].offset) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void copy_records(uint8_t * dst, size_t dst_stride,
+                         const uint8_t * src, size_t src_stride,
+                         size_t record_size, uint32_t count) {
+    uint32_t i;
+
+    if (dst_stride == record_size && src_stride == record_size) {
+        memcpy(dst, src, record_size * count);
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        memcpy(dst + i * dst_stride, src + i * src_stride, record_size);
+    }
+}
+
+// Compiles format up to end into a plan, along with the records of each of
+// its groups. Returns NULL if the format is invalid or memory could not be
+// allocated.
+static jpack_plan * compile_plan(const char * format, char end) {
+    const char * fields = format;
+    jpack_plan header;
+    jpack_plan * plan;
+    uint32_t count;
+    uint32_t i;
+
+    count = compile_format(&fields, end, &header, NULL, 0);
+    if (count == JPACK_INVALID) {
+        return NULL;
+    }
+
+#ifdef JPACK_STATS
+    plan = malloc(sizeof(*plan) + count * sizeof(jpack_op) + (size_t)(fields - format) + 1);
+#else
+    plan = malloc(sizeof(*plan) + count * sizeof(jpack_op));
+#endif // JPACK_STATS
+    if (plan == NULL) {
+        return NULL;
+    }
+
+    fields = format;
+    compile_format(&fields, end, plan, (jpack_op *)(plan + 1), count);
+#ifdef JPACK_STATS
+    plan->format = (char *)((jpack_op *)(plan + 1) + count);
+    memcpy(plan->format, format, (size_t)(fields - format));
+    plan->format[fields - format] = 0;
+#endif // JPACK_STATS
+
+    for (i = 0; i < count; ++i) {
+        jpack_op * op = &plan->ops[i];
+        if (op->type == '(' && (op->group = compile_plan(op->body, ')')) == NULL) {
+            jpack_plan_free(plan);
+            return NULL;
+        }
+    }
+
+    return plan;
+}
+
+jpack_plan * jpack_compile(const char * format) {
+    return compile_plan(format, '\0');
+}
+
+void jpack_plan_free(jpack_plan * plan) {
+    uint32_t i;
+
+    if (plan == NULL) {
+        return;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        if (plan->ops[i].type == '(') {
+            jpack_plan_free(plan->ops[i].group);
+        }
+    }
+
+    free(plan);
+}
+
+uint32_t jpack_plan_length(const jpack_plan * plan) {
+    return plan->variable ? 0 : plan->size;
+}
+
+uint32_t jpack_plan_pack(const jpack_plan * plan, uint8_t * buf, size_t size, ...) {
+    uint32_t offset;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, size);
+    offset = plan_pack(plan, buf, size, &arg_list);
+    va_end(arg_list);
+
+    STATS_RECORD(plan->format, size, offset, start);
+    return offset;
+}
+
+uint32_t jpack_plan_unpack(const jpack_plan * plan, const uint8_t * buf, size_t size, ...) {
+    uint32_t offset;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, size);
+    offset = plan_unpack(plan, buf, size, &arg_list);
+    va_end(arg_list);
+
+    STATS_RECORD(plan->format, size, offset, start);
+    return offset;
+}
+
+uint32_t jpack_plan_unpack_safe(const jpack_plan * plan, const uint8_t * buf,
+                                size_t size, ...) {
+    uint32_t offset = JPACK_INVALID;
+    va_list arg_list;
+    STATS_START(start);
+
+    if (plan_measure(plan, buf, size, 0) != JPACK_INVALID) {
+        va_start(arg_list, size);
+        offset = plan_unpack(plan, buf, size, &arg_list);
+        va_end(arg_list);
+    }
+
+    STATS_RECORD(plan->format, size, offset, start);
+    return offset;
+}
+
+uint32_t jpack_plan_pack_fields(const jpack_plan * plan, uint8_t * buf, size_t size,
+                                const void * const * ptrs) {
+    uint32_t base = 0;
+    uint32_t i;
+    STATS_START(start);
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t offset = base + op->offset;
+        uint32_t length = pack_field(op, buf, size, offset, ptrs[i]);
+        if (op->width == 0) {
+            base = offset + length;
+        }
+    }
+
+    STATS_RECORD(plan->format, size, base + plan->tail, start);
+    return base + plan->tail;
+}
+
+uint32_t jpack_plan_unpack_fields(const jpack_plan * plan, const uint8_t * buf,
+                                  size_t size, void * const * ptrs) {
+    uint32_t base = 0;
+    uint32_t i;
+    STATS_START(start);
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t offset = base + op->offset;
+        uint32_t length = unpack_field(op, buf, size, offset, ptrs[i]);
+        if (op->width == 0) {
+            base = offset + length;
+        }
+    }
+
+    STATS_RECORD(plan->format, size, base + plan->tail, start);
+    return base + plan->tail;
+}
+
+uint32_t jpack_plan_field_offset(const jpack_plan * plan, uint32_t index) {
+    return index < plan->fixed ? plan->ops[index].offset : JPACK_INVALID;
+}
+
+uint32_t jpack_plan_unpack_mask(const jpack_plan * plan, const uint8_t * buf,
+                                size_t size, uint64_t mask, ...) {
+    uint32_t base = 0;
+    uint32_t end = 0;
+    uint32_t i;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, mask);
+
+    for (i = 0; i < plan->op_count && !mask_done(mask, i); ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t offset = base + op->offset;
+        uint32_t length = unpack_selected(op, buf, size, offset, in_mask(mask, i),
+                                          &arg_list);
+        if (length == JPACK_INVALID) {
+            end = JPACK_INVALID;
+            break;
+        }
+        if (op->width == 0) {
+            base = offset + length;
+        }
+        if (in_mask(mask, i)) {
+            end = op->width ? offset + fixed_length(op) : base;
+        }
+    }
+
+    va_end(arg_list);
+
+    STATS_RECORD(plan->format, size, end, start);
+    return end;
+}
+
+// Packs one record from the struct at record at offset.
+// Returns the number of bytes the record takes.
+static uint32_t pack_record(const jpack_plan * plan, uint8_t * buf, size_t size,
+                            uint32_t offset, const uint8_t * record,
+                            const size_t * field_offsets) {
+    uint32_t segment = offset;
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t at = segment + op->offset;
+        uint32_t field_length = pack_field(op, buf, size, at, record + field_offsets[i]);
+        if (op->width == 0) {
+            segment = at + field_length;
+        }
+    }
+
+    return segment + plan->tail - offset;
+}
+
+// Unpacks the record at offset, which the caller has checked is in the
+// buffer, into the struct at record
+static void unpack_record(const jpack_plan * plan, const uint8_t * buf, size_t size,
+                          uint32_t offset, uint8_t * record,
+                          const size_t * field_offsets) {
+    uint32_t segment = offset;
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t at = segment + op->offset;
+        uint32_t field_length = unpack_field(op, buf, size, at, record + field_offsets[i]);
+        if (op->width == 0) {
+            segment = at + field_length;
+        }
+    }
+}
+
+// Packs records back to back from *offset until one does not fit in size.
+// Returns the number of records packed and moves *offset past them.
+static uint32_t pack_records(const jpack_plan * plan, uint8_t * buf, size_t size,
+                             const uint8_t * records, uint32_t count, size_t stride,
+                             const size_t * field_offsets, uint32_t * offset) {
+    uint32_t r;
+
+    for (r = 0; r < count; ++r) {
+        uint32_t length;
+
+        if (!plan->variable && !fits(size, *offset, plan->size)) {
+            break;
+        }
+
+        length = pack_record(plan, buf, size, *offset, records + r * stride, field_offsets);
+
+        // A string made the record run past the end, it does not count
+        if (*offset + length > size) {
+            break;
+        }
+        *offset += length;
+    }
+
+    return r;
+}
+
+uint32_t jpack_plan_pack_batch(const jpack_plan * plan, uint8_t * buf, size_t size,
+                               const void * base, uint32_t count, size_t stride,
+                               const size_t * field_offsets, uint32_t * length) {
+    const uint8_t * records = base;
+    uint32_t offset = 0;
+    uint32_t r;
+
+    if (layout_matches(plan, stride, field_offsets)) {
+        if (plan->size != 0 && count > size / plan->size) {
+            count = (uint32_t)(size / plan->size);
+        }
+        copy_records(buf, plan->size, records, stride, plan->size, count);
+        if (length) {
+            *length = count * plan->size;
+        }
+        return count;
+    }
+
+    r = pack_records(plan, buf, size, records, count, stride, field_offsets, &offset);
+
+    if (length) {
+        *length = offset;
+    }
+
+    return r;
+}
+
+uint32_t jpack_plan_unpack_batch(const jpack_plan * plan, const uint8_t * buf,
+                                 size_t size, void * base, uint32_t count,
+                                 size_t stride, const size_t * field_offsets,
+                                 uint32_t * length) {
+    uint8_t * records = base;
+    uint32_t offset = 0;
+    uint32_t r;
+
+    if (layout_matches(plan, stride, field_offsets)) {
+        if (plan->size != 0 && count > size / plan->size) {
+            count = (uint32_t)(size / plan->size);
+        }
+        copy_records(records, stride, buf, plan->size, plan->size, count);
+        if (length) {
+            *length = count * plan->size;
+        }
+        return count;
+    }
+
+    for (r = 0; r < count; ++r) {
+        uint32_t record_length = plan->variable
+                                 ? plan_measure(plan, buf, size, offset)
+                                 : plan->size;
+
+        if (record_length == JPACK_INVALID || !fits(size, offset, record_length)) {
+            break;
+        }
+
+        unpack_record(plan, buf, size, offset, records + r * stride, field_offsets);
+        offset += record_length;
+    }
+
+    if (length) {
+        *length = offset;
+    }
+
+    return r;
+}
+
+uint32_t jpack_batch(uint8_t * buf, size_t size, const char * format,
+                     const void * base, uint32_t count, size_t stride,
+                     const size_t * field_offsets, uint32_t * length) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t records;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    records = jpack_plan_pack_batch(plan, buf, size, base, count, stride,
+                                    field_offsets, length);
+    jpack_plan_free(plan);
+
+    return records;
+}
+
+uint32_t junpack_batch(const uint8_t * buf, size_t size, const char * format,
+                       void * base, uint32_t count, size_t stride,
+                       const size_t * field_offsets, uint32_t * length) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t records;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    records = jpack_plan_unpack_batch(plan, buf, size, base, count, stride,
+                                      field_offsets, length);
+    jpack_plan_free(plan);
+
+    return records;
+}
+
+static uint64_t record_length(const jpack_plan * plan, const uint8_t * record,
+                              const size_t * field_offsets) {
+    uint64_t length = plan->size;
+    uint32_t i;
+
+    if (!plan->variable) {
+        return length;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        if (op->width == 0) {
+            length += field_size(op, record + field_offsets[i]);
+        }
+    }
+
+    return length;
+}
+
+uint32_t jpack_plan_record_length(const jpack_plan * plan, const void * record,
+                                  const size_t * field_offsets) {
+    uint64_t length = record_length(plan, record, field_offsets);
+    return length < JPACK_INVALID ? (uint32_t)length : JPACK_INVALID;
+}
+
+uint32_t jpack_record_length(const char * format, const void * record,
+                             const size_t * field_offsets) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t length;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    length = jpack_plan_record_length(plan, record, field_offsets);
+    jpack_plan_free(plan);
+
+    return length;
+}
+
+// Returns the number of records of group that fit in the count of the group op
+static uint32_t group_count(const jpack_op * op, const jpack_group * group) {
+    return group->count < prefix_max(op) ? group->count : prefix_max(op);
+}
+
+// Packs the group op from group: the number of records in the prefix of op,
+// then the records back to back. Records with the same layout and byte order
+// as the packed ones are copied as they are.
+// Returns the number of bytes the group takes.
+static uint32_t pack_group(const jpack_op * op, uint8_t * buf, size_t size,
+                           uint32_t offset, const jpack_group * group) {
+    const jpack_plan * plan = op->group;
+    const uint8_t * items = group->items;
+    uint32_t count = group_count(op, group);
+    uint32_t at = offset + op->prefix;
+    uint32_t r;
+
+    put_prefix(op, buf, size, offset, count);
+
+    if (layout_matches(plan, group->stride, group->field_offsets) &&
+            fits(size, at, (size_t)count * plan->size)) {
+        copy_records(buf + at, plan->size, items, group->stride, plan->size, count);
+        return op->prefix + count * plan->size;
+    }
+
+    for (r = 0; r < count; ++r) {
+        at += pack_record(plan, buf, size, at, items + (size_t)r * group->stride,
+                          group->field_offsets);
+    }
+
+    return at - offset;
+}
+
+// Unpacks the group op at offset into the first capacity records of group
+// and stores the number unpacked in count. The other records are skipped and
+// only records that are whole in the buffer are unpacked.
+// Returns the number of bytes the group takes.
+static uint32_t unpack_group(const jpack_op * op, const uint8_t * buf, size_t size,
+                             uint32_t offset, jpack_group * group) {
+    const jpack_plan * plan = op->group;
+    uint8_t * items = group->items;
+    uint32_t at = offset + op->prefix;
+    uint32_t count;
+    uint32_t r;
+
+    group->count = 0;
+
+    if (!get_prefix(op, buf, size, offset, &count)) {
+        return op->prefix;
+    }
+
+    if (!plan->variable) {
+        size_t whole = count < group->capacity ? count : group->capacity;
+        if (whole > (size - at) / plan->size) {
+            whole = (size - at) / plan->size;
+        }
+        if (layout_matches(plan, group->stride, group->field_offsets)) {
+            copy_records(items, group->stride, buf + at, plan->size, plan->size,
+                         (uint32_t)whole);
+        } else {
+            for (r = 0; r < whole; ++r) {
+                unpack_record(plan, buf, size, at + r * plan->size,
+                              items + (size_t)r * group->stride, group->field_offsets);
+            }
+        }
+        group->count = (uint32_t)whole;
+        return op->prefix + count * plan->size;
+    }
+
+    for (r = 0; r < count; ++r) {
+        uint32_t length = plan_measure(plan, buf, size, at);
+        if (length == JPACK_INVALID) {
+            // The rest of the group is cut off by the end of the buffer
+            return (uint32_t)(size - offset) + 1;
+        }
+        if (r < group->capacity) {
+            unpack_record(plan, buf, size, at, items + (size_t)r * group->stride,
+                          group->field_offsets);
+            group->count = r + 1;
+        }
+        at += length;
+    }
+
+    return at - offset;
+}
+
+// Returns the number of bytes the group op at offset takes, or JPACK_INVALID
+// if it runs past the end of the buffer
+static uint32_t group_length(const jpack_op * op, const uint8_t * buf, size_t size,
+                             uint32_t offset) {
+    const jpack_plan * plan = op->group;
+    uint32_t at = offset + op->prefix;
+    uint32_t count;
+    uint32_t r;
+
+    if (!get_prefix(op, buf, size, offset, &count)) {
+        return JPACK_INVALID;
+    }
+
+    if (!plan->variable) {
+        if (!fits(size, at, (size_t)count * plan->size)) {
+            return JPACK_INVALID;
+        }
+        return op->prefix + count * plan->size;
+    }
+
+    for (r = 0; r < count; ++r) {
+        uint32_t length = plan_measure(plan, buf, size, at);
+        if (length == JPACK_INVALID) {
+            return JPACK_INVALID;
+        }
+        at += length;
+    }
+
+    return at - offset;
+}
+
+// Returns the number of bytes the group op takes when packed from group
+static uint64_t group_size(const jpack_op * op, const jpack_group * group) {
+    const jpack_plan * plan = op->group;
+    const uint8_t * items = group->items;
+    uint32_t count = group_count(op, group);
+    uint64_t length = op->prefix;
+    uint32_t r;
+
+    if (!plan->variable) {
+        return length + (uint64_t)count * plan->size;
+    }
+
+    for (r = 0; r < count; ++r) {
+        length += record_length(plan, items + (size_t)r * group->stride,
+                                group->field_offsets);
+    }
+
+    return length;
+}
+
+// Smallest number of records worth handing to a thread of its own
+#define PARALLEL_MIN_RECORDS 4096
+
+// Chunks per thread, more than one so that a slow thread does not hold up
+// the others
+#define PARALLEL_CHUNKS 4
+
+typedef struct batch_chunk {
+    uint32_t first;     // Index of the first record
+    uint32_t count;
+    uint64_t offset;    // Where the chunk starts in buf
+    uint64_t length;    // Bytes taken by all records of the chunk
+    uint32_t packed;    // Records that fit in buf
+    uint32_t end;       // Offset after the last record that fit
+} batch_chunk;
+
+typedef struct batch_job {
+    const jpack_plan * plan;
+    uint8_t * buf;
+    size_t size;
+    const uint8_t * records;
+    size_t stride;
+    const size_t * field_offsets;
+    int copy;           // Non zero if records can be copied as they are
+    batch_chunk * chunks;
+} batch_job;
+
+static void measure_chunk(void * ctx, uint32_t index) {
+    batch_job * job = ctx;
+    batch_chunk * chunk = &job->chunks[index];
+    const uint8_t * record = job->records + (size_t)chunk->first * job->stride;
+    uint64_t length = 0;
+    uint32_t r;
+
+    for (r = 0; r < chunk->count; ++r, record += job->stride) {
+        length += record_length(job->plan, record, job->field_offsets);
+    }
+
+    chunk->length = length;
+}
+
+static void pack_chunk(void * ctx, uint32_t index) {
+    batch_job * job = ctx;
+    batch_chunk * chunk = &job->chunks[index];
+    const uint8_t * records = job->records + (size_t)chunk->first * job->stride;
+    uint32_t offset = (uint32_t)chunk->offset;
+
+    if (job->copy) {
+        uint32_t record_size = job->plan->size;
+        uint32_t count = chunk->count;
+
+        if (count > (job->size - offset) / record_size) {
+            count = (uint32_t)((job->size - offset) / record_size);
+        }
+        copy_records(job->buf + offset, record_size, records, job->stride,
+                     record_size, count);
+        chunk->packed = count;
+        chunk->end = offset + count * record_size;
+        return;
+    }
+
+    chunk->packed = pack_records(job->plan, job->buf, job->size, records, chunk->count,
+                                 job->stride, job->field_offsets, &offset);
+    chunk->end = offset;
+}
+
+uint32_t jpack_plan_pack_batch_parallel(jpack_pool * pool, const jpack_plan * plan,
+                                        uint8_t * buf, size_t size, const void * base,
+                                        uint32_t count, size_t stride,
+                                        const size_t * field_offsets, uint32_t * length) {
+    uint32_t threads = pool ? jpack_pool_threads(pool) : 1;
+    uint32_t chunk_count = threads * PARALLEL_CHUNKS;
+    uint32_t chunk_size;
+    uint32_t last;
+    uint32_t records = 0;
+    uint64_t offset = 0;
+    batch_job job;
+    uint32_t i;
+
+    if (threads == 1 || plan->size == 0 || count / 2 < PARALLEL_MIN_RECORDS) {
+        return jpack_plan_pack_batch(plan, buf, size, base, count, stride,
+                                     field_offsets, length);
+    }
+
+    // Offsets into buf are 32 bits like for the other functions
+    if (size > UINT32_MAX) {
+        size = UINT32_MAX;
+    }
+
+    chunk_size = count / chunk_count + (count % chunk_count != 0);
+    if (chunk_size < PARALLEL_MIN_RECORDS) {
+        chunk_size = PARALLEL_MIN_RECORDS;
+    }
+    chunk_count = count / chunk_size + (count % chunk_size != 0);
+
+    job.plan = plan;
+    job.buf = buf;
+    job.size = size;
+    job.records = base;
+    job.stride = stride;
+    job.field_offsets = field_offsets;
+    job.copy = layout_matches(plan, stride, field_offsets);
+    job.chunks = malloc(chunk_count * sizeof(batch_chunk));
+    if (job.chunks == NULL) {
+        return jpack_plan_pack_batch(plan, buf, size, base, count, stride,
+                                     field_offsets, length);
+    }
+
+    for (i = 0; i < chunk_count; ++i) {
+        job.chunks[i].first = i * chunk_size;
+        job.chunks[i].count = i + 1 < chunk_count ? chunk_size : count - i * chunk_size;
+        job.chunks[i].length = (uint64_t)job.chunks[i].count * plan->size;
+    }
+
+    // Records with strings are measured first so that every chunk knows where
+    // it starts
+    if (plan->variable) {
+        jpack_pool_run(pool, measure_chunk, &job, chunk_count);
+    }
+
+    // Prefix sum of the chunk lengths, stopping at the chunk that runs past the
+    // end of buf. Only that one has to check which of its records fit.
+    for (last = 0; last < chunk_count; ++last) {
+        job.chunks[last].offset = offset;
+        offset += job.chunks[last].length;
+        if (offset > size || last + 1 == chunk_count) {
+            break;
+        }
+    }
+
+    jpack_pool_run(pool, pack_chunk, &job, last + 1);
+
+    for (i = 0; i <= last; ++i) {
+        records += job.chunks[i].packed;
+    }
+
+    if (length) {
+        *length = job.chunks[last].end;
+    }
+
+    free(job.chunks);
+
+    return records;
+}
+
+uint32_t jpack_batch_parallel(jpack_pool * pool, uint8_t * buf, size_t size,
+                              const char * format, const void * base, uint32_t count,
+                              size_t stride, const size_t * field_offsets,
+                              uint32_t * length) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t records;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    records = jpack_plan_pack_batch_parallel(pool, plan, buf, size, base, count, stride,
+                                             field_offsets, length);
+    jpack_plan_free(plan);
+
+    return records;
+}
+
+// Columns start on 8 byte boundaries so that they can be read in place
+#define COLUMN_ALIGN 8
+
+static uint64_t align_column(uint64_t offset) {
+    return (offset + COLUMN_ALIGN - 1) & ~(uint64_t)(COLUMN_ALIGN - 1);
+}
+
+// Bytes the field takes in a struct, arrays and varints are inline, strings
+// pointers and views jpack_view
+static size_t field_storage(const jpack_op * op) {
+    if (op->width) {
+        return element_storage(op) * op->count;
+    }
+    if (varint_max(op)) {
+        return varint_max(op) == 5 ? sizeof(uint32_t) : sizeof(uint64_t);
+    }
+    if (op->element) {
+        return (size_t)op->element * op->count;
+    }
+    if (op->type == '(') {
+        return sizeof(jpack_group);
+    }
+    return op->type == 'S' || op->type == 'p' ? sizeof(jpack_view) : sizeof(char *);
+}
+
+static uint32_t read_header(const uint8_t * buf, uint32_t index) {
+    uint32_t val;
+    memcpy(&val, buf + index * 4, sizeof(val));
+    if (is_system_big_endian()) {
+        swap_bytes_32(&val);
+    }
+    return val;
+}
+
+static void write_header(uint8_t * buf, uint32_t index, uint32_t val) {
+    if (is_system_big_endian()) {
+        swap_bytes_32(&val);
+    }
+    memcpy(buf + index * 4, &val, sizeof(val));
+}
+
+// Copies count elements between strided arrays. The common sizes get their
+// own loops so that the copies become single moves.
+static void copy_strided(uint8_t * dst, size_t dst_stride,
+                         const uint8_t * src, size_t src_stride,
+                         size_t element, uint32_t count) {
+    uint32_t r;
+
+    switch (element) {
+    case 1:
+        for (r = 0; r < count; ++r) {
+            dst[r * dst_stride] = src[r * src_stride];
+        }
+        break;
+    case 2:
+        for (r = 0; r < count; ++r) {
+            memcpy(dst + r * dst_stride, src + r * src_stride, 2);
+        }
+        break;
+    case 4:
+        for (r = 0; r < count; ++r) {
+            memcpy(dst + r * dst_stride, src + r * src_stride, 4);
+        }
+        break;
+    case 8:
+        for (r = 0; r < count; ++r) {
+            memcpy(dst + r * dst_stride, src + r * src_stride, 8);
+        }
+        break;
+    default:
+        for (r = 0; r < count; ++r) {
+            memcpy(dst + r * dst_stride, src + r * src_stride, element);
+        }
+        break;
+    }
+}
+
+// Copies a field of count records starting at first into a column
+static void gather_column(const jpack_op * op, uint8_t * column,
+                          const uint8_t * first, size_t stride, uint32_t count) {
+    size_t element = field_storage(op);
+    uint32_t r;
+
+    if (stride == element) {
+        put_elements(op, column, first, (size_t)count * op->count);
+        return;
+    }
+
+    if (is_converted(op)) {
+        for (r = 0; r < count; ++r) {
+            put_elements(op, column + (size_t)r * op->width * op->count, first + r * stride,
+                         op->count);
+        }
+        return;
+    }
+
+    copy_strided(column, element, first, stride, element, count);
+    copy_elements(column, column, (size_t)count * op->count, op->width, op->swap);
+}
+
+// Copies a column out to the field of count records starting at first
+static void scatter_column(const jpack_op * op, uint8_t * first, size_t stride,
+                           const uint8_t * column, uint32_t count) {
+    size_t element = field_storage(op);
+    uint8_t chunk[512];
+    uint32_t per_chunk = (uint32_t)(sizeof(chunk) / element);
+    uint32_t r;
+
+    if (stride == element) {
+        get_elements(op, first, column, (size_t)count * op->count);
+        return;
+    }
+
+    if (is_converted(op)) {
+        for (r = 0; r < count; ++r) {
+            get_elements(op, first + r * stride, column + (size_t)r * op->width * op->count,
+                         op->count);
+        }
+        return;
+    }
+
+    if (!op->swap) {
+        copy_strided(first, stride, column, element, element, count);
+        return;
+    }
+
+    if (per_chunk == 0) {
+        for (r = 0; r < count; ++r) {
+            copy_elements(first + r * stride, column + r * element, op->count,
+                          op->width, op->swap);
+        }
+        return;
+    }
+
+    // Swap a chunk of the column at a time, then spread it over the records
+    for (r = 0; r < count; r += per_chunk) {
+        uint32_t n = count - r < per_chunk ? count - r : per_chunk;
+        copy_elements(chunk, column + r * element, (size_t)n * op->count,
+                      op->width, op->swap);
+        copy_strided(first + r * stride, stride, chunk, element, element, n);
+    }
+}
+
+// Bytes a fixed size column of count records takes. Bit fields are packed
+// back to back.
+static uint64_t column_length(const jpack_op * op, uint32_t count) {
+    if (op->type == 'u') {
+        return ((uint64_t)op->bits * count + 7) / 8;
+    }
+    return (uint64_t)op->width * op->count * count;
+}
+
+// Packs the bit field of count records starting at first into a column. The
+// bits are gathered in a 64-bit word and written out 32 at a time.
+static void gather_bits(const jpack_op * op, uint8_t * column,
+                        const uint8_t * first, size_t stride, uint32_t count) {
+    uint64_t word = 0;
+    uint32_t filled = 0;
+    uint32_t r;
+
+    for (r = 0; r < count; ++r) {
+        uint32_t val;
+        memcpy(&val, first + r * stride, sizeof(val));
+        word |= (val & bit_mask(op->bits)) << filled;
+        filled += op->bits;
+
+        if (filled >= 32) {
+            uint32_t out = (uint32_t)word;
+            if (is_system_big_endian()) {
+                swap_bytes_32(&out);
+            }
+            memcpy(column, &out, sizeof(out));
+            column += sizeof(out);
+            word >>= 32;
+            filled -= 32;
+        }
+    }
+
+    for (; filled > 0; filled = filled > 8 ? filled - 8 : 0) {
+        *column++ = (uint8_t)word;
+        word >>= 8;
+    }
+}
+
+// Copies a bit field column out to count records starting at first, reading
+// 32 bits at a time into a 64-bit word
+static void scatter_bits(const jpack_op * op, uint8_t * first, size_t stride,
+                         const uint8_t * column, uint32_t count) {
+    size_t left = (size_t)column_length(op, count);
+    uint64_t word = 0;
+    uint32_t available = 0;
+    uint32_t r;
+
+    for (r = 0; r < count; ++r) {
+        uint32_t val;
+
+        if (available < op->bits) {
+            uint32_t in = 0;
+            size_t n = left < sizeof(in) ? left : sizeof(in);
+            memcpy(&in, column, n);
+            if (is_system_big_endian()) {
+                swap_bytes_32(&in);
+            }
+            column += n;
+            left -= n;
+            word |= (uint64_t)in << available;
+            available += 32;
+        }
+
+        val = (uint32_t)(word & bit_mask(op->bits));
+        word >>= op->bits;
+        available -= op->bits;
+        memcpy(first + r * stride, &val, sizeof(val));
+    }
+}
+
+static uint32_t plan_pack_columns(const jpack_plan * plan, uint8_t * buf, size_t size,
+                                  const void * base, uint32_t count, size_t stride,
+                                  const size_t * field_offsets) {
+    const uint8_t * records = base;
+    uint64_t offset = align_column(8 + 4 * ((uint64_t)plan->op_count + 1));
+    uint32_t i, r;
+
+    // First work out where the columns go
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint64_t length = 0;
+
+        if (op->width) {
+            length = column_length(op, count);
+        } else {
+            for (r = 0; r < count; ++r) {
+                length += field_size(op, records + r * stride + field_offsets[i]);
+            }
+        }
+        offset = align_column(offset + length);
+    }
+
+    if (offset > UINT32_MAX) {
+        return JPACK_INVALID;
+    }
+    if (offset > size) {
+        return (uint32_t)offset;
+    }
+
+    write_header(buf, 0, count);
+    write_header(buf, 1, plan->op_count);
+    offset = align_column(8 + 4 * ((uint64_t)plan->op_count + 1));
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        const uint8_t * first = records + field_offsets[i];
+        uint8_t * column = buf + offset;
+        uint8_t * end = column;
+
+        write_header(buf, 2 + i, (uint32_t)offset);
+
+        if (op->type == 'u') {
+            gather_bits(op, column, first, stride, count);
+            end += column_length(op, count);
+        } else if (op->width) {
+            gather_column(op, column, first, stride, count);
+            end += column_length(op, count);
+        } else {
+            for (r = 0; r < count; ++r) {
+                end += pack_field(op, buf, size, (uint32_t)(end - buf), first + r * stride);
+            }
+        }
+
+        offset = align_column((uint64_t)(end - buf));
+        memset(end, 0, (size_t)(buf + offset - end));
+    }
+    write_header(buf, 2 + plan->op_count, (uint32_t)offset);
+
+    return (uint32_t)offset;
+}
+
+// Unpacks the columns either into records, when columns is NULL, or into one
+// array per field. Returns the number of records or JPACK_INVALID if the
+// columns do not match the plan.
+static uint32_t plan_unpack_columns(const jpack_plan * plan, const uint8_t * buf,
+                                    size_t size, void * base, size_t stride,
+                                    const size_t * field_offsets,
+                                    void * const * columns, uint32_t count) {
+    uint32_t records;
+    uint32_t i, r;
+
+    if (size < 8 + 4 * ((size_t)plan->op_count + 1) ||
+            read_header(buf, 1) != plan->op_count) {
+        return JPACK_INVALID;
+    }
+
+    records = read_header(buf, 0);
+    if (records < count) {
+        count = records;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t start = read_header(buf, 2 + i);
+        uint32_t end = read_header(buf, 3 + i);
+        uint8_t * first;
+        size_t step;
+
+        if (start > end || end > size) {
+            return JPACK_INVALID;
+        }
+
+        if (columns) {
+            first = columns[i];
+            step = field_storage(op);
+        } else {
+            first = (uint8_t *)base + field_offsets[i];
+            step = stride;
+        }
+
+        if (op->width) {
+            if (column_length(op, records) > end - start) {
+                return JPACK_INVALID;
+            }
+            if (op->type == 'u') {
+                scatter_bits(op, first, step, buf + start, count);
+            } else {
+                scatter_column(op, first, step, buf + start, count);
+            }
+        } else {
+            uint32_t offset = start;
+            for (r = 0; r < count; ++r) {
+                if (variable_length(op, buf, end, offset) == JPACK_INVALID) {
+                    return JPACK_INVALID;
+                }
+                offset += unpack_field(op, buf, end, offset, first + r * step);
+            }
+        }
+    }
+
+    return count;
+}
+
+uint32_t jpack_columns(uint8_t * buf, size_t size, const char * format,
+                       const void * base, uint32_t count, size_t stride,
+                       const size_t * field_offsets) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t length;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    length = plan_pack_columns(plan, buf, size, base, count, stride, field_offsets);
+    jpack_plan_free(plan);
+
+    return length;
+}
+
+uint32_t junpack_columns(const uint8_t * buf, size_t size, const char * format,
+                         void * base, uint32_t count, size_t stride,
+                         const size_t * field_offsets) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t records;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    records = plan_unpack_columns(plan, buf, size, base, stride, field_offsets,
+                                  NULL, count);
+    jpack_plan_free(plan);
+
+    return records;
+}
+
+uint32_t junpack_columns_soa(const uint8_t * buf, size_t size, const char * format,
+                             void * const * columns, uint32_t count) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t records;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    records = plan_unpack_columns(plan, buf, size, NULL, 0, NULL, columns, count);
+    jpack_plan_free(plan);
+
+    return records;
+}
+
+const uint8_t * jpack_column(const uint8_t * buf, size_t size, uint32_t column,
+                             uint32_t * count, uint32_t * length) {
+    uint32_t columns, start, end;
+
+    if (size < 8) {
+        return NULL;
+    }
+
+    columns = read_header(buf, 1);
+    if (column >= columns || size < 8 + 4 * ((size_t)columns + 1)) {
+        return NULL;
+    }
+
+    start = read_header(buf, 2 + column);
+    end = read_header(buf, 3 + column);
+    if (start > end || end > size) {
+        return NULL;
+    }
+
+    if (count) {
+        *count = read_header(buf, 0);
+    }
+    if (length) {
+        *length = end - start;
+    }
+
+    return buf + start;
+}
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+// Hands all but the last keep staged bytes to write
+static int stream_flush_keep(jpack_stream * stream, size_t keep) {
+    // Bytes of a framed message are checksummed as they leave the buffer
+    if (stream->framed && stream->used - keep > stream->mark) {
+        stream->crc = jpack_crc32c_update(stream->crc, stream->buf + stream->mark,
+                                          stream->used - keep - stream->mark);
+    }
+    stream->mark = 0;
+
+    if (stream->used > keep &&
+            stream->write(stream->ctx, stream->buf, stream->used - keep) != 0) {
+        stream->error = 1;
+        return -1;
+    }
+    memmove(stream->buf, stream->buf + stream->used - keep, keep);
+    stream->used = keep;
+    return 0;
+}
+
+static int stream_flush(jpack_stream * stream) {
+    return stream_flush_keep(stream, 0);
+}
+
+// Makes room for length bytes in the staging buffer
+static int stream_reserve(jpack_stream * stream, size_t length) {
+    if (stream->size - stream->used < length && stream_flush(stream) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Writes length bytes from data, or zeros if data is NULL
+static int stream_write(jpack_stream * stream, const uint8_t * data, size_t length) {
+    while (length) {
+        size_t n;
+
+        if (stream_reserve(stream, 1) != 0) {
+            return -1;
+        }
+
+        n = min_size(length, stream->size - stream->used);
+        if (data) {
+            memcpy(stream->buf + stream->used, data, n);
+            data += n;
+        } else {
+            memset(stream->buf + stream->used, 0, n);
+        }
+        stream->used += n;
+        stream->total += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int stream_write_array(jpack_stream * stream, const jpack_op * op,
+                              const uint8_t * src) {
+    size_t left = op->count;
+
+    while (left) {
+        size_t n;
+
+        if (stream_reserve(stream, op->width) != 0) {
+            return -1;
+        }
+
+        n = min_size(left, (stream->size - stream->used) / op->width);
+        put_elements(op, stream->buf + stream->used, src, n);
+        stream->used += n * op->width;
+        stream->total += n * op->width;
+        src += n * element_storage(op);
+        left -= n;
+    }
+    return 0;
+}
+
+// Packs the field op, padding with zeros up to it. segment holds the number
+// of bytes written since the last variable length field.
+static int stream_pack_op(jpack_stream * stream, const jpack_op * op,
+                          uint32_t * segment, va_list * arg_list) {
+    if (op->element || op->type == '(') {
+        return -1;
+    }
+
+    if (op->type == 'u') {
+        // A bit field that starts inside the last byte written shares it,
+        // so that byte has to stay staged
+        uint32_t keep = op->shift ? 1 : 0;
+        uint32_t length = (op->shift + op->bits + 7u) / 8 - keep;
+
+        if (!keep && stream_write(stream, NULL, op->offset - *segment) != 0) {
+            return -1;
+        }
+        if (stream->size - stream->used < length &&
+                stream_flush_keep(stream, keep) != 0) {
+            return -1;
+        }
+        put_bits(op, stream->buf, stream->size, (uint32_t)(stream->used - keep),
+                 va_arg(*arg_list, uint32_t));
+        stream->used += length;
+        stream->total += length;
+        *segment = op->offset + keep + length;
+        return 0;
+    }
+
+    if (stream_write(stream, NULL, op->offset - *segment) != 0) {
+        return -1;
+    }
+
+    if (op->array) {
+        if (stream_write_array(stream, op, va_arg(*arg_list, const uint8_t *)) != 0) {
+            return -1;
+        }
+        *segment = op->offset + op->width * op->count;
+    } else if (varint_max(op)) {
+        uint8_t tmp[10];
+        uint32_t length = pack_op(op, tmp, sizeof(tmp), 0, arg_list);
+        if (stream_write(stream, tmp, length) != 0) {
+            return -1;
+        }
+        *segment = 0;
+    } else if (op->width == 0) {
+        uint8_t prefix[4];
+        uint32_t length;
+        const void * val;
+        if (op->type == 'S' || op->type == 'p') {
+            const jpack_view * view = va_arg(*arg_list, const jpack_view *);
+            val = view->ptr;
+            length = view->len;
+        } else {
+            val = va_arg(*arg_list, const char *);
+            length = (uint32_t)strlen(val);
+        }
+        if (op->prefix) {
+            length = (uint32_t)(variable_size(op, length) - op->prefix);
+            put_prefix(op, prefix, sizeof(prefix), 0, length);
+            if (stream_write(stream, prefix, op->prefix) != 0) {
+                return -1;
+            }
+        }
+        if (stream_write(stream, val, length) != 0 ||
+                (op->prefix == 0 && stream_write(stream, NULL, 1) != 0)) {
+            return -1;
+        }
+        *segment = 0;
+    } else {
+        if (stream_reserve(stream, op->width) != 0) {
+            return -1;
+        }
+        pack_op(op, stream->buf, stream->size, (uint32_t)stream->used, arg_list);
+        stream->used += op->width;
+        stream->total += op->width;
+        *segment = op->offset + op->width;
+    }
+
+    return 0;
+}
+
+// Makes sure length bytes are buffered at the read position, keeping the
+// keep bytes before it
+static int stream_fill_keep(jpack_stream * stream, size_t length, size_t keep) {
+    if (stream->used - stream->pos >= length) {
+        return 0;
+    }
+    if (length + keep > stream->size) {
+        stream->error = 1;
+        return -1;
+    }
+
+    memmove(stream->buf, stream->buf + stream->pos - keep,
+            stream->used - stream->pos + keep);
+    stream->used -= stream->pos - keep;
+    stream->pos = keep;
+
+    while (stream->used < keep + length) {
+        size_t n = stream->read(stream->ctx, stream->buf + stream->used,
+                                stream->size - stream->used);
+        if (n == 0) {
+            stream->error = 1;
+            return -1;
+        }
+        stream->used += n;
+    }
+    return 0;
+}
+
+static int stream_fill(jpack_stream * stream, size_t length) {
+    return stream_fill_keep(stream, length, 0);
+}
+
+// Reads length bytes into data, or skips them if data is NULL
+static int stream_read(jpack_stream * stream, uint8_t * data, size_t length) {
+    while (length) {
+        size_t n;
+
+        if (stream_fill(stream, 1) != 0) {
+            return -1;
+        }
+
+        n = min_size(length, stream->used - stream->pos);
+        if (data) {
+            memcpy(data, stream->buf + stream->pos, n);
+            data += n;
+        }
+        stream->pos += n;
+        stream->total += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int stream_read_array(jpack_stream * stream, const jpack_op * op,
+                             uint8_t * dst) {
+    size_t left = op->count;
+
+    while (left) {
+        size_t n;
+
+        if (stream_fill(stream, op->width) != 0) {
+            return -1;
+        }
+
+        n = min_size(left, (stream->used - stream->pos) / op->width);
+        get_elements(op, dst, stream->buf + stream->pos, n);
+        stream->pos += n * op->width;
+        stream->total += n * op->width;
+        dst += n * element_storage(op);
+        left -= n;
+    }
+    return 0;
+}
+
+static int stream_read_string(jpack_stream * stream, char * dst) {
+    for (;;) {
+        const uint8_t * start;
+        const uint8_t * end;
+        size_t n;
+
+        if (stream_fill(stream, 1) != 0) {
+            return -1;
+        }
+
+        start = stream->buf + stream->pos;
+        end = memchr(start, 0, stream->used - stream->pos);
+        n = end ? (size_t)(end - start) + 1 : stream->used - stream->pos;
+        memcpy(dst, start, n);
+        dst += n;
+        stream->pos += n;
+        stream->total += n;
+
+        if (end) {
+            return 0;
+        }
+    }
+}
+
+// Unpacks the field op, skipping the pad bytes before it
+static int stream_unpack_op(jpack_stream * stream, const jpack_op * op,
+                            uint32_t * segment, va_list * arg_list) {
+    if (op->element || op->type == '(') {
+        return -1;
+    }
+
+    if (op->type == 'u') {
+        // The first byte is shared with the bit field before it
+        uint32_t keep = op->shift ? 1 : 0;
+        uint32_t length = (op->shift + op->bits + 7u) / 8 - keep;
+
+        if (!keep && stream_read(stream, NULL, op->offset - *segment) != 0) {
+            return -1;
+        }
+        if (stream_fill_keep(stream, length, keep) != 0) {
+            return -1;
+        }
+        get_bits(op, stream->buf, stream->used, (uint32_t)(stream->pos - keep),
+                 va_arg(*arg_list, uint32_t *));
+        stream->pos += length;
+        stream->total += length;
+        *segment = op->offset + keep + length;
+        return 0;
+    }
+
+    if (stream_read(stream, NULL, op->offset - *segment) != 0) {
+        return -1;
+    }
+
+    if (op->array) {
+        if (stream_read_array(stream, op, va_arg(*arg_list, uint8_t *)) != 0) {
+            return -1;
+        }
+        *segment = op->offset + op->width * op->count;
+    } else if (varint_max(op)) {
+        uint8_t tmp[10];
+        uint32_t length = 0;
+        do {
+            if (length == varint_max(op)) {
+                stream->error = 1;
+                return -1;
+            }
+            if (stream_read(stream, tmp + length, 1) != 0) {
+                return -1;
+            }
+        } while (tmp[length++] & 0x80);
+        unpack_op(op, tmp, length, 0, arg_list);
+        *segment = 0;
+    } else if (op->width == 0) {
+        // A view would point into the staging buffer, which is reused
+        if (op->type == 'S' || op->type == 'p') {
+            stream->error = 1;
+            return -1;
+        }
+        if (op->type == 'z') {
+            char * dst = va_arg(*arg_list, char *);
+            uint32_t length;
+            if (stream_fill(stream, op->prefix) != 0) {
+                return -1;
+            }
+            get_prefix(op, stream->buf, stream->used, (uint32_t)stream->pos, &length);
+            stream->pos += op->prefix;
+            stream->total += op->prefix;
+            if (stream_read(stream, (uint8_t *)dst, length) != 0) {
+                return -1;
+            }
+            dst[length] = 0;
+        } else if (stream_read_string(stream, va_arg(*arg_list, char *)) != 0) {
+            return -1;
+        }
+        *segment = 0;
+    } else {
+        if (stream_fill(stream, op->width) != 0) {
+            return -1;
+        }
+        unpack_op(op, stream->buf, stream->used, (uint32_t)stream->pos, arg_list);
+        stream->pos += op->width;
+        stream->total += op->width;
+        *segment = op->offset + op->width;
+    }
+
+    return 0;
+}
+
+// Returns non zero if every field of plan can go to or come from a stream,
+// which coded arrays and groups can not. This is checked before the first
+// field so that no part of the message is written or read.
+static int stream_plan_supported(const jpack_plan * plan) {
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        if (plan->ops[i].element || plan->ops[i].type == '(') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint32_t stream_plan_pack(jpack_stream * stream, const jpack_plan * plan,
+                                 va_list * arg_list) {
+    uint64_t start = stream->total;
+    uint32_t segment = 0;
+    uint32_t i;
+
+    if (stream->error || !stream_plan_supported(plan)) {
+        return JPACK_INVALID;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        if (stream_pack_op(stream, &plan->ops[i], &segment, arg_list) != 0) {
+            return JPACK_INVALID;
+        }
+    }
+    if (stream_write(stream, NULL, plan->tail - segment) != 0) {
+        return JPACK_INVALID;
+    }
+
+    return (uint32_t)(stream->total - start);
+}
+
+static uint32_t stream_plan_unpack(jpack_stream * stream, const jpack_plan * plan,
+                                   va_list * arg_list) {
+    uint64_t start = stream->total;
+    uint32_t segment = 0;
+    uint32_t i;
+
+    if (stream->error || !stream_plan_supported(plan)) {
+        return JPACK_INVALID;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        if (stream_unpack_op(stream, &plan->ops[i], &segment, arg_list) != 0) {
+            return JPACK_INVALID;
+        }
+    }
+    if (stream_read(stream, NULL, plan->tail - segment) != 0) {
+        return JPACK_INVALID;
+    }
+
+    return (uint32_t)(stream->total - start);
+}
+
+void jpack_stream_writer(jpack_stream * stream, uint8_t * buf, size_t size,
+                         jpack_write_fn write, void * ctx) {
+    memset(stream, 0, sizeof(*stream));
+    stream->buf = buf;
+    stream->size = size;
+    stream->write = write;
+    stream->ctx = ctx;
+    stream->error = size < 8;
+}
+
+void jpack_stream_reader(jpack_stream * stream, uint8_t * buf, size_t size,
+                         jpack_read_fn read, void * ctx) {
+    memset(stream, 0, sizeof(*stream));
+    stream->buf = buf;
+    stream->size = size;
+    stream->read = read;
+    stream->ctx = ctx;
+    stream->error = size < 8;
+}
+
+int jpack_stream_flush(jpack_stream * stream) {
+    return stream->error ? -1 : stream_flush(stream);
+}
+
+static uint32_t stream_pack_format(jpack_stream * stream, const char * format,
+                                   va_list * arg_list) {
+    uint64_t start = stream->total;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t written = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL || stream->error) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        if (stream_pack_op(stream, &op, &written, arg_list) != 0) {
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0 && stream_write(stream, NULL, segment - written) != 0) {
+        status = -1;
+    }
+
+    return status < 0 ? JPACK_INVALID : (uint32_t)(stream->total - start);
+}
+
+uint32_t jpack_stream_pack(jpack_stream * stream, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+
+    va_start(arg_list, format);
+    length = stream_pack_format(stream, format, &arg_list);
+    va_end(arg_list);
+
+    return length;
+}
+
+uint32_t jpack_stream_pack_framed(jpack_stream * stream, const char * format, ...) {
+    uint8_t crc[JPACK_CRC_SIZE];
+    uint32_t length;
+    va_list arg_list;
+
+    stream->framed = 1;
+    stream->mark = stream->used;
+    stream->crc = ~0u;
+
+    va_start(arg_list, format);
+    length = stream_pack_format(stream, format, &arg_list);
+    va_end(arg_list);
+
+    stream->crc = ~jpack_crc32c_update(stream->crc, stream->buf + stream->mark,
+                                       stream->used - stream->mark);
+    stream->framed = 0;
+
+    if (length == JPACK_INVALID) {
+        return JPACK_INVALID;
+    }
+
+    write_header(crc, 0, stream->crc);
+    if (stream_write(stream, crc, sizeof(crc)) != 0) {
+        return JPACK_INVALID;
+    }
+
+    return length + JPACK_CRC_SIZE;
+}
+
+uint32_t jpack_stream_unpack(jpack_stream * stream, const char * format, ...) {
+    uint64_t start = stream->total;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t consumed = 0;
+    int status;
+    jpack_op op;
+    va_list arg_list;
+
+    if (format == NULL || stream->error) {
+        return JPACK_INVALID;
+    }
+
+    va_start(arg_list, format);
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        if (stream_unpack_op(stream, &op, &consumed, &arg_list) != 0) {
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0 && stream_read(stream, NULL, segment - consumed) != 0) {
+        status = -1;
+    }
+
+    va_end(arg_list);
+
+    return status < 0 ? JPACK_INVALID : (uint32_t)(stream->total - start);
+}
+
+uint32_t jpack_stream_plan_pack(jpack_stream * stream, const jpack_plan * plan, ...) {
+    uint32_t length;
+    va_list arg_list;
+
+    va_start(arg_list, plan);
+    length = stream_plan_pack(stream, plan, &arg_list);
+    va_end(arg_list);
+
+    return length;
+}
+
+uint32_t jpack_stream_plan_unpack(jpack_stream * stream, const jpack_plan * plan, ...) {
+    uint32_t length;
+    va_list arg_list;
+
+    va_start(arg_list, plan);
+    length = stream_plan_unpack(stream, plan, &arg_list);
+    va_end(arg_list);
+
+    return length;
+}
+
+// Compiles the records of op if it is a group parsed from a format string,
+// for the length of the call. Plans have theirs compiled already.
+// Returns -1 if memory could not be allocated.
+static int bind_group(jpack_op * op) {
+    if (op->type != '(') {
+        return 0;
+    }
+    op->group = compile_plan(op->body, ')');
+    return op->group ? 0 : -1;
+}
+
+static void release_group(jpack_op * op) {
+    if (op->type == '(') {
+        jpack_plan_free(op->group);
+    }
+}
+
+static uint32_t pack_format(uint8_t * buf, size_t size, const char * format,
+                            va_list * arg_list) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+        if (bind_group(&op) < 0) {
+            return JPACK_INVALID;
+        }
+        length = pack_op(&op, buf, size, offset, arg_list);
+        release_group(&op);
+        if (op.width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return status < 0 ? JPACK_INVALID : base + segment;
+}
+
+static uint32_t unpack_format(const uint8_t * buf, size_t size, const char * format,
+                              va_list * arg_list) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+        if (bind_group(&op) < 0) {
+            return JPACK_INVALID;
+        }
+        length = unpack_op(&op, buf, size, offset, arg_list);
+        release_group(&op);
+        if (op.width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return status < 0 ? JPACK_INVALID : base + segment;
+}
+
+uint32_t jpack(uint8_t * buf, size_t size, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, format);
+    length = pack_format(buf, size, format, &arg_list);
+    va_end(arg_list);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t jvpack(uint8_t * buf, size_t size, const char * format, va_list arg_list) {
+    uint32_t length;
+    va_list args;
+    STATS_START(start);
+
+    va_copy(args, arg_list);
+    length = pack_format(buf, size, format, &args);
+    va_end(args);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t junpack(const uint8_t * buf, size_t size, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, format);
+    length = unpack_format(buf, size, format, &arg_list);
+    va_end(arg_list);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t jvunpack(const uint8_t * buf, size_t size, const char * format, va_list arg_list) {
+    uint32_t length;
+    va_list args;
+    STATS_START(start);
+
+    va_copy(args, arg_list);
+    length = unpack_format(buf, size, format, &args);
+    va_end(args);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+static uint32_t pack_fields_format(uint8_t * buf, size_t size, const char * format,
+                                   const void * const * ptrs) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t i = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+        if (bind_group(&op) < 0) {
+            return JPACK_INVALID;
+        }
+        length = pack_field(&op, buf, size, offset, ptrs[i++]);
+        release_group(&op);
+        if (op.width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return status < 0 ? JPACK_INVALID : base + segment;
+}
+
+static uint32_t unpack_fields_format(const uint8_t * buf, size_t size, const char * format,
+                                     void * const * ptrs) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t i = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+        if (bind_group(&op) < 0) {
+            return JPACK_INVALID;
+        }
+        length = unpack_field(&op, buf, size, offset, ptrs[i++]);
+        release_group(&op);
+        if (op.width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return status < 0 ? JPACK_INVALID : base + segment;
+}
+
+// Running CRC32C of a framed message. Bytes are checksummed once no later
+// field can change them, while they are still in cache from being written or
+// measured.
+typedef struct crc_state {
+    uint32_t crc;
+    uint32_t mark;      // Bytes checksummed so far
+} crc_state;
+
+// Bytes that are left for later fields to be checksummed with, so that small
+// fields do not each make a call
+#define CRC_BATCH 256
+
+// Checksums the bytes of buf before end once there are CRC_BATCH of them, or
+// right away if flush is set. Bytes past the end of buf are left out, the
+// checksum of a message that is cut off is not used.
+static void crc_advance(crc_state * state, const uint8_t * buf, size_t size,
+                        uint32_t end, int flush) {
+    if (end > size) {
+        end = (uint32_t)size;
+    }
+    if (end > state->mark && (flush || end - state->mark >= CRC_BATCH)) {
+        state->crc = jpack_crc32c_update(state->crc, buf + state->mark, end - state->mark);
+        state->mark = end;
+    }
+}
+
+// Returns the number of bytes the message of the format at the start of buf
+// takes, or JPACK_INVALID if the format is invalid or the message runs past
+// the end of buf. The message is checksummed into crc if it is not NULL.
+static uint32_t measure_format(const uint8_t * buf, size_t size, const char * format,
+                               crc_state * crc) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        if (op.width == 0) {
+            uint32_t offset = base + op.offset;
+            uint32_t length;
+            if (bind_group(&op) < 0) {
+                return JPACK_INVALID;
+            }
+            length = variable_length(&op, buf, size, offset);
+            release_group(&op);
+            if (length == JPACK_INVALID) {
+                return JPACK_INVALID;
+            }
+            base = offset + length;
+            if (crc) {
+                crc_advance(crc, buf, size, base, 0);
+            }
+        }
+    }
+
+    if (status < 0 || !fits(size, base, segment)) {
+        return JPACK_INVALID;
+    }
+
+    if (crc) {
+        crc_advance(crc, buf, size, base + segment, 1);
+    }
+    return base + segment;
+}
+
+static uint32_t unpack_safe_format(const uint8_t * buf, size_t size, const char * format,
+                                   va_list * arg_list) {
+    // Check that the whole message is in buf before touching any variable
+    if (measure_format(buf, size, format, NULL) == JPACK_INVALID) {
+        return JPACK_INVALID;
+    }
+
+    return unpack_format(buf, size, format, arg_list);
+}
+
+uint32_t jpack_crc32c(uint32_t crc, const uint8_t * data, size_t length) {
+    return ~jpack_crc32c_update(~crc, data, length);
+}
+
+// Same as pack_format but checksums the message into crc as it is written.
+// The bytes before a field are final when it is packed, as only a bit field
+// shares its first byte with the field before it.
+static uint32_t pack_framed_format(uint8_t * buf, size_t size, const char * format,
+                                   va_list * arg_list, crc_state * crc) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+        crc_advance(crc, buf, size, offset, 0);
+        if (bind_group(&op) < 0) {
+            return JPACK_INVALID;
+        }
+        length = pack_op(&op, buf, size, offset, arg_list);
+        release_group(&op);
+        if (op.width == 0) {
+            base = offset + length;
+        }
+    }
+
+    if (status < 0) {
+        return JPACK_INVALID;
+    }
+
+    crc_advance(crc, buf, size, base + segment, 1);
+    return base + segment;
+}
+
+uint32_t jpack_framed(uint8_t * buf, size_t size, const char * format, ...) {
+    crc_state crc = { ~0u, 0 };
+    uint32_t length;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, format);
+    length = pack_framed_format(buf, size, format, &arg_list, &crc);
+    va_end(arg_list);
+
+    if (length != JPACK_INVALID) {
+        if (fits(size, length, JPACK_CRC_SIZE)) {
+            write_header(buf + length, 0, ~crc.crc);
+        }
+        length = length < JPACK_INVALID - JPACK_CRC_SIZE ?
+            length + JPACK_CRC_SIZE : JPACK_INVALID;
+    }
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t junpack_framed(const uint8_t * buf, size_t size, const char * format, ...) {
+    crc_state crc = { ~0u, 0 };
+    uint32_t length;
+    va_list arg_list;
+    STATS_START(start);
+
+    // The message is checksummed while it is measured
+    length = measure_format(buf, size, format, &crc);
+    if (length != JPACK_INVALID) {
+        if (!fits(size, length, JPACK_CRC_SIZE) || read_header(buf + length, 0) != ~crc.crc) {
+            length = JPACK_INVALID;
+        } else {
+            va_start(arg_list, format);
+            unpack_format(buf, length, format, &arg_list);
+            va_end(arg_list);
+            length += JPACK_CRC_SIZE;
+        }
+    }
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+// A message being packed as pieces for writev. Offsets in the message are
+// ahead of offsets in scratch by the bytes of the payloads pointed at so far.
+typedef struct iov_state {
+    struct iovec * iov;
+    uint32_t capacity;      // Entries iov has room for
+    uint32_t count;         // Entries the message needs so far
+    uint8_t * scratch;
+    size_t size;
+    uint32_t start;         // Start in scratch of the piece not yet in iov
+    uint32_t referenced;    // Bytes of payloads pointed at instead of packed
+    size_t threshold;
+} iov_state;
+
+static void iov_add(iov_state * state, const void * data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (state->count < state->capacity) {
+        state->iov[state->count].iov_base = (void *)(uintptr_t)data;
+        state->iov[state->count].iov_len = length;
+    }
+    state->count++;
+}
+
+// Ends the piece of scratch that runs up to end
+static void iov_cut(iov_state * state, uint32_t end) {
+    iov_add(state, state->scratch + state->start, end - state->start);
+    state->start = end;
+}
+
+// Packs the next argument as the field op at offset in the message. The
+// payload of a string or blob of at least threshold bytes is pointed at and
+// anything else is packed into scratch.
+// Returns the number of bytes the field takes in the message.
+static uint32_t iov_pack_op(iov_state * state, const jpack_op * op, uint32_t offset,
+                            va_list * arg_list) {
+    uint32_t at = offset - state->referenced;
+    const void * data;
+    uint32_t length;
+
+    switch (op->array ? 0 : op->type) {
+    case 's':
+    case 'z': {
+        const char * val = va_arg(*arg_list, const char *);
+        data = val;
+        length = (uint32_t)strlen(val);
+        break;
+    }
+    case 'S':
+    case 'p': {
+        const jpack_view * val = va_arg(*arg_list, const jpack_view *);
+        data = val->ptr;
+        length = val->len;
+        break;
+    }
+    default:
+        return pack_op(op, state->scratch, state->size, at, arg_list);
+    }
+
+    if (length == 0 || length < state->threshold) {
+        return store_variable(op, state->scratch, state->size, at, data, length);
+    }
+
+    if (op->prefix) {
+        if (length > prefix_max(op)) {
+            length = prefix_max(op);
+        }
+        put_prefix(op, state->scratch, state->size, at, length);
+        at += op->prefix;
+    }
+
+    iov_cut(state, at);
+    iov_add(state, data, length);
+    state->referenced += length;
+
+    if (op->prefix == 0) {
+        const uint8_t terminator = 0;
+        store(state->scratch, state->size, at, &terminator, 1);
+        return length + 1;
+    }
+
+    return op->prefix + length;
+}
+
+// Adds the last piece of scratch for a message of length bytes and stores
+// the number of entries it needs in count.
+// Returns length, or JPACK_INVALID if scratch or iov was too short.
+static uint32_t iov_finish(iov_state * state, uint32_t length, uint32_t * count) {
+    uint32_t packed = length - state->referenced;
+
+    iov_cut(state, packed);
+    *count = state->count;
+
+    if (packed > state->size || state->count > state->capacity) {
+        return JPACK_INVALID;
+    }
+
+    return length;
+}
+
+static uint32_t pack_iov_format(iov_state * state, uint32_t * count, const char * format,
+                                va_list * arg_list) {
+    uint32_t base = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+        if (bind_group(&op) < 0) {
+            return JPACK_INVALID;
+        }
+        length = iov_pack_op(state, &op, offset, arg_list);
+        release_group(&op);
+        if (op.width == 0) {
+            base = offset + length;
+        }
+    }
+
+    return status < 0 ? JPACK_INVALID : iov_finish(state, base + segment, count);
+}
+
+uint32_t jpack_iov(uint8_t * scratch, size_t size, struct iovec * iov, uint32_t * count,
+                   size_t threshold, const char * format, ...) {
+    iov_state state = { iov, *count, 0, scratch, size, 0, 0, threshold };
+    uint32_t length;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, format);
+    length = pack_iov_format(&state, count, format, &arg_list);
+    va_end(arg_list);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t jpack_plan_pack_iov(const jpack_plan * plan, uint8_t * scratch, size_t size,
+                             struct iovec * iov, uint32_t * count, size_t threshold, ...) {
+    iov_state state = { iov, *count, 0, scratch, size, 0, 0, threshold };
+    uint32_t base = 0;
+    uint32_t length;
+    uint32_t i;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, threshold);
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+        uint32_t offset = base + op->offset;
+        uint32_t field_length = iov_pack_op(&state, op, offset, &arg_list);
+        if (op->width == 0) {
+            base = offset + field_length;
+        }
+    }
+    va_end(arg_list);
+
+    length = iov_finish(&state, base + plan->tail, count);
+
+    STATS_RECORD(plan->format, size, length, start);
+    return length;
+}
+
+// Records that reach no further than this are compared with one pass over
+// their bytes before the fields are checked
+#define DELTA_BYTES 1024
+
+// Returns non zero if any of length bytes from offset are set in diff
+static int bytes_differ(const uint64_t * diff, size_t offset, size_t length) {
+    while (length) {
+        size_t bit = offset % 64;
+        size_t n = length < 64 - bit ? length : 64 - bit;
+        uint64_t mask = n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << bit;
+        if (diff[offset / 64] & mask) {
+            return 1;
+        }
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Returns non zero if the field op at offset differs between the records at
+// current and previous. Fixed size fields are looked up in diff, the bytes
+// that differ, when it is given. Strings and views are compared by content.
+static int field_differs(const jpack_op * op, const uint8_t * current,
+                         const uint8_t * previous, size_t offset, const uint64_t * diff) {
+    uint32_t current_length, previous_length;
+    const void * current_data;
+    const void * previous_data;
+
+    if (op->width || varint_max(op) || op->element) {
+        if (diff) {
+            return bytes_differ(diff, offset, field_storage(op));
+        }
+        return memcmp(current + offset, previous + offset, field_storage(op)) != 0;
+    }
+
+    current_data = field_string(op, current + offset, &current_length);
+    previous_data = field_string(op, previous + offset, &previous_length);
+    return current_length != previous_length ||
+           memcmp(current_data, previous_data, current_length) != 0;
+}
+
+// Returns op as a field of its own in a delta, where a bit field starts on a
+// byte
+static jpack_op delta_op(const jpack_op * op) {
+    jpack_op field = *op;
+    field.shift = 0;
+    return field;
+}
+
+// Returns non zero if the plan has a group, which a delta can not hold
+static int has_group(const jpack_plan * plan) {
+    uint32_t i;
+
+    for (i = 0; i < plan->op_count; ++i) {
+        if (plan->ops[i].type == '(') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint32_t jpack_plan_pack_delta(const jpack_plan * plan, uint8_t * buf, size_t size,
+                               const void * current, const void * previous,
+                               const size_t * field_offsets) {
+    uint64_t diff[DELTA_BYTES / 64];
+    const uint64_t * changed = NULL;
+    const uint8_t * record = current;
+    uint64_t length = (plan->op_count + 7) / 8;
+    size_t extent = 0;
+    uint8_t bits = 0;
+    uint32_t i;
+    STATS_START(start);
+
+    for (i = 0; i < plan->op_count; ++i) {
+        size_t end = field_offsets[i] + field_storage(&plan->ops[i]);
+        if (plan->ops[i].type == '(') {
+            return JPACK_INVALID;
+        }
+        extent = end > extent ? end : extent;
+    }
+
+    // The bytes of the whole record are compared at once, which covers all
+    // the fixed size fields
+    if (previous && extent <= DELTA_BYTES) {
+        jpack_diff_bytes(diff, current, previous, extent);
+        changed = diff;
+    }
+
+    for (i = 0; i < plan->op_count; ++i) {
+        const jpack_op * op = &plan->ops[i];
+
+        if (previous == NULL || field_differs(op, record, previous, field_offsets[i], changed)) {
+            jpack_op field = delta_op(op);
+            uint32_t at = length < UINT32_MAX ? (uint32_t)length : UINT32_MAX;
+            uint32_t field_length = pack_field(&field, buf, size, at, record + field_offsets[i]);
+            length += op->width ? fixed_length(&field) : field_length;
+            bits |= (uint8_t)(1u << i % 8);
+        }
+
+        if (i % 8 == 7 || i + 1 == plan->op_count) {
+            store(buf, size, i / 8, &bits, 1);
+            bits = 0;
+        }
+    }
+
+    if (length > UINT32_MAX) {
+        return JPACK_INVALID;
+    }
+
+    STATS_RECORD(plan->format, size, (uint32_t)length, start);
+    return (uint32_t)length;
+}
+
+// Returns non zero if field i is set in the change mask of a delta
+static int delta_has(const uint8_t * buf, uint32_t i) {
+    return (buf[i / 8] >> i % 8) & 1;
+}
+
+uint32_t jpack_plan_unpack_delta(const jpack_plan * plan, const uint8_t * buf, size_t size,
+                                 void * state, const size_t * field_offsets) {
+    uint8_t * record = state;
+    uint32_t mask_bytes = (plan->op_count + 7) / 8;
+    uint32_t offset = mask_bytes;
+    uint32_t end;
+    uint32_t i;
+    STATS_START(start);
+
+    if (has_group(plan) || size < mask_bytes ||
+            (plan->op_count % 8 && buf[mask_bytes - 1] >> plan->op_count % 8)) {
+        return JPACK_INVALID;
+    }
+
+    // Measure first so that a delta that is cut off leaves state untouched
+    for (i = 0; i < plan->op_count; ++i) {
+        jpack_op field = delta_op(&plan->ops[i]);
+        uint32_t length;
+
+        if (!delta_has(buf, i)) {
+            continue;
+        }
+        length = field.width ? fixed_length(&field) : variable_length(&field, buf, size, offset);
+        if (length == JPACK_INVALID || !fits(size, offset, length)) {
+            return JPACK_INVALID;
+        }
+        offset += length;
+    }
+    end = offset;
+
+    offset = mask_bytes;
+    for (i = 0; i < plan->op_count; ++i) {
+        jpack_op field = delta_op(&plan->ops[i]);
+        uint32_t length;
+
+        if (!delta_has(buf, i)) {
+            continue;
+        }
+        length = unpack_field(&field, buf, size, offset, record + field_offsets[i]);
+        offset += field.width ? fixed_length(&field) : length;
+    }
+
+    STATS_RECORD(plan->format, size, end, start);
+    return end;
+}
+
+uint32_t jpack_delta(uint8_t * buf, size_t size, const char * format,
+                     const void * current, const void * previous,
+                     const size_t * field_offsets) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t length;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    length = jpack_plan_pack_delta(plan, buf, size, current, previous, field_offsets);
+    jpack_plan_free(plan);
+
+    return length;
+}
+
+uint32_t junpack_delta(const uint8_t * buf, size_t size, const char * format,
+                       void * state, const size_t * field_offsets) {
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t length;
+
+    if (plan == NULL) {
+        return JPACK_INVALID;
+    }
+
+    length = jpack_plan_unpack_delta(plan, buf, size, state, field_offsets);
+    jpack_plan_free(plan);
+
+    return length;
+}
+
+uint32_t jpack_fields(uint8_t * buf, size_t size, const char * format,
+                      const void * const * ptrs) {
+    uint32_t length;
+    STATS_START(start);
+
+    length = pack_fields_format(buf, size, format, ptrs);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t junpack_fields(const uint8_t * buf, size_t size, const char * format,
+                        void * const * ptrs) {
+    uint32_t length;
+    STATS_START(start);
+
+    length = unpack_fields_format(buf, size, format, ptrs);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t junpack_safe(const uint8_t * buf, size_t size, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+    STATS_START(start);
+
+    va_start(arg_list, format);
+    length = unpack_safe_format(buf, size, format, &arg_list);
+    va_end(arg_list);
+
+    STATS_RECORD(format, size, length, start);
+    return length;
+}
+
+uint32_t jpack_format_length(const char * format) {
+    jpack_plan plan;
+
+    if (compile_format(&format, '\0', &plan, NULL, 0) == JPACK_INVALID) {
+        return JPACK_INVALID;
+    }
+
+    return jpack_plan_length(&plan);
+}
+
+// Same as jpack_format_bounds for format up to end, which is left at end
+static int format_bounds(const char ** format, char end, uint64_t * min, uint64_t * max) {
+    uint64_t lower = 0;
+    uint64_t upper = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    int unbounded = 0;
+    int status;
+    jpack_op op;
+
+    if (*format == NULL) {
+        return -1;
+    }
+
+    while ((status = parse_field(format, &op, &segment, &bit)) > 0) {
+        if (op.width) {
+            continue;
+        }
+        if (op.type == '(') {
+            const char * records = op.body;
+            uint64_t record_max;
+            format_bounds(&records, ')', NULL, &record_max);
+            lower += (uint64_t)op.offset + op.prefix;
+            if (record_max > (UINT64_MAX - upper) / prefix_max(&op)) {
+                unbounded = 1;
+            } else {
+                upper += (uint64_t)op.offset + op.prefix + prefix_max(&op) * record_max;
+            }
+            continue;
+        }
+        if (varint_max(&op)) {
+            lower += (uint64_t)op.offset + 1;
+            upper += (uint64_t)op.offset + varint_max(&op);
+            continue;
+        }
+        if (op.element) {
+            uint64_t seeds = coded_seeds(&op);
+            uint64_t blocks = (op.count - seeds + CODED_BLOCK - 1) / CODED_BLOCK;
+            lower += op.offset + (seeds + blocks) * op.element + blocks;
+            upper += op.offset + (uint64_t)op.count * op.element + blocks * (1 + op.element);
+            continue;
+        }
+        lower += (uint64_t)op.offset + (op.prefix ? op.prefix : 1);
+        upper += (uint64_t)op.offset + op.prefix + prefix_max(&op);
+        unbounded |= op.prefix == 0;
+    }
+
+    if (status < 0 || **format != end) {
+        return -1;
+    }
+
+    if (min) {
+        *min = lower + segment;
+    }
+    if (max) {
+        *max = unbounded ? UINT64_MAX : upper + segment;
+    }
+
+    return 0;
+}
+
+int jpack_format_bounds(const char * format, uint64_t * min, uint64_t * max) {
+    return format_bounds(&format, '\0', min, max);
+}
+
+uint32_t jpack_field_offset(const char * format, uint32_t index) {
+    uint32_t offset = JPACK_INVALID;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t i = 0;
+    int variable = 0;
+    int status;
+    jpack_op op;
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    while ((status = parse_op(&format, &op, &segment, &bit)) > 0) {
+        if (i++ == index && !variable) {
+            offset = op.offset;
+        }
+        variable |= op.width == 0;
+    }
+
+    return status < 0 ? JPACK_INVALID : offset;
+}
+
+uint32_t junpack_mask(const uint8_t * buf, size_t size, const char * format,
+                      uint64_t mask, ...) {
+    const char * fields = format;
+    uint32_t base = 0;
+    uint32_t end = 0;
+    uint32_t segment = 0;
+    uint8_t bit = 0;
+    uint32_t i = 0;
+    int status;
+    jpack_op op;
+    va_list arg_list;
+    STATS_START(start);
+
+    if (format == NULL) {
+        return JPACK_INVALID;
+    }
+
+    va_start(arg_list, mask);
+
+    // The rest of the format is still parsed to check it
+    while ((status = parse_op(&fields, &op, &segment, &bit)) > 0) {
+        uint32_t offset = base + op.offset;
+        uint32_t length;
+
+        if (mask_done(mask, i) || end == JPACK_INVALID) {
+            i++;
+            continue;
+        }
+
+        if (bind_group(&op) < 0) {
+            end = JPACK_INVALID;
+            i++;
+            continue;
+        }
+        length = unpack_selected(&op, buf, size, offset, in_mask(mask, i), &arg_list);
+        release_group(&op);
+        if (length == JPACK_INVALID) {
+            end = JPACK_INVALID;
+        } else {
+            if (op.width == 0) {
+                base = offset + length;
+            }
+            if (in_mask(mask, i)) {
+                end = op.width ? offset + fixed_length(&op) : base;
+            }
+        }
+        i++;
+    }
+
+    va_end(arg_list);
+
+    if (status < 0) {
+        end = JPACK_INVALID;
+    }
+
+    STATS_RECORD(format, size, end, start);
+    return end;
+}
+
+#ifdef TEST
+typedef struct test_sink {
+    uint8_t data[4096];
+    size_t length;
+    size_t chunk;
+} test_sink;
+
+static int test_write(void * ctx, const uint8_t * data, size_t length) {
+    test_sink * sink = ctx;
+    if (sink->length + length > sizeof(sink->data)) {
+        return -1;
+    }
+    memcpy(sink->data + sink->length, data, length);
+    sink->length += length;
+    return 0;
+}
+
+// Hands out at most 5 bytes at a time to exercise refills
+static size_t test_read(void * ctx, uint8_t * data, size_t length) {
+    test_sink * sink = ctx;
+    size_t n = sink->length - sink->chunk;
+    if (n > length) {
+        n = length;
+    }
+    if (n > 5) {
+        n = 5;
+    }
+    memcpy(data, sink->data + sink->chunk, n);
+    sink->chunk += n;
+    return n;
+}
+
+// Wraps jvpack and jvunpack the way a logging or RPC helper would
+static uint32_t test_vpack(uint8_t * buf, size_t size, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+
+    va_start(arg_list, format);
+    length = jvpack(buf, size, format, arg_list);
+    va_end(arg_list);
+
+    return length;
+}
+
+static uint32_t test_vunpack(const uint8_t * buf, size_t size, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+
+    va_start(arg_list, format);
+    length = jvunpack(buf, size, format, arg_list);
+    va_end(arg_list);
+
+    return length;
+}
+
+typedef struct test_tick {
+    uint32_t price;
+    uint16_t quantity;
+} test_tick;
+
+typedef struct test_note {
+    uint64_t time;
+    jpack_view text;
+} test_note;
+
+// Logs the calls of jpack_dispatch and sums the first field of the records
+typedef struct test_dispatch {
+    uint8_t ids[16];
+    uint32_t counts[16];
+    uint32_t calls;
+    uint64_t sum;
+} test_dispatch;
+
+static void test_handler(void * ctx, uint8_t id, const void * records, uint32_t count) {
+    test_dispatch * log = ctx;
+    uint32_t i;
+
+    if (log->calls < 16) {
+        log->ids[log->calls] = id;
+        log->counts[log->calls] = count;
+    }
+    log->calls++;
+
+    for (i = 0; i < count; ++i) {
+        if (id == 1) {
+            log->sum += ((const test_tick *)records)[i].price;
+        } else {
+            const test_note * note = (const test_note *)records + i;
+            log->sum += note->time + note->text.len;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    { // TEST 1
+        uint32_t length = jpack_format_length("IiB");
+        if (length != 9) {
+            fprintf(stderr, "IiB format length should be 9 not: %i\n", length);
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST1 Succeeded\n");
+
+    { // TEST 2
+        uint8_t * buffer;
+
+        int8_t a = -1, a2;
+        uint8_t b = 2, b2;
+        int16_t c = -3, c2;
+        uint16_t d = 4, d2;
+        int32_t e = -5, e2;
+        uint32_t f = 6, f2;
+        int64_t g = -7, g2;
+        uint64_t h = 8, h2;
+        float i = 1.0f, i2;
+        double j = 2.0, j2;
+        char k[5] = "Test";
+        char k2[5];
+
+        size_t length = (size_t)jpack_format_length("bBxhHxiIxlLxfd") + 5;
+        buffer = malloc(length);
+
+        jpack(buffer, length, "bBxhHxiIxlLxfds", a, b, c, d, e, f, g, h, i, j, k);
+
+        junpack(buffer, length, "bBxhHxiIxlLxfds", &a2, &b2, &c2, &d2, &e2, &f2, &g2, &h2, &i2, &j2, k2);
+
+        free(buffer);
+
+        if (a != a2 ||
+                b != b2 ||
+                c != c2 ||
+                d != d2 ||
+                e != e2 ||
                 f != f2 ||
                 g != g2 ||
                 h != h2 ||
@@ -505,48 +4678,2190 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Unpacked data is not the same as packed data\n");
             return EXIT_FAILURE;
         }
-    } fprintf(stderr, "TEST2 Succeeded\n");
+    } fprintf(stderr, "TEST2 Succeeded\n");
+
+    { // TEST 3
+        uint8_t * buffer;
+
+        int8_t a = -1, a2;
+        uint8_t b = 2, b2;
+        int16_t c = -3, c2;
+        uint16_t d = 4, d2;
+        int32_t e = -5, e2;
+        uint32_t f = 6, f2;
+        int64_t g = -7, g2;
+        uint64_t h = 8, h2;
+        float i = 1.0f, i2;
+        double j = 2.0, j2;
+        char k[5] = "Test";
+        char k2[5];
+
+        size_t length = (size_t)jpack_format_length("!b!Bx!h!Hx!i!Ix!l!Lx!f!d") + 5;
+        buffer = malloc(length);
+
+        jpack(buffer, length, "!b!Bx!h!Hx!i!Ix!l!Lx!f!ds", a, b, c, d, e, f, g, h, i, j, k);
+
+        junpack(buffer, length, "!b!Bx!h!Hx!i!Ix!l!Lx!f!ds", &a2, &b2, &c2, &d2, &e2, &f2, &g2, &h2, &i2, &j2, k2);
+
+        free(buffer);
+
+        if (a != a2 ||
+            b != b2 ||
+            c != c2 ||
+            d != d2 ||
+            e != e2 ||
+            f != f2 ||
+            g != g2 ||
+            h != h2 ||
+            i != i2 ||
+            j != j2 ||
+            strcmp(k, k2) != 0) {
+            fprintf(stderr, "Unpacked data is not the same as packed data\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST3 Succeeded\n");
+
+    { // TEST 4
+        uint8_t expected[64];
+        uint8_t buffer[64];
+
+        int16_t a = -3, a2;
+        uint32_t b = 0x01020304, b2;
+        char c[5] = "Test";
+        char c2[5];
+        double d = 2.5, d2;
+        uint8_t e = 7, e2;
+
+        jpack_plan * plan = jpack_compile("h!Ixs!dB");
+        if (plan == NULL) {
+            fprintf(stderr, "Failed to compile a valid format\n");
+            return EXIT_FAILURE;
+        }
+
+        uint32_t length = jpack(expected, sizeof(expected), "h!Ixs!dB", a, b, c, d, e);
+        uint32_t plan_length = jpack_plan_pack(plan, buffer, sizeof(buffer), a, b, c, d, e);
+
+        if (length != 21 || plan_length != length ||
+                memcmp(expected, buffer, length) != 0) {
+            fprintf(stderr, "Plan packed data is not the same as jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        plan_length = jpack_plan_unpack(plan, buffer, length, &a2, &b2, c2, &d2, &e2);
+
+        jpack_plan_free(plan);
+
+        if (plan_length != length ||
+                a != a2 ||
+                b != b2 ||
+                strcmp(c, c2) != 0 ||
+                d != d2 ||
+                e != e2) {
+            fprintf(stderr, "Plan unpacked data is not the same as packed data\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST4 Succeeded\n");
+
+    { // TEST 5
+        uint8_t buffer[8];
+
+        if (jpack_compile("IiQ") != NULL ||
+                jpack(buffer, sizeof(buffer), "I?", 1) != JPACK_INVALID) {
+            fprintf(stderr, "Invalid format was accepted\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_plan * plan = jpack_compile("<IxH");
+        if (plan == NULL || jpack_plan_length(plan) != 7) {
+            fprintf(stderr, "Plan length of <IxH should be 7\n");
+            return EXIT_FAILURE;
+        }
+        jpack_plan_free(plan);
+    } fprintf(stderr, "TEST5 Succeeded\n");
+
+    { // TEST 6
+        uint8_t buffer[1024];
+
+        uint16_t a[37], a2[37];
+        uint32_t b[37], b2[37];
+        double c[37], c2[37];
+        uint8_t d = 9, d2;
+        uint32_t i;
+
+        for (i = 0; i < 37; ++i) {
+            a[i] = (uint16_t)(i * 1000);
+            b[i] = i * 100000;
+            c[i] = i * 0.5;
+        }
+
+        uint32_t length = jpack_format_length("!37Hx!37I37dB");
+        if (length != 37 * 14 + 2) {
+            fprintf(stderr, "!37Hx!37I37dB format length should be %i not: %i\n", 37 * 14 + 2, length);
+            return EXIT_FAILURE;
+        }
+
+        if (jpack(buffer, sizeof(buffer), "!37Hx!37I37dB", a, b, c, d) != length) {
+            fprintf(stderr, "Packed array length is wrong\n");
+            return EXIT_FAILURE;
+        }
+
+        if (buffer[2] != 0x03 || buffer[3] != 0xe8 ||
+                buffer[75 + 4] != 0x00 || buffer[75 + 5] != 0x01 ||
+                buffer[75 + 6] != 0x86 || buffer[75 + 7] != 0xa0) {
+            fprintf(stderr, "Packed arrays are not big-endian\n");
+            return EXIT_FAILURE;
+        }
+
+        junpack(buffer, length, "!37Hx!37I37dB", a2, b2, c2, &d2);
+
+        if (memcmp(a, a2, sizeof(a)) != 0 ||
+                memcmp(b, b2, sizeof(b)) != 0 ||
+                memcmp(c, c2, sizeof(c)) != 0 ||
+                d != d2) {
+            fprintf(stderr, "Unpacked arrays are not the same as packed arrays\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_format_length("3s") != JPACK_INVALID ||
+                jpack_format_length("4") != JPACK_INVALID ||
+                jpack_format_length("4000000000B4000000000B") != JPACK_INVALID ||
+                jpack_format_length("3000000000x3000000000xI") != JPACK_INVALID ||
+                jpack_format_length("3000000000xs3000000000x") != JPACK_INVALID ||
+                jpack_format_length("4294967295xu1") != JPACK_INVALID ||
+                jpack_compile("3000000000x3000000000xI") != NULL) {
+            fprintf(stderr, "Invalid count was accepted\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST6 Succeeded\n");
+
+    { // TEST 7
+        uint8_t buffer[16];
+        uint32_t a[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+        uint32_t a2[8] = { 0 };
+
+        memset(buffer, 0xff, sizeof(buffer));
+
+        if (jpack(buffer, 10, "!8I", a) != 32 ||
+                buffer[9] != 0x00 || buffer[10] != 0xff) {
+            fprintf(stderr, "Truncated array was not cut at the end of the buffer\n");
+            return EXIT_FAILURE;
+        }
+
+        junpack(buffer, 10, "!8I", a2);
+
+        if (a2[0] != 1 || a2[1] != 2 || a2[3] != 0) {
+            fprintf(stderr, "Truncated array was not unpacked up to the end of the buffer\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST7 Succeeded\n");
+
+    { // TEST 8
+        struct entity {
+            uint32_t id;
+            float pos[3];
+            char * name;
+            uint8_t flags;
+        } in[5], out[5];
+        const size_t offsets[] = {
+            offsetof(struct entity, id),
+            offsetof(struct entity, pos),
+            offsetof(struct entity, name),
+            offsetof(struct entity, flags)
+        };
+        char names[5][8] = { "a", "bb", "ccc", "dddd", "" };
+        char out_names[5][8];
+        uint8_t expected[256];
+        uint8_t buffer[256];
+        uint32_t expected_length = 0;
+        uint32_t length;
+        uint32_t i;
+
+        for (i = 0; i < 5; ++i) {
+            in[i].id = i + 100;
+            in[i].pos[0] = (float)i;
+            in[i].pos[1] = (float)i * 2.0f;
+            in[i].pos[2] = (float)i * 3.0f;
+            in[i].name = names[i];
+            in[i].flags = (uint8_t)i;
+            out[i].name = out_names[i];
+            expected_length += jpack(expected + expected_length, sizeof(expected) - expected_length,
+                                     "!I!3fsB", in[i].id, in[i].pos, in[i].name, in[i].flags);
+        }
+
+        if (jpack_batch(buffer, sizeof(buffer), "!I!3fsB", in, 5, sizeof(in[0]), offsets, &length) != 5 ||
+                length != expected_length ||
+                memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Batch packed data is not the same as jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_batch(buffer, length, "!I!3fsB", out, 5, sizeof(out[0]), offsets, &length) != 5 ||
+                length != expected_length) {
+            fprintf(stderr, "Batch unpack did not read all records\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < 5; ++i) {
+            if (in[i].id != out[i].id ||
+                    memcmp(in[i].pos, out[i].pos, sizeof(in[i].pos)) != 0 ||
+                    strcmp(in[i].name, out[i].name) != 0 ||
+                    in[i].flags != out[i].flags) {
+                fprintf(stderr, "Batch unpacked data is not the same as packed data\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Record 3 starts at 19 + 20 + 21 = 60 and is cut off
+        if (jpack_batch(buffer, 70, "!I!3fsB", in, 5, sizeof(in[0]), offsets, &length) != 3 ||
+                length != 60 ||
+                junpack_batch(buffer, 70, "!I!3fsB", out, 5, sizeof(out[0]), offsets, &length) != 3 ||
+                length != 60) {
+            fprintf(stderr, "Batch did not stop at the last whole record\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST8 Succeeded\n");
+
+    { // TEST 9
+        struct sample {
+            uint32_t a;
+            uint16_t b;
+            uint8_t c;
+            uint8_t d;
+        } in[16], out[16];
+        const size_t offsets[] = {
+            offsetof(struct sample, a),
+            offsetof(struct sample, b),
+            offsetof(struct sample, c),
+            offsetof(struct sample, d)
+        };
+        uint8_t expected[128];
+        uint8_t buffer[128];
+        uint32_t length;
+        uint32_t i;
+
+        for (i = 0; i < 16; ++i) {
+            in[i].a = i * 7;
+            in[i].b = (uint16_t)(i * 3);
+            in[i].c = (uint8_t)i;
+            in[i].d = (uint8_t)(255 - i);
+            jpack(expected + i * 8, 8, "IHBB", in[i].a, in[i].b, in[i].c, in[i].d);
+        }
+
+        if (jpack_batch(buffer, 100, "IHBB", in, 16, sizeof(in[0]), offsets, &length) != 12 ||
+                length != 96 ||
+                memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Batch copied data is not the same as jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(out, 0, sizeof(out));
+        if (junpack_batch(expected, sizeof(expected), "IHBB", out, 16, sizeof(out[0]), offsets, NULL) != 16 ||
+                memcmp(in, out, sizeof(in)) != 0) {
+            fprintf(stderr, "Batch copied records are not the same as packed records\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST9 Succeeded\n");
+
+    { // TEST 10
+        struct reading {
+            uint16_t channels[3];
+            uint32_t id;
+            double value;
+            char * unit;
+        } in[40], out[40];
+        const size_t offsets[] = {
+            offsetof(struct reading, id),
+            offsetof(struct reading, value),
+            offsetof(struct reading, unit),
+            offsetof(struct reading, channels)
+        };
+        char units[40][4];
+        char out_units[40][4];
+        uint32_t ids[40];
+        double values[40];
+        char * unit_ptrs[40];
+        uint16_t channels[40][3];
+        void * const columns[] = { ids, values, unit_ptrs, channels };
+        uint8_t buffer[2048];
+        const uint8_t * column;
+        uint32_t count, column_length;
+        uint32_t i;
+
+        for (i = 0; i < 40; ++i) {
+            in[i].id = i * 1000;
+            in[i].value = i * 0.25;
+            in[i].channels[0] = (uint16_t)i;
+            in[i].channels[1] = (uint16_t)(i + 1);
+            in[i].channels[2] = (uint16_t)(i + 2);
+            units[i][0] = (char)('a' + i % 26);
+            units[i][1] = (char)('a' + i % 3);
+            units[i][2] = 0;
+            in[i].unit = units[i];
+            out[i].unit = out_units[i];
+            unit_ptrs[i] = out_units[i];
+        }
+
+        uint32_t length = jpack_columns(NULL, 0, "!I!ds!3H", in, 40, sizeof(in[0]), offsets);
+        if (length > sizeof(buffer) ||
+                jpack_columns(buffer, sizeof(buffer), "!I!ds!3H", in, 40, sizeof(in[0]), offsets) != length) {
+            fprintf(stderr, "Columns were not sized correctly\n");
+            return EXIT_FAILURE;
+        }
+
+        column = jpack_column(buffer, length, 0, &count, &column_length);
+        if (column == NULL || count != 40 || column_length != 160 ||
+                column[4 * 3 + 2] != 0x0b || column[4 * 3 + 3] != 0xb8) {
+            fprintf(stderr, "Column was not mapped in place\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_columns(buffer, length, "!I!ds!3H", out, 40, sizeof(out[0]), offsets) != 40) {
+            fprintf(stderr, "Columns were not unpacked into records\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_columns_soa(buffer, length, "!I!ds!3H", columns, 40) != 40) {
+            fprintf(stderr, "Columns were not unpacked into arrays\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < 40; ++i) {
+            if (in[i].id != out[i].id || in[i].id != ids[i] ||
+                    in[i].value != out[i].value || in[i].value != values[i] ||
+                    strcmp(in[i].unit, out[i].unit) != 0 ||
+                    memcmp(in[i].channels, out[i].channels, sizeof(in[i].channels)) != 0 ||
+                    memcmp(in[i].channels, channels[i], sizeof(in[i].channels)) != 0) {
+                fprintf(stderr, "Unpacked columns are not the same as packed records\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (junpack_columns(buffer, length, "!I!d", out, 40, sizeof(out[0]), offsets) != JPACK_INVALID) {
+            fprintf(stderr, "Columns with a different format were accepted\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST10 Succeeded\n");
+
+    { // TEST 11
+        static test_sink sink;
+        uint8_t staging[16];
+        uint8_t expected[1024] = { 0 };
+        uint32_t values[100];
+        uint32_t values_out[100] = { 0 };
+        char name[64] = { 0 };
+        uint16_t a = 0;
+        int64_t b = 0;
+        uint8_t c = 0;
+        uint32_t length;
+        uint32_t i;
+        jpack_stream stream;
+        jpack_plan * plan = jpack_compile(">H2xl!100Is<B");
+
+        for (i = 0; i < 100; ++i) {
+            values[i] = i * 0x01010101u;
+        }
+
+        length = jpack(expected, sizeof(expected), ">H2xl!100Is<B",
+                       0x1234, -5ll, values, "a string longer than staging", 7);
+
+        jpack_stream_writer(&stream, staging, sizeof(staging), test_write, &sink);
+        if (jpack_stream_pack(&stream, ">H2xl!100Is<B",
+                              0x1234, -5ll, values, "a string longer than staging", 7) != length ||
+                jpack_stream_plan_pack(&stream, plan,
+                                       0x1234, -5ll, values, "a string longer than staging", 7) != length ||
+                jpack_stream_flush(&stream) != 0) {
+            fprintf(stderr, "Stream pack failed\n");
+            return EXIT_FAILURE;
+        }
+
+        if (sink.length != 2 * length ||
+                memcmp(sink.data, expected, length) != 0 ||
+                memcmp(sink.data + length, expected, length) != 0) {
+            fprintf(stderr, "Streamed bytes are not the same as jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_stream_reader(&stream, staging, sizeof(staging), test_read, &sink);
+        if (jpack_stream_unpack(&stream, ">H2xl!100Is<B",
+                                &a, &b, values_out, name, &c) != length ||
+                a != 0x1234 || b != -5 || c != 7 ||
+                strcmp(name, "a string longer than staging") != 0 ||
+                memcmp(values, values_out, sizeof(values)) != 0) {
+            fprintf(stderr, "Stream unpack failed\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(values_out, 0, sizeof(values_out));
+        if (jpack_stream_plan_unpack(&stream, plan,
+                                     &a, &b, values_out, name, &c) != length ||
+                memcmp(values, values_out, sizeof(values)) != 0) {
+            fprintf(stderr, "Stream plan unpack failed\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_stream_unpack(&stream, "B", &c) != JPACK_INVALID) {
+            fprintf(stderr, "Stream unpack did not fail at the end of the stream\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_plan_free(plan);
+    } fprintf(stderr, "TEST11 Succeeded\n");
+
+    { // TEST 12
+        struct named {
+            uint32_t id;
+            jpack_view name;
+        } in[3], out[3];
+        const size_t offsets[] = { offsetof(struct named, id), offsetof(struct named, name) };
+        const char * names[] = { "first", "", "third" };
+        uint8_t buffer[64];
+        uint8_t expected[64];
+        jpack_view view = { (const uint8_t *)"hello", 5 };
+        jpack_view first, second;
+        uint16_t a = 0;
+        uint32_t length;
+        uint32_t i;
+
+        length = jpack(buffer, sizeof(buffer), "S<HS", &view, 0x1234, &view);
+        if (length != 14 ||
+                jpack(expected, sizeof(expected), "s<Hs", "hello", 0x1234, "hello") != length ||
+                memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Views were not packed like strings\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack(buffer, length, "S<HS", &first, &a, &second) != length ||
+                first.ptr != buffer || first.len != 5 || a != 0x1234 ||
+                second.ptr != buffer + 8 || second.len != 5) {
+            fprintf(stderr, "Views do not point into the buffer\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack(buffer, length - 1, "S<HS", &first, &a, &second) <= length - 1 ||
+                second.ptr != NULL || second.len != 0) {
+            fprintf(stderr, "A cut off view was not empty\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < 3; ++i) {
+            in[i].id = i;
+            in[i].name.ptr = (const uint8_t *)names[i];
+            in[i].name.len = (uint32_t)strlen(names[i]);
+        }
+
+        if (jpack_batch(buffer, sizeof(buffer), "IS", in, 3, sizeof(in[0]), offsets, &length) != 3 ||
+                junpack_batch(buffer, length, "IS", out, 3, sizeof(out[0]), offsets, NULL) != 3) {
+            fprintf(stderr, "Batch of views failed\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < 3; ++i) {
+            if (out[i].id != i || out[i].name.len != in[i].name.len ||
+                    memcmp(out[i].name.ptr, names[i], out[i].name.len) != 0 ||
+                    out[i].name.ptr < buffer || out[i].name.ptr >= buffer + length) {
+                fprintf(stderr, "Unpacked views are not the same as packed\n");
+                return EXIT_FAILURE;
+            }
+        }
+    } fprintf(stderr, "TEST12 Succeeded\n");
+
+    { // TEST 13
+        const uint8_t payload[] = { 1, 0, 2, 0, 3 };
+        const uint8_t expected[] = { 0x00, 0x05, 1, 0, 2, 0, 3, 2, 'h', 'i', 0x34, 0x12 };
+        jpack_view blob = { payload, sizeof(payload) };
+        jpack_view blob_out = { NULL, 0 };
+        char string[16] = "untouched";
+        uint8_t buffer[64];
+        uint16_t a = 0;
+        uint64_t min = 0, max = 0;
+        uint32_t length;
+
+        length = jpack(buffer, sizeof(buffer), "!pHzB<H", &blob, "hi", 0x1234);
+        if (length != sizeof(expected) || memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Prefixed fields were not packed\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_safe(buffer, length - 1, "!pHzB<H", &blob_out, string, &a) != JPACK_INVALID ||
+                blob_out.ptr != NULL || strcmp(string, "untouched") != 0 || a != 0) {
+            fprintf(stderr, "Safe unpack touched a cut off message\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_safe(buffer, length, "!pHzB<H", &blob_out, string, &a) != length ||
+                blob_out.ptr != buffer + 2 || blob_out.len != sizeof(payload) ||
+                strcmp(string, "hi") != 0 || a != 0x1234) {
+            fprintf(stderr, "Prefixed fields were not unpacked\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_safe((const uint8_t *)"abc", 3, "s", string) != JPACK_INVALID) {
+            fprintf(stderr, "Safe unpack accepted a string without terminator\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_format_bounds("!pHzB<H", &min, &max) != 0 || min != 5 ||
+                max != 2 + 0xffff + 1 + 0xff + 2 ||
+                jpack_format_bounds("I2xs", &min, &max) != 0 || min != 7 || max != UINT64_MAX ||
+                jpack_format_bounds("pQ", &min, &max) != -1 ||
+                jpack_format_bounds("2zB", &min, &max) != -1) {
+            fprintf(stderr, "Format bounds are wrong\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST13 Succeeded\n");
+
+    { // TEST 14
+        const uint64_t values[] = {
+            0, 1, 127, 128, 300, 16383, 16384, UINT32_MAX,
+            (uint64_t)1 << 56, UINT64_MAX
+        };
+        const int64_t signed_values[] = { 0, -1, 1, -64, 64, INT32_MIN, INT32_MAX, INT64_MIN, INT64_MAX };
+        const uint8_t expected[] = { 0xac, 0x02, 0x01, 0x80, 0x01, 0x7f };
+        uint8_t buffer[64];
+        uint64_t min = 0, max = 0;
+        uint32_t length;
+        uint32_t i;
+
+        length = jpack(buffer, sizeof(buffer), "VvVB", 300u, -1, 128u, 0x7f);
+        if (length != sizeof(expected) || memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Varints were not encoded as LEB128\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+            uint64_t out = 0;
+            uint32_t out_32 = 0;
+
+            // Once with room after the varint and once right at the end
+            length = jpack(buffer, sizeof(buffer), "W", values[i]);
+            if (junpack(buffer, sizeof(buffer), "W", &out) != length ||
+                    out != values[i] || junpack(buffer, length, "W", &out) != length ||
+                    out != values[i]) {
+                fprintf(stderr, "Varint %llu did not round trip\n", (unsigned long long)values[i]);
+                return EXIT_FAILURE;
+            }
+
+            if (values[i] <= UINT32_MAX &&
+                    (junpack(buffer, sizeof(buffer), "V", &out_32) != length ||
+                     out_32 != values[i])) {
+                fprintf(stderr, "32-bit varint did not round trip\n");
+                return EXIT_FAILURE;
+            }
+
+            if (length > 1 && junpack(buffer, length - 1, "W", &out) <= length - 1) {
+                fprintf(stderr, "Cut off varint was not reported\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (i = 0; i < sizeof(signed_values) / sizeof(signed_values[0]); ++i) {
+            int64_t out = 0;
+            int32_t out_32 = 0;
+
+            length = jpack(buffer, sizeof(buffer), "w", signed_values[i]);
+            if (junpack_safe(buffer, length, "w", &out) != length || out != signed_values[i]) {
+                fprintf(stderr, "Zigzag varint did not round trip\n");
+                return EXIT_FAILURE;
+            }
+
+            if (signed_values[i] >= INT32_MIN && signed_values[i] <= INT32_MAX &&
+                    (jpack(buffer, sizeof(buffer), "v", (int32_t)signed_values[i]) != length ||
+                     junpack(buffer, sizeof(buffer), "v", &out_32) != length ||
+                     out_32 != signed_values[i])) {
+                fprintf(stderr, "32-bit zigzag varint did not round trip\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        memset(buffer, 0xff, sizeof(buffer));
+        if (junpack_safe(buffer, sizeof(buffer), "V", &i) != JPACK_INVALID) {
+            fprintf(stderr, "Overlong varint was accepted\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_format_bounds("IVw", &min, &max) != 0 || min != 6 || max != 19 ||
+                jpack_format_bounds("3V", &min, &max) != -1) {
+            fprintf(stderr, "Varint bounds are wrong\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST14 Succeeded\n");
+
+    { // TEST 15
+        struct flags {
+            uint32_t kind;
+            uint32_t on;
+            uint32_t level;
+            uint8_t id;
+        } in[20], out[20];
+        const size_t offsets[] = {
+            offsetof(struct flags, kind), offsetof(struct flags, on),
+            offsetof(struct flags, level), offsetof(struct flags, id)
+        };
+        const uint8_t expected[] = { 0x9d, 0xab, 0xbc, 0x3a };
+        static test_sink bits_sink;
+        uint8_t staging[8];
+        uint8_t buffer[512];
+        uint32_t a = 0, b = 0, c = 0, d = 0, e = 0;
+        uint8_t f = 0;
+        uint32_t length;
+        uint32_t i;
+        jpack_stream stream;
+
+        memset(buffer, 0xff, sizeof(buffer));
+        length = jpack(buffer, sizeof(buffer), "u3u1u4B>u12u4", 5, 1, 9, 0xab, 0xabc, 0x13);
+        if (length != sizeof(expected) || memcmp(buffer, expected, length) != 0 ||
+                jpack_format_length("u3u1u4B>u12u4") != 4) {
+            fprintf(stderr, "Bit fields were not packed\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack(buffer, length, "u3u1u4B>u12u4", &a, &b, &c, &f, &d, &e) != length ||
+                a != 5 || b != 1 || c != 9 || f != 0xab || d != 0xabc || e != 3) {
+            fprintf(stderr, "Bit fields were not unpacked\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(buffer, 0xff, sizeof(buffer));
+        if (jpack(buffer, sizeof(buffer), "u3xu5u32u27", 5, 1, 0xdeadbeef, 0x5555555) != 10 ||
+                buffer[0] != 5 ||
+                junpack(buffer, 10, "u3xu5u32u27", &a, &b, &c, &d) != 10 ||
+                a != 5 || b != 1 || c != 0xdeadbeef || d != 0x5555555) {
+            fprintf(stderr, "Wide bit fields did not round trip\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_format_length("u0") != JPACK_INVALID ||
+                jpack_format_length("u33") != JPACK_INVALID ||
+                jpack_format_length("2u3") != JPACK_INVALID ||
+                jpack_format_length("u") != JPACK_INVALID) {
+            fprintf(stderr, "Invalid bit fields were accepted\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(in, 0, sizeof(in));
+        for (i = 0; i < 20; ++i) {
+            in[i].kind = i % 6;
+            in[i].on = i & 1;
+            in[i].level = i * 37 % 512;
+            in[i].id = (uint8_t)(100 + i);
+        }
+
+        memset(out, 0, sizeof(out));
+        if (jpack_batch(buffer, sizeof(buffer), "u3u1u9B", in, 20, sizeof(in[0]), offsets, &length) != 20 ||
+                length != 20 * 3 ||
+                junpack_batch(buffer, length, "u3u1u9B", out, 20, sizeof(out[0]), offsets, NULL) != 20 ||
+                memcmp(in, out, sizeof(in)) != 0) {
+            fprintf(stderr, "Batch of bit fields did not round trip\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(out, 0, sizeof(out));
+        length = jpack_columns(buffer, sizeof(buffer), "u3u1u9B", in, 20, sizeof(in[0]), offsets);
+        if (length == JPACK_INVALID || length > sizeof(buffer) ||
+                junpack_columns(buffer, length, "u3u1u9B", out, 20, sizeof(out[0]), offsets) != 20 ||
+                memcmp(in, out, sizeof(in)) != 0) {
+            fprintf(stderr, "Columns of bit fields did not round trip\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_stream_writer(&stream, staging, sizeof(staging), test_write, &bits_sink);
+        for (i = 0; i < 20; ++i) {
+            if (jpack_stream_pack(&stream, "u3u1u9Bu20u20", in[i].kind, in[i].on,
+                                  in[i].level, in[i].id, i * 999, i) != 8) {
+                fprintf(stderr, "Stream pack of bit fields failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+        jpack_stream_flush(&stream);
+
+        jpack_stream_reader(&stream, staging, sizeof(staging), test_read, &bits_sink);
+        for (i = 0; i < 20; ++i) {
+            if (jpack_stream_unpack(&stream, "u3u1u9Bu20u20", &a, &b, &c, &f, &d, &e) != 8 ||
+                    a != in[i].kind || b != in[i].on || c != in[i].level ||
+                    f != in[i].id || d != i * 999 || e != i) {
+                fprintf(stderr, "Stream unpack of bit fields failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+    } fprintf(stderr, "TEST15 Succeeded\n");
+
+    { // TEST 16
+        const char * format = ">fd3Hsu3u5xw";
+        uint8_t buffer[64];
+        uint8_t expected[64];
+        float f = 1.25f, f_out = 0;
+        double d = -2.5, d_out = 0;
+        uint16_t h[3] = { 1, 2, 0x1234 }, h_out[3] = { 0 };
+        const char * name = "name";
+        char name_out[8] = { 0 };
+        char * name_ptr = name_out;
+        uint32_t a = 5, a_out = 0, b = 17, b_out = 0;
+        int64_t w = -300, w_out = 0;
+        const void * const in[] = { &f, &d, h, &name, &a, &b, &w };
+        void * const out[] = { &f_out, &d_out, h_out, &name_ptr, &a_out, &b_out, &w_out };
+        jpack_plan * plan = jpack_compile(format);
+        uint32_t length;
+
+        memset(buffer, 0, sizeof(buffer));
+        memset(expected, 0, sizeof(expected));
+        length = jpack(expected, sizeof(expected), format, f, d, h, name, a, b, w);
+
+        if (test_vpack(buffer, sizeof(buffer), format, f, d, h, name, a, b, w) != length ||
+                memcmp(buffer, expected, length) != 0 ||
+                test_vunpack(buffer, length, format, &f_out, &d_out, h_out, name_out,
+                             &a_out, &b_out, &w_out) != length ||
+                f_out != f || d_out != d || memcmp(h, h_out, sizeof(h)) != 0 ||
+                strcmp(name, name_out) != 0 || a_out != a || b_out != b || w_out != w) {
+            fprintf(stderr, "va_list pack and unpack failed\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(buffer, 0, sizeof(buffer));
+        if (jpack_fields(buffer, sizeof(buffer), format, in) != length ||
+                memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Fields were not packed like jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        memset(buffer, 0, sizeof(buffer));
+        if (jpack_plan_pack_fields(plan, buffer, sizeof(buffer), in) != length ||
+                memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Plan fields were not packed like jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        f_out = 0; d_out = 0; a_out = 0; b_out = 0; w_out = 0;
+        memset(h_out, 0, sizeof(h_out));
+        memset(name_out, 0, sizeof(name_out));
+        if (junpack_fields(buffer, length, format, out) != length ||
+                f_out != f || d_out != d || memcmp(h, h_out, sizeof(h)) != 0 ||
+                strcmp(name, name_out) != 0 || a_out != a || b_out != b || w_out != w) {
+            fprintf(stderr, "Fields were not unpacked\n");
+            return EXIT_FAILURE;
+        }
+
+        f_out = 0; w_out = 0;
+        if (jpack_plan_unpack_fields(plan, buffer, length, out) != length ||
+                f_out != f || w_out != w) {
+            fprintf(stderr, "Plan fields were not unpacked\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_plan_free(plan);
+    } fprintf(stderr, "TEST16 Succeeded\n");
+
+    { // TEST 17
+        typedef struct {
+            uint32_t id;
+            const char * name;
+            double value;
+        } record;
+
+        static const char * names[] = { "", "a", "bb", "ccccccc", "dddddddddddddddddddd" };
+        const size_t offsets[] = { offsetof(record, id), offsetof(record, name),
+                                   offsetof(record, value) };
+        const uint32_t count = 20000;
+        record * in = malloc(count * sizeof(record));
+        uint8_t * expected = malloc(count * 32);
+        uint8_t * buffer = malloc(count * 32);
+        uint64_t total = 0;
+        uint32_t r;
+        size_t s;
+
+        jpack_pool * pool = jpack_pool_create(4);
+        if (pool == NULL || jpack_pool_threads(pool) != 4) {
+            fprintf(stderr, "Failed to create a pool of 4 threads\n");
+            return EXIT_FAILURE;
+        }
+
+        for (r = 0; r < count; ++r) {
+            in[r].id = r;
+            in[r].name = names[(r * 7) % 5];
+            in[r].value = r * 0.5;
+            total += jpack_record_length("!Isd", &in[r], offsets);
+        }
+
+        if (jpack_record_length("!Isd", &in[3], offsets) != 4 + 2 + 8) {
+            fprintf(stderr, "Record length should count the string\n");
+            return EXIT_FAILURE;
+        }
+
+        // Cut off in the first chunk, in the middle and exactly at the end
+        const size_t sizes[] = { count * 32, total, total - 1, total / 2, 100, 0 };
+
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            uint32_t length = 0;
+            uint32_t parallel_length = 0;
+
+            memset(expected, 0xAA, count * 32);
+            memset(buffer, 0xAA, count * 32);
+
+            uint32_t records = jpack_batch(expected, sizes[s], "!Isd", in, count,
+                                           sizeof(record), offsets, &length);
+            uint32_t parallel = jpack_batch_parallel(pool, buffer, sizes[s], "!Isd", in, count,
+                                                     sizeof(record), offsets, &parallel_length);
+
+            if (parallel != records || parallel_length != length ||
+                memcmp(buffer, expected, count * 32) != 0) {
+                fprintf(stderr, "Parallel batch differs with size %u: %u records in %u bytes\n",
+                        (uint32_t)sizes[s], parallel, parallel_length);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (jpack_batch_parallel(pool, buffer, count * 32, "!Isd", in, count, sizeof(record),
+                                 offsets, NULL) != count) {
+            fprintf(stderr, "Parallel batch should pack every record\n");
+            return EXIT_FAILURE;
+        }
+
+        // Structs with the same layout as the records are copied in chunks
+        uint32_t * values = malloc(count * sizeof(uint32_t));
+        const size_t value_offsets[] = { 0 };
+        uint32_t length = 0;
+
+        for (r = 0; r < count; ++r) {
+            values[r] = r * 3;
+        }
+
+        if (jpack_batch_parallel(pool, buffer, 10001 * 4 + 3, "I", values, count,
+                                 sizeof(uint32_t), value_offsets, &length) != 10001 ||
+            length != 10001 * 4 || memcmp(buffer, values, length) != 0) {
+            fprintf(stderr, "Parallel batch did not copy matching records\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_pool_free(pool);
+        free(values);
+        free(buffer);
+        free(expected);
+        free(in);
+    } fprintf(stderr, "TEST17 Succeeded\n");
+
+    { // TEST 18
+        jpack_stats stats;
+#ifdef JPACK_STATS
+        uint8_t buffer[16];
+        uint32_t value = 0;
+        uint32_t i;
+        int found = 0;
+
+        jpack(buffer, sizeof(buffer), "!IH", 1u, 2);
+        jpack_stats_reset();
+
+        for (i = 0; i < 3; ++i) {
+            jpack(buffer, sizeof(buffer), "!IH", i, 2);
+        }
+        jpack(buffer, 4, "!IH", 1u, 2);
+        junpack(buffer, sizeof(buffer), "!IH", &value, &value);
+        jpack(buffer, sizeof(buffer), "!Iq", 1u, 2);
+
+        if (jpack_stats_snapshot(&stats) != 0) {
+            fprintf(stderr, "Snapshot failed with statistics enabled\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < stats.count; ++i) {
+            const jpack_format_stats * format = &stats.formats[i];
+
+            if (strcmp(format->format, "!IH") == 0) {
+                found++;
+                if (format->calls != 5 || format->bytes != 4 * 6 + 4 ||
+                    format->truncated != 1 || format->invalid != 0) {
+                    fprintf(stderr, "Wrong counts for !IH: %u calls %u bytes %u truncated\n",
+                            (uint32_t)format->calls, (uint32_t)format->bytes,
+                            (uint32_t)format->truncated);
+                    return EXIT_FAILURE;
+                }
+            } else if (strcmp(format->format, "!Iq") == 0) {
+                found++;
+                if (format->calls != 1 || format->invalid != 1) {
+                    fprintf(stderr, "Invalid format was not counted\n");
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+
+        if (found != 2) {
+            fprintf(stderr, "Formats missing from the snapshot\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_stats_reset();
+        jpack_stats_snapshot(&stats);
+        for (i = 0; i < stats.count; ++i) {
+            if (stats.formats[i].calls != 0) {
+                fprintf(stderr, "Reset did not clear the counts\n");
+                return EXIT_FAILURE;
+            }
+        }
+#else
+        if (jpack_stats_snapshot(&stats) != -1 || stats.count != 0) {
+            fprintf(stderr, "Snapshot should fail without statistics\n");
+            return EXIT_FAILURE;
+        }
+#endif // JPACK_STATS
+    } fprintf(stderr, "TEST18 Succeeded\n");
+
+    { // TEST 19
+        const char * path = "jpack_test.records";
+        const uint32_t count = 100000;
+        static uint8_t large[100000];
+        jpack_view blob = { large, sizeof(large) };
+        jpack_file_writer * writer;
+        jpack_file_reader * reader;
+        uint64_t offset = 0;
+        uint32_t length;
+        uint32_t i;
+        FILE * file;
+
+        remove(path);
+
+        writer = jpack_file_writer_open(path);
+        if (writer == NULL) {
+            fprintf(stderr, "Could not open %s for writing\n", path);
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < count; ++i) {
+            if (i % 3 == 0) {
+                length = jpack_file_pack(writer, "!IHs", i, (uint16_t)(i * 7), "record");
+            } else {
+                length = jpack_file_pack(writer, "!IHd", i, (uint16_t)(i * 7), (double)i / 4);
+            }
+            if (length == JPACK_INVALID) {
+                fprintf(stderr, "Could not append record %u\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (i = 0; i < sizeof(large); ++i) {
+            large[i] = (uint8_t)(i * 31);
+        }
+        if (jpack_file_pack(writer, "IpI", count, &blob) != 4 + 4 + sizeof(large) ||
+            jpack_file_pack(writer, "!Iq", 1u) != JPACK_INVALID) {
+            fprintf(stderr, "Large or invalid record was not handled\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_file_writer_close(writer) != 0) {
+            fprintf(stderr, "Closing %s failed\n", path);
+            return EXIT_FAILURE;
+        }
+
+        // A record cut off by a crash while appending
+        file = fopen(path, "ab");
+        fwrite("\x10\x00\x00\x00\x01\x02", 1, 6, file);
+        fclose(file);
+
+        reader = jpack_file_reader_open(path);
+        if (reader == NULL) {
+            fprintf(stderr, "Could not map %s\n", path);
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < count; ++i) {
+            uint32_t id = 0;
+            uint16_t kind = 0;
+            double value = 0;
+            jpack_view text = { NULL, 0 };
+
+            if (i % 3 == 0) {
+                length = jpack_file_unpack(reader, &offset, "!IHS", &id, &kind, &text);
+                if (length != 13 || text.len != 6 || memcmp(text.ptr, "record", 6) != 0) {
+                    fprintf(stderr, "Wrong string in record %u\n", i);
+                    return EXIT_FAILURE;
+                }
+            } else {
+                length = jpack_file_unpack(reader, &offset, "!IHd", &id, &kind, &value);
+                if (length != 14 || value != (double)i / 4) {
+                    fprintf(stderr, "Wrong value in record %u\n", i);
+                    return EXIT_FAILURE;
+                }
+            }
+            if (id != i || kind != (uint16_t)(i * 7)) {
+                fprintf(stderr, "Wrong record %u read back\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        {
+            jpack_view out = { NULL, 0 };
+            uint32_t id = 0;
+
+            if (jpack_file_unpack(reader, &offset, "IpI", &id, &out) != 4 + 4 + sizeof(large) ||
+                id != count || out.len != sizeof(large) ||
+                memcmp(out.ptr, large, sizeof(large)) != 0) {
+                fprintf(stderr, "Large record was not read back\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (jpack_file_next(reader, &offset, &length) != NULL) {
+            fprintf(stderr, "Cut off record should end the file\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_file_index(reader) != count + 1 ||
+            jpack_file_advise(reader, 0, 0, JPACK_FILE_RANDOM) != 0) {
+            fprintf(stderr, "Wrong number of records in the index\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < count; i += 997) {
+            const uint8_t * record = jpack_file_record(reader, i, &length);
+            uint32_t id = 0;
+
+            if (record == NULL || junpack(record, length, "!I", &id) != 4 || id != i) {
+                fprintf(stderr, "Record %u not found through the index\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (jpack_file_record(reader, count + 1, &length) != NULL ||
+            jpack_file_advise(reader, 5, 100, JPACK_FILE_WILLNEED) != 0 ||
+            jpack_file_advise(reader, 0, 0, 5) != -1) {
+            fprintf(stderr, "Out of range lookups were not rejected\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_file_reader_close(reader);
+        remove(path);
+    } fprintf(stderr, "TEST19 Succeeded\n");
+
+    { // TEST 20
+        const char * format = "B!HS!I!pH!du3u5B";
+        const char * fixed = "2xB3Hu3u5!I";
+        const uint32_t offsets[] = { 0, 1, 3, JPACK_INVALID };
+        const uint32_t fixed_offsets[] = { 2, 3, 9, 9, 10, JPACK_INVALID };
+        jpack_view hello = { (const uint8_t *)"hello", 5 };
+        jpack_view abc = { (const uint8_t *)"abc", 3 };
+        jpack_plan * plan = jpack_compile(format);
+        jpack_plan * fixed_plan = jpack_compile(fixed);
+        uint8_t buffer[64];
+        uint32_t length;
+        uint32_t i;
+
+        for (i = 0; i < 6; ++i) {
+            if (jpack_field_offset(fixed, i) != fixed_offsets[i] ||
+                jpack_plan_field_offset(fixed_plan, i) != fixed_offsets[i]) {
+                fprintf(stderr, "Wrong offset for field %u of %s\n", i, fixed);
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (i = 0; i < 10; ++i) {
+            uint32_t expected = offsets[i < 3 ? i : 3];
+            if (jpack_field_offset(format, i) != expected ||
+                jpack_plan_field_offset(plan, i) != expected) {
+                fprintf(stderr, "Wrong offset for field %u of %s\n", i, format);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (jpack_field_offset("!I2q", 0) != JPACK_INVALID) {
+            fprintf(stderr, "Offset into an invalid format\n");
+            return EXIT_FAILURE;
+        }
+
+        length = jpack(buffer, sizeof(buffer), format, 0x11, 0x2233, &hello, 0xDEADBEEFu,
+                       &abc, 2.5, 5u, 17u, 0x99);
+        if (length != 28) {
+            fprintf(stderr, "Expected 28 bytes, got %u\n", length);
+            return EXIT_FAILURE;
+        }
+
+        {
+            uint32_t id = 0;
+            uint8_t last = 0;
+            uint32_t bits = 0;
+            jpack_view text = { NULL, 0 };
+
+            if (junpack_mask(buffer, length, format, 1u << 3 | 1u << 8, &id, &last) != 28 ||
+                id != 0xDEADBEEF || last != 0x99) {
+                fprintf(stderr, "Projected unpack read the wrong fields\n");
+                return EXIT_FAILURE;
+            }
+
+            id = 0;
+            if (jpack_plan_unpack_mask(plan, buffer, length, 1u << 2 | 1u << 3, &text, &id) != 13 ||
+                id != 0xDEADBEEF || text.len != 5 || memcmp(text.ptr, "hello", 5) != 0) {
+                fprintf(stderr, "Projected plan unpack read the wrong fields\n");
+                return EXIT_FAILURE;
+            }
+
+            if (jpack_plan_unpack_mask(plan, buffer, length, 1u << 7, &bits) != 27 ||
+                junpack_mask(buffer, length, format, 0) != 0 || bits != 17) {
+                fprintf(stderr, "Projected unpack of a bit field failed\n");
+                return EXIT_FAILURE;
+            }
+
+            // The blob is cut off, so the fields after it can not be found
+            if (junpack_mask(buffer, 16, format, 1u << 5, NULL) != JPACK_INVALID ||
+                jpack_plan_unpack_mask(plan, buffer, 16, 1u << 5, NULL) != JPACK_INVALID ||
+                junpack_mask(buffer, length, "!I2q", 1, &id) != JPACK_INVALID) {
+                fprintf(stderr, "Projected unpack past the end of the buffer\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        jpack_plan_free(plan);
+        jpack_plan_free(fixed_plan);
+    } fprintf(stderr, "TEST20 Succeeded\n");
+
+    { // TEST 21
+        static uint8_t expected[64 * 1024];
+        static uint8_t large[10000];
+        jpack_view blob = { large, sizeof(large) };
+        struct iovec blocks[64];
+        jpack_buf * buf = jpack_buf_create(16);
+        const uint8_t * data;
+        size_t length = 0;
+        size_t joined = 0;
+        uint32_t block_count;
+        uint32_t round;
+        uint32_t i;
+
+        if (buf == NULL) {
+            fprintf(stderr, "Could not create buffer\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < sizeof(large); ++i) {
+            large[i] = (uint8_t)(i * 13);
+        }
+
+        for (round = 0; round < 3; ++round) {
+            length = 0;
+            jpack_buf_reset(buf);
+
+            for (i = 0; i < 1000; ++i) {
+                uint32_t packed;
+                if (i == 500) {
+                    packed = jpack_buf_pack(buf, "!IpH", i, &blob);
+                    length += jpack(expected + length, sizeof(expected) - length, "!IpH",
+                                    i, &blob);
+                } else {
+                    packed = jpack_buf_pack(buf, "!Hsd", (uint16_t)i, i % 2 ? "odd" : "",
+                                            (double)i);
+                    length += jpack(expected + length, sizeof(expected) - length, "!Hsd",
+                                    (uint16_t)i, i % 2 ? "odd" : "", (double)i);
+                }
+                if (packed == JPACK_INVALID) {
+                    fprintf(stderr, "Could not pack message %u\n", i);
+                    return EXIT_FAILURE;
+                }
+            }
+
+            if (jpack_buf_pack(buf, "!I2q", 1u) != JPACK_INVALID ||
+                jpack_buf_length(buf) != length) {
+                fprintf(stderr, "Wrong length %u packed\n", (uint32_t)jpack_buf_length(buf));
+                return EXIT_FAILURE;
+            }
+
+            block_count = jpack_buf_blocks(buf, blocks, 64);
+            if (round == 0 ? block_count < 2 : block_count != 1) {
+                fprintf(stderr, "Round %u packed into %u blocks\n", round, block_count);
+                return EXIT_FAILURE;
+            }
+
+            for (i = 0, joined = 0; i < block_count; ++i) {
+                if (memcmp(blocks[i].iov_base, expected + joined, blocks[i].iov_len) != 0) {
+                    fprintf(stderr, "Block %u differs from jpack\n", i);
+                    return EXIT_FAILURE;
+                }
+                joined += blocks[i].iov_len;
+            }
+
+            data = jpack_buf_data(buf, &joined);
+            if (data == NULL || joined != length || memcmp(data, expected, length) != 0) {
+                fprintf(stderr, "Joined data differs from jpack\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        jpack_buf_free(buf);
+    } fprintf(stderr, "TEST21 Succeeded\n");
+
+    { // TEST 22
+        static test_sink sink;
+        static uint8_t data[1000];
+        static uint8_t whole[2400];
+        static uint8_t plain[2400];
+        jpack_view payload = { data, sizeof(data) };
+        jpack_view views[2];
+        uint32_t out_bits[3];
+        uint32_t out_id;
+        uint8_t out_kind;
+        char out_text[64];
+        const char * text = "a string longer than the staging buffer";
+        uint8_t staging[8];
+        uint8_t buffer[128];
+        jpack_stream stream;
+        uint32_t length;
+        uint32_t i;
+
+        if (jpack_crc32c(0, (const uint8_t *)"123456789", 9) != 0xE3069283) {
+            fprintf(stderr, "Wrong CRC32C of the check string\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < sizeof(data); ++i) {
+            data[i] = (uint8_t)(i * 7 + 3);
+        }
+
+        // Odd lengths and offsets against a bit at a time reference
+        for (i = 0; i < 40; ++i) {
+            const uint8_t * start = data + i;
+            size_t size = sizeof(data) - 2 * i - 1;
+            uint32_t expected = ~0u;
+            size_t b;
+            int k;
+
+            for (b = 0; b < size; ++b) {
+                expected ^= start[b];
+                for (k = 0; k < 8; ++k) {
+                    expected = expected & 1 ? (expected >> 1) ^ 0x82F63B78 : expected >> 1;
+                }
+            }
+            expected = ~expected;
+
+            if (jpack_crc32c(0, start, size) != expected ||
+                jpack_crc32c(jpack_crc32c(0, start, i), start + i, size - i) != expected) {
+                fprintf(stderr, "Wrong CRC32C of %u bytes\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        length = jpack_framed(buffer, sizeof(buffer), "!IsH", 0xCAFEu, text, 7);
+        if (length != 4 + 40 + 2 + JPACK_CRC_SIZE ||
+            jpack_framed(buffer + 64, 10, "!IsH", 0xCAFEu, text, 7) != length) {
+            fprintf(stderr, "Framed message should be %u bytes\n", length);
+            return EXIT_FAILURE;
+        }
 
-    { // TEST 3
-        uint8_t * buffer;
+        // The checksum is taken field by field as the message is written and
+        // measured, across bit fields sharing a byte, pads and long payloads
+        memset(whole, 0xAA, sizeof(whole));
+        memset(plain, 0xAA, sizeof(plain));
+        length = jpack(plain, sizeof(plain), "!Iu3u13x2xspIBpHu4", 1u, 5u, 4000u, text,
+                       &payload, 9, &payload, 3u);
+        if (jpack_framed(whole, sizeof(whole), "!Iu3u13x2xspIBpHu4", 1u, 5u, 4000u, text,
+                         &payload, 9, &payload, 3u) != length + JPACK_CRC_SIZE ||
+            memcmp(whole, plain, length) != 0 ||
+            read_header(whole + length, 0) != jpack_crc32c(0, plain, length) ||
+            junpack_framed(whole, sizeof(whole), "!Iu3u13x2xs", NULL, NULL, NULL, NULL) !=
+                JPACK_INVALID ||
+            junpack_framed(whole, length + JPACK_CRC_SIZE, "!Iu3u13x2xspIBpHu4", &out_id,
+                           &out_bits[0], &out_bits[1], out_text, &views[0], &out_kind,
+                           &views[1], &out_bits[2]) != length + JPACK_CRC_SIZE ||
+            out_bits[1] != 4000 || strcmp(out_text, text) != 0 || views[1].len != sizeof(data) ||
+            memcmp(views[1].ptr, data, sizeof(data)) != 0 || out_bits[2] != 3) {
+            fprintf(stderr, "Framed checksum differs from jpack_crc32c\n");
+            return EXIT_FAILURE;
+        }
 
-        int8_t a = -1, a2;
-        uint8_t b = 2, b2;
-        int16_t c = -3, c2;
-        uint16_t d = 4, d2;
-        int32_t e = -5, e2;
-        uint32_t f = 6, f2;
-        int64_t g = -7, g2;
-        uint64_t h = 8, h2;
-        float i = 1.0f, i2;
-        double j = 2.0, j2;
-        char k[5] = "Test";
-        char k2[5];
+        length = jpack_framed(buffer, sizeof(buffer), "!IsH", 0xCAFEu, text, 7);
+        for (i = 0; i <= length * 8; ++i) {
+            uint32_t id = 1;
+            char out[64] = "untouched";
+            uint16_t kind = 2;
+            uint32_t result;
 
-        size_t length = (size_t)jpack_format_length("!b!Bx!h!Hx!i!Ix!l!Lx!f!d") + 5;
-        buffer = malloc(length);
+            if (i < length * 8) {
+                buffer[i / 8] ^= (uint8_t)(1 << i % 8);
+            }
+            result = junpack_framed(buffer, length, "!IsH", &id, out, &kind);
+            if (i < length * 8) {
+                buffer[i / 8] ^= (uint8_t)(1 << i % 8);
+                if (result != JPACK_INVALID || id != 1 || strcmp(out, "untouched") != 0 ||
+                    kind != 2) {
+                    fprintf(stderr, "Corrupted bit %u was not rejected\n", i);
+                    return EXIT_FAILURE;
+                }
+            } else if (result != length || id != 0xCAFE || strcmp(out, text) != 0 ||
+                       kind != 7) {
+                fprintf(stderr, "Framed message did not unpack\n");
+                return EXIT_FAILURE;
+            }
+        }
 
-        jpack(buffer, length, "!b!Bx!h!Hx!i!Ix!l!Lx!f!ds", a, b, c, d, e, f, g, h, i, j, k);
+        if (junpack_framed(buffer, length - 1, "!IsH", NULL, NULL, NULL) != JPACK_INVALID) {
+            fprintf(stderr, "Cut off checksum was not rejected\n");
+            return EXIT_FAILURE;
+        }
 
-        junpack(buffer, length, "!b!Bx!h!Hx!i!Ix!l!Lx!f!ds", &a2, &b2, &c2, &d2, &e2, &f2, &g2, &h2, &i2, &j2, k2);
+        sink.length = 0;
+        jpack_stream_writer(&stream, staging, sizeof(staging), test_write, &sink);
+        if (jpack_stream_pack(&stream, "B", 1) != 1 ||
+            jpack_stream_pack_framed(&stream, "!IsH", 0xCAFEu, text, 7) != length ||
+            jpack_stream_pack(&stream, "B", 2) != 1 ||
+            jpack_stream_flush(&stream) != 0) {
+            fprintf(stderr, "Could not pack framed message to a stream\n");
+            return EXIT_FAILURE;
+        }
 
-        free(buffer);
+        if (sink.length != length + 2 || sink.data[0] != 1 ||
+            memcmp(sink.data + 1, buffer, length) != 0 || sink.data[length + 1] != 2) {
+            fprintf(stderr, "Framed stream differs from jpack_framed\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST22 Succeeded\n");
 
-        if (a != a2 ||
-            b != b2 ||
-            c != c2 ||
-            d != d2 ||
-            e != e2 ||
-            f != f2 ||
-            g != g2 ||
-            h != h2 ||
-            i != i2 ||
-            j != j2 ||
-            strcmp(k, k2) != 0) {
-            fprintf(stderr, "Unpacked data is not the same as packed data\n");
+    { // TEST 23
+        static uint64_t stamps[1000];
+        static uint64_t out_stamps[1000];
+        static uint32_t ids[300];
+        static uint32_t out_ids[300];
+        static uint64_t noise[200];
+        static uint64_t out_noise[200];
+        static uint8_t buffer[16 * 1024];
+        const struct {
+            const char * format;
+            uint32_t count;
+            int wide;
+        } shorts[] = {
+            { "3rI", 3, 0 }, { "3tI", 3, 0 }, { "3TI", 3, 0 },
+            { "2TL", 2, 1 }, { "1TL", 1, 1 }, { "129tL", 129, 1 }
+        };
+        uint64_t seed = 0x9E3779B97F4A7C15ull;
+        uint64_t min, max;
+        uint16_t head = 0;
+        uint8_t tail = 0;
+        uint32_t length;
+        uint32_t i, f;
+
+        for (i = 0; i < 1000; ++i) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            stamps[i] = 1700000000000000000ull + i * 1000000ull + (seed >> 60);
+        }
+        for (i = 0; i < 300; ++i) {
+            ids[i] = 4000000000u + i * 2 + (i % 3 == 0);
+        }
+        for (i = 0; i < 200; ++i) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            noise[i] = seed;
+        }
+
+        length = jpack(buffer, sizeof(buffer), "!H1000TLB", 0xBEEF, stamps, 0x42);
+        if (length == JPACK_INVALID || length > 1000 ||
+            junpack(buffer, length, "!H1000TLB", &head, out_stamps, &tail) != length ||
+            head != 0xBEEF || tail != 0x42 ||
+            memcmp(stamps, out_stamps, sizeof(stamps)) != 0) {
+            fprintf(stderr, "Timestamps did not survive delta of delta coding in %u bytes\n",
+                    length);
             return EXIT_FAILURE;
         }
-    } fprintf(stderr, "TEST3 Succeeded\n");
+
+        length = jpack(buffer, sizeof(buffer), "300tI", ids);
+        if (length > 300 || junpack(buffer, length, "300tI", out_ids) != length ||
+            memcmp(ids, out_ids, sizeof(ids)) != 0) {
+            fprintf(stderr, "Ids did not survive delta coding in %u bytes\n", length);
+            return EXIT_FAILURE;
+        }
+
+        // Values that use every bit, in all three codings
+        for (f = 0; f < 3; ++f) {
+            const char * wide[] = { "200rL", "200tL", "200TL" };
+            const char * narrow[] = { "200rI", "200tI", "200TI" };
+            uint32_t narrow_in[200];
+            uint32_t narrow_out[200];
+
+            for (i = 0; i < 200; ++i) {
+                narrow_in[i] = (uint32_t)(noise[i] >> 32);
+            }
+
+            length = jpack(buffer, sizeof(buffer), wide[f], noise);
+            if (junpack_safe(buffer, length, wide[f], out_noise) != length ||
+                memcmp(noise, out_noise, sizeof(noise)) != 0) {
+                fprintf(stderr, "Random values did not survive %s\n", wide[f]);
+                return EXIT_FAILURE;
+            }
+
+            length = jpack(buffer, sizeof(buffer), narrow[f], narrow_in);
+            if (junpack_safe(buffer, length, narrow[f], narrow_out) != length ||
+                memcmp(narrow_in, narrow_out, sizeof(narrow_in)) != 0) {
+                fprintf(stderr, "Random values did not survive %s\n", narrow[f]);
+                return EXIT_FAILURE;
+            }
+
+            if (junpack_safe(buffer, length - 1, narrow[f], narrow_out) != JPACK_INVALID) {
+                fprintf(stderr, "Cut off %s was not rejected\n", narrow[f]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Short arrays that are all or mostly seeds, and falling sequences
+        for (f = 0; f < sizeof(shorts) / sizeof(shorts[0]); ++f) {
+            jpack_plan * plan = jpack_compile(shorts[f].format);
+            uint64_t wide[129];
+            uint32_t narrow[129];
+            uint64_t out[129];
+            const void * values = shorts[f].wide ? (const void *)wide : (const void *)narrow;
+            size_t bytes = shorts[f].count * (shorts[f].wide ? sizeof(uint64_t) : sizeof(uint32_t));
+
+            for (i = 0; i < 129; ++i) {
+                wide[i] = 1000000 - (uint64_t)i * i;
+                narrow[i] = 7 - i * 3;
+            }
+            memset(out, 0, sizeof(out));
+
+            length = jpack_plan_pack(plan, buffer, sizeof(buffer), values);
+            if (jpack_plan_unpack(plan, buffer, length, out) != length ||
+                    memcmp(values, out, bytes) != 0) {
+                fprintf(stderr, "Short array did not survive %s\n", shorts[f].format);
+                return EXIT_FAILURE;
+            }
+            jpack_plan_free(plan);
+        }
+
+        if (jpack_format_bounds("!H1000TLB", &min, &max) != 0 ||
+            min != 2 + 16 + 8 * 9 + 1 || max != 2 + 8000 + 8 * 9 + 1 ||
+            jpack_format_length("4rI") != 0) {
+            fprintf(stderr, "Wrong bounds for a coded array\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_format_length("tI") != JPACK_INVALID ||
+            jpack_format_length("4tB") != JPACK_INVALID ||
+            jpack_format_length("4t") != JPACK_INVALID) {
+            fprintf(stderr, "Invalid coded arrays were accepted\n");
+            return EXIT_FAILURE;
+        }
+
+        {
+            static test_sink sink;
+            uint8_t staging[16];
+            jpack_stream stream;
+
+            jpack_plan * plan = jpack_compile("I3rI");
+
+            jpack_stream_writer(&stream, staging, sizeof(staging), test_write, &sink);
+            if (jpack_stream_pack(&stream, "3tI", ids) != JPACK_INVALID) {
+                fprintf(stderr, "Coded array should not go to a stream\n");
+                return EXIT_FAILURE;
+            }
+
+            // A plan is rejected before any of its fields are written
+            jpack_stream_writer(&stream, staging, sizeof(staging), test_write, &sink);
+            if (plan == NULL ||
+                jpack_stream_plan_pack(&stream, plan, 0xAABBCCDDu, ids) != JPACK_INVALID ||
+                jpack_stream_pack(&stream, "!H", 0x1234) != 2 ||
+                jpack_stream_flush(&stream) != 0 || sink.length != 2 ||
+                sink.data[0] != 0x12 || sink.data[1] != 0x34) {
+                fprintf(stderr, "Plan with a coded array wrote to a stream\n");
+                return EXIT_FAILURE;
+            }
+
+            jpack_stream_reader(&stream, staging, sizeof(staging), test_read, &sink);
+            if (jpack_stream_plan_unpack(&stream, plan, &ids[0], out_ids) != JPACK_INVALID ||
+                sink.chunk != 0) {
+                fprintf(stderr, "Plan with a coded array read from a stream\n");
+                return EXIT_FAILURE;
+            }
+            jpack_plan_free(plan);
+        }
+    } fprintf(stderr, "TEST23 Succeeded\n");
+
+    { // TEST 24
+        struct entity {
+            uint32_t id;
+            float x;
+            float y;
+            uint8_t flags;
+        } entities[3], entities_out[8];
+        const size_t entity_offsets[] = {
+            offsetof(struct entity, id), offsetof(struct entity, x),
+            offsetof(struct entity, y), offsetof(struct entity, flags)
+        };
+        struct player {
+            uint16_t id;
+            char * name;
+            jpack_group items;
+        } players[2], players_out[2];
+        const size_t player_offsets[] = {
+            offsetof(struct player, id), offsetof(struct player, name),
+            offsetof(struct player, items)
+        };
+        const size_t item_offsets[] = { 0 };
+        struct pair {
+            uint32_t a;
+            uint32_t b;
+        } pairs[2] = { { 1, 2 }, { 3, 4 } };
+        const size_t pair_offsets[] = { offsetof(struct pair, a), offsetof(struct pair, b) };
+        const char * invalid[] = {
+            "H(", "H()", "H(I", "I)", "2H(I)", "L(I)", "v(I)", "H(I))", "H(I)x)", "(I)", "H(2)"
+        };
+        char names[2][8] = { "ann", "bo" };
+        char names_out[2][8];
+        uint32_t items[2][2] = { { 10, 11 }, { 12, 0 } };
+        uint32_t items_out[2][4];
+        uint8_t bytes[300];
+        jpack_group group = { entities, 3, 3, sizeof(entities[0]), entity_offsets };
+        jpack_group group_out = { entities_out, 0, 8, sizeof(entities_out[0]), entity_offsets };
+        jpack_plan * plan = jpack_compile("I!H(IffB)B");
+        uint8_t buffer[512];
+        uint8_t expected[512];
+        uint32_t length, expected_length;
+        uint32_t head = 0;
+        uint8_t tail = 0;
+        uint64_t min, max;
+        uint32_t i;
+
+        for (i = 0; i < 3; ++i) {
+            entities[i].id = 100 + i;
+            entities[i].x = (float)i * 0.5f;
+            entities[i].y = (float)i * -2.0f;
+            entities[i].flags = (uint8_t)(1u << i);
+        }
+
+        // Count, then the records as if they were fields of the message
+        expected_length = jpack(expected, sizeof(expected), "I!HIffBIffBIffBB", 7u, 3,
+                                100u, 0.0, -0.0, 1, 101u, 0.5, -2.0, 2, 102u, 1.0, -4.0, 4, 9);
+        length = jpack(buffer, sizeof(buffer), "I!H(IffB)B", 7u, &group, 9);
+        if (plan == NULL || length != 4 + 2 + 3 * 13 + 1 || length != expected_length ||
+                memcmp(buffer, expected, length) != 0 ||
+                jpack_plan_pack(plan, expected, sizeof(expected), 7u, &group, 9) != length ||
+                memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Group packed data is not the records after their count\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack(buffer, length, "I!H(IffB)B", &head, &group_out, &tail) != length ||
+                head != 7 || tail != 9 || group_out.count != 3) {
+            fprintf(stderr, "Group unpack did not read all records\n");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < 3; ++i) {
+            if (entities_out[i].id != entities[i].id || entities_out[i].x != entities[i].x ||
+                    entities_out[i].y != entities[i].y ||
+                    entities_out[i].flags != entities[i].flags) {
+                fprintf(stderr, "Group unpacked records are not the same as packed records\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Records past capacity are skipped and the fields after still unpack
+        group_out.capacity = 2;
+        tail = 0;
+        if (jpack_plan_unpack(plan, buffer, length, &head, &group_out, &tail) != length ||
+                group_out.count != 2 || tail != 9 || entities_out[1].id != 101) {
+            fprintf(stderr, "Group unpack did not stop at capacity\n");
+            return EXIT_FAILURE;
+        }
+
+        // Cut off in the third record
+        group_out.capacity = 8;
+        if (junpack(buffer, 4 + 2 + 2 * 13 + 5, "I!H(IffB)B", &head, &group_out, &tail) !=
+                    length ||
+                group_out.count != 2 ||
+                junpack_safe(buffer, length - 1, "I!H(IffB)B", &head, &group_out, &tail) !=
+                    JPACK_INVALID) {
+            fprintf(stderr, "Group unpack did not stop at the last whole record\n");
+            return EXIT_FAILURE;
+        }
+        jpack_plan_free(plan);
+
+        // Records laid out like the packed ones are copied as they are
+        group.items = pairs;
+        group.count = 2;
+        group.stride = sizeof(pairs[0]);
+        group.field_offsets = pair_offsets;
+        if (jpack(buffer, sizeof(buffer), "H(II)", &group) != 2 + 16 ||
+                jpack(expected, sizeof(expected), "H4I", 2, (uint32_t *)pairs) != 2 + 16 ||
+                memcmp(buffer, expected, 18) != 0) {
+            fprintf(stderr, "Group with the packed layout is not copied as it is\n");
+            return EXIT_FAILURE;
+        }
+
+        // Nested groups with strings
+        for (i = 0; i < 2; ++i) {
+            players[i].id = (uint16_t)(i + 1);
+            players[i].name = names[i];
+            players[i].items.items = items[i];
+            players[i].items.count = 2 - i;
+            players[i].items.stride = sizeof(items[i][0]);
+            players[i].items.field_offsets = item_offsets;
+            players_out[i].name = names_out[i];
+            players_out[i].items = players[i].items;
+            players_out[i].items.items = items_out[i];
+            players_out[i].items.count = 0;
+            players_out[i].items.capacity = 4;
+        }
+        group.items = players;
+        group.count = 2;
+        group.stride = sizeof(players[0]);
+        group.field_offsets = player_offsets;
+        group_out = group;
+        group_out.items = players_out;
+        group_out.count = 0;
+        group_out.capacity = 2;
+
+        expected_length = jpack(expected, sizeof(expected), "B!HsBII!HsBI",
+                                2, 1, "ann", 2, 10u, 11u, 2, "bo", 1, 12u);
+        length = jpack(buffer, sizeof(buffer), "B(!Hs!B(I))", &group);
+        if (length != expected_length || memcmp(buffer, expected, length) != 0 ||
+                jpack_record_length("H(!Hs!B(I))", &group, item_offsets) !=
+                    length + 1) {
+            fprintf(stderr, "Nested group packed data is not the same as jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack_safe(buffer, length, "B(!Hs!B(I))", &group_out) != length ||
+                group_out.count != 2 ||
+                players_out[0].id != 1 || strcmp(names_out[0], "ann") != 0 ||
+                players_out[0].items.count != 2 || items_out[0][0] != 10 ||
+                items_out[0][1] != 11 ||
+                players_out[1].id != 2 || strcmp(names_out[1], "bo") != 0 ||
+                players_out[1].items.count != 1 || items_out[1][0] != 12) {
+            fprintf(stderr, "Nested group unpacked data is not the same as packed data\n");
+            return EXIT_FAILURE;
+        }
+
+        if (junpack(buffer, length - 1, "B(!Hs!B(I))", &group_out) <= length - 1 ||
+                group_out.count != 1 ||
+                junpack_safe(buffer, length - 1, "B(!Hs!B(I))", &group_out) != JPACK_INVALID) {
+            fprintf(stderr, "Nested group that is cut off was not detected\n");
+            return EXIT_FAILURE;
+        }
+
+        // More records than the count can hold are cut short
+        memset(bytes, 7, sizeof(bytes));
+        group.items = bytes;
+        group.count = sizeof(bytes);
+        group.stride = 1;
+        group.field_offsets = item_offsets;
+        if (jpack(buffer, sizeof(buffer), "B(B)", &group) != 1 + 255 || buffer[0] != 255) {
+            fprintf(stderr, "Group count was not cut to what the count can hold\n");
+            return EXIT_FAILURE;
+        }
+
+        // Skipping a group to reach the field after it
+        group.count = 3;
+        length = jpack(buffer, sizeof(buffer), "BH(B)I", 1, &group, 0xdeadbeefu);
+        head = 0;
+        if (length != 1 + 2 + 3 + 4 ||
+                junpack_mask(buffer, length, "BH(B)I", 1u << 2, &head) != length ||
+                head != 0xdeadbeefu ||
+                jpack_field_offset("BH(B)I", 1) != 1 ||
+                jpack_field_offset("BH(B)I", 2) != JPACK_INVALID) {
+            fprintf(stderr, "Field after a group was not found\n");
+            return EXIT_FAILURE;
+        }
+
+        if (jpack_format_bounds("H(IffB)", &min, &max) != 0 ||
+                min != 2 || max != 2 + 65535 * 13 ||
+                jpack_format_bounds("B(B(H))", &min, &max) != 0 ||
+                min != 1 || max != 1 + 255 * (1 + 255 * 2) ||
+                jpack_format_bounds("xB(s)", &min, &max) != 0 ||
+                min != 2 || max != UINT64_MAX ||
+                jpack_format_length("H(I)") != 0) {
+            fprintf(stderr, "Group bounds are wrong\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+            if (jpack_compile(invalid[i]) != NULL ||
+                    jpack(buffer, sizeof(buffer), invalid[i], &group) != JPACK_INVALID ||
+                    jpack_format_bounds(invalid[i], &min, &max) != -1) {
+                fprintf(stderr, "Invalid group format %s was accepted\n", invalid[i]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        {
+            test_sink sink = { { 0 }, 0, 0 };
+            uint8_t stage[64];
+            jpack_stream stream;
+
+            jpack_plan * plan = jpack_compile("I!H(IffB)");
+
+            jpack_stream_writer(&stream, stage, sizeof(stage), test_write, &sink);
+            if (jpack_stream_pack(&stream, "H(B)", &group) != JPACK_INVALID) {
+                fprintf(stderr, "Group was packed to a stream\n");
+                return EXIT_FAILURE;
+            }
+
+            // A plan is rejected before any of its fields are written
+            if (plan == NULL ||
+                jpack_stream_plan_pack(&stream, plan, 0xAABBCCDDu, &group) != JPACK_INVALID ||
+                jpack_stream_pack(&stream, "!H", 0x1234) != 2 ||
+                jpack_stream_flush(&stream) != 0 || sink.length != 2 ||
+                sink.data[0] != 0x12 || sink.data[1] != 0x34) {
+                fprintf(stderr, "Plan with a group wrote to a stream\n");
+                return EXIT_FAILURE;
+            }
+            jpack_plan_free(plan);
+        }
+    } fprintf(stderr, "TEST24 Succeeded\n");
+
+    { // TEST 25
+        const size_t tick_offsets[] = {
+            offsetof(test_tick, price), offsetof(test_tick, quantity)
+        };
+        const size_t note_offsets[] = { offsetof(test_note, time), offsetof(test_note, text) };
+        const uint8_t expected_ids[] = { 1, 1, 2, 1, 2 };
+        const uint32_t expected_counts[] = { 2, 1, 1, 1, 1 };
+        const char * invalid[] = { "Is", "zB", "H(I)", "I)" };
+        jpack_registry * registry = jpack_registry_create(2);
+        test_dispatch log = { { 0 }, { 0 }, 0, 0 };
+        jpack_view text = { (const uint8_t *)"hello", 5 };
+        uint8_t buffer[256];
+        uint32_t offset = 0;
+        uint32_t whole, length;
+        uint32_t i;
+
+        if (registry == NULL ||
+                jpack_registry_add(registry, 1, "!I!H", sizeof(test_tick), tick_offsets,
+                                   test_handler, &log) != 0 ||
+                jpack_registry_add(registry, 2, "!LpB", sizeof(test_note), note_offsets,
+                                   test_handler, &log) != 0 ||
+                jpack_registry_add(registry, 3, "I", sizeof(test_tick), tick_offsets,
+                                   NULL, &log) != -1) {
+            fprintf(stderr, "Registering message types failed\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+            if (jpack_registry_add(registry, 4, invalid[i], sizeof(test_tick),
+                                   tick_offsets, test_handler, &log) != -1) {
+                fprintf(stderr, "Registering %s was not refused\n", invalid[i]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Ticks 1 to 3 come in a run that is split at the batch size of 2
+        for (i = 1; i <= 3; ++i) {
+            offset += jpack(buffer + offset, sizeof(buffer) - offset, "B!I!H", 1, i, 10);
+        }
+        offset += jpack(buffer + offset, sizeof(buffer) - offset, "B!LpB", 2, (uint64_t)100, &text);
+        offset += jpack(buffer + offset, sizeof(buffer) - offset, "B!I!H", 1, 4u, 10);
+        offset += jpack(buffer + offset, sizeof(buffer) - offset, "B!LpB", 2, (uint64_t)200, &text);
+        whole = offset;
+        // A tick cut off by the end of the buffer
+        offset += jpack(buffer + offset, sizeof(buffer) - offset, "B!I!H", 1, 5u, 10) - 1;
+
+        if (jpack_dispatch(registry, buffer, offset, &length) != 6 || length != whole ||
+                log.calls != 5 || log.sum != 1 + 2 + 3 + 105 + 4 + 205) {
+            fprintf(stderr, "Dispatch did not hand every whole message to its handler\n");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < 5; ++i) {
+            if (log.ids[i] != expected_ids[i] || log.counts[i] != expected_counts[i]) {
+                fprintf(stderr, "Dispatch call %u had the wrong type or count\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        // A type that is not registered stops the loop after the messages before it
+        log.calls = 0;
+        buffer[whole] = 9;
+        if (jpack_dispatch(registry, buffer, offset, &length) != JPACK_INVALID ||
+                length != whole || log.calls != 5) {
+            fprintf(stderr, "Dispatch did not stop at an unknown type\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_registry_remove(registry, 2);
+        if (jpack_dispatch(registry, buffer, whole, &length) != JPACK_INVALID ||
+                length != 3 * 7) {
+            fprintf(stderr, "Dispatch handled a removed type\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_registry_free(registry);
+    } fprintf(stderr, "TEST25 Succeeded\n");
+
+    { // TEST 26
+        static uint8_t blob[5000];
+        char text[101];
+        uint8_t whole[12000];
+        uint8_t joined[6000];
+        uint8_t scratch[32];
+        struct iovec iov[8];
+        jpack_view view = { blob, sizeof(blob) };
+        const char * format = "!IsH!pIB";
+        jpack_plan * plan = jpack_compile(format);
+        uint32_t length;
+        uint32_t count;
+        uint32_t at;
+        uint32_t i;
+
+        memset(text, 'x', sizeof(text) - 1);
+        text[sizeof(text) - 1] = '\0';
+        for (i = 0; i < sizeof(blob); ++i) {
+            blob[i] = (uint8_t)(i * 7);
+        }
+
+        length = jpack(whole, sizeof(whole), format, 0xCAFEu, text, 3, &view, 9);
+
+        // Both payloads are pointed at and the fields around them are packed
+        for (i = 0; i < 2; ++i) {
+            count = 8;
+            if (i == 0) {
+                at = jpack_iov(scratch, sizeof(scratch), iov, &count, 64, format, 0xCAFEu, text,
+                               3, &view, 9);
+            } else {
+                at = jpack_plan_pack_iov(plan, scratch, sizeof(scratch), iov, &count, 64,
+                                         0xCAFEu, text, 3, &view, 9);
+            }
+            if (at != length || count != 5 || iov[1].iov_base != (void *)text ||
+                    iov[3].iov_base != (void *)blob || iov[3].iov_len != sizeof(blob)) {
+                fprintf(stderr, "Large payloads were not pointed at\n");
+                return EXIT_FAILURE;
+            }
+
+            for (at = 0, count = 0; count < 5; ++count) {
+                memcpy(joined + at, iov[count].iov_base, iov[count].iov_len);
+                at += (uint32_t)iov[count].iov_len;
+            }
+            if (at != length || memcmp(joined, whole, length) != 0) {
+                fprintf(stderr, "Pieces did not join into the packed message\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Below the threshold everything is packed into one piece
+        count = 8;
+        if (jpack_iov(whole + length, sizeof(whole) - length, iov, &count, sizeof(blob) + 1,
+                      format, 0xCAFEu, text, 3, &view, 9) != length || count != 1 ||
+                iov[0].iov_base != whole + length || memcmp(whole + length, whole, length) != 0) {
+            fprintf(stderr, "Small payloads were not packed into scratch\n");
+            return EXIT_FAILURE;
+        }
+
+        // Too few entries or too little scratch fails but reports what is needed
+        count = 4;
+        if (jpack_iov(scratch, sizeof(scratch), iov, &count, 64, format, 0xCAFEu, text, 3,
+                      &view, 9) != JPACK_INVALID || count != 5) {
+            fprintf(stderr, "Too few entries were not rejected\n");
+            return EXIT_FAILURE;
+        }
+        count = 8;
+        if (jpack_iov(scratch, 8, iov, &count, 64, format, 0xCAFEu, text, 3, &view, 9) !=
+                JPACK_INVALID || count != 5) {
+            fprintf(stderr, "Too little scratch was not rejected\n");
+            return EXIT_FAILURE;
+        }
+        count = 8;
+        if (jpack_iov(scratch, sizeof(scratch), iov, &count, 64, "!I(", 1) != JPACK_INVALID) {
+            fprintf(stderr, "Invalid format was not rejected\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_plan_free(plan);
+    } fprintf(stderr, "TEST26 Succeeded\n");
+
+    { // TEST 27
+        static test_sink sink;
+        jpack_stream stream;
+        typedef struct sample {
+            float level;
+            uint8_t id;
+            double angle;
+        } sample;
+        const size_t sample_offsets[] = {
+            offsetof(sample, level), offsetof(sample, id), offsetof(sample, angle)
+        };
+        const uint8_t expected[] = { 0x3e, 0x00, 0x00, 0x3c, 0xff, 0xff, 0x80, 0x7c, 0x00 };
+        const char * invalid[] = {
+            "q", "qH", "qL[0,1]", "qH[1,1]", "qH[2,1]", "qH[0,1", "qH[a,1]", "qH[0,1e999]",
+            "qH[0;1]", "qH(B)", "qH[,1]", "qH[1e,2]", "qH[0.5 ,1]", "qH[0,1,5]", "qH[.,1]",
+            "qH[inf,1]", "qH[0x1,2]"
+        };
+        const char * decimal_locales[] = { "de_DE.UTF-8", "de_DE", "fr_FR.UTF-8", "fr_FR" };
+        const double bounds[] = { 0.5, 1.0, -100.0, 25.0, -0.5, 1.0 };
+        uint8_t buffer[4096];
+        uint8_t staging[16];
+        float halves[1001];
+        float halves_out[1001];
+        double angles[37];
+        double angles_out[37];
+        sample in[20];
+        sample out[20];
+        const uint32_t nan_bits = 0x7fc00000;
+        float nan;
+        float e1 = 0, e2 = 0, e3 = 0;
+        double q1 = 0, q2 = 0;
+        uint32_t length;
+        uint32_t i;
+
+        memcpy(&nan, &nan_bits, sizeof(nan));
+
+        // Scalars, rounding, clamping and the byte order of each field
+        length = jpack(buffer, sizeof(buffer), "!e<e!qH[-1,1]qB[0,1]!e", 1.5, 1.0, 2.0, 0.5,
+                       65520.0);
+        if (length != sizeof(expected) || memcmp(buffer, expected, length) != 0) {
+            fprintf(stderr, "Half and fixed point fields packed wrong\n");
+            return EXIT_FAILURE;
+        }
+        if (junpack(buffer, length, "!e<e!qH[-1,1]qB[0,1]!e", &e1, &e2, &q1, &q2, &e3) != length ||
+                e1 != 1.5f || e2 != 1.0f || q1 - 1.0 > 1e-12 || 1.0 - q1 > 1e-12 ||
+                q2 - 128.0 / 255.0 > 1e-12 || 128.0 / 255.0 - q2 > 1e-12 ||
+                e3 <= FLT_MAX) {
+            fprintf(stderr, "Half and fixed point fields unpacked wrong\n");
+            return EXIT_FAILURE;
+        }
+
+        length = jpack(buffer, sizeof(buffer), "eeqI[-90,90]qI[-90,90]", 0.1, (double)nan,
+                       12.345678, (double)nan);
+        if (junpack(buffer, length, "eeqI[-90,90]qI[-90,90]", &e1, &e2, &q1, &q2) != 12 ||
+                e1 - 0.1f > 0.0001f || 0.1f - e1 > 0.0001f || e2 == e2 ||
+                q1 - 12.345678 > 1e-7 || 12.345678 - q1 > 1e-7 || q2 != -90.0) {
+            fprintf(stderr, "Half and fixed point precision was wrong\n");
+            return EXIT_FAILURE;
+        }
+
+        // Arrays go through the bulk conversion and match the scalars
+        for (i = 0; i < 1001; ++i) {
+            halves[i] = (float)i * 0.37f - 150.0f;
+        }
+        for (i = 0; i < 37; ++i) {
+            angles[i] = (double)i * 9.7 - 180.0;
+        }
+        length = jpack(buffer, sizeof(buffer), "!1001e!37qH[-180,180]", halves, angles);
+        if (length != 1001 * 2 + 37 * 2) {
+            fprintf(stderr, "Half and fixed point arrays had the wrong length\n");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < 1001; ++i) {
+            uint8_t one[2];
+            jpack(one, sizeof(one), "!e", (double)halves[i]);
+            if (memcmp(one, buffer + i * 2, sizeof(one)) != 0) {
+                fprintf(stderr, "Half array element %u did not match the scalar\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+        if (junpack(buffer, length, "!1001e!37qH[-180,180]", halves_out, angles_out) != length) {
+            fprintf(stderr, "Half and fixed point arrays did not unpack\n");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < 1001; ++i) {
+            float error = halves_out[i] - halves[i];
+            if (error > 0.07f || error < -0.07f) {
+                fprintf(stderr, "Half array element %u did not round trip\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+        for (i = 0; i < 37; ++i) {
+            double error = angles_out[i] - angles[i];
+            if (error > 0.003 || error < -0.003) {
+                fprintf(stderr, "Fixed point array element %u did not round trip\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Batches, columns and streams store them as floats and doubles
+        for (i = 0; i < 20; ++i) {
+            in[i].level = (float)i / 4;
+            in[i].id = (uint8_t)i;
+            in[i].angle = (double)i * 0.5;
+        }
+        memset(out, 0, sizeof(out));
+        if (jpack_batch(buffer, sizeof(buffer), "!eB!qI[0,10]", in, 20, sizeof(in[0]),
+                        sample_offsets, &length) != 20 || length != 20 * 7 ||
+                junpack_batch(buffer, length, "!eB!qI[0,10]", out, 20, sizeof(out[0]),
+                              sample_offsets, NULL) != 20) {
+            fprintf(stderr, "Batch of half and fixed point fields failed\n");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < 20; ++i) {
+            double error = out[i].angle - in[i].angle;
+            if (out[i].level != in[i].level || out[i].id != in[i].id ||
+                    error > 1e-8 || error < -1e-8) {
+                fprintf(stderr, "Batch record %u did not round trip\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        memset(out, 0, sizeof(out));
+        length = jpack_columns(buffer, sizeof(buffer), "!eB!qI[0,10]", in, 20, sizeof(in[0]),
+                               sample_offsets);
+        if (length == JPACK_INVALID || length > sizeof(buffer) ||
+                junpack_columns(buffer, length, "!eB!qI[0,10]", out, 20, sizeof(out[0]),
+                                sample_offsets) != 20 ||
+                out[19].level != in[19].level || out[19].angle - in[19].angle > 1e-8 ||
+                in[19].angle - out[19].angle > 1e-8) {
+            fprintf(stderr, "Columns of half and fixed point fields failed\n");
+            return EXIT_FAILURE;
+        }
+
+        jpack_stream_writer(&stream, staging, sizeof(staging), test_write, &sink);
+        if (jpack_stream_pack(&stream, "!e!37qH[-180,180]", 1.5, angles) != 2 + 37 * 2) {
+            fprintf(stderr, "Stream pack of half and fixed point fields failed\n");
+            return EXIT_FAILURE;
+        }
+        jpack_stream_flush(&stream);
+        jpack_stream_reader(&stream, staging, sizeof(staging), test_read, &sink);
+        memset(angles_out, 0, sizeof(angles_out));
+        if (jpack_stream_unpack(&stream, "!e!37qH[-180,180]", &e1, angles_out) != 2 + 37 * 2 ||
+                e1 != 1.5f || sink.length != 2 + 37 * 2 ||
+                angles_out[36] - angles[36] > 0.003 || angles[36] - angles_out[36] > 0.003) {
+            fprintf(stderr, "Stream unpack of half and fixed point fields failed\n");
+            return EXIT_FAILURE;
+        }
+
+        // Bounds are read the same way in every locale
+        for (i = 0; i <= sizeof(decimal_locales) / sizeof(decimal_locales[0]); ++i) {
+            if (i > 0 && setlocale(LC_NUMERIC, decimal_locales[i - 1]) == NULL) {
+                continue;
+            }
+            memset(buffer, 0x11, 6);
+            if (jpack(buffer, sizeof(buffer), "2qB[0.5,1]2qB[-1e2,+2.5E+1]2qB[-.5,1.]",
+                      bounds, bounds + 2, bounds + 4) != 6 ||
+                buffer[0] != 0 || buffer[1] != 0xff || buffer[2] != 0 || buffer[3] != 0xff ||
+                buffer[4] != 0 || buffer[5] != 0xff) {
+                fprintf(stderr, "Fixed point bounds were misread\n");
+                return EXIT_FAILURE;
+            }
+        }
+        setlocale(LC_NUMERIC, "C");
+
+        for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+            if (jpack(buffer, sizeof(buffer), invalid[i], 1.0) != JPACK_INVALID) {
+                fprintf(stderr, "Invalid format %s was accepted\n", invalid[i]);
+                return EXIT_FAILURE;
+            }
+        }
+    } fprintf(stderr, "TEST27 Succeeded\n");
+
+    { // TEST 28
+        typedef struct state {
+            uint32_t id;
+            float x;
+            float y;
+            float z;
+            uint8_t flags;
+            char * name;
+            uint32_t level;
+            uint32_t score;
+        } state;
+        const size_t state_offsets[] = {
+            offsetof(state, id), offsetof(state, x), offsetof(state, y),
+            offsetof(state, z), offsetof(state, flags), offsetof(state, name),
+            offsetof(state, level), offsetof(state, score)
+        };
+        struct wide {
+            uint32_t id;
+            uint32_t values[300];
+            uint8_t flags;
+        } * wide = calloc(2, sizeof(struct wide));
+        const size_t wide_offsets[] = {
+            offsetof(struct wide, id), offsetof(struct wide, values), offsetof(struct wide, flags)
+        };
+        const char * format = "!IfffBsu5V";
+        char name[16] = "ann";
+        char name_out[16];
+        char name_copy[16];
+        state previous, current, out, copy;
+        uint8_t buffer[64];
+        uint8_t big[1400];
+        jpack_plan * plan;
+        uint32_t length;
+
+        memset(&previous, 0, sizeof(previous));
+        previous.id = 7;
+        previous.x = 1.0f;
+        previous.y = 2.0f;
+        previous.z = 3.0f;
+        previous.flags = 0x81;
+        previous.name = name;
+        previous.level = 21;
+        previous.score = 1000;
+
+        // A delta against nothing is a keyframe with every field
+        memset(&out, 0, sizeof(out));
+        out.name = name_out;
+        length = jpack_delta(buffer, sizeof(buffer), format, &previous, NULL, state_offsets);
+        if (length != 1 + 4 + 12 + 1 + 4 + 1 + 2 || buffer[0] != 0xff ||
+                junpack_delta(buffer, length, format, &out, state_offsets) != length ||
+                out.id != 7 || out.x != 1.0f || out.y != 2.0f || out.z != 3.0f ||
+                out.flags != 0x81 || strcmp(out.name, "ann") != 0 || out.level != 21 ||
+                out.score != 1000) {
+            fprintf(stderr, "Keyframe delta failed\n");
+            return EXIT_FAILURE;
+        }
+
+        // Nothing changed, only the mask is sent
+        current = previous;
+        if (jpack_delta(buffer, sizeof(buffer), format, &current, &previous, state_offsets) != 1 ||
+                buffer[0] != 0 ||
+                junpack_delta(buffer, 1, format, &out, state_offsets) != 1) {
+            fprintf(stderr, "Empty delta failed\n");
+            return EXIT_FAILURE;
+        }
+
+        // A new string with the same contents is not a change
+        strcpy(name_copy, "bo");
+        strcpy(name, "bo");
+        current.name = name_copy;
+        current.y = 2.5f;
+        current.level = 3;
+        length = jpack_delta(buffer, sizeof(buffer), format, &current, &previous, state_offsets);
+        if (length != 1 + 4 + 1 || buffer[0] != ((1 << 2) | (1 << 6)) ||
+                buffer[3] != 0x20 || buffer[4] != 0x40 || buffer[5] != 3) {
+            fprintf(stderr, "Delta of changed fields failed\n");
+            return EXIT_FAILURE;
+        }
+
+        // A cut off delta leaves the state untouched
+        memcpy(&copy, &out, sizeof(out));
+        if (junpack_delta(buffer, length - 1, format, &out, state_offsets) != JPACK_INVALID ||
+                memcmp(&copy, &out, sizeof(out)) != 0 ||
+                junpack_delta(buffer, length, format, &out, state_offsets) != length ||
+                out.y != 2.5f || out.level != 3 || out.x != 1.0f || out.score != 1000) {
+            fprintf(stderr, "Apply of a delta failed\n");
+            return EXIT_FAILURE;
+        }
+
+        // A delta that is too short reports the length it needs
+        strcpy(name_copy, "carol");
+        current.score = 300;
+        plan = jpack_compile(format);
+        length = jpack_plan_pack_delta(plan, buffer, 3, &current, &previous, state_offsets);
+        if (length != 1 + 4 + 6 + 1 + 2 ||
+                jpack_plan_pack_delta(plan, buffer, sizeof(buffer), &current, &previous,
+                                      state_offsets) != length ||
+                jpack_plan_unpack_delta(plan, buffer, length, &out, state_offsets) != length ||
+                strcmp(out.name, "carol") != 0 || out.score != 300 || out.level != 3) {
+            fprintf(stderr, "Plan delta failed\n");
+            return EXIT_FAILURE;
+        }
+
+        // Mask bits past the last field do not match the format
+        buffer[0] |= 0x80;
+        if (junpack_delta(buffer, length, "!IfffBsu5", &out, state_offsets) != JPACK_INVALID) {
+            fprintf(stderr, "Delta with a mask for another format was accepted\n");
+            return EXIT_FAILURE;
+        }
+        jpack_plan_free(plan);
+
+        if (jpack_delta(buffer, sizeof(buffer), "H(I)", &current, &previous,
+                        state_offsets) != JPACK_INVALID ||
+                junpack_delta(buffer, sizeof(buffer), "H(I)", &out,
+                              state_offsets) != JPACK_INVALID) {
+            fprintf(stderr, "Delta with a group was accepted\n");
+            return EXIT_FAILURE;
+        }
+
+        // Records larger than the single pass are compared field by field
+        if (wide == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        wide[0].values[299] = 1;
+        wide[1].values[299] = 2;
+        wide[1].flags = 1;
+        length = jpack_delta(big, sizeof(big), "I300IB", &wide[1], &wide[0], wide_offsets);
+        if (length != 1 + 1200 + 1 || big[0] != 6 ||
+                junpack_delta(big, length, "I300IB", &wide[0], wide_offsets) != length ||
+                memcmp(&wide[0], &wide[1], sizeof(wide[0])) != 0 ||
+                jpack_delta(big, sizeof(big), "I300IB", &wide[1], &wide[0], wide_offsets) != 1) {
+            fprintf(stderr, "Delta of a wide record failed\n");
+            return EXIT_FAILURE;
+        }
+        free(wide);
+    } fprintf(stderr, "TEST28 Succeeded\n");
 
     return EXIT_SUCCESS;
 }
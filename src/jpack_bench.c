@@ -0,0 +1,1075 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "jpack.h"
+
+#define ITERATIONS 2000000
+
+static volatile uint32_t sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Results are printed as a table by default, or with --csv as one row per
+// measurement for tracking them between releases:
+//
+//     group,name,variant,ns,bytes,gb_per_s
+//
+// ns is the time per message, record or value and bytes the number of packed
+// bytes it stands for, 0 where that does not apply.
+static int csv;
+
+static void summary(const char * format, ...) {
+    va_list arg_list;
+
+    if (csv) {
+        return;
+    }
+
+    va_start(arg_list, format);
+    vprintf(format, arg_list);
+    va_end(arg_list);
+}
+
+static void result(const char * group, const char * name, const char * variant,
+                   double ns, double bytes) {
+    if (csv) {
+        printf("%s,%s,%s,%.3f,%.2f,%.3f\n", group, name, variant, ns, bytes, bytes / ns);
+    }
+}
+
+static void report(const char * group, const char * name, uint32_t bytes,
+                   double string_ns, double plan_ns) {
+    result(group, name, "string", string_ns, bytes);
+    result(group, name, "plan", plan_ns, bytes);
+    summary("%-24s string %7.2f ns/msg  plan %7.2f ns/msg  speedup %.2fx\n",
+            name, string_ns, plan_ns, string_ns / plan_ns);
+}
+
+static void bench_pack(const char * name, const char * format) {
+    uint8_t buffer[256];
+    jpack_plan * plan = jpack_compile(format);
+    double start, string_ns, plan_ns;
+    uint32_t i;
+
+    uint32_t bytes = jpack(buffer, sizeof(buffer), format, 0u, 0, 0, 0.0, (uint64_t)0,
+                           0u, 0, 0, 0.0, (uint64_t)0, "id");
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = jpack(buffer, sizeof(buffer), format,
+                     i, (uint16_t)i, (uint8_t)i, 1.5, (uint64_t)i,
+                     i, (uint16_t)i, (uint8_t)i, 1.5, (uint64_t)i, "id");
+    }
+    string_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = jpack_plan_pack(plan, buffer, sizeof(buffer),
+                               i, (uint16_t)i, (uint8_t)i, 1.5, (uint64_t)i,
+                               i, (uint16_t)i, (uint8_t)i, 1.5, (uint64_t)i, "id");
+    }
+    plan_ns = (now() - start) / ITERATIONS;
+
+    report("pack", name, bytes, string_ns, plan_ns);
+    jpack_plan_free(plan);
+}
+
+static void bench_unpack(const char * name, const char * format) {
+    uint8_t buffer[256];
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t a, a2;
+    uint16_t b, b2;
+    uint8_t c, c2;
+    double d, d2;
+    uint64_t e, e2;
+    char s[8];
+    double start, string_ns, plan_ns;
+    uint32_t i;
+
+    uint32_t bytes = jpack(buffer, sizeof(buffer), format, 1u, 2, 3, 4.0, (uint64_t)5,
+                           1u, 2, 3, 4.0, (uint64_t)5, "id");
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = junpack(buffer, sizeof(buffer), format,
+                       &a, &b, &c, &d, &e, &a2, &b2, &c2, &d2, &e2, s);
+    }
+    string_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = jpack_plan_unpack(plan, buffer, sizeof(buffer),
+                                 &a, &b, &c, &d, &e, &a2, &b2, &c2, &d2, &e2, s);
+    }
+    plan_ns = (now() - start) / ITERATIONS;
+
+    report("unpack", name, bytes, string_ns, plan_ns);
+    jpack_plan_free(plan);
+}
+
+static void bench_fields(const char * name, const char * format) {
+    uint8_t buffer[256];
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t a = 1;
+    uint16_t b = 2;
+    uint8_t c = 3;
+    double d = 1.5;
+    uint64_t e = 5;
+    const void * const fields[] = { &a, &b, &c, &d, &e, &a, &b, &c, &d, &e };
+    double start, args_ns, fields_ns;
+    uint32_t i;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        a = i;
+        sink = jpack_plan_pack(plan, buffer, sizeof(buffer), a, b, c, d, e, a, b, c, d, e);
+    }
+    args_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        a = i;
+        sink = jpack_plan_pack_fields(plan, buffer, sizeof(buffer), fields);
+    }
+    fields_ns = (now() - start) / ITERATIONS;
+
+    result("fields", name, "varargs", args_ns, jpack_plan_length(plan));
+    result("fields", name, "fields", fields_ns, jpack_plan_length(plan));
+    summary("%-24s varargs %7.2f ns/msg  fields %7.2f ns/msg  speedup %.2fx\n",
+            name, args_ns, fields_ns, args_ns / fields_ns);
+    jpack_plan_free(plan);
+}
+
+static void bench_array(const char * name, const char * format, uint32_t bytes) {
+    static uint8_t values[8192];
+    static uint8_t buffer[8192];
+    double start, pack_ns, unpack_ns;
+    uint32_t i;
+
+    start = now();
+    for (i = 0; i < ITERATIONS / 16; ++i) {
+        sink = jpack(buffer, sizeof(buffer), format, values);
+    }
+    pack_ns = (now() - start) / (ITERATIONS / 16);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / 16; ++i) {
+        sink = junpack(buffer, sizeof(buffer), format, values);
+    }
+    unpack_ns = (now() - start) / (ITERATIONS / 16);
+
+    result("array", name, "pack", pack_ns, bytes);
+    result("array", name, "unpack", unpack_ns, bytes);
+    summary("%-24s pack %8.2f ns/msg %6.2f GB/s  unpack %8.2f ns/msg %6.2f GB/s\n",
+            name, pack_ns, bytes / pack_ns, unpack_ns, bytes / unpack_ns);
+}
+
+// Storage for one field of any type, used to drive jpack_fields and
+// junpack_fields from a format alone
+typedef union field_value {
+    uint64_t number;
+    float real_32;
+    double real_64;
+    const char * string;
+    char * text;
+    jpack_view view;
+} field_value;
+
+#define MAX_FIELDS 16
+
+static const char payload[] = "a string of a typical length";
+
+// Points ptrs at values set up for the fields of format, a format without
+// counts or bit fields. unpack selects storage that junpack_fields can write.
+static void setup_fields(const char * format, field_value * values, void ** ptrs,
+                         int unpack) {
+    static char texts[MAX_FIELDS][sizeof(payload)];
+    uint32_t n = 0;
+
+    for (; *format; ++format) {
+        field_value * value = &values[n];
+        char c = *format;
+
+        if (c == '!' || c == '<' || c == '>' || c == 'x') {
+            continue;
+        }
+
+        memset(value, 0, sizeof(*value));
+        ptrs[n++] = value;
+
+        if (c == 'p' || c == 'z') {
+            format++;
+        }
+
+        switch (c) {
+        case 's': case 'z':
+            if (unpack) {
+                value->text = texts[n - 1];
+            } else {
+                value->string = payload;
+            }
+            break;
+        case 'S': case 'p':
+            value->view.ptr = (const uint8_t *)payload;
+            value->view.len = sizeof(payload) - 1;
+            break;
+        case 'f':
+            value->real_32 = 1.5f;
+            break;
+        case 'd':
+            value->real_64 = 2.5;
+            break;
+        default:
+            value->number = 1000 + n;
+            break;
+        }
+    }
+}
+
+// Called through a volatile pointer so that the copies are not optimized away
+static void * (* volatile copy)(void *, const void *, size_t) = memcpy;
+
+static void bench_message(const char * group, const char * name, const char * format) {
+    static uint8_t buffer[1024];
+    static uint8_t target[1024];
+    field_value pack_values[MAX_FIELDS];
+    field_value unpack_values[MAX_FIELDS];
+    void * pack_ptrs[MAX_FIELDS];
+    void * unpack_ptrs[MAX_FIELDS];
+    double start, pack_ns, unpack_ns, copy_ns;
+    uint32_t bytes;
+    uint32_t i;
+
+    setup_fields(format, pack_values, pack_ptrs, 0);
+    setup_fields(format, unpack_values, unpack_ptrs, 1);
+    bytes = jpack_fields(buffer, sizeof(buffer), format, (const void * const *)pack_ptrs);
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = jpack_fields(buffer, sizeof(buffer), format, (const void * const *)pack_ptrs);
+    }
+    pack_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = junpack_fields(buffer, bytes, format, unpack_ptrs);
+    }
+    unpack_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        copy(target, buffer, bytes);
+    }
+    copy_ns = (now() - start) / ITERATIONS;
+
+    result(group, name, "pack", pack_ns, bytes);
+    result(group, name, "unpack", unpack_ns, bytes);
+    result(group, name, "memcpy", copy_ns, bytes);
+    summary("%-24s %4u B  pack %6.2f ns %5.2f GB/s  unpack %6.2f ns %5.2f GB/s  "
+            "memcpy %5.2f ns\n", name, bytes, pack_ns, bytes / pack_ns,
+            unpack_ns, bytes / unpack_ns, copy_ns);
+}
+
+// Messages of 8 fields of each format char, in both byte orders where the
+// byte order makes a difference
+static void bench_chars(void) {
+    static const char * chars[] = {
+        "b", "B", "h", "H", "i", "I", "l", "L", "f", "d",
+        "s", "S", "pB", "pI", "zB", "v", "V", "w", "W"
+    };
+    uint32_t c, i;
+
+    for (c = 0; c < sizeof(chars) / sizeof(chars[0]); ++c) {
+        int ordered = strlen(chars[c]) == 1 && strchr("hHiIlLfd", chars[c][0]) != NULL;
+        char format[32] = "";
+        char name[32];
+
+        for (i = 0; i < 8; ++i) {
+            strcat(format, chars[c]);
+        }
+        sprintf(name, "char %s little", chars[c]);
+        bench_message("char", name, format);
+
+        if (ordered) {
+            format[0] = '\0';
+            for (i = 0; i < 8; ++i) {
+                strcat(format, "!");
+                strcat(format, chars[c]);
+            }
+            sprintf(name, "char %s big", chars[c]);
+            bench_message("char", name, format);
+        }
+    }
+}
+
+#define RECORDS 1000
+
+struct record {
+    uint64_t time;
+    double value;
+    uint32_t id;
+    uint16_t kind;
+    uint8_t flags;
+    uint8_t spare;
+};
+
+static void bench_batch(const char * name, const char * format) {
+    static struct record records[RECORDS];
+    static uint8_t buffer[RECORDS * sizeof(struct record)];
+    const size_t offsets[] = {
+        offsetof(struct record, time),
+        offsetof(struct record, value),
+        offsetof(struct record, id),
+        offsetof(struct record, kind),
+        offsetof(struct record, flags),
+        offsetof(struct record, spare)
+    };
+    double start, loop_ns, batch_ns;
+    uint32_t i, r;
+
+    start = now();
+    for (i = 0; i < ITERATIONS / RECORDS; ++i) {
+        uint32_t offset = 0;
+        for (r = 0; r < RECORDS; ++r) {
+            const struct record * rec = &records[r];
+            offset += jpack(buffer + offset, sizeof(buffer) - offset, format,
+                            rec->time, rec->value, rec->id, rec->kind,
+                            rec->flags, rec->spare);
+        }
+        sink = offset;
+    }
+    loop_ns = (now() - start) / (ITERATIONS / RECORDS * RECORDS);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / RECORDS; ++i) {
+        sink = jpack_batch(buffer, sizeof(buffer), format, records, RECORDS,
+                           sizeof(records[0]), offsets, NULL);
+    }
+    batch_ns = (now() - start) / (ITERATIONS / RECORDS * RECORDS);
+
+    result("batch", name, "loop", loop_ns, jpack_format_length(format));
+    result("batch", name, "batch", batch_ns, jpack_format_length(format));
+    summary("%-24s loop %7.2f ns/rec  batch %7.2f ns/rec  speedup %.2fx\n",
+            name, loop_ns, batch_ns, loop_ns / batch_ns);
+}
+
+static void bench_columns(const char * name, const char * format) {
+    static struct record records[RECORDS];
+    static uint8_t buffer[RECORDS * sizeof(struct record) + 256];
+    const size_t offsets[] = {
+        offsetof(struct record, time),
+        offsetof(struct record, value),
+        offsetof(struct record, id),
+        offsetof(struct record, kind),
+        offsetof(struct record, flags),
+        offsetof(struct record, spare)
+    };
+    double start, pack_ns, unpack_ns;
+    uint32_t i;
+
+    start = now();
+    for (i = 0; i < ITERATIONS / RECORDS; ++i) {
+        sink = jpack_columns(buffer, sizeof(buffer), format, records, RECORDS,
+                             sizeof(records[0]), offsets);
+    }
+    pack_ns = (now() - start) / (ITERATIONS / RECORDS * RECORDS);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / RECORDS; ++i) {
+        sink = junpack_columns(buffer, sizeof(buffer), format, records, RECORDS,
+                               sizeof(records[0]), offsets);
+    }
+    unpack_ns = (now() - start) / (ITERATIONS / RECORDS * RECORDS);
+
+    result("columns", name, "pack", pack_ns, jpack_format_length(format));
+    result("columns", name, "unpack", unpack_ns, jpack_format_length(format));
+    summary("%-24s pack %7.2f ns/rec  unpack %7.2f ns/rec\n",
+            name, pack_ns, unpack_ns);
+}
+
+#define VALUES 1024
+
+#define PARALLEL_RECORDS 1000000
+#define PARALLEL_ROUNDS 5
+
+struct named_record {
+    uint64_t time;
+    double value;
+    uint32_t id;
+    const char * name;
+};
+
+static void bench_parallel(const char * name, const char * format) {
+    static const char * names[] = { "cpu", "memory", "disk.read", "disk.write", "network" };
+    struct named_record * records = malloc(PARALLEL_RECORDS * sizeof(*records));
+    uint8_t * buffer = malloc(PARALLEL_RECORDS * 40);
+    const size_t offsets[] = {
+        offsetof(struct named_record, time),
+        offsetof(struct named_record, value),
+        offsetof(struct named_record, id),
+        offsetof(struct named_record, name)
+    };
+    double single_ns = 0;
+    uint32_t threads, i, r;
+    uint32_t length = 0;
+
+    for (r = 0; r < PARALLEL_RECORDS; ++r) {
+        records[r].time = 1700000000000ull + r;
+        records[r].value = r * 0.25;
+        records[r].id = r;
+        records[r].name = names[r % 5];
+    }
+
+    for (threads = 1; threads <= 8; threads *= 2) {
+        jpack_pool * pool = jpack_pool_create(threads);
+        jpack_plan * plan = jpack_compile(format);
+        char variant[16];
+        double start, ns;
+
+        start = now();
+        for (i = 0; i < PARALLEL_ROUNDS; ++i) {
+            sink = jpack_plan_pack_batch_parallel(pool, plan, buffer, PARALLEL_RECORDS * 40,
+                                                  records, PARALLEL_RECORDS, sizeof(records[0]),
+                                                  offsets, &length);
+        }
+        ns = (now() - start) / (PARALLEL_ROUNDS * PARALLEL_RECORDS);
+        if (threads == 1) {
+            single_ns = ns;
+        }
+
+        sprintf(variant, "threads %u", threads);
+        result("parallel", name, variant, ns, (double)length / PARALLEL_RECORDS);
+        summary("%-24s threads %u %7.2f ns/rec  speedup %.2fx\n",
+                name, threads, ns, single_ns / ns);
+
+        jpack_plan_free(plan);
+        jpack_pool_free(pool);
+    }
+
+    free(buffer);
+    free(records);
+}
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// Mostly below 128 with a tail up to 16383, like counters and small enums
+static uint64_t small_value(void) {
+    uint64_t r = next_random();
+    return r % 10 ? (r >> 8) % 128 : (r >> 8) % 16384;
+}
+
+// Zigzag encoded deltas within +-1000, as 32-bit two's complement
+static uint64_t small_delta(void) {
+    return (uint32_t)((int32_t)(next_random() % 2001) - 1000);
+}
+
+// Timestamps in microseconds a few hours apart
+static uint64_t timestamp(void) {
+    return 1700000000000000ull + next_random() % 10000000000ull;
+}
+
+static uint64_t uniform_32(void) {
+    return (uint32_t)next_random();
+}
+
+// Packs and unpacks messages of 8 fields of the same type, as 32 or 64-bit
+// values depending on wide
+static uint32_t pack_eight(const jpack_plan * plan, uint8_t * buf, size_t size,
+                           const uint64_t * v, int wide) {
+    if (wide) {
+        return jpack_plan_pack(plan, buf, size, v[0], v[1], v[2], v[3],
+                               v[4], v[5], v[6], v[7]);
+    }
+    return jpack_plan_pack(plan, buf, size, (uint32_t)v[0], (uint32_t)v[1],
+                           (uint32_t)v[2], (uint32_t)v[3], (uint32_t)v[4],
+                           (uint32_t)v[5], (uint32_t)v[6], (uint32_t)v[7]);
+}
+
+static uint32_t unpack_eight(const jpack_plan * plan, const uint8_t * buf,
+                             size_t size, uint64_t * v, int wide) {
+    uint32_t * n = (uint32_t *)v;
+    if (wide) {
+        return jpack_plan_unpack(plan, buf, size, &v[0], &v[1], &v[2], &v[3],
+                                 &v[4], &v[5], &v[6], &v[7]);
+    }
+    return jpack_plan_unpack(plan, buf, size, &n[0], &n[1], &n[2], &n[3],
+                             &n[4], &n[5], &n[6], &n[7]);
+}
+
+static void bench_varint(const char * name, char fixed, char varint, int wide,
+                         uint64_t (*next)(void)) {
+    static uint64_t values[VALUES];
+    static uint8_t buffer[VALUES * 10];
+    const char types[2] = { fixed, varint };
+    const char names[2][2] = { { fixed, 0 }, { varint, 0 } };
+    uint64_t out[8];
+    uint32_t bytes[2];
+    double decode_ns[2];
+    double start;
+    uint32_t f, i, r;
+
+    for (r = 0; r < VALUES; ++r) {
+        values[r] = next();
+    }
+
+    for (f = 0; f < 2; ++f) {
+        char format[9];
+        jpack_plan * plan;
+        uint32_t offset = 0;
+
+        memset(format, types[f], 8);
+        format[8] = 0;
+        plan = jpack_compile(format);
+
+        for (r = 0; r < VALUES; r += 8) {
+            offset += pack_eight(plan, buffer + offset, sizeof(buffer) - offset,
+                                 values + r, wide);
+        }
+        bytes[f] = offset;
+
+        start = now();
+        for (i = 0; i < ITERATIONS / VALUES; ++i) {
+            offset = 0;
+            for (r = 0; r < VALUES; r += 8) {
+                offset += unpack_eight(plan, buffer + offset, bytes[f] - offset, out, wide);
+            }
+            sink = offset;
+        }
+        decode_ns[f] = (now() - start) / (ITERATIONS / VALUES * VALUES);
+
+        jpack_plan_free(plan);
+    }
+
+    result("varint", name, names[0], decode_ns[0], (double)bytes[0] / VALUES);
+    result("varint", name, names[1], decode_ns[1], (double)bytes[1] / VALUES);
+    summary("%-24s %c %5.2f B/val %6.2f ns/val  %c %5.2f B/val %6.2f ns/val\n",
+            name, fixed, (double)bytes[0] / VALUES, decode_ns[0],
+            varint, (double)bytes[1] / VALUES, decode_ns[1]);
+}
+
+static void bench_bits(const char * name, const char * format) {
+    uint8_t buffer[64];
+    jpack_plan * plan = jpack_compile(format);
+    uint32_t v[8];
+    double start, pack_ns, unpack_ns;
+    uint32_t i;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = jpack_plan_pack(plan, buffer, sizeof(buffer), i & 1, (i >> 1) & 1,
+                               i & 7, (i >> 3) & 7, i & 31, i & 15, (i >> 4) & 1, i & 3);
+    }
+    pack_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        sink = jpack_plan_unpack(plan, buffer, sizeof(buffer), &v[0], &v[1], &v[2],
+                                 &v[3], &v[4], &v[5], &v[6], &v[7]);
+    }
+    unpack_ns = (now() - start) / ITERATIONS;
+
+    result("bits", name, "pack", pack_ns, jpack_plan_length(plan));
+    result("bits", name, "unpack", unpack_ns, jpack_plan_length(plan));
+    summary("%-24s %2u bytes  pack %7.2f ns/msg  unpack %7.2f ns/msg\n",
+            name, jpack_plan_length(plan), pack_ns, unpack_ns);
+    jpack_plan_free(plan);
+}
+
+// Regular timestamps in nanoseconds, a millisecond apart with some jitter
+static uint64_t tick(void) {
+    static uint64_t time = 1700000000000000000ull;
+    time += 1000000 + next_random() % 1000;
+    return time;
+}
+
+// Ids handed out in increasing order with small gaps
+static uint64_t sequence(void) {
+    static uint64_t id = 100000;
+    id += 1 + next_random() % 4;
+    return id;
+}
+
+// Decodes VALUES values of a coded array against the raw array of the same
+// type, reporting bytes per value and the rate of decoded output
+static void bench_coded(const char * name, char coding, char type,
+                        uint64_t (*next)(void)) {
+    static uint64_t values[VALUES];
+    static uint64_t out[VALUES];
+    static uint8_t buffer[VALUES * 10];
+    const uint32_t element = type == 'L' ? 8 : 4;
+    const char codings[2] = { 0, coding };
+    const char variant[2] = { coding, 0 };
+    uint32_t bytes[2];
+    double decode_ns[2];
+    double start;
+    uint32_t f, i, r;
+
+    for (r = 0; r < VALUES; ++r) {
+        uint64_t value = next();
+        if (element == 8) {
+            values[r] = value;
+        } else {
+            ((uint32_t *)values)[r] = (uint32_t)value;
+        }
+    }
+
+    for (f = 0; f < 2; ++f) {
+        char format[16];
+        jpack_plan * plan;
+
+        if (codings[f]) {
+            sprintf(format, "%u%c%c", VALUES, codings[f], type);
+        } else {
+            sprintf(format, "%u%c", VALUES, type);
+        }
+        plan = jpack_compile(format);
+        bytes[f] = jpack_plan_pack(plan, buffer, sizeof(buffer), values);
+
+        start = now();
+        for (i = 0; i < ITERATIONS / VALUES; ++i) {
+            sink = jpack_plan_unpack(plan, buffer, bytes[f], out);
+        }
+        decode_ns[f] = (now() - start) / (ITERATIONS / VALUES);
+
+        jpack_plan_free(plan);
+    }
+
+    result("coded", name, "raw", decode_ns[0] / VALUES, (double)bytes[0] / VALUES);
+    result("coded", name, variant, decode_ns[1] / VALUES,
+           (double)bytes[1] / VALUES);
+    summary("%-24s raw %5.2f B/val %6.2f GB/s  %c%c %5.2f B/val %6.2f GB/s\n",
+            name, (double)bytes[0] / VALUES, VALUES * element / decode_ns[0],
+            coding, type, (double)bytes[1] / VALUES, VALUES * element / decode_ns[1]);
+}
+
+#define ENTITIES 64
+
+struct entity {
+    uint32_t id;
+    float x;
+    float y;
+    uint8_t flags;
+};
+
+// Packs a list of entities by calling jpack for each one and then patching
+// in the count, against a group that packs them from a compiled plan
+static void bench_group(const char * name) {
+    static struct entity entities[ENTITIES];
+    static uint8_t buffer[ENTITIES * 16];
+    const size_t offsets[] = {
+        offsetof(struct entity, id), offsetof(struct entity, x),
+        offsetof(struct entity, y), offsetof(struct entity, flags)
+    };
+    jpack_group group = { entities, ENTITIES, ENTITIES, sizeof(entities[0]), offsets };
+    jpack_plan * plan = jpack_compile("!H(IffB)");
+    jpack_plan * record = jpack_compile("IffB");
+    double start, loop_ns, group_ns, loop_unpack_ns, group_unpack_ns;
+    uint32_t i, r, offset = 0;
+
+    for (r = 0; r < ENTITIES; ++r) {
+        entities[r].id = r;
+        entities[r].x = (float)r;
+        entities[r].y = (float)r * 0.5f;
+        entities[r].flags = (uint8_t)r;
+    }
+
+    start = now();
+    for (i = 0; i < ITERATIONS / ENTITIES; ++i) {
+        offset = 2;
+        for (r = 0; r < ENTITIES; ++r) {
+            offset += jpack_plan_pack(record, buffer + offset, sizeof(buffer) - offset,
+                                      entities[r].id, (double)entities[r].x,
+                                      (double)entities[r].y, entities[r].flags);
+        }
+        jpack(buffer, 2, "!H", ENTITIES);
+        sink = offset;
+    }
+    loop_ns = (now() - start) / (ITERATIONS / ENTITIES);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / ENTITIES; ++i) {
+        uint16_t count;
+        offset = junpack(buffer, 2, "!H", &count);
+        for (r = 0; r < count && r < ENTITIES; ++r) {
+            offset += jpack_plan_unpack(record, buffer + offset, sizeof(buffer) - offset,
+                                        &entities[r].id, &entities[r].x,
+                                        &entities[r].y, &entities[r].flags);
+        }
+        sink = offset;
+    }
+    loop_unpack_ns = (now() - start) / (ITERATIONS / ENTITIES);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / ENTITIES; ++i) {
+        sink = jpack_plan_pack(plan, buffer, sizeof(buffer), &group);
+    }
+    group_ns = (now() - start) / (ITERATIONS / ENTITIES);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / ENTITIES; ++i) {
+        sink = jpack_plan_unpack(plan, buffer, sizeof(buffer), &group);
+    }
+    group_unpack_ns = (now() - start) / (ITERATIONS / ENTITIES);
+
+    result("group", name, "loop pack", loop_ns, offset);
+    result("group", name, "group pack", group_ns, offset);
+    result("group", name, "loop unpack", loop_unpack_ns, offset);
+    result("group", name, "group unpack", group_unpack_ns, offset);
+    summary("%-24s pack loop %7.2f ns/msg group %7.2f ns/msg  "
+            "unpack loop %7.2f ns/msg group %7.2f ns/msg\n",
+            name, loop_ns, group_ns, loop_unpack_ns, group_unpack_ns);
+    jpack_plan_free(record);
+    jpack_plan_free(plan);
+}
+
+#define MESSAGES 1024
+
+struct tick {
+    uint32_t price;
+    uint16_t quantity;
+    uint64_t time;
+};
+
+struct quote {
+    uint32_t bid;
+    uint32_t ask;
+    jpack_view venue;
+};
+
+static void sum_records(void * ctx, uint8_t id, const void * records, uint32_t count) {
+    uint64_t * sum = ctx;
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        *sum += id == 1 ? ((const struct tick *)records)[i].price
+                        : ((const struct quote *)records)[i].bid;
+    }
+}
+
+// Decodes a buffer of mixed ticks and quotes with a switch on the type byte
+// and junpack, against a registry
+static void bench_dispatch(const char * name) {
+    static uint8_t buffer[MESSAGES * 32];
+    const size_t tick_offsets[] = {
+        offsetof(struct tick, price), offsetof(struct tick, quantity),
+        offsetof(struct tick, time)
+    };
+    const size_t quote_offsets[] = {
+        offsetof(struct quote, bid), offsetof(struct quote, ask),
+        offsetof(struct quote, venue)
+    };
+    const jpack_view venue = { (const uint8_t *)"XNAS", 4 };
+    jpack_registry * registry = jpack_registry_create(0);
+    uint64_t sum = 0;
+    double start, switch_ns, dispatch_ns;
+    uint32_t i, r, length = 0;
+
+    jpack_registry_add(registry, 1, "!I!H!L", sizeof(struct tick), tick_offsets,
+                       sum_records, &sum);
+    jpack_registry_add(registry, 2, "!I!IpB", sizeof(struct quote), quote_offsets,
+                       sum_records, &sum);
+
+    // Runs of a few messages of each type
+    for (r = 0; r < MESSAGES; ++r) {
+        if (next_random() % 4) {
+            length += jpack(buffer + length, sizeof(buffer) - length, "B!I!H!L",
+                            1, r, 10, (uint64_t)r);
+        } else {
+            length += jpack(buffer + length, sizeof(buffer) - length, "B!I!IpB",
+                            2, r, r + 1, &venue);
+        }
+    }
+
+    start = now();
+    for (i = 0; i < ITERATIONS / MESSAGES; ++i) {
+        uint32_t offset = 0;
+        while (offset < length) {
+            struct tick tick;
+            struct quote quote;
+            switch (buffer[offset]) {
+            case 1:
+                offset += 1 + junpack(buffer + offset + 1, length - offset - 1, "!I!H!L",
+                                      &tick.price, &tick.quantity, &tick.time);
+                sum += tick.price;
+                break;
+            default:
+                offset += 1 + junpack(buffer + offset + 1, length - offset - 1, "!I!IpB",
+                                      &quote.bid, &quote.ask, &quote.venue);
+                sum += quote.bid;
+                break;
+            }
+        }
+    }
+    switch_ns = (now() - start) / (ITERATIONS / MESSAGES * MESSAGES);
+
+    start = now();
+    for (i = 0; i < ITERATIONS / MESSAGES; ++i) {
+        sink = jpack_dispatch(registry, buffer, length, NULL);
+    }
+    dispatch_ns = (now() - start) / (ITERATIONS / MESSAGES * MESSAGES);
+
+    sink = (uint32_t)sum;
+    result("dispatch", name, "switch", switch_ns, (double)length / MESSAGES);
+    result("dispatch", name, "registry", dispatch_ns, (double)length / MESSAGES);
+    summary("%-24s switch %7.2f ns/msg  registry %7.2f ns/msg  speedup %.2fx\n",
+            name, switch_ns, dispatch_ns, switch_ns / dispatch_ns);
+    jpack_registry_free(registry);
+}
+
+// Packing a header and a large payload into one buffer against packing the
+// header into scratch and pointing at the payload for writev
+static void bench_iov(const char * name, uint32_t payload_size) {
+    static uint8_t buffer[65536 + 64];
+    uint8_t scratch[64];
+    struct iovec iov[4];
+    uint8_t * payload = malloc(payload_size);
+    jpack_view view = { payload, payload_size };
+    uint32_t iterations = ITERATIONS / 100;
+    double start, copy_ns, iov_ns;
+    uint32_t i, length = 0;
+
+    memset(payload, 0x5a, payload_size);
+
+    start = now();
+    for (i = 0; i < iterations; ++i) {
+        length = jpack(buffer, sizeof(buffer), "!L!I!HpI", (uint64_t)i, i, 7, &view);
+        sink += buffer[i % length];
+    }
+    copy_ns = (now() - start) / iterations;
+
+    start = now();
+    for (i = 0; i < iterations; ++i) {
+        uint32_t count = 4;
+        length = jpack_iov(scratch, sizeof(scratch), iov, &count, 1024, "!L!I!HpI",
+                           (uint64_t)i, i, 7, &view);
+        sink += scratch[i % 8] + count;
+    }
+    iov_ns = (now() - start) / iterations;
+
+    result("iov", name, "copy", copy_ns, length);
+    result("iov", name, "iov", iov_ns, length);
+    summary("%-24s copy %7.2f ns/msg  iov %7.2f ns/msg  speedup %.2fx\n",
+            name, copy_ns, iov_ns, copy_ns / iov_ns);
+    free(payload);
+}
+
+// Packing a message and then taking its checksum in a second pass against
+// jpack_framed, which takes it field by field as the message is written, and
+// the same for unpacking
+static void bench_framed(const char * name, uint32_t payload_size) {
+    static uint8_t buffer[65536 + 64];
+    uint8_t * payload = malloc(payload_size);
+    jpack_view view = { payload, payload_size };
+    jpack_view out_view;
+    uint32_t iterations = payload_size > 1024 ? ITERATIONS / 100 : ITERATIONS;
+    double start, pass_ns, framed_ns, unpass_ns, unframed_ns;
+    uint64_t time;
+    uint32_t id;
+    uint16_t kind;
+    uint32_t i, length = 0;
+
+    memset(payload, 0x5a, payload_size);
+
+    start = now();
+    for (i = 0; i < iterations; ++i) {
+        length = jpack(buffer, sizeof(buffer), "!L!I!HpI", (uint64_t)i, i, 7, &view);
+        sink += jpack_crc32c(0, buffer, length);
+    }
+    pass_ns = (now() - start) / iterations;
+
+    start = now();
+    for (i = 0; i < iterations; ++i) {
+        length = jpack_framed(buffer, sizeof(buffer), "!L!I!HpI", (uint64_t)i, i, 7, &view);
+        sink += buffer[i % length];
+    }
+    framed_ns = (now() - start) / iterations;
+
+    start = now();
+    for (i = 0; i < iterations; ++i) {
+        sink += jpack_crc32c(0, buffer, length - JPACK_CRC_SIZE);
+        sink += junpack(buffer, length - JPACK_CRC_SIZE, "!L!I!HpI", &time, &id, &kind,
+                        &out_view);
+    }
+    unpass_ns = (now() - start) / iterations;
+
+    start = now();
+    for (i = 0; i < iterations; ++i) {
+        sink += junpack_framed(buffer, length, "!L!I!HpI", &time, &id, &kind, &out_view);
+    }
+    unframed_ns = (now() - start) / iterations;
+
+    result("framed", name, "pack then crc", pass_ns, length);
+    result("framed", name, "pack framed", framed_ns, length);
+    result("framed", name, "crc then unpack", unpass_ns, length);
+    result("framed", name, "unpack framed", unframed_ns, length);
+    summary("%-24s pack+crc %9.2f ns/msg  framed %9.2f ns/msg  crc+unpack %9.2f ns/msg  "
+            "framed %9.2f ns/msg\n", name, pass_ns, framed_ns, unpass_ns, unframed_ns);
+    free(payload);
+}
+
+// Packing a whole entity every tick against packing the fields that changed
+// since the last tick, when a position and a counter move
+static void bench_delta(const char * name) {
+    struct entity {
+        uint32_t id;
+        float values[12];
+        uint8_t flags;
+        char * name;
+    } entities[2];
+    const size_t offsets[] = {
+        offsetof(struct entity, id), offsetof(struct entity, values[0]),
+        offsetof(struct entity, values[1]), offsetof(struct entity, values[2]),
+        offsetof(struct entity, values[3]), offsetof(struct entity, values[4]),
+        offsetof(struct entity, values[5]), offsetof(struct entity, values[6]),
+        offsetof(struct entity, values[7]), offsetof(struct entity, values[8]),
+        offsetof(struct entity, values[9]), offsetof(struct entity, values[10]),
+        offsetof(struct entity, values[11]), offsetof(struct entity, flags),
+        offsetof(struct entity, name)
+    };
+    const char * format = "IffffffffffffBs";
+    jpack_plan * plan = jpack_compile(format);
+    uint8_t buffer[128];
+    char label[] = "orc";
+    double start, full_ns, delta_ns;
+    uint32_t i, j, full_length = 0, delta_length = 0;
+
+    memset(entities, 0, sizeof(entities));
+    for (j = 0; j < 12; ++j) {
+        entities[0].values[j] = (float)j;
+    }
+    entities[0].name = label;
+    entities[1] = entities[0];
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        struct entity * current = &entities[i & 1];
+        current->values[0] = (float)i;
+        current->values[6] = (float)i;
+        jpack_plan_pack_batch(plan, buffer, sizeof(buffer), current, 1, sizeof(*current),
+                              offsets, &full_length);
+        sink += buffer[i % 16];
+    }
+    full_ns = (now() - start) / ITERATIONS;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; ++i) {
+        struct entity * current = &entities[i & 1];
+        current->values[0] = (float)i;
+        current->values[6] = (float)i;
+        delta_length = jpack_plan_pack_delta(plan, buffer, sizeof(buffer), current,
+                                             &entities[~i & 1], offsets);
+        sink += buffer[i % 8];
+    }
+    delta_ns = (now() - start) / ITERATIONS;
+
+    result("delta", name, "full", full_ns, full_length);
+    result("delta", name, "delta", delta_ns, delta_length);
+    summary("%-24s full %7.2f ns/msg %3u bytes  delta %7.2f ns/msg %3u bytes\n",
+            name, full_ns, full_length, delta_ns, delta_length);
+    jpack_plan_free(plan);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--csv") == 0) {
+        csv = 1;
+        printf("group,name,variant,ns,bytes,gb_per_s\n");
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [--csv]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bench_chars();
+    bench_message("mixed", "market tick", "!L!I!d!d!I!HB");
+    bench_message("mixed", "telemetry", "!H!H!L!f!f!f!fB");
+    bench_message("mixed", "telemetry little-endian", "HHLffffB");
+    bench_message("mixed", "rpc header", "!I!H!HzHpH");
+    bench_message("mixed", "sensor varints", "WVVvvB");
+    bench_message("strings", "log line", "!L!Bss");
+    bench_message("strings", "8 strings", "ssssssss");
+    bench_message("strings", "8 views", "SSSSSSSS");
+    bench_pack("pack little-endian", "IHBdLIHBdL");
+    bench_pack("pack network", "!I!H!B!d!L!I!H!B!d!L");
+    bench_pack("pack with string", "IHBdLIHBdLs");
+    bench_unpack("unpack little-endian", "IHBdLIHBdL");
+    bench_unpack("unpack network", "!I!H!B!d!L!I!H!B!d!L");
+    bench_unpack("unpack with string", "IHBdLIHBdLs");
+    bench_fields("fields little-endian", "IHBdLIHBdL");
+    bench_fields("fields network", "!I!H!B!d!L!I!H!B!d!L");
+    bench_array("array 2048I", "2048I", 8192);
+    bench_array("array !2048I", "!2048I", 8192);
+    bench_array("array !4096H", "!4096H", 8192);
+    bench_array("array !1024d", "!1024d", 8192);
+    bench_array("array !2048f", "!2048f", 8192);
+    bench_array("array !2048e", "!2048e", 8192);
+    bench_array("array !1024qH", "!1024qH[-180,180]", 8192);
+    bench_batch("batch native layout", "LdIHBB");
+    bench_batch("batch network", "!L!d!I!HBB");
+    bench_columns("columns native", "LdIHBB");
+    bench_columns("columns network", "!L!d!I!HBB");
+    bench_parallel("parallel with string", "!L!d!Is");
+    bench_varint("varint small values", 'I', 'V', 0, small_value);
+    bench_varint("varint small deltas", 'i', 'v', 0, small_delta);
+    bench_varint("varint uniform 32-bit", 'I', 'V', 0, uniform_32);
+    bench_varint("varint timestamps", 'L', 'W', 1, timestamp);
+    bench_bits("flags as I", "IIIIIIII");
+    bench_bits("flags as bit fields", "u1u1u3u3u5u4u1u2");
+    bench_coded("coded timestamps r", 'r', 'L', tick);
+    bench_coded("coded timestamps t", 't', 'L', tick);
+    bench_coded("coded timestamps T", 'T', 'L', tick);
+    bench_coded("coded ids t", 't', 'I', sequence);
+    bench_coded("coded ids r", 'r', 'I', sequence);
+    bench_group("group of 64 IffB");
+    bench_dispatch("mixed ticks and quotes");
+    bench_iov("iov 4 KiB payload", 4096);
+    bench_iov("iov 64 KiB payload", 65536);
+    bench_framed("framed 16 B payload", 16);
+    bench_framed("framed 64 KiB payload", 65536);
+    bench_delta("delta 2 of 15 fields");
+
+    return EXIT_SUCCESS;
+}
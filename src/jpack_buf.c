@@ -0,0 +1,248 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "jpack.h"
+
+// Size of the first block when none is given
+#define DEFAULT_BLOCK 4096
+
+// Blocks never grow past what a jpack_view can describe
+#define MAX_BLOCK ((size_t)UINT32_MAX)
+
+typedef struct buf_block {
+    uint8_t * data;
+    size_t size;
+    size_t used;
+} buf_block;
+
+struct jpack_buf {
+    buf_block * blocks;     // Kept across resets so that they are reused
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t current;       // Block messages are packed into
+    uint64_t length;
+};
+
+jpack_buf * jpack_buf_create(size_t size) {
+    jpack_buf * buf = malloc(sizeof(*buf));
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    if (size == 0) {
+        size = DEFAULT_BLOCK;
+    } else if (size > MAX_BLOCK) {
+        size = MAX_BLOCK;
+    }
+
+    buf->blocks = malloc(4 * sizeof(buf_block));
+    buf->count = 1;
+    buf->capacity = 4;
+    buf->current = 0;
+    buf->length = 0;
+
+    if (buf->blocks == NULL || (buf->blocks[0].data = malloc(size)) == NULL) {
+        free(buf->blocks);
+        free(buf);
+        return NULL;
+    }
+    buf->blocks[0].size = size;
+    buf->blocks[0].used = 0;
+
+    return buf;
+}
+
+void jpack_buf_free(jpack_buf * buf) {
+    uint32_t i;
+
+    for (i = 0; i < buf->count; ++i) {
+        free(buf->blocks[i].data);
+    }
+    free(buf->blocks);
+    free(buf);
+}
+
+void jpack_buf_reset(jpack_buf * buf) {
+    uint32_t i;
+
+    for (i = 0; i < buf->count; ++i) {
+        buf->blocks[i].used = 0;
+    }
+    buf->current = 0;
+    buf->length = 0;
+}
+
+// Moves on to a block with room for a message of length bytes that did not
+// fit in the current one. An empty block that is too small is grown in place
+// so that the same messages fit in the same blocks after a reset. Returns 0
+// on success or -1 if memory could not be allocated.
+static int next_block(jpack_buf * buf, uint32_t length) {
+    buf_block * block = &buf->blocks[buf->current];
+    size_t size = block->size < MAX_BLOCK / 2 ? 2 * block->size : MAX_BLOCK;
+    uint8_t * data;
+
+    if (size < length) {
+        size = length;
+    }
+
+    if (block->used == 0) {
+        if ((data = realloc(block->data, size)) == NULL) {
+            return -1;
+        }
+        block->data = data;
+        block->size = size;
+        return 0;
+    }
+
+    if (buf->current + 1 < buf->count) {
+        buf->current++;
+        return 0;
+    }
+
+    if (buf->count == buf->capacity) {
+        buf_block * blocks = realloc(buf->blocks, 2 * buf->capacity * sizeof(buf_block));
+        if (blocks == NULL) {
+            return -1;
+        }
+        buf->blocks = blocks;
+        buf->capacity *= 2;
+    }
+
+    if ((data = malloc(size)) == NULL) {
+        return -1;
+    }
+
+    block = &buf->blocks[buf->count++];
+    block->data = data;
+    block->size = size;
+    block->used = 0;
+    buf->current++;
+
+    return 0;
+}
+
+uint32_t jpack_buf_vpack(jpack_buf * buf, const char * format, va_list arg_list) {
+    for (;;) {
+        buf_block * block = &buf->blocks[buf->current];
+        size_t space = block->size - block->used;
+        uint32_t length;
+        va_list args;
+
+        va_copy(args, arg_list);
+        length = jvpack(block->data + block->used, space, format, args);
+        va_end(args);
+
+        if (length == JPACK_INVALID) {
+            return JPACK_INVALID;
+        }
+
+        if (length <= space) {
+            block->used += length;
+            buf->length += length;
+            return length;
+        }
+
+        if (next_block(buf, length) != 0) {
+            return JPACK_INVALID;
+        }
+    }
+}
+
+uint32_t jpack_buf_pack(jpack_buf * buf, const char * format, ...) {
+    uint32_t length;
+    va_list arg_list;
+
+    va_start(arg_list, format);
+    length = jpack_buf_vpack(buf, format, arg_list);
+    va_end(arg_list);
+
+    return length;
+}
+
+uint64_t jpack_buf_length(const jpack_buf * buf) {
+    return buf->length;
+}
+
+const uint8_t * jpack_buf_data(jpack_buf * buf, size_t * length) {
+    uint8_t * data;
+    size_t size;
+    size_t at = 0;
+    uint32_t i;
+
+    if (length) {
+        *length = (size_t)buf->length;
+    }
+
+    // Only the blocks up to the current one hold messages
+    if (buf->current == 0) {
+        return buf->blocks[0].data;
+    }
+
+    // Joined into one block with room to spare, so that the same messages
+    // are packed contiguously after a reset
+    size = buf->length < MAX_BLOCK / 2 ? 2 * (size_t)buf->length : MAX_BLOCK;
+    if (buf->length > size || (data = malloc(size)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < buf->count; ++i) {
+        memcpy(data + at, buf->blocks[i].data, buf->blocks[i].used);
+        at += buf->blocks[i].used;
+        free(buf->blocks[i].data);
+    }
+
+    buf->blocks[0].data = data;
+    buf->blocks[0].size = size;
+    buf->blocks[0].used = at;
+    buf->count = 1;
+    buf->current = 0;
+
+    return data;
+}
+
+uint32_t jpack_buf_blocks(const jpack_buf * buf, struct iovec * iov, uint32_t count) {
+    uint32_t used = 0;
+    uint32_t i;
+
+    for (i = 0; i < buf->count; ++i) {
+        if (buf->blocks[i].used == 0) {
+            continue;
+        }
+        if (used < count) {
+            iov[used].iov_base = buf->blocks[i].data;
+            iov[used].iov_len = buf->blocks[i].used;
+        }
+        used++;
+    }
+
+    return used;
+}
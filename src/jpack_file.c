@@ -0,0 +1,390 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jpack.h"
+
+// Bytes in front of every record holding its length
+#define FRAME 4
+
+// Size of the staging buffer of a writer
+#define STAGING (64 * 1024)
+
+struct jpack_file_writer {
+    int fd;
+    int error;
+    size_t used;
+    uint8_t buf[STAGING];
+};
+
+struct jpack_file_reader {
+    const uint8_t * data;
+    uint64_t size;
+    uint64_t * index;       // Offset of every record after jpack_file_index
+    uint64_t count;
+};
+
+static void put_frame(uint8_t * buf, uint32_t length) {
+    buf[0] = (uint8_t)length;
+    buf[1] = (uint8_t)(length >> 8);
+    buf[2] = (uint8_t)(length >> 16);
+    buf[3] = (uint8_t)(length >> 24);
+}
+
+static uint32_t get_frame(const uint8_t * buf) {
+    return (uint32_t)buf[0] |
+           (uint32_t)buf[1] << 8 |
+           (uint32_t)buf[2] << 16 |
+           (uint32_t)buf[3] << 24;
+}
+
+static int write_all(int fd, const uint8_t * data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+jpack_file_writer * jpack_file_writer_open(const char * path) {
+    jpack_file_writer * writer = malloc(sizeof(*writer));
+
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (writer->fd < 0) {
+        free(writer);
+        return NULL;
+    }
+    writer->error = 0;
+    writer->used = 0;
+
+    return writer;
+}
+
+int jpack_file_flush(jpack_file_writer * writer) {
+    if (writer->used > 0 && !writer->error) {
+        writer->error = write_all(writer->fd, writer->buf, writer->used) != 0;
+    }
+    writer->used = 0;
+    return writer->error ? -1 : 0;
+}
+
+int jpack_file_writer_close(jpack_file_writer * writer) {
+    int status = jpack_file_flush(writer);
+
+    if (close(writer->fd) != 0) {
+        status = -1;
+    }
+    free(writer);
+
+    return status;
+}
+
+int jpack_file_append(jpack_file_writer * writer, const uint8_t * record,
+                      uint32_t length) {
+    if (writer->used + FRAME + length > STAGING && jpack_file_flush(writer) != 0) {
+        return -1;
+    }
+
+    // Records larger than the staging buffer go straight to the file
+    if (FRAME + (size_t)length > STAGING) {
+        uint8_t frame[FRAME];
+        put_frame(frame, length);
+        if (write_all(writer->fd, frame, FRAME) != 0 ||
+            write_all(writer->fd, record, length) != 0) {
+            writer->error = 1;
+            return -1;
+        }
+        return 0;
+    }
+
+    put_frame(writer->buf + writer->used, length);
+    memcpy(writer->buf + writer->used + FRAME, record, length);
+    writer->used += FRAME + length;
+
+    return writer->error ? -1 : 0;
+}
+
+// Packs the record into buf and returns the length it needs, which is more
+// than size if it did not fit
+static uint32_t pack_copy(uint8_t * buf, size_t size, const char * format,
+                          va_list * arg_list) {
+    uint32_t length;
+    va_list copy;
+
+    va_copy(copy, *arg_list);
+    length = jvpack(buf, size, format, copy);
+    va_end(copy);
+
+    return length;
+}
+
+// Appends a record of length bytes that is larger than the staging buffer
+static uint32_t pack_large(jpack_file_writer * writer, const char * format,
+                           va_list * arg_list, uint32_t length) {
+    uint8_t * record = malloc(length);
+
+    if (record == NULL) {
+        return JPACK_INVALID;
+    }
+
+    pack_copy(record, length, format, arg_list);
+    if (jpack_file_append(writer, record, length) != 0) {
+        length = JPACK_INVALID;
+    }
+    free(record);
+
+    return length;
+}
+
+uint32_t jpack_file_pack(jpack_file_writer * writer, const char * format, ...) {
+    size_t space = STAGING - writer->used;
+    uint32_t length;
+    va_list arg_list;
+
+    if (writer->error) {
+        return JPACK_INVALID;
+    }
+
+    va_start(arg_list, format);
+
+    space = space > FRAME ? space - FRAME : 0;
+    length = pack_copy(space ? writer->buf + writer->used + FRAME : writer->buf, space,
+                       format, &arg_list);
+
+    if (length != JPACK_INVALID && length > space) {
+        if (jpack_file_flush(writer) != 0) {
+            length = JPACK_INVALID;
+        } else if (length <= STAGING - FRAME) {
+            pack_copy(writer->buf + FRAME, STAGING - FRAME, format, &arg_list);
+        } else {
+            length = pack_large(writer, format, &arg_list, length);
+            va_end(arg_list);
+            return length;
+        }
+    }
+
+    va_end(arg_list);
+
+    if (length == JPACK_INVALID) {
+        return JPACK_INVALID;
+    }
+
+    put_frame(writer->buf + writer->used, length);
+    writer->used += FRAME + length;
+
+    return length;
+}
+
+jpack_file_reader * jpack_file_reader_open(const char * path) {
+    jpack_file_reader * reader;
+    struct stat info;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &info) != 0 || (uint64_t)info.st_size > SIZE_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    reader->size = (uint64_t)info.st_size;
+    if (reader->size > 0) {
+        void * data = mmap(NULL, (size_t)reader->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            free(reader);
+            return NULL;
+        }
+        reader->data = data;
+        posix_madvise(data, (size_t)reader->size, POSIX_MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid after the file is closed
+    close(fd);
+
+    return reader;
+}
+
+void jpack_file_reader_close(jpack_file_reader * reader) {
+    if (reader->data) {
+        munmap((void *)reader->data, (size_t)reader->size);
+    }
+    free(reader->index);
+    free(reader);
+}
+
+const uint8_t * jpack_file_next(const jpack_file_reader * reader, uint64_t * offset,
+                                uint32_t * length) {
+    uint64_t at = *offset;
+    uint32_t record_length;
+
+    if (at > reader->size || reader->size - at < FRAME) {
+        return NULL;
+    }
+
+    record_length = get_frame(reader->data + at);
+    if (reader->size - at - FRAME < record_length) {
+        return NULL;
+    }
+
+    *offset = at + FRAME + record_length;
+    if (length) {
+        *length = record_length;
+    }
+
+    return reader->data + at + FRAME;
+}
+
+uint32_t jpack_file_unpack(const jpack_file_reader * reader, uint64_t * offset,
+                           const char * format, ...) {
+    const uint8_t * record;
+    uint32_t length;
+    va_list arg_list;
+
+    record = jpack_file_next(reader, offset, &length);
+    if (record == NULL) {
+        return JPACK_INVALID;
+    }
+
+    va_start(arg_list, format);
+    if (jvunpack(record, length, format, arg_list) == JPACK_INVALID) {
+        length = JPACK_INVALID;
+    }
+    va_end(arg_list);
+
+    return length;
+}
+
+uint64_t jpack_file_index(jpack_file_reader * reader) {
+    uint64_t capacity = 1024;
+    uint64_t offset = 0;
+    uint64_t count = 0;
+    uint64_t * index;
+
+    index = malloc(capacity * sizeof(uint64_t));
+    if (index == NULL) {
+        return UINT64_MAX;
+    }
+
+    for (;;) {
+        uint64_t at = offset;
+
+        if (jpack_file_next(reader, &offset, NULL) == NULL) {
+            break;
+        }
+
+        if (count == capacity) {
+            uint64_t * grown = realloc(index, 2 * capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                free(index);
+                return UINT64_MAX;
+            }
+            index = grown;
+            capacity *= 2;
+        }
+        index[count++] = at;
+    }
+
+    free(reader->index);
+    reader->index = index;
+    reader->count = count;
+
+    return count;
+}
+
+const uint8_t * jpack_file_record(const jpack_file_reader * reader, uint64_t index,
+                                  uint32_t * length) {
+    uint64_t offset;
+
+    if (index >= reader->count) {
+        return NULL;
+    }
+
+    offset = reader->index[index];
+    return jpack_file_next(reader, &offset, length);
+}
+
+int jpack_file_advise(const jpack_file_reader * reader, uint64_t offset,
+                      uint64_t length, int advice) {
+    static const int advices[] = {
+        POSIX_MADV_NORMAL,
+        POSIX_MADV_SEQUENTIAL,
+        POSIX_MADV_RANDOM,
+        POSIX_MADV_WILLNEED,
+        POSIX_MADV_DONTNEED
+    };
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start;
+
+    if (advice < 0 || advice >= (int)(sizeof(advices) / sizeof(advices[0])) ||
+        offset > reader->size) {
+        return -1;
+    }
+
+    if (length == 0 || length > reader->size - offset) {
+        length = reader->size - offset;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    // The range has to start on a page boundary
+    start = offset - offset % page;
+    length += offset - start;
+
+    return posix_madvise((void *)(reader->data + start), (size_t)length,
+                         advices[advice]) == 0 ? 0 : -1;
+}
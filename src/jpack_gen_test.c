@@ -0,0 +1,247 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+// Checks that the functions jpackgen makes from jpack_gen_test.jpack give the
+// same bytes and values as jpack and junpack
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpack.h"
+#include "jpack_gen_test_jpack.h"
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    { // TEST 1
+        uint32_t id = 0x01020304;
+        uint16_t kind = 0xBEEF;
+        double value = -1.5;
+        uint32_t out_id = 0;
+        uint16_t out_kind = 0;
+        double out_value = 0;
+        uint8_t expected[32];
+        uint8_t buffer[32];
+        size_t size;
+
+        for (size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0xAA, sizeof(expected));
+            memset(buffer, 0xAA, sizeof(buffer));
+
+            if (pack_sample(buffer, size, id, kind, value) !=
+                    jpack(expected, size, "!IHd", id, kind, value) ||
+                memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "pack_sample differs from jpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (unpack_sample(buffer, 14, &out_id, &out_kind, &out_value) != 14 ||
+            out_id != id || out_kind != kind || out_value != value) {
+            fprintf(stderr, "unpack_sample did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST1 Succeeded\n");
+
+    { // TEST 2
+        int8_t b = -3;
+        int16_t h = -1234;
+        int32_t i = -123456789;
+        uint64_t L = 0x0102030405060708ull;
+        float f = 3.25f;
+        int64_t l = -5;
+        uint16_t H[3] = { 1, 0x8001, 0xFFFF };
+        uint8_t B = 0x7F;
+        double d = 1e100;
+        uint32_t I[4] = { 0, 1, 0xDEADBEEF, 0x80000000 };
+        int8_t out_b[2] = { 0, 0 };
+        int16_t out_h[2] = { 0, 0 };
+        int32_t out_i[2] = { 0, 0 };
+        uint64_t out_L[2] = { 0, 0 };
+        float out_f[2] = { 0, 0 };
+        int64_t out_l[2] = { 0, 0 };
+        uint16_t out_H[2][3] = { { 0 } };
+        uint8_t out_B[2] = { 0, 0 };
+        double out_d[2] = { 0, 0 };
+        uint32_t out_I[2][4] = { { 0 } };
+        uint8_t expected[64];
+        uint8_t buffer[64];
+        size_t size;
+
+        for (size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0x55, sizeof(expected));
+            memset(buffer, 0x55, sizeof(buffer));
+
+            if (pack_mixed(buffer, size, b, h, i, L, f, l, H, B, d, I) !=
+                    jpack(expected, size, "b<h>iL2xf!l3HBd2x4I", b, h, i, L, f, l, H, B, d, I) ||
+                memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "pack_mixed differs from jpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (size = 0; size <= 62; ++size) {
+            uint32_t length = junpack(buffer, size, "b<h>iL2xf!l3HBd2x4I",
+                                      &out_b[0], &out_h[0], &out_i[0], &out_L[0], &out_f[0],
+                                      &out_l[0], out_H[0], &out_B[0], &out_d[0], out_I[0]);
+
+            if (unpack_mixed(buffer, size, &out_b[1], &out_h[1], &out_i[1], &out_L[1],
+                             &out_f[1], &out_l[1], out_H[1], &out_B[1], &out_d[1],
+                             out_I[1]) != length ||
+                out_b[0] != out_b[1] || out_h[0] != out_h[1] || out_i[0] != out_i[1] ||
+                out_L[0] != out_L[1] || out_f[0] != out_f[1] || out_l[0] != out_l[1] ||
+                memcmp(out_H[0], out_H[1], sizeof(out_H[0])) != 0 || out_B[0] != out_B[1] ||
+                out_d[0] != out_d[1] || memcmp(out_I[0], out_I[1], sizeof(out_I[0])) != 0) {
+                fprintf(stderr, "unpack_mixed differs from junpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (out_b[1] != b || out_h[1] != h || out_i[1] != i || out_L[1] != L ||
+            out_f[1] != f || out_l[1] != l || memcmp(out_H[1], H, sizeof(H)) != 0 ||
+            out_B[1] != B || out_d[1] != d || memcmp(out_I[1], I, sizeof(I)) != 0) {
+            fprintf(stderr, "unpack_mixed did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST2 Succeeded\n");
+
+    { // TEST 3
+        uint16_t first = 0x1234;
+        const char * name = "name";
+        uint32_t second = 0xCAFEBABE;
+        const char * empty = "";
+        uint8_t last = 9;
+        uint8_t expected[32];
+        uint8_t buffer[32];
+        size_t size;
+
+        for (size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0x11, sizeof(expected));
+            memset(buffer, 0x11, sizeof(buffer));
+
+            if (pack_named(buffer, size, first, name, second, empty, last) !=
+                    jpack(expected, size, "!HsIsB", first, name, second, empty, last) ||
+                memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "pack_named differs from jpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (size = 0; size <= 14; ++size) {
+            uint16_t out_first[2] = { 0, 0 };
+            char out_name[2][8] = { "", "" };
+            uint32_t out_second[2] = { 0, 0 };
+            char out_empty[2][8] = { "x", "x" };
+            uint8_t out_last[2] = { 0, 0 };
+            uint32_t length = junpack(buffer, size, "!HsIsB", &out_first[0], out_name[0],
+                                      &out_second[0], out_empty[0], &out_last[0]);
+
+            if (unpack_named(buffer, size, &out_first[1], out_name[1], &out_second[1],
+                             out_empty[1], &out_last[1]) != length ||
+                out_first[0] != out_first[1] || strcmp(out_name[0], out_name[1]) != 0 ||
+                out_second[0] != out_second[1] || strcmp(out_empty[0], out_empty[1]) != 0 ||
+                out_last[0] != out_last[1]) {
+                fprintf(stderr, "unpack_named differs from junpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+
+            if (size == 14 && (out_first[1] != first || strcmp(out_name[1], name) != 0 ||
+                               out_second[1] != second || out_empty[1][0] != '\0' ||
+                               out_last[1] != last)) {
+                fprintf(stderr, "unpack_named did not unpack the packed values\n");
+                return EXIT_FAILURE;
+            }
+        }
+    } fprintf(stderr, "TEST3 Succeeded\n");
+
+    { // TEST 4
+        uint32_t i = 7;
+        uint16_t base[2] = { 0x0102, 0x0304 };
+        const char * end = "end";
+        uint32_t length_end = 0xA5A5A5A5;
+        const char * text = "text";
+        uint32_t out_i = 0;
+        uint16_t out_base[2] = { 0, 0 };
+        char out_end[8] = "";
+        uint32_t out_length_end = 0;
+        char out_text[8] = "";
+        uint8_t expected[32];
+        uint8_t buffer[32];
+        size_t size;
+
+        for (size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0x33, sizeof(expected));
+            memset(buffer, 0x33, sizeof(buffer));
+
+            if (pack_locals(buffer, size, i, base, end, length_end, text) !=
+                    jpack(expected, size, "!I2HsIs", i, base, end, length_end, text) ||
+                memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "pack_locals differs from jpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (unpack_locals(buffer, 21, &out_i, out_base, out_end, &out_length_end,
+                          out_text) != 21 ||
+            out_i != i || memcmp(out_base, base, sizeof(base)) != 0 ||
+            strcmp(out_end, end) != 0 || out_length_end != length_end ||
+            strcmp(out_text, text) != 0) {
+            fprintf(stderr, "unpack_locals did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST4 Succeeded\n");
+
+    { // TEST 5
+        uint16_t none[1] = { 0xFFFF };
+        uint32_t out_id = 0;
+        uint16_t out_none[1] = { 0x1111 };
+        uint8_t out_last = 0;
+        uint8_t expected[8];
+        uint8_t buffer[8];
+        size_t size;
+
+        for (size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0x77, sizeof(expected));
+            memset(buffer, 0x77, sizeof(buffer));
+
+            if (pack_empty(buffer, size, 42, none, 3) !=
+                    jpack(expected, size, "!I0HB", 42, none, 3) ||
+                memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "pack_empty differs from jpack with size %u\n", (uint32_t)size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (unpack_empty(buffer, 5, &out_id, out_none, &out_last) != 5 ||
+            out_id != 42 || out_none[0] != 0x1111 || out_last != 3) {
+            fprintf(stderr, "unpack_empty did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST5 Succeeded\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,302 @@
+// Generated by jpackgen from jpack_gen_test.jpack, do not edit
+
+#include <string.h>
+
+#include "jpack.h"
+#include "jpack_gen_test_jpack.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG 1
+#else
+#define HOST_BIG 0
+#endif
+
+static inline uint16_t swap_16(uint16_t val) {
+    return (uint16_t)(val << 8 | val >> 8);
+}
+
+static inline uint32_t swap_32(uint32_t val) {
+    return val << 24 | (val & 0xFF00) << 8 | (val >> 8 & 0xFF00) | val >> 24;
+}
+
+static inline uint64_t swap_64(uint64_t val) {
+    return (uint64_t)swap_32((uint32_t)val) << 32 | swap_32((uint32_t)(val >> 32));
+}
+
+static inline void put_16(uint8_t * buf, uint16_t val, int big) {
+    if (big != HOST_BIG) {
+        val = swap_16(val);
+    }
+    memcpy(buf, &val, sizeof(val));
+}
+
+static inline void put_32(uint8_t * buf, uint32_t val, int big) {
+    if (big != HOST_BIG) {
+        val = swap_32(val);
+    }
+    memcpy(buf, &val, sizeof(val));
+}
+
+static inline void put_64(uint8_t * buf, uint64_t val, int big) {
+    if (big != HOST_BIG) {
+        val = swap_64(val);
+    }
+    memcpy(buf, &val, sizeof(val));
+}
+
+static inline uint16_t get_16(const uint8_t * buf, int big) {
+    uint16_t val;
+    memcpy(&val, buf, sizeof(val));
+    return big != HOST_BIG ? swap_16(val) : val;
+}
+
+static inline uint32_t get_32(const uint8_t * buf, int big) {
+    uint32_t val;
+    memcpy(&val, buf, sizeof(val));
+    return big != HOST_BIG ? swap_32(val) : val;
+}
+
+static inline uint64_t get_64(const uint8_t * buf, int big) {
+    uint64_t val;
+    memcpy(&val, buf, sizeof(val));
+    return big != HOST_BIG ? swap_64(val) : val;
+}
+
+static inline uint32_t float_bits(float val) {
+    uint32_t out;
+    memcpy(&out, &val, sizeof(out));
+    return out;
+}
+
+static inline uint64_t double_bits(double val) {
+    uint64_t out;
+    memcpy(&out, &val, sizeof(out));
+    return out;
+}
+
+static inline float float_value(uint32_t val) {
+    float out;
+    memcpy(&out, &val, sizeof(out));
+    return out;
+}
+
+static inline double double_value(uint64_t val) {
+    double out;
+    memcpy(&out, &val, sizeof(out));
+    return out;
+}
+
+uint32_t pack_sample(uint8_t * buf, size_t size, uint32_t id, uint16_t kind, double value) {
+
+    if (size < 14) {
+        return jpack(buf, size, "!IHd", id, kind, value);
+    }
+
+    put_32(buf + 0, (uint32_t)id, 1);
+    put_16(buf + 4, (uint16_t)kind, 0);
+    put_64(buf + 6, double_bits(value), 0);
+
+    return 14;
+}
+
+uint32_t unpack_sample(const uint8_t * buf, size_t size, uint32_t * id, uint16_t * kind, double * value) {
+
+    if (size < 14) {
+        return junpack(buf, size, "!IHd", id, kind, value);
+    }
+
+    *id = (uint32_t)get_32(buf + 0, 1);
+    *kind = (uint16_t)get_16(buf + 4, 0);
+    *value = double_value(get_64(buf + 6, 0));
+
+    return 14;
+}
+
+uint32_t pack_mixed(uint8_t * buf, size_t size, int8_t f0, int16_t f1, int32_t f2, uint64_t f3, float f4, int64_t f5, const uint16_t * f6, uint8_t f7, double f8, const uint32_t * f9) {
+    uint32_t jp_i;
+
+    if (size < 62) {
+        return jpack(buf, size, "b<h>iL2xf!l3HBd2x4I", f0, f1, f2, f3, f4, f5, f6, f7, f8, f9);
+    }
+
+    *(buf + 0) = (uint8_t)f0;
+    put_16(buf + 1, (uint16_t)f1, 0);
+    put_32(buf + 3, (uint32_t)f2, 1);
+    put_64(buf + 7, (uint64_t)f3, 0);
+    put_32(buf + 17, float_bits(f4), 0);
+    put_64(buf + 21, (uint64_t)f5, 1);
+    for (jp_i = 0; jp_i < 3; ++jp_i) {
+        put_16(buf + 29 + 2 * jp_i, (uint16_t)f6[jp_i], 0);
+    }
+    *(buf + 35) = (uint8_t)f7;
+    put_64(buf + 36, double_bits(f8), 0);
+    for (jp_i = 0; jp_i < 4; ++jp_i) {
+        put_32(buf + 46 + 4 * jp_i, (uint32_t)f9[jp_i], 0);
+    }
+
+    return 62;
+}
+
+uint32_t unpack_mixed(const uint8_t * buf, size_t size, int8_t * f0, int16_t * f1, int32_t * f2, uint64_t * f3, float * f4, int64_t * f5, uint16_t * f6, uint8_t * f7, double * f8, uint32_t * f9) {
+    uint32_t jp_i;
+
+    if (size < 62) {
+        return junpack(buf, size, "b<h>iL2xf!l3HBd2x4I", f0, f1, f2, f3, f4, f5, f6, f7, f8, f9);
+    }
+
+    *f0 = (int8_t)*(buf + 0);
+    *f1 = (int16_t)get_16(buf + 1, 0);
+    *f2 = (int32_t)get_32(buf + 3, 1);
+    *f3 = (uint64_t)get_64(buf + 7, 0);
+    *f4 = float_value(get_32(buf + 17, 0));
+    *f5 = (int64_t)get_64(buf + 21, 1);
+    for (jp_i = 0; jp_i < 3; ++jp_i) {
+        f6[jp_i] = (uint16_t)get_16(buf + 29 + 2 * jp_i, 0);
+    }
+    *f7 = (uint8_t)*(buf + 35);
+    *f8 = double_value(get_64(buf + 36, 0));
+    for (jp_i = 0; jp_i < 4; ++jp_i) {
+        f9[jp_i] = (uint32_t)get_32(buf + 46 + 4 * jp_i, 0);
+    }
+
+    return 62;
+}
+
+uint32_t pack_named(uint8_t * buf, size_t size, uint16_t first, const char * name, uint32_t second, const char * empty, uint8_t last) {
+    size_t jp_length_name = strlen(name) + 1;
+    size_t jp_length_empty = strlen(empty) + 1;
+    size_t jp_base = 0;
+
+    if (size < 7 + jp_length_name + jp_length_empty) {
+        return jpack(buf, size, "!HsIsB", first, name, second, empty, last);
+    }
+
+    put_16(buf + jp_base + 0, (uint16_t)first, 1);
+    memcpy(buf + jp_base + 2, name, jp_length_name);
+    jp_base += 2 + jp_length_name;
+    put_32(buf + jp_base + 0, (uint32_t)second, 0);
+    memcpy(buf + jp_base + 4, empty, jp_length_empty);
+    jp_base += 4 + jp_length_empty;
+    *(buf + jp_base + 0) = (uint8_t)last;
+
+    return (uint32_t)(jp_base + 1);
+}
+
+uint32_t unpack_named(const uint8_t * buf, size_t size, uint16_t * first, char * name, uint32_t * second, char * empty, uint8_t * last) {
+    size_t jp_length_name;
+    size_t jp_length_empty;
+    const uint8_t * jp_end;
+    size_t jp_base = 0;
+
+    if (jp_base + 2 >= size ||
+        (jp_end = memchr(buf + jp_base + 2, 0, size - jp_base - 2)) == NULL) {
+        return junpack(buf, size, "!HsIsB", first, name, second, empty, last);
+    }
+    jp_length_name = (size_t)(jp_end - (buf + jp_base + 2)) + 1;
+    jp_base += 2 + jp_length_name;
+    if (jp_base + 4 >= size ||
+        (jp_end = memchr(buf + jp_base + 4, 0, size - jp_base - 4)) == NULL) {
+        return junpack(buf, size, "!HsIsB", first, name, second, empty, last);
+    }
+    jp_length_empty = (size_t)(jp_end - (buf + jp_base + 4)) + 1;
+    jp_base += 4 + jp_length_empty;
+    if (size < jp_base + 1) {
+        return junpack(buf, size, "!HsIsB", first, name, second, empty, last);
+    }
+
+    jp_base = 0;
+    *first = (uint16_t)get_16(buf + jp_base + 0, 1);
+    memcpy(name, buf + jp_base + 2, jp_length_name);
+    jp_base += 2 + jp_length_name;
+    *second = (uint32_t)get_32(buf + jp_base + 0, 0);
+    memcpy(empty, buf + jp_base + 4, jp_length_empty);
+    jp_base += 4 + jp_length_empty;
+    *last = (uint8_t)*(buf + jp_base + 0);
+
+    return (uint32_t)(jp_base + 1);
+}
+
+uint32_t pack_locals(uint8_t * buf, size_t size, uint32_t i, const uint16_t * base, const char * end, uint32_t length_end, const char * text) {
+    size_t jp_length_end = strlen(end) + 1;
+    size_t jp_length_text = strlen(text) + 1;
+    size_t jp_base = 0;
+    uint32_t jp_i;
+
+    if (size < 12 + jp_length_end + jp_length_text) {
+        return jpack(buf, size, "!I2HsIs", i, base, end, length_end, text);
+    }
+
+    put_32(buf + jp_base + 0, (uint32_t)i, 1);
+    for (jp_i = 0; jp_i < 2; ++jp_i) {
+        put_16(buf + jp_base + 4 + 2 * jp_i, (uint16_t)base[jp_i], 0);
+    }
+    memcpy(buf + jp_base + 8, end, jp_length_end);
+    jp_base += 8 + jp_length_end;
+    put_32(buf + jp_base + 0, (uint32_t)length_end, 0);
+    memcpy(buf + jp_base + 4, text, jp_length_text);
+    jp_base += 4 + jp_length_text;
+
+    return (uint32_t)(jp_base + 0);
+}
+
+uint32_t unpack_locals(const uint8_t * buf, size_t size, uint32_t * i, uint16_t * base, char * end, uint32_t * length_end, char * text) {
+    size_t jp_length_end;
+    size_t jp_length_text;
+    const uint8_t * jp_end;
+    size_t jp_base = 0;
+    uint32_t jp_i;
+
+    if (jp_base + 8 >= size ||
+        (jp_end = memchr(buf + jp_base + 8, 0, size - jp_base - 8)) == NULL) {
+        return junpack(buf, size, "!I2HsIs", i, base, end, length_end, text);
+    }
+    jp_length_end = (size_t)(jp_end - (buf + jp_base + 8)) + 1;
+    jp_base += 8 + jp_length_end;
+    if (jp_base + 4 >= size ||
+        (jp_end = memchr(buf + jp_base + 4, 0, size - jp_base - 4)) == NULL) {
+        return junpack(buf, size, "!I2HsIs", i, base, end, length_end, text);
+    }
+    jp_length_text = (size_t)(jp_end - (buf + jp_base + 4)) + 1;
+    jp_base += 4 + jp_length_text;
+    if (size < jp_base + 0) {
+        return junpack(buf, size, "!I2HsIs", i, base, end, length_end, text);
+    }
+
+    jp_base = 0;
+    *i = (uint32_t)get_32(buf + jp_base + 0, 1);
+    for (jp_i = 0; jp_i < 2; ++jp_i) {
+        base[jp_i] = (uint16_t)get_16(buf + jp_base + 4 + 2 * jp_i, 0);
+    }
+    memcpy(end, buf + jp_base + 8, jp_length_end);
+    jp_base += 8 + jp_length_end;
+    *length_end = (uint32_t)get_32(buf + jp_base + 0, 0);
+    memcpy(text, buf + jp_base + 4, jp_length_text);
+    jp_base += 4 + jp_length_text;
+
+    return (uint32_t)(jp_base + 0);
+}
+
+uint32_t pack_empty(uint8_t * buf, size_t size, uint32_t id, const uint16_t * none, uint8_t last) {
+
+    if (size < 5) {
+        return jpack(buf, size, "!I0HB", id, none, last);
+    }
+
+    put_32(buf + 0, (uint32_t)id, 1);
+    *(buf + 4) = (uint8_t)last;
+
+    return 5;
+}
+
+uint32_t unpack_empty(const uint8_t * buf, size_t size, uint32_t * id, uint16_t * none, uint8_t * last) {
+
+    if (size < 5) {
+        return junpack(buf, size, "!I0HB", id, none, last);
+    }
+
+    *id = (uint32_t)get_32(buf + 0, 1);
+    *last = (uint8_t)*(buf + 4);
+
+    return 5;
+}
+
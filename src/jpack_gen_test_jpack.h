@@ -0,0 +1,37 @@
+// Generated by jpackgen from jpack_gen_test.jpack, do not edit
+
+#ifndef JPACK_GEN_TEST_JPACK_H_
+#define JPACK_GEN_TEST_JPACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// !IHd
+uint32_t pack_sample(uint8_t * buf, size_t size, uint32_t id, uint16_t kind, double value);
+uint32_t unpack_sample(const uint8_t * buf, size_t size, uint32_t * id, uint16_t * kind, double * value);
+
+// b<h>iL2xf!l3HBd2x4I
+uint32_t pack_mixed(uint8_t * buf, size_t size, int8_t f0, int16_t f1, int32_t f2, uint64_t f3, float f4, int64_t f5, const uint16_t * f6, uint8_t f7, double f8, const uint32_t * f9);
+uint32_t unpack_mixed(const uint8_t * buf, size_t size, int8_t * f0, int16_t * f1, int32_t * f2, uint64_t * f3, float * f4, int64_t * f5, uint16_t * f6, uint8_t * f7, double * f8, uint32_t * f9);
+
+// !HsIsB
+uint32_t pack_named(uint8_t * buf, size_t size, uint16_t first, const char * name, uint32_t second, const char * empty, uint8_t last);
+uint32_t unpack_named(const uint8_t * buf, size_t size, uint16_t * first, char * name, uint32_t * second, char * empty, uint8_t * last);
+
+// !I2HsIs
+uint32_t pack_locals(uint8_t * buf, size_t size, uint32_t i, const uint16_t * base, const char * end, uint32_t length_end, const char * text);
+uint32_t unpack_locals(const uint8_t * buf, size_t size, uint32_t * i, uint16_t * base, char * end, uint32_t * length_end, char * text);
+
+// !I0HB
+uint32_t pack_empty(uint8_t * buf, size_t size, uint32_t id, const uint16_t * none, uint8_t last);
+uint32_t unpack_empty(const uint8_t * buf, size_t size, uint32_t * id, uint16_t * none, uint8_t * last);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // JPACK_GEN_TEST_JPACK_H_
@@ -0,0 +1,201 @@
+// Checks that jpack.hpp produces the same bytes and values as the C functions
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "jpack.hpp"
+
+int main(int argc, char *argv[]) {
+    (void)argc; (void)argv;
+
+    { // TEST 1
+        constexpr auto format = JPACK_FORMAT("!IHd");
+        static_assert(jpk::length(format) == 14, "!IHd should be 14 bytes");
+
+        uint32_t id = 0x01020304;
+        uint16_t kind = 0xBEEF;
+        double value = -1.5;
+        uint8_t expected[32];
+        uint8_t buffer[32];
+
+        for (size_t size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0xAA, sizeof(expected));
+            memset(buffer, 0xAA, sizeof(buffer));
+
+            uint32_t c_length = jpack(expected, size, "!IHd", id, kind, value);
+            uint32_t length = jpk::pack(format, buffer, size, id, kind, value);
+
+            if (length != c_length || memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "!IHd packed differently from jpack with size %zu\n", size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        uint32_t out_id = 0;
+        uint16_t out_kind = 0;
+        double out_value = 0;
+
+        if (jpk::unpack(format, buffer, 14, &out_id, &out_kind, &out_value) != 14 ||
+            out_id != id || out_kind != kind || out_value != value) {
+            fprintf(stderr, "!IHd did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST1 Succeeded\n");
+
+    { // TEST 2
+        constexpr auto format = JPACK_FORMAT("b<h>iL2xf!l3HBd2x4I");
+
+        int8_t b = -3;
+        int16_t h = -1234;
+        int32_t i = -123456789;
+        uint64_t L = 0x0102030405060708ull;
+        float f = 3.25f;
+        int64_t l = -5;
+        uint16_t H[3] = { 1, 0x8001, 0xFFFF };
+        uint8_t B = 0x7F;
+        double d = 1e100;
+        uint32_t I[4] = { 0, 1, 0xDEADBEEF, 0x80000000 };
+        uint8_t expected[64];
+        uint8_t buffer[64];
+
+        for (size_t size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0x55, sizeof(expected));
+            memset(buffer, 0x55, sizeof(buffer));
+
+            uint32_t c_length = jpack(expected, size, "b<h>iL2xf!l3HBd2x4I",
+                                      b, h, i, L, f, l, H, B, d, I);
+            uint32_t length = jpk::pack(format, buffer, size,
+                                        b, h, i, L, f, l, H, B, d, I);
+
+            if (length != c_length || memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "Mixed format packed differently from jpack with size %zu\n", size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        int8_t out_b[2] = { 0, 0 };
+        int16_t out_h[2] = { 0, 0 };
+        int32_t out_i[2] = { 0, 0 };
+        uint64_t out_L[2] = { 0, 0 };
+        float out_f[2] = { 0, 0 };
+        int64_t out_l[2] = { 0, 0 };
+        uint16_t out_H[2][3] = { { 0 } };
+        uint8_t out_B[2] = { 0, 0 };
+        double out_d[2] = { 0, 0 };
+        uint32_t out_I[2][4] = { { 0 } };
+        uint32_t length = jpk::length(format);
+
+        for (size_t size = 0; size <= length; ++size) {
+            uint32_t c_length = junpack(buffer, size, "b<h>iL2xf!l3HBd2x4I",
+                                        &out_b[0], &out_h[0], &out_i[0], &out_L[0], &out_f[0],
+                                        &out_l[0], out_H[0], &out_B[0], &out_d[0], out_I[0]);
+            uint32_t cpp_length = jpk::unpack(format, buffer, size,
+                                              &out_b[1], &out_h[1], &out_i[1], &out_L[1], &out_f[1],
+                                              &out_l[1], out_H[1], &out_B[1], &out_d[1], out_I[1]);
+
+            if (cpp_length != c_length ||
+                out_b[0] != out_b[1] || out_h[0] != out_h[1] || out_i[0] != out_i[1] ||
+                out_L[0] != out_L[1] || out_f[0] != out_f[1] || out_l[0] != out_l[1] ||
+                memcmp(out_H[0], out_H[1], sizeof(out_H[0])) != 0 || out_B[0] != out_B[1] ||
+                out_d[0] != out_d[1] || memcmp(out_I[0], out_I[1], sizeof(out_I[0])) != 0) {
+                fprintf(stderr, "Mixed format unpacked differently from junpack with size %zu\n", size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (out_b[1] != b || out_h[1] != h || out_i[1] != i || out_L[1] != L ||
+            out_f[1] != f || out_l[1] != l || memcmp(out_H[1], H, sizeof(H)) != 0 ||
+            out_B[1] != B || out_d[1] != d || memcmp(out_I[1], I, sizeof(I)) != 0) {
+            fprintf(stderr, "Mixed format did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST2 Succeeded\n");
+
+    { // TEST 3
+        constexpr auto format = JPACK_FORMAT("!HsIsB");
+
+        uint16_t first = 0x1234;
+        const char * name = "name";
+        uint32_t second = 0xCAFEBABE;
+        char empty[] = "";
+        uint8_t last = 9;
+        uint8_t expected[32];
+        uint8_t buffer[32];
+
+        static_assert(jpk::length(format) == 0, "formats with strings have no fixed length");
+
+        for (size_t size = 0; size <= sizeof(buffer); ++size) {
+            memset(expected, 0x11, sizeof(expected));
+            memset(buffer, 0x11, sizeof(buffer));
+
+            uint32_t c_length = jpack(expected, size, "!HsIsB", first, name, second, empty, last);
+            uint32_t length = jpk::pack(format, buffer, size, first, name, second, empty, last);
+
+            if (length != c_length || memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                fprintf(stderr, "!HsIsB packed differently from jpack with size %zu\n", size);
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (size_t size = 0; size <= 14; ++size) {
+            uint16_t out_first[2] = { 0, 0 };
+            char out_name[2][8] = { "", "" };
+            uint32_t out_second[2] = { 0, 0 };
+            char out_empty[2][8] = { "x", "x" };
+            uint8_t out_last[2] = { 0, 0 };
+
+            uint32_t c_length = junpack(buffer, size, "!HsIsB", &out_first[0], out_name[0],
+                                        &out_second[0], out_empty[0], &out_last[0]);
+            uint32_t length = jpk::unpack(format, buffer, size, &out_first[1], out_name[1],
+                                          &out_second[1], out_empty[1], &out_last[1]);
+
+            if (length != c_length || out_first[0] != out_first[1] ||
+                strcmp(out_name[0], out_name[1]) != 0 || out_second[0] != out_second[1] ||
+                strcmp(out_empty[0], out_empty[1]) != 0 || out_last[0] != out_last[1]) {
+                fprintf(stderr, "!HsIsB unpacked differently from junpack with size %zu\n", size);
+                return EXIT_FAILURE;
+            }
+
+            if (size == 14 && (out_first[1] != first || strcmp(out_name[1], name) != 0 ||
+                               out_second[1] != second || out_empty[1][0] != '\0' ||
+                               out_last[1] != last)) {
+                fprintf(stderr, "!HsIsB did not unpack the packed values\n");
+                return EXIT_FAILURE;
+            }
+        }
+    } fprintf(stderr, "TEST3 Succeeded\n");
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+    { // TEST 4
+        uint32_t id = 7;
+        uint16_t kind = 8;
+        double value = 9.5;
+        uint8_t expected[14];
+        uint8_t buffer[14];
+
+        static_assert(jpk::length<"!IHd">() == 14, "!IHd should be 14 bytes");
+
+        jpack(expected, sizeof(expected), "!IHd", id, kind, value);
+        uint32_t length = jpk::pack<"!IHd">(buffer, sizeof(buffer), id, kind, value);
+
+        if (length != 14 || memcmp(buffer, expected, sizeof(buffer)) != 0) {
+            fprintf(stderr, "Literal format packed differently from jpack\n");
+            return EXIT_FAILURE;
+        }
+
+        uint32_t out_id = 0;
+        uint16_t out_kind = 0;
+        double out_value = 0;
+
+        jpk::unpack<"!IHd">(buffer, sizeof(buffer), &out_id, &out_kind, &out_value);
+
+        if (out_id != id || out_kind != kind || out_value != value) {
+            fprintf(stderr, "Literal format did not unpack the packed values\n");
+            return EXIT_FAILURE;
+        }
+    } fprintf(stderr, "TEST4 Succeeded\n");
+#endif
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "jpack_pool.h"
+
+struct jpack_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signalled when there are tasks or on stop
+    pthread_cond_t done;        // Signalled when the last task finishes
+    pthread_t * workers;
+    uint32_t worker_count;      // The calling thread is not counted
+    void (*task)(void * ctx, uint32_t index);
+    void * ctx;
+    uint32_t task_count;
+    uint32_t next;              // Next task to hand out
+    uint32_t running;           // Tasks handed out or waiting, not yet finished
+    int stop;
+};
+
+// Runs tasks until none are left, called and returns with the lock held
+static void run_tasks(jpack_pool * pool) {
+    while (pool->next < pool->task_count) {
+        uint32_t index = pool->next++;
+
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->ctx, index);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->running == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+}
+
+static void * worker_main(void * arg) {
+    jpack_pool * pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        if (pool->next < pool->task_count) {
+            run_tasks(pool);
+        } else {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+jpack_pool * jpack_pool_create(uint32_t threads) {
+    jpack_pool * pool;
+    uint32_t i;
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (uint32_t)online : 1;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i + 1 < threads; ++i) {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+            jpack_pool_free(pool);
+            return NULL;
+        }
+        pool->worker_count++;
+    }
+
+    return pool;
+}
+
+void jpack_pool_free(jpack_pool * pool) {
+    uint32_t i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->worker_count; ++i) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+uint32_t jpack_pool_threads(const jpack_pool * pool) {
+    return pool->worker_count + 1;
+}
+
+void jpack_pool_run(jpack_pool * pool, void (*task)(void * ctx, uint32_t index),
+                    void * ctx, uint32_t count) {
+    uint32_t i;
+
+    if (pool == NULL || pool->worker_count == 0 || count < 2) {
+        for (i = 0; i < count; ++i) {
+            task(ctx, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->task_count = count;
+    pool->next = 0;
+    pool->running = count;
+    pthread_cond_broadcast(&pool->wake);
+
+    run_tasks(pool);
+    while (pool->running != 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pool->task_count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
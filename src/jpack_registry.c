@@ -0,0 +1,167 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpack.h"
+
+// Records handed to a handler at a time when none is given
+#define DEFAULT_BATCH 64
+
+typedef struct registry_entry {
+    jpack_plan * plan;              // NULL if the type is not registered
+    uint8_t * records;              // Room for a batch of records
+    size_t stride;
+    const size_t * field_offsets;
+    jpack_handler handler;
+    void * ctx;
+} registry_entry;
+
+struct jpack_registry {
+    registry_entry entries[256];    // Indexed by the type byte
+    uint32_t batch;
+};
+
+jpack_registry * jpack_registry_create(uint32_t batch) {
+    jpack_registry * registry = calloc(1, sizeof(*registry));
+
+    if (registry == NULL) {
+        return NULL;
+    }
+
+    registry->batch = batch ? batch : DEFAULT_BATCH;
+
+    return registry;
+}
+
+void jpack_registry_free(jpack_registry * registry) {
+    uint32_t id;
+
+    for (id = 0; id < 256; ++id) {
+        jpack_registry_remove(registry, (uint8_t)id);
+    }
+    free(registry);
+}
+
+int jpack_registry_add(jpack_registry * registry, uint8_t id, const char * format,
+                       size_t stride, const size_t * field_offsets,
+                       jpack_handler handler, void * ctx) {
+    registry_entry * entry = &registry->entries[id];
+    jpack_plan * plan;
+    uint8_t * records;
+
+    // Only s, z and groups have these chars, and they would be unpacked into
+    // buffers the records do not have
+    if (format == NULL || strpbrk(format, "sz(") != NULL || handler == NULL || stride == 0 ||
+            stride > SIZE_MAX / registry->batch) {
+        return -1;
+    }
+
+    if ((plan = jpack_compile(format)) == NULL) {
+        return -1;
+    }
+
+    if ((records = malloc(stride * registry->batch)) == NULL) {
+        jpack_plan_free(plan);
+        return -1;
+    }
+
+    jpack_registry_remove(registry, id);
+    entry->plan = plan;
+    entry->records = records;
+    entry->stride = stride;
+    entry->field_offsets = field_offsets;
+    entry->handler = handler;
+    entry->ctx = ctx;
+
+    return 0;
+}
+
+void jpack_registry_remove(jpack_registry * registry, uint8_t id) {
+    registry_entry * entry = &registry->entries[id];
+
+    jpack_plan_free(entry->plan);
+    free(entry->records);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Hands the count records waiting in entry to its handler
+static void flush_run(const registry_entry * entry, uint8_t id, uint32_t count) {
+    if (count) {
+        entry->handler(entry->ctx, id, entry->records, count);
+    }
+}
+
+uint32_t jpack_dispatch(jpack_registry * registry, const uint8_t * buf, size_t size,
+                        uint32_t * length) {
+    uint32_t messages = 0;
+    uint32_t offset = 0;
+    uint32_t pending = 0;
+    uint8_t run = 0;
+    int unknown = 0;
+
+    // Offsets are 32-bit like the rest of the library
+    if (size > UINT32_MAX) {
+        size = UINT32_MAX;
+    }
+
+    while (offset < size) {
+        uint8_t id = buf[offset];
+        registry_entry * entry = &registry->entries[id];
+        uint32_t message_length;
+
+        if (entry->plan == NULL) {
+            unknown = 1;
+            break;
+        }
+
+        if (id != run || pending == registry->batch) {
+            flush_run(&registry->entries[run], run, pending);
+            run = id;
+            pending = 0;
+        }
+
+        if (jpack_plan_unpack_batch(entry->plan, buf + offset + 1, size - offset - 1,
+                                    entry->records + pending * entry->stride, 1,
+                                    entry->stride, entry->field_offsets,
+                                    &message_length) != 1) {
+            break;
+        }
+
+        pending++;
+        messages++;
+        offset += 1 + message_length;
+    }
+
+    flush_run(&registry->entries[run], run, pending);
+
+    if (length) {
+        *length = offset;
+    }
+
+    return unknown ? JPACK_INVALID : messages;
+}
@@ -0,0 +1,808 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "jpack_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPACK_X86
+#include <immintrin.h>
+#endif // __GNUC__ && x86
+
+#if defined(__SSE2__) && !defined(JPACK_X86)
+#include <emmintrin.h>
+#endif // __SSE2__
+
+// CRC32C (Castagnoli) of every byte value, reflected polynomial 0x82f63b78
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static const uint8_t swap_mask_16[16] = {
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+};
+
+static const uint8_t swap_mask_32[16] = {
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+};
+
+static const uint8_t swap_mask_64[16] = {
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+};
+
+#ifdef JPACK_X86
+__attribute__((target("avx2")))
+static size_t shuffle_avx2(uint8_t * dst, const uint8_t * src, size_t bytes,
+                           const uint8_t * mask) {
+    __m256i m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mask));
+    size_t i = 0;
+
+    for (; i + 64 <= bytes; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(a, m));
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_shuffle_epi8(b, m));
+    }
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(a, m));
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t shuffle_ssse3(uint8_t * dst, const uint8_t * src, size_t bytes,
+                            const uint8_t * mask) {
+    __m128i m = _mm_loadu_si128((const __m128i *)mask);
+    size_t i = 0;
+
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(a, m));
+    }
+
+    return i;
+}
+#endif // JPACK_X86
+
+// Shuffles as many whole 16 byte blocks as the cpu allows.
+// Returns the number of bytes done, the caller finishes the rest.
+static size_t shuffle(uint8_t * dst, const uint8_t * src, size_t bytes,
+                      const uint8_t * mask) {
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("avx2")) {
+        size_t done = shuffle_avx2(dst, src, bytes, mask);
+        return done + shuffle_ssse3(dst + done, src + done, bytes - done, mask);
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return shuffle_ssse3(dst, src, bytes, mask);
+    }
+#else
+    (void)dst; (void)src; (void)bytes; (void)mask;
+#endif // JPACK_X86
+    return 0;
+}
+
+void jpack_swap_16(void * dst, const void * src, size_t count) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    size_t i = shuffle(out, in, count * 2, swap_mask_16) / 2;
+
+    for (; i < count; ++i) {
+        uint16_t num;
+        memcpy(&num, in + i * 2, sizeof(num));
+        num = (uint16_t)((uint16_t)(num >> 8) | (uint16_t)(num << 8));
+        memcpy(out + i * 2, &num, sizeof(num));
+    }
+}
+
+void jpack_swap_32(void * dst, const void * src, size_t count) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    size_t i = shuffle(out, in, count * 4, swap_mask_32) / 4;
+
+    for (; i < count; ++i) {
+        uint32_t num;
+        memcpy(&num, in + i * 4, sizeof(num));
+        num = ((num >> 24) & 0x000000ff) |
+              ((num >> 8)  & 0x0000ff00) |
+              ((num << 8)  & 0x00ff0000) |
+              ((num << 24) & 0xff000000);
+        memcpy(out + i * 4, &num, sizeof(num));
+    }
+}
+
+void jpack_swap_64(void * dst, const void * src, size_t count) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    size_t i = shuffle(out, in, count * 8, swap_mask_64) / 8;
+
+    for (; i < count; ++i) {
+        uint64_t num;
+        memcpy(&num, in + i * 8, sizeof(num));
+        num = ((num >> 56) & 0x00000000000000ff) |
+              ((num >> 40) & 0x000000000000ff00) |
+              ((num >> 24) & 0x0000000000ff0000) |
+              ((num >> 8)  & 0x00000000ff000000) |
+              ((num << 8)  & 0x000000ff00000000) |
+              ((num << 24) & 0x0000ff0000000000) |
+              ((num << 40) & 0x00ff000000000000) |
+              ((num << 56) & 0xff00000000000000);
+        memcpy(out + i * 8, &num, sizeof(num));
+    }
+}
+
+#ifdef JPACK_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t * data, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t val;
+        memcpy(&val, data, sizeof(val));
+        crc64 = _mm_crc32_u64(crc64, val);
+    }
+    crc = (uint32_t)crc64;
+#endif // __x86_64__
+
+    for (; length >= 4; data += 4, length -= 4) {
+        uint32_t val;
+        memcpy(&val, data, sizeof(val));
+        crc = _mm_crc32_u32(crc, val);
+    }
+    for (; length; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+#endif // JPACK_X86
+
+uint32_t jpack_crc32c_update(uint32_t crc, const void * data, size_t length) {
+    const uint8_t * in = data;
+
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(crc, in, length);
+    }
+#endif // JPACK_X86
+
+    for (; length; in++, length--) {
+        crc = crc32c_table[(crc ^ *in) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+// Packed blocks use the vertical layout of SIMD-BP128: value i goes to lane
+// i % lanes of a 128-bit register and each lane is filled from its lowest bit
+// up, so every step shifts all lanes by the same amount. Words are stored
+// little-endian. The plain c versions write the same bytes.
+
+#ifdef __SSE2__
+static void bitpack_32(uint8_t * out, const uint32_t * in, uint32_t bits) {
+    __m128i acc = _mm_setzero_si128();
+    uint32_t shift = 0;
+    uint32_t j;
+
+    for (j = 0; j < 32; ++j) {
+        __m128i val = _mm_loadu_si128((const __m128i *)(in + 4 * j));
+        acc = _mm_or_si128(acc, _mm_sll_epi32(val, _mm_cvtsi32_si128((int)shift)));
+        shift += bits;
+        if (shift >= 32) {
+            _mm_storeu_si128((__m128i *)out, acc);
+            out += 16;
+            shift -= 32;
+            acc = _mm_srl_epi32(val, _mm_cvtsi32_si128((int)(bits - shift)));
+        }
+    }
+}
+
+static void bitunpack_32(uint32_t * out, const uint8_t * in, uint32_t bits) {
+    __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (int)((1u << bits) - 1));
+    __m128i word = _mm_loadu_si128((const __m128i *)in);
+    uint32_t shift = 0;
+    uint32_t j;
+
+    for (j = 0; j < 32; ++j) {
+        __m128i val = _mm_srl_epi32(word, _mm_cvtsi32_si128((int)shift));
+        shift += bits;
+        if (shift >= 32 && j < 31) {
+            in += 16;
+            word = _mm_loadu_si128((const __m128i *)in);
+            shift -= 32;
+            val = _mm_or_si128(val, _mm_sll_epi32(word, _mm_cvtsi32_si128((int)(bits - shift))));
+        }
+        _mm_storeu_si128((__m128i *)(out + 4 * j), _mm_and_si128(val, mask));
+    }
+}
+
+static void bitpack_64(uint8_t * out, const uint64_t * in, uint32_t bits) {
+    __m128i acc = _mm_setzero_si128();
+    uint32_t shift = 0;
+    uint32_t j;
+
+    for (j = 0; j < 64; ++j) {
+        __m128i val = _mm_loadu_si128((const __m128i *)(in + 2 * j));
+        acc = _mm_or_si128(acc, _mm_sll_epi64(val, _mm_cvtsi32_si128((int)shift)));
+        shift += bits;
+        if (shift >= 64) {
+            _mm_storeu_si128((__m128i *)out, acc);
+            out += 16;
+            shift -= 64;
+            acc = _mm_srl_epi64(val, _mm_cvtsi32_si128((int)(bits - shift)));
+        }
+    }
+}
+
+static void bitunpack_64(uint64_t * out, const uint8_t * in, uint32_t bits) {
+    __m128i mask = _mm_set1_epi64x(bits == 64 ? -1 : (long long)((1ull << bits) - 1));
+    __m128i word = _mm_loadu_si128((const __m128i *)in);
+    uint32_t shift = 0;
+    uint32_t j;
+
+    for (j = 0; j < 64; ++j) {
+        __m128i val = _mm_srl_epi64(word, _mm_cvtsi32_si128((int)shift));
+        shift += bits;
+        if (shift >= 64 && j < 63) {
+            in += 16;
+            word = _mm_loadu_si128((const __m128i *)in);
+            shift -= 64;
+            val = _mm_or_si128(val, _mm_sll_epi64(word, _mm_cvtsi32_si128((int)(bits - shift))));
+        }
+        _mm_storeu_si128((__m128i *)(out + 2 * j), _mm_and_si128(val, mask));
+    }
+}
+
+#else
+
+// Reads and writes words of packed blocks in little-endian order
+static uint32_t load_32le(const uint8_t * in) {
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 |
+           (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static void store_32le(uint8_t * out, uint32_t val) {
+    out[0] = (uint8_t)val;
+    out[1] = (uint8_t)(val >> 8);
+    out[2] = (uint8_t)(val >> 16);
+    out[3] = (uint8_t)(val >> 24);
+}
+
+static uint64_t load_64le(const uint8_t * in) {
+    return (uint64_t)load_32le(in) | (uint64_t)load_32le(in + 4) << 32;
+}
+
+static void store_64le(uint8_t * out, uint64_t val) {
+    store_32le(out, (uint32_t)val);
+    store_32le(out + 4, (uint32_t)(val >> 32));
+}
+
+
+static void bitpack_32(uint8_t * out, const uint32_t * in, uint32_t bits) {
+    uint32_t lane;
+
+    for (lane = 0; lane < 4; ++lane) {
+        uint32_t acc = 0;
+        uint32_t shift = 0;
+        uint32_t word = 0;
+        uint32_t j;
+
+        for (j = 0; j < 32; ++j) {
+            uint32_t val = in[4 * j + lane];
+            acc |= val << shift;
+            shift += bits;
+            if (shift >= 32) {
+                store_32le(out + 16 * word++ + 4 * lane, acc);
+                shift -= 32;
+                acc = shift ? val >> (bits - shift) : 0;
+            }
+        }
+    }
+}
+
+static void bitunpack_32(uint32_t * out, const uint8_t * in, uint32_t bits) {
+    uint32_t mask = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+    uint32_t lane;
+
+    for (lane = 0; lane < 4; ++lane) {
+        uint32_t word = 0;
+        uint32_t acc = load_32le(in + 4 * lane);
+        uint32_t shift = 0;
+        uint32_t j;
+
+        for (j = 0; j < 32; ++j) {
+            uint32_t val = acc >> shift;
+            shift += bits;
+            if (shift >= 32 && j < 31) {
+                acc = load_32le(in + 16 * ++word + 4 * lane);
+                shift -= 32;
+                if (shift) {
+                    val |= acc << (bits - shift);
+                }
+            }
+            out[4 * j + lane] = val & mask;
+        }
+    }
+}
+
+static void bitpack_64(uint8_t * out, const uint64_t * in, uint32_t bits) {
+    uint32_t lane;
+
+    for (lane = 0; lane < 2; ++lane) {
+        uint64_t acc = 0;
+        uint32_t shift = 0;
+        uint32_t word = 0;
+        uint32_t j;
+
+        for (j = 0; j < 64; ++j) {
+            uint64_t val = in[2 * j + lane];
+            acc |= val << shift;
+            shift += bits;
+            if (shift >= 64) {
+                store_64le(out + 16 * word++ + 8 * lane, acc);
+                shift -= 64;
+                acc = shift ? val >> (bits - shift) : 0;
+            }
+        }
+    }
+}
+
+static void bitunpack_64(uint64_t * out, const uint8_t * in, uint32_t bits) {
+    uint64_t mask = bits == 64 ? UINT64_MAX : ((uint64_t)1 << bits) - 1;
+    uint32_t lane;
+
+    for (lane = 0; lane < 2; ++lane) {
+        uint32_t word = 0;
+        uint64_t acc = load_64le(in + 8 * lane);
+        uint32_t shift = 0;
+        uint32_t j;
+
+        for (j = 0; j < 64; ++j) {
+            uint64_t val = acc >> shift;
+            shift += bits;
+            if (shift >= 64 && j < 63) {
+                acc = load_64le(in + 16 * ++word + 8 * lane);
+                shift -= 64;
+                if (shift) {
+                    val |= acc << (bits - shift);
+                }
+            }
+            out[2 * j + lane] = val & mask;
+        }
+    }
+}
+#endif // __SSE2__
+
+void jpack_bitpack_32(uint8_t * out, const uint32_t * in, uint32_t bits) {
+    if (bits) {
+        bitpack_32(out, in, bits);
+    }
+}
+
+void jpack_bitunpack_32(uint32_t * out, const uint8_t * in, uint32_t bits) {
+    if (bits) {
+        bitunpack_32(out, in, bits);
+    } else {
+        memset(out, 0, 128 * sizeof(*out));
+    }
+}
+
+void jpack_bitpack_64(uint8_t * out, const uint64_t * in, uint32_t bits) {
+    if (bits) {
+        bitpack_64(out, in, bits);
+    }
+}
+
+void jpack_bitunpack_64(uint64_t * out, const uint8_t * in, uint32_t bits) {
+    if (bits) {
+        bitunpack_64(out, in, bits);
+    } else {
+        memset(out, 0, 128 * sizeof(*out));
+    }
+}
+
+// Rounds the float with bits x to the nearest half. Halves too small to be
+// normal are rounded by adding a magic number that puts their bits at the
+// bottom of the mantissa, so the fpu does the rounding.
+static uint16_t float_to_half(uint32_t x) {
+    const uint32_t infinity = 0x7f800000;
+    const uint32_t too_large = (127u + 16) << 23;
+    const uint32_t magic_bits = (127u - 15 + 23 - 10 + 1) << 23;
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    uint16_t half;
+
+    x &= 0x7fffffff;
+
+    if (x > infinity) {
+        half = (uint16_t)(0x7e00 | ((x >> 13) & 0x3ff));
+    } else if (x >= too_large) {
+        half = 0x7c00;
+    } else if (x < (127u - 14) << 23) {
+        float val, magic;
+        memcpy(&val, &x, sizeof(val));
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        val += magic;
+        memcpy(&x, &val, sizeof(x));
+        half = (uint16_t)(x - magic_bits);
+    } else {
+        uint32_t odd = (x >> 13) & 1;
+        x += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+        half = (uint16_t)(x >> 13);
+    }
+
+    return sign | half;
+}
+
+static uint32_t half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t x;
+
+    if (exponent == 0x1f) {
+        return sign | 0x7f800000 | (mantissa ? 0x400000 : 0) | mantissa << 13;
+    }
+    if (exponent) {
+        return sign | (exponent + 127 - 15) << 23 | mantissa << 13;
+    }
+
+    // Subnormal halves are normal floats
+    {
+        float val = (float)mantissa * (1.0f / 16777216.0f);
+        memcpy(&x, &val, sizeof(x));
+    }
+    return sign | x;
+}
+
+#ifdef JPACK_X86
+__attribute__((target("avx,f16c")))
+static size_t float_to_half_f16c(uint8_t * dst, const uint8_t * src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 a = _mm256_loadu_ps((const float *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+static size_t half_to_float_f16c(uint8_t * dst, const uint8_t * src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        _mm256_storeu_ps((float *)(dst + i * 4), _mm256_cvtph_ps(a));
+    }
+
+    return i;
+}
+#endif // JPACK_X86
+
+void jpack_float_to_half(void * dst, const void * src, size_t count) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    size_t i = 0;
+
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("f16c")) {
+        i = float_to_half_f16c(out, in, count);
+    }
+#endif // JPACK_X86
+
+    for (; i < count; ++i) {
+        uint32_t x;
+        uint16_t half;
+        memcpy(&x, in + i * 4, sizeof(x));
+        half = float_to_half(x);
+        memcpy(out + i * 2, &half, sizeof(half));
+    }
+}
+
+void jpack_half_to_float(void * dst, const void * src, size_t count) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    size_t i = 0;
+
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("f16c")) {
+        i = half_to_float_f16c(out, in, count);
+    }
+#endif // JPACK_X86
+
+    for (; i < count; ++i) {
+        uint16_t half;
+        uint32_t x;
+        memcpy(&half, in + i * 2, sizeof(half));
+        x = half_to_float(half);
+        memcpy(out + i * 4, &x, sizeof(x));
+    }
+}
+
+// Codes are rounded by adding a half and truncating, which is the same as
+// flooring since the value is clamped to be non negative first
+static double quantize(double val, double low, double scale, double top) {
+    val = (val - low) * scale + 0.5;
+    val = val > 0 ? val : 0;
+    return val < top ? val : top;
+}
+
+#ifdef JPACK_X86
+// Clamps, rounds and converts 4 doubles to unsigned 32-bit codes. Codes of
+// 2^31 or more do not fit the signed conversion, so every code is shifted
+// down by 2^31 first and its top bit flipped back after.
+__attribute__((target("avx2")))
+static __m128i quantize_avx2(const uint8_t * src, __m256d low, __m256d scale,
+                             __m256d top) {
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d bias = _mm256_set1_pd(2147483648.0);
+    __m256d val = _mm256_loadu_pd((const double *)src);
+
+    val = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(val, low), scale), half);
+    val = _mm256_max_pd(val, _mm256_setzero_pd());
+    val = _mm256_min_pd(val, top);
+    val = _mm256_sub_pd(_mm256_floor_pd(val), bias);
+
+    return _mm_xor_si128(_mm256_cvtpd_epi32(val), _mm_set1_epi32(INT32_MIN));
+}
+
+__attribute__((target("avx2")))
+static size_t quantize_avx2_loop(uint8_t * dst, const uint8_t * src, size_t count,
+                                 uint32_t width, double low, double scale, double top) {
+    __m256d lows = _mm256_set1_pd(low);
+    __m256d scales = _mm256_set1_pd(scale);
+    __m256d tops = _mm256_set1_pd(top);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = quantize_avx2(src + i * 8, lows, scales, tops);
+        __m128i b = quantize_avx2(src + i * 8 + 32, lows, scales, tops);
+        if (width == 1) {
+            __m128i codes = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_setzero_si128());
+            _mm_storel_epi64((__m128i *)(dst + i), codes);
+        } else if (width == 2) {
+            _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packus_epi32(a, b));
+        } else {
+            _mm_storeu_si128((__m128i *)(dst + i * 4), a);
+            _mm_storeu_si128((__m128i *)(dst + i * 4 + 16), b);
+        }
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t dequantize_avx2_loop(uint8_t * dst, const uint8_t * src, size_t count,
+                                   uint32_t width, double low, double step) {
+    __m256d lows = _mm256_set1_pd(low);
+    __m256d steps = _mm256_set1_pd(step);
+    __m256d bias = _mm256_set1_pd(2147483648.0);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i codes;
+        __m256d val;
+        if (width == 1) {
+            int32_t packed;
+            memcpy(&packed, src + i, sizeof(packed));
+            codes = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+        } else if (width == 2) {
+            codes = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(src + i * 2)));
+        } else {
+            codes = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        }
+        if (width == 4) {
+            codes = _mm_xor_si128(codes, _mm_set1_epi32(INT32_MIN));
+            val = _mm256_add_pd(_mm256_cvtepi32_pd(codes), bias);
+        } else {
+            val = _mm256_cvtepi32_pd(codes);
+        }
+        val = _mm256_add_pd(lows, _mm256_mul_pd(val, steps));
+        _mm256_storeu_pd((double *)(dst + i * 8), val);
+    }
+
+    return i;
+}
+#endif // JPACK_X86
+
+void jpack_quantize(void * dst, const void * src, size_t count, uint32_t width,
+                    double low, double scale) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    double top = width == 4 ? (double)UINT32_MAX : (double)((1u << width * 8) - 1);
+    size_t i = 0;
+
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = quantize_avx2_loop(out, in, count, width, low, scale, top);
+    }
+#endif // JPACK_X86
+
+    for (; i < count; ++i) {
+        double val;
+        memcpy(&val, in + i * 8, sizeof(val));
+        val = quantize(val, low, scale, top);
+        if (width == 1) {
+            out[i] = (uint8_t)val;
+        } else if (width == 2) {
+            uint16_t code = (uint16_t)val;
+            memcpy(out + i * 2, &code, sizeof(code));
+        } else {
+            uint32_t code = (uint32_t)val;
+            memcpy(out + i * 4, &code, sizeof(code));
+        }
+    }
+}
+
+void jpack_dequantize(void * dst, const void * src, size_t count, uint32_t width,
+                      double low, double step) {
+    uint8_t * out = dst;
+    const uint8_t * in = src;
+    size_t i = 0;
+
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = dequantize_avx2_loop(out, in, count, width, low, step);
+    }
+#endif // JPACK_X86
+
+    for (; i < count; ++i) {
+        double val;
+        if (width == 1) {
+            val = in[i];
+        } else if (width == 2) {
+            uint16_t code;
+            memcpy(&code, in + i * 2, sizeof(code));
+            val = code;
+        } else {
+            uint32_t code;
+            memcpy(&code, in + i * 4, sizeof(code));
+            val = code;
+        }
+        val = low + val * step;
+        memcpy(out + i * 8, &val, sizeof(val));
+    }
+}
+
+#ifdef JPACK_X86
+__attribute__((target("avx2")))
+static size_t diff_bytes_avx2(uint64_t * out, const uint8_t * a, const uint8_t * b,
+                              size_t length) {
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                        _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+                                         _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+        uint64_t same = (uint32_t)_mm256_movemask_epi8(low) |
+                        (uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32;
+        out[i / 64] = ~same;
+    }
+
+    return i;
+}
+#endif // JPACK_X86
+
+#ifdef __SSE2__
+static size_t diff_bytes_sse2(uint64_t * out, const uint8_t * a, const uint8_t * b,
+                              size_t length) {
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        uint64_t same = 0;
+        uint32_t j;
+        for (j = 0; j < 4; ++j) {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + j * 16)),
+                                        _mm_loadu_si128((const __m128i *)(b + i + j * 16)));
+            same |= (uint64_t)(uint32_t)_mm_movemask_epi8(eq) << (j * 16);
+        }
+        out[i / 64] = ~same;
+    }
+
+    return i;
+}
+#endif // __SSE2__
+
+void jpack_diff_bytes(uint64_t * out, const void * a, const void * b, size_t length) {
+    const uint8_t * left = a;
+    const uint8_t * right = b;
+    size_t i = 0;
+
+#ifdef JPACK_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = diff_bytes_avx2(out, left, right, length);
+    }
+#endif // JPACK_X86
+#ifdef __SSE2__
+    i += diff_bytes_sse2(out + i / 64, left + i, right + i, length - i);
+#endif // __SSE2__
+
+    // The tail is copied to zeroed blocks, which compare equal past length
+    if (i < length) {
+        uint8_t tail[2][64] = { { 0 }, { 0 } };
+        uint64_t diff = 0;
+
+        memcpy(tail[0], left + i, length - i);
+        memcpy(tail[1], right + i, length - i);
+#ifdef __SSE2__
+        diff_bytes_sse2(&diff, tail[0], tail[1], 64);
+#else
+        for (i = 0; i < 64; ++i) {
+            diff |= (uint64_t)(tail[0][i] != tail[1][i]) << i;
+        }
+#endif // __SSE2__
+        out[length / 64] = diff;
+    }
+}
@@ -0,0 +1,72 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef JPACK_SIMD_H_
+#define JPACK_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bulk kernels used by jpack.c. They pick the widest instruction set the cpu
+// supports at runtime and fall back to plain c on other architectures.
+
+// Copies count elements from src to dst reversing the bytes of each element.
+// dst and src may be the same but must not otherwise overlap.
+void jpack_swap_16(void * dst, const void * src, size_t count);
+void jpack_swap_32(void * dst, const void * src, size_t count);
+void jpack_swap_64(void * dst, const void * src, size_t count);
+
+// Feeds length bytes from data into the CRC32C register crc. The register is
+// not inverted before or after, the caller does that.
+uint32_t jpack_crc32c_update(uint32_t crc, const void * data, size_t length);
+
+// Packs 128 values of at most bits bits each into 16 * bits bytes, or unpacks
+// them. The vertical layout of SIMD-BP128 is used so that a 128-bit register
+// of values is shifted into place at every step. bits may be 0 to 32 or 64.
+void jpack_bitpack_32(uint8_t * out, const uint32_t * in, uint32_t bits);
+void jpack_bitunpack_32(uint32_t * out, const uint8_t * in, uint32_t bits);
+void jpack_bitpack_64(uint8_t * out, const uint64_t * in, uint32_t bits);
+void jpack_bitunpack_64(uint64_t * out, const uint8_t * in, uint32_t bits);
+
+// Converts count floats to IEEE 754 half floats rounding to nearest even, or
+// half floats back to floats. Values too large for a half become infinity
+// and NaNs stay NaNs.
+void jpack_float_to_half(void * dst, const void * src, size_t count);
+void jpack_half_to_float(void * dst, const void * src, size_t count);
+
+// Converts count doubles to fixed point codes of width 1, 2 or 4 bytes as
+// (val - low) * scale rounded to nearest and clamped to the codes there are,
+// with NaN as code 0, or codes back to doubles as low + code * step.
+void jpack_quantize(void * dst, const void * src, size_t count, uint32_t width,
+                    double low, double scale);
+void jpack_dequantize(void * dst, const void * src, size_t count, uint32_t width,
+                      double low, double step);
+
+// Compares length bytes of a and b and sets bit i % 64 of out[i / 64] if
+// byte i differs. Bits past length in the last word are cleared.
+void jpack_diff_bytes(uint64_t * out, const void * a, const void * b, size_t length);
+
+#endif // JPACK_SIMD_H_
@@ -0,0 +1,238 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+
+#include "jpack.h"
+#include "jpack_stats.h"
+
+#ifdef JPACK_STATS
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Counters are only written by the thread that owns them and read by
+// snapshots, relaxed atomics keep that free of data races without making
+// the writes any more expensive than plain ones
+#if defined(__GNUC__)
+#define LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define IS_USED(entry) __atomic_load_n(&(entry)->used, __ATOMIC_ACQUIRE)
+#define SET_USED(entry) __atomic_store_n(&(entry)->used, 1, __ATOMIC_RELEASE)
+#else
+#define LOAD(ptr) (*(ptr))
+#define STORE(ptr, val) (*(ptr) = (val))
+#define IS_USED(entry) ((entry)->used)
+#define SET_USED(entry) ((entry)->used = 1)
+#endif // __GNUC__
+
+#define ADD(ptr, val) STORE(ptr, LOAD(ptr) + (val))
+
+typedef struct stats_counters {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t truncated;
+    uint64_t invalid;
+    uint64_t cycles;
+} stats_counters;
+
+typedef struct stats_entry {
+    int used;                   // Set once format has been filled in
+    uint32_t hash;
+    char format[JPACK_STATS_FORMAT_MAX];
+    stats_counters counts;      // Only written by the owning thread
+    stats_counters reset;       // counts at the last reset, under the lock
+} stats_entry;
+
+// One per thread. Tables are never freed so that the counts of threads that
+// have exited still show up in snapshots.
+typedef struct stats_table {
+    struct stats_table * next;
+    stats_entry entries[JPACK_STATS_MAX_FORMATS];
+    stats_entry other;
+} stats_table;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_table * tables;
+static __thread stats_table * local;
+
+static stats_table * local_table(void) {
+    if (local == NULL) {
+        local = calloc(1, sizeof(*local));
+        if (local == NULL) {
+            return NULL;
+        }
+        strcpy(local->other.format, "(other)");
+        SET_USED(&local->other);
+
+        pthread_mutex_lock(&lock);
+        local->next = tables;
+        tables = local;
+        pthread_mutex_unlock(&lock);
+    }
+    return local;
+}
+
+static stats_entry * find_entry(stats_table * table, const char * format) {
+    char key[JPACK_STATS_FORMAT_MAX];
+    uint32_t hash = 2166136261u;
+    uint32_t length;
+    uint32_t i;
+
+    if (format == NULL) {
+        format = "(null)";
+    }
+
+    for (length = 0; format[length] && length < JPACK_STATS_FORMAT_MAX - 1; ++length) {
+        key[length] = format[length];
+        hash = (hash ^ (uint8_t)format[length]) * 16777619u;
+    }
+    key[length] = '\0';
+
+    for (i = 0; i < JPACK_STATS_MAX_FORMATS; ++i) {
+        stats_entry * entry = &table->entries[(hash + i) % JPACK_STATS_MAX_FORMATS];
+
+        if (!entry->used) {
+            entry->hash = hash;
+            memcpy(entry->format, key, length + 1);
+            SET_USED(entry);
+            return entry;
+        }
+        if (entry->hash == hash && strcmp(entry->format, key) == 0) {
+            return entry;
+        }
+    }
+
+    return &table->other;
+}
+
+void jpack_stats_record(const char * format, size_t size, uint32_t length,
+                        uint64_t cycles) {
+    stats_table * table = local_table();
+    stats_entry * entry;
+
+    if (table == NULL) {
+        return;
+    }
+
+    entry = find_entry(table, format);
+    ADD(&entry->counts.calls, 1);
+    ADD(&entry->counts.cycles, cycles);
+
+    if (length == JPACK_INVALID) {
+        ADD(&entry->counts.invalid, 1);
+    } else if (length > size) {
+        ADD(&entry->counts.truncated, 1);
+        ADD(&entry->counts.bytes, size);
+    } else {
+        ADD(&entry->counts.bytes, length);
+    }
+}
+
+int jpack_stats_snapshot(jpack_stats * stats) {
+    stats_table * table;
+    uint32_t i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&lock);
+    for (table = tables; table; table = table->next) {
+        for (i = 0; i <= JPACK_STATS_MAX_FORMATS; ++i) {
+            const stats_entry * entry = i < JPACK_STATS_MAX_FORMATS
+                                        ? &table->entries[i] : &table->other;
+            jpack_format_stats * out = NULL;
+            uint32_t j;
+
+            if (!IS_USED(entry)) {
+                continue;
+            }
+
+            for (j = 0; j < stats->count; ++j) {
+                if (strcmp(stats->formats[j].format, entry->format) == 0) {
+                    out = &stats->formats[j];
+                    break;
+                }
+            }
+
+            // The last slot is kept for formats that do not fit
+            if (out == NULL && stats->count < JPACK_STATS_MAX_FORMATS - 1) {
+                out = &stats->formats[stats->count++];
+                strcpy(out->format, entry->format);
+            } else if (out == NULL) {
+                out = &stats->formats[JPACK_STATS_MAX_FORMATS - 1];
+                strcpy(out->format, "(other)");
+                stats->count = JPACK_STATS_MAX_FORMATS;
+            }
+
+            out->calls += LOAD(&entry->counts.calls) - entry->reset.calls;
+            out->bytes += LOAD(&entry->counts.bytes) - entry->reset.bytes;
+            out->truncated += LOAD(&entry->counts.truncated) - entry->reset.truncated;
+            out->invalid += LOAD(&entry->counts.invalid) - entry->reset.invalid;
+            out->cycles += LOAD(&entry->counts.cycles) - entry->reset.cycles;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+void jpack_stats_reset(void) {
+    stats_table * table;
+    uint32_t i;
+
+    pthread_mutex_lock(&lock);
+    for (table = tables; table; table = table->next) {
+        for (i = 0; i <= JPACK_STATS_MAX_FORMATS; ++i) {
+            stats_entry * entry = i < JPACK_STATS_MAX_FORMATS
+                                  ? &table->entries[i] : &table->other;
+
+            if (!IS_USED(entry)) {
+                continue;
+            }
+
+            entry->reset.calls = LOAD(&entry->counts.calls);
+            entry->reset.bytes = LOAD(&entry->counts.bytes);
+            entry->reset.truncated = LOAD(&entry->counts.truncated);
+            entry->reset.invalid = LOAD(&entry->counts.invalid);
+            entry->reset.cycles = LOAD(&entry->counts.cycles);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+#else
+
+int jpack_stats_snapshot(jpack_stats * stats) {
+    memset(stats, 0, sizeof(*stats));
+    return -1;
+}
+
+void jpack_stats_reset(void) {
+}
+
+#endif // JPACK_STATS
@@ -0,0 +1,60 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef JPACK_STATS_H_
+#define JPACK_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hooks that jpack.c calls around each counted function. They are only
+// compiled in with JPACK_STATS, otherwise they expand to nothing.
+
+#ifdef JPACK_STATS
+
+#if defined(JPACK_STATS_CYCLES) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define JPACK_STATS_CLOCK() __builtin_ia32_rdtsc()
+#else
+#define JPACK_STATS_CLOCK() 0
+#endif
+
+// Counts a call for format that returned length with a buffer of size bytes
+void jpack_stats_record(const char * format, size_t size, uint32_t length,
+                        uint64_t cycles);
+
+#define STATS_START(start) uint64_t start = JPACK_STATS_CLOCK()
+#define STATS_RECORD(format, size, length, start) \
+    jpack_stats_record(format, size, length, JPACK_STATS_CLOCK() - (start))
+
+#else
+
+#define STATS_START(start)
+#define STATS_RECORD(format, size, length, start) ((void)0)
+
+#endif // JPACK_STATS
+
+#endif // JPACK_STATS_H_
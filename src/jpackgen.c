@@ -0,0 +1,688 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright (C) 2013 Jonathan Nilsson                                        */
+/* Contact: l.a.jonathan.nilsson@gmail.com                                    */
+/*                                                                            */
+/*                                                                            */
+/* Permission is hereby granted, free of charge, to any person obtaining a    */
+/* copy of this software and associated documentation files (the "Software"), */
+/* to deal in the Software without restriction, including without limitation  */
+/* the rights to use, copy, modify, merge, publish, distribute, sublicense,   */
+/* and/or sell copies of the Software, and to permit persons to whom the      */
+/* Software is furnished to do so, subject to the following conditions:       */
+/*                                                                            */
+/* The above copyright notice and this permission notice shall be included    */
+/* in all copies or substantial portions of the Software.                     */
+/*                                                                            */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR */
+/* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   */
+/* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    */
+/* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER */
+/* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING    */
+/* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER        */
+/* DEALINGS IN THE SOFTWARE.                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+// Reads a schema of named formats and writes C functions that pack and
+// unpack each of them with fixed offsets and typed parameters.
+//
+// Usage: jpackgen <schema> <header> <source>
+//
+// Every schema line holds a name, a format and optionally one name per
+// field. Text after # is a comment.
+//
+//     # id, kind and value of a sample
+//     sample  !IHd  id kind value
+//
+// gives
+//
+//     uint32_t pack_sample(uint8_t * buf, size_t size,
+//                          uint32_t id, uint16_t kind, double value);
+//     uint32_t unpack_sample(const uint8_t * buf, size_t size,
+//                            uint32_t * id, uint16_t * kind, double * value);
+//
+// These return the same lengths and write the same bytes as jpack and
+// junpack, and they call them when buf is too short.
+// Supported format chars are b B h H i I l L f d with counts, x, s and
+// the byte order options. Field names must be unique and can not be C
+// keywords, buf, size, names the generated code calls or start with jp_,
+// which is kept for its locals.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpack.h"
+
+#define MAX_NAME 64
+#define MAX_FORMAT 256
+#define MAX_FIELDS 64
+#define MAX_LINE 1024
+
+typedef struct gen_field {
+    char type;
+    uint32_t count;
+    int array;
+    int big;
+    uint32_t offset;    // Offset from the end of the previous string
+    char name[MAX_NAME];
+} gen_field;
+
+typedef struct gen_message {
+    char name[MAX_NAME];
+    char format[MAX_FORMAT];
+    gen_field fields[MAX_FIELDS];
+    uint32_t field_count;
+    uint32_t strings;
+    uint32_t fixed;     // Bytes taken by everything but the strings
+    uint32_t tail;      // Bytes after the last string
+} gen_message;
+
+static uint32_t field_width(char type) {
+    switch (type) {
+    case 'b': case 'B':
+        return 1;
+    case 'h': case 'H':
+        return 2;
+    case 'i': case 'I': case 'f':
+        return 4;
+    case 'l': case 'L': case 'd':
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static const char * field_type(char type) {
+    switch (type) {
+    case 'b': return "int8_t";
+    case 'B': return "uint8_t";
+    case 'h': return "int16_t";
+    case 'H': return "uint16_t";
+    case 'i': return "int32_t";
+    case 'I': return "uint32_t";
+    case 'l': return "int64_t";
+    case 'L': return "uint64_t";
+    case 'f': return "float";
+    case 'd': return "double";
+    default: return "char";
+    }
+}
+
+// Identifiers the generated functions use besides their locals
+static const char * const reserved_names[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do",
+    "double", "else", "enum", "extern", "float", "for", "goto", "if", "inline",
+    "int", "long", "register", "restrict", "return", "short", "signed",
+    "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned",
+    "void", "volatile", "while", "_Bool", "_Complex", "_Imaginary",
+    "buf", "size", "size_t", "int8_t", "uint8_t", "int16_t", "uint16_t",
+    "int32_t", "uint32_t", "int64_t", "uint64_t", "memcpy", "memchr",
+    "strlen", "jpack", "junpack", "HOST_BIG", "swap_16", "swap_32", "swap_64",
+    "put_16", "put_32", "put_64", "get_16", "get_32", "get_64", "float_bits",
+    "double_bits", "float_value", "double_value"
+};
+
+static int is_reserved(const char * name) {
+    size_t i;
+
+    if (strncmp(name, "jp_", 3) == 0) {
+        return 1;
+    }
+    for (i = 0; i < sizeof(reserved_names) / sizeof(reserved_names[0]); ++i) {
+        if (strcmp(name, reserved_names[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_identifier(const char * name) {
+    if (!isalpha((unsigned char)*name) && *name != '_') {
+        return 0;
+    }
+    for (; *name; ++name) {
+        if (!isalnum((unsigned char)*name) && *name != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Fills in the fields of message from its format, returns 0 on success
+static int parse_format(gen_message * message) {
+    const char * format = message->format;
+    uint32_t segment = 0;
+    uint32_t count = 0;
+    int has_count = 0;
+    int big = 0;
+
+    if (jpack_format_length(format) == JPACK_INVALID) {
+        return -1;
+    }
+
+    for (;; ++format) {
+        char c = *format;
+        uint32_t width = field_width(c);
+
+        if (c == '\0') {
+            message->fixed += segment;
+            message->tail = segment;
+            return has_count ? -1 : 0;
+        } else if (c >= '0' && c <= '9') {
+            count = count * 10 + (uint32_t)(c - '0');
+            has_count = 1;
+            continue;
+        } else if (c == '<') {
+            big = 0;
+            continue;
+        } else if (c == '>' || c == '!') {
+            big = 1;
+            continue;
+        } else if (c == 'x') {
+            segment += has_count ? count : 1;
+        } else if ((c == 's' && !has_count) || width) {
+            gen_field * field;
+
+            if (message->field_count == MAX_FIELDS) {
+                return -1;
+            }
+
+            field = &message->fields[message->field_count];
+            field->type = c;
+            field->count = has_count ? count : 1;
+            field->array = has_count;
+            field->big = big;
+            field->offset = segment;
+            sprintf(field->name, "f%u", message->field_count);
+            message->field_count++;
+
+            if (c == 's') {
+                message->strings++;
+                message->fixed += segment;
+                segment = 0;
+            } else {
+                segment += width * field->count;
+            }
+        } else {
+            return -1;
+        }
+
+        big = 0;
+        has_count = 0;
+        count = 0;
+    }
+}
+
+// Parses one schema line, returns 1 for a message, 0 for a blank line and
+// -1 with error set if the line is invalid
+static int parse_line(char * line, gen_message * message, const char ** error) {
+    char * comment = strchr(line, '#');
+    char * token;
+    uint32_t names = 0;
+    uint32_t i;
+
+    if (comment) {
+        *comment = '\0';
+    }
+
+    memset(message, 0, sizeof(*message));
+
+    token = strtok(line, " \t\r\n");
+    if (!token) {
+        return 0;
+    }
+    if (strlen(token) >= MAX_NAME || !is_identifier(token)) {
+        *error = "invalid name";
+        return -1;
+    }
+    strcpy(message->name, token);
+
+    token = strtok(NULL, " \t\r\n");
+    if (!token || strlen(token) >= MAX_FORMAT) {
+        *error = "missing or too long format";
+        return -1;
+    }
+    strcpy(message->format, token);
+
+    if (parse_format(message) != 0) {
+        *error = "invalid or unsupported format";
+        return -1;
+    }
+    if (message->field_count == 0) {
+        *error = "format has no fields";
+        return -1;
+    }
+
+    while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+        if (names == message->field_count) {
+            *error = "more field names than fields";
+            return -1;
+        }
+        if (strlen(token) >= MAX_NAME || !is_identifier(token) || is_reserved(token)) {
+            *error = "invalid field name";
+            return -1;
+        }
+        for (i = 0; i < names; ++i) {
+            if (strcmp(token, message->fields[i].name) == 0) {
+                *error = "duplicate field name";
+                return -1;
+            }
+        }
+        strcpy(message->fields[names++].name, token);
+    }
+
+    if (names != 0 && names != message->field_count) {
+        *error = "fewer field names than fields";
+        return -1;
+    }
+
+    return 1;
+}
+
+static void write_prototype(FILE * out, const gen_message * message, int unpack) {
+    uint32_t i;
+
+    if (unpack) {
+        fprintf(out, "uint32_t unpack_%s(const uint8_t * buf, size_t size", message->name);
+    } else {
+        fprintf(out, "uint32_t pack_%s(uint8_t * buf, size_t size", message->name);
+    }
+
+    for (i = 0; i < message->field_count; ++i) {
+        const gen_field * field = &message->fields[i];
+
+        if (field->type == 's') {
+            fprintf(out, ", %schar * %s", unpack ? "" : "const ", field->name);
+        } else if (unpack || field->array) {
+            fprintf(out, ", %s%s * %s", unpack ? "" : "const ",
+                    field_type(field->type), field->name);
+        } else {
+            fprintf(out, ", %s %s", field_type(field->type), field->name);
+        }
+    }
+
+    fprintf(out, ")");
+}
+
+static void write_arguments(FILE * out, const gen_message * message) {
+    uint32_t i;
+
+    fprintf(out, "buf, size, \"%s\"", message->format);
+    for (i = 0; i < message->field_count; ++i) {
+        fprintf(out, ", %s", message->fields[i].name);
+    }
+}
+
+// Writes the expression that stores the bits of value
+static void write_put(FILE * out, const gen_field * field, const char * at,
+                      const char * value) {
+    uint32_t width = field_width(field->type);
+
+    if (width == 1) {
+        fprintf(out, "*(%s) = (uint8_t)%s;\n", at, value);
+    } else if (field->type == 'f' || field->type == 'd') {
+        fprintf(out, "put_%u(%s, %s_bits(%s), %d);\n", width * 8, at,
+                field_type(field->type), value, field->big);
+    } else {
+        fprintf(out, "put_%u(%s, (uint%u_t)%s, %d);\n", width * 8, at, width * 8,
+                value, field->big);
+    }
+}
+
+static void write_get(FILE * out, const gen_field * field, const char * at,
+                      const char * value) {
+    uint32_t width = field_width(field->type);
+
+    if (width == 1) {
+        fprintf(out, "%s = (%s)*(%s);\n", value, field_type(field->type), at);
+    } else if (field->type == 'f' || field->type == 'd') {
+        fprintf(out, "%s = %s_value(get_%u(%s, %d));\n", value,
+                field_type(field->type), width * 8, at, field->big);
+    } else {
+        fprintf(out, "%s = (%s)get_%u(%s, %d);\n", value, field_type(field->type),
+                width * 8, at, field->big);
+    }
+}
+
+static void write_pack(FILE * out, const gen_message * message) {
+    const char * base = message->strings ? "jp_base + " : "";
+    int arrays = 0;
+    uint32_t i;
+
+    write_prototype(out, message, 0);
+    fprintf(out, " {\n");
+
+    for (i = 0; i < message->field_count; ++i) {
+        const gen_field * field = &message->fields[i];
+        if (field->type == 's') {
+            fprintf(out, "    size_t jp_length_%s = strlen(%s) + 1;\n", field->name, field->name);
+        }
+        arrays |= field->array && field->count;
+    }
+    if (message->strings) {
+        fprintf(out, "    size_t jp_base = 0;\n");
+    }
+    if (arrays) {
+        fprintf(out, "    uint32_t jp_i;\n");
+    }
+
+    fprintf(out, "\n    if (size < %u", message->fixed);
+    for (i = 0; i < message->field_count; ++i) {
+        if (message->fields[i].type == 's') {
+            fprintf(out, " + jp_length_%s", message->fields[i].name);
+        }
+    }
+    fprintf(out, ") {\n        return jpack(");
+    write_arguments(out, message);
+    fprintf(out, ");\n    }\n\n");
+
+    for (i = 0; i < message->field_count; ++i) {
+        const gen_field * field = &message->fields[i];
+        char at[128];
+        char value[MAX_NAME + 8];
+
+        if (field->type == 's') {
+            fprintf(out, "    memcpy(buf + jp_base + %u, %s, jp_length_%s);\n", field->offset,
+                    field->name, field->name);
+            fprintf(out, "    jp_base += %u + jp_length_%s;\n", field->offset, field->name);
+        } else if (field->array && field->count == 0) {
+            continue;
+        } else if (field->array) {
+            sprintf(at, "buf + %s%u + %u * jp_i", base, field->offset, field_width(field->type));
+            sprintf(value, "%s[jp_i]", field->name);
+            fprintf(out, "    for (jp_i = 0; jp_i < %u; ++jp_i) {\n        ", field->count);
+            write_put(out, field, at, value);
+            fprintf(out, "    }\n");
+        } else {
+            sprintf(at, "buf + %s%u", base, field->offset);
+            fprintf(out, "    ");
+            write_put(out, field, at, field->name);
+        }
+    }
+
+    if (message->strings) {
+        fprintf(out, "\n    return (uint32_t)(jp_base + %u);\n}\n\n", message->tail);
+    } else {
+        fprintf(out, "\n    return %u;\n}\n\n", message->fixed);
+    }
+}
+
+static void write_unpack(FILE * out, const gen_message * message) {
+    const char * base = message->strings ? "jp_base + " : "";
+    int arrays = 0;
+    uint32_t i;
+
+    write_prototype(out, message, 1);
+    fprintf(out, " {\n");
+
+    for (i = 0; i < message->field_count; ++i) {
+        const gen_field * field = &message->fields[i];
+        if (field->type == 's') {
+            fprintf(out, "    size_t jp_length_%s;\n", field->name);
+        }
+        arrays |= field->array && field->count;
+    }
+    if (message->strings) {
+        fprintf(out, "    const uint8_t * jp_end;\n");
+        fprintf(out, "    size_t jp_base = 0;\n");
+    }
+    if (arrays) {
+        fprintf(out, "    uint32_t jp_i;\n");
+    }
+    fprintf(out, "\n");
+
+    // Find every string terminator before writing to any argument
+    for (i = 0; i < message->field_count; ++i) {
+        const gen_field * field = &message->fields[i];
+        if (field->type == 's') {
+            fprintf(out, "    if (jp_base + %u >= size ||\n", field->offset);
+            fprintf(out, "        (jp_end = memchr(buf + jp_base + %u, 0, size - jp_base - %u)) == NULL) {\n",
+                    field->offset, field->offset);
+            fprintf(out, "        return junpack(");
+            write_arguments(out, message);
+            fprintf(out, ");\n    }\n");
+            fprintf(out, "    jp_length_%s = (size_t)(jp_end - (buf + jp_base + %u)) + 1;\n",
+                    field->name, field->offset);
+            fprintf(out, "    jp_base += %u + jp_length_%s;\n", field->offset, field->name);
+        }
+    }
+
+    fprintf(out, "    if (size < %s%u) {\n        return junpack(", base, message->tail);
+    write_arguments(out, message);
+    fprintf(out, ");\n    }\n\n");
+
+    if (message->strings) {
+        fprintf(out, "    jp_base = 0;\n");
+    }
+
+    for (i = 0; i < message->field_count; ++i) {
+        const gen_field * field = &message->fields[i];
+        char at[128];
+        char value[MAX_NAME + 8];
+
+        if (field->type == 's') {
+            fprintf(out, "    memcpy(%s, buf + jp_base + %u, jp_length_%s);\n", field->name,
+                    field->offset, field->name);
+            fprintf(out, "    jp_base += %u + jp_length_%s;\n", field->offset, field->name);
+        } else if (field->array && field->count == 0) {
+            continue;
+        } else if (field->array) {
+            sprintf(at, "buf + %s%u + %u * jp_i", base, field->offset, field_width(field->type));
+            sprintf(value, "%s[jp_i]", field->name);
+            fprintf(out, "    for (jp_i = 0; jp_i < %u; ++jp_i) {\n        ", field->count);
+            write_get(out, field, at, value);
+            fprintf(out, "    }\n");
+        } else {
+            sprintf(at, "buf + %s%u", base, field->offset);
+            sprintf(value, "*%s", field->name);
+            fprintf(out, "    ");
+            write_get(out, field, at, value);
+        }
+    }
+
+    if (message->strings) {
+        fprintf(out, "\n    return (uint32_t)(jp_base + %u);\n}\n\n", message->tail);
+    } else {
+        fprintf(out, "\n    return %u;\n}\n\n", message->fixed);
+    }
+}
+
+static const char source_helpers[] =
+    "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n"
+    "#define HOST_BIG 1\n"
+    "#else\n"
+    "#define HOST_BIG 0\n"
+    "#endif\n"
+    "\n"
+    "static inline uint16_t swap_16(uint16_t val) {\n"
+    "    return (uint16_t)(val << 8 | val >> 8);\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t swap_32(uint32_t val) {\n"
+    "    return val << 24 | (val & 0xFF00) << 8 | (val >> 8 & 0xFF00) | val >> 24;\n"
+    "}\n"
+    "\n"
+    "static inline uint64_t swap_64(uint64_t val) {\n"
+    "    return (uint64_t)swap_32((uint32_t)val) << 32 | swap_32((uint32_t)(val >> 32));\n"
+    "}\n"
+    "\n"
+    "static inline void put_16(uint8_t * buf, uint16_t val, int big) {\n"
+    "    if (big != HOST_BIG) {\n"
+    "        val = swap_16(val);\n"
+    "    }\n"
+    "    memcpy(buf, &val, sizeof(val));\n"
+    "}\n"
+    "\n"
+    "static inline void put_32(uint8_t * buf, uint32_t val, int big) {\n"
+    "    if (big != HOST_BIG) {\n"
+    "        val = swap_32(val);\n"
+    "    }\n"
+    "    memcpy(buf, &val, sizeof(val));\n"
+    "}\n"
+    "\n"
+    "static inline void put_64(uint8_t * buf, uint64_t val, int big) {\n"
+    "    if (big != HOST_BIG) {\n"
+    "        val = swap_64(val);\n"
+    "    }\n"
+    "    memcpy(buf, &val, sizeof(val));\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t get_16(const uint8_t * buf, int big) {\n"
+    "    uint16_t val;\n"
+    "    memcpy(&val, buf, sizeof(val));\n"
+    "    return big != HOST_BIG ? swap_16(val) : val;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t get_32(const uint8_t * buf, int big) {\n"
+    "    uint32_t val;\n"
+    "    memcpy(&val, buf, sizeof(val));\n"
+    "    return big != HOST_BIG ? swap_32(val) : val;\n"
+    "}\n"
+    "\n"
+    "static inline uint64_t get_64(const uint8_t * buf, int big) {\n"
+    "    uint64_t val;\n"
+    "    memcpy(&val, buf, sizeof(val));\n"
+    "    return big != HOST_BIG ? swap_64(val) : val;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t float_bits(float val) {\n"
+    "    uint32_t out;\n"
+    "    memcpy(&out, &val, sizeof(out));\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static inline uint64_t double_bits(double val) {\n"
+    "    uint64_t out;\n"
+    "    memcpy(&out, &val, sizeof(out));\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static inline float float_value(uint32_t val) {\n"
+    "    float out;\n"
+    "    memcpy(&out, &val, sizeof(out));\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static inline double double_value(uint64_t val) {\n"
+    "    double out;\n"
+    "    memcpy(&out, &val, sizeof(out));\n"
+    "    return out;\n"
+    "}\n"
+    "\n";
+
+static const char * base_name(const char * path) {
+    const char * slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+int main(int argc, char *argv[]) {
+    static gen_message messages[256];
+    uint32_t message_count = 0;
+    char line[MAX_LINE];
+    char guard[MAX_LINE];
+    uint32_t line_number = 0;
+    FILE * schema;
+    FILE * header;
+    FILE * source;
+    uint32_t i;
+
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <schema> <header> <source>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    schema = fopen(argv[1], "r");
+    if (!schema) {
+        fprintf(stderr, "%s: Could not open %s\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    while (fgets(line, sizeof(line), schema)) {
+        const char * error = NULL;
+        int result;
+
+        line_number++;
+
+        if (message_count == sizeof(messages) / sizeof(messages[0])) {
+            fprintf(stderr, "%s:%u: Too many messages\n", argv[1], line_number);
+            fclose(schema);
+            return EXIT_FAILURE;
+        }
+
+        result = parse_line(line, &messages[message_count], &error);
+        if (result < 0) {
+            fprintf(stderr, "%s:%u: %s\n", argv[1], line_number, error);
+            fclose(schema);
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; result > 0 && i < message_count; ++i) {
+            if (strcmp(messages[i].name, messages[message_count].name) == 0) {
+                fprintf(stderr, "%s:%u: Duplicate name %s\n", argv[1], line_number,
+                        messages[i].name);
+                fclose(schema);
+                return EXIT_FAILURE;
+            }
+        }
+
+        message_count += (uint32_t)result;
+    }
+    fclose(schema);
+
+    for (i = 0; base_name(argv[2])[i] && i < sizeof(guard) - 2; ++i) {
+        unsigned char c = (unsigned char)base_name(argv[2])[i];
+        guard[i] = isalnum(c) ? (char)toupper(c) : '_';
+    }
+    guard[i++] = '_';
+    guard[i] = '\0';
+
+    header = fopen(argv[2], "w");
+    if (!header) {
+        fprintf(stderr, "%s: Could not open %s\n", argv[0], argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(header, "// Generated by jpackgen from %s, do not edit\n\n", base_name(argv[1]));
+    fprintf(header, "#ifndef %s\n#define %s\n\n", guard, guard);
+    fprintf(header, "#include <stddef.h>\n#include <stdint.h>\n\n");
+    fprintf(header, "#ifdef __cplusplus\nextern \"C\" {\n#endif // __cplusplus\n\n");
+    for (i = 0; i < message_count; ++i) {
+        fprintf(header, "// %s\n", messages[i].format);
+        write_prototype(header, &messages[i], 0);
+        fprintf(header, ";\n");
+        write_prototype(header, &messages[i], 1);
+        fprintf(header, ";\n\n");
+    }
+    fprintf(header, "#ifdef __cplusplus\n}\n#endif // __cplusplus\n\n");
+    fprintf(header, "#endif // %s\n", guard);
+
+    if (fclose(header) != 0) {
+        fprintf(stderr, "%s: Could not write %s\n", argv[0], argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    source = fopen(argv[3], "w");
+    if (!source) {
+        fprintf(stderr, "%s: Could not open %s\n", argv[0], argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(source, "// Generated by jpackgen from %s, do not edit\n\n", base_name(argv[1]));
+    fprintf(source, "#include <string.h>\n\n#include \"jpack.h\"\n#include \"%s\"\n\n",
+            base_name(argv[2]));
+    fputs(source_helpers, source);
+    for (i = 0; i < message_count; ++i) {
+        write_pack(source, &messages[i]);
+        write_unpack(source, &messages[i]);
+    }
+
+    if (fclose(source) != 0) {
+        fprintf(stderr, "%s: Could not write %s\n", argv[0], argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}